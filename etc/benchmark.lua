@@ -0,0 +1,599 @@
+--------------------------------------------------------------------------------
+-- benchmark.lua: luatexts versus other serialization formats
+--------------------------------------------------------------------------------
+-- Usage:
+--
+--   lua etc/benchmark.lua [FORMAT [CORPORA [SCALE [MIN_TIME]]]]
+--
+-- FORMAT   -- "tsv" (default) or "lua".
+-- CORPORA  -- comma-separated corpus names, or "all" (default).
+-- SCALE    -- corpus size multiplier (default 1).
+-- MIN_TIME -- minimum seconds of CPU time per measurement (default 0.5).
+--
+-- Results are written to stdout, progress and skipped measurements
+-- to stderr. See README for the meaning of the columns.
+-- Other formats are skipped if they fail, luatexts failures are errors.
+--------------------------------------------------------------------------------
+
+pcall(require, 'luarocks.require')
+
+local FORMAT = (select(1, ...) or "tsv"):lower()
+local CORPORA = select(2, ...) or "all"
+local SCALE = tonumber(select(3, ...) or 1) or 1
+local MIN_TIME = tonumber(select(4, ...) or 0.5) or 0.5
+
+local loadstring = loadstring or load
+
+if FORMAT ~= "tsv" and FORMAT ~= "lua" then
+  error("unknown format")
+end
+
+--------------------------------------------------------------------------------
+
+local try_require = function(name)
+  local ok, module = pcall(require, name)
+  return ok and module or nil
+end
+
+local log = function(...)
+  io.stderr:write("benchmark.lua: ", table.concat({ ... }, " "), "\n")
+  io.stderr:flush()
+end
+
+--------------------------------------------------------------------------------
+-- Corpora
+--------------------------------------------------------------------------------
+
+-- Park-Miller generator: exact in doubles, so the corpora are the same
+-- on all Lua versions, regardless of their math.random() implementation.
+local random, random_seed
+do
+  local state = 1
+
+  random_seed = function(seed)
+    state = seed
+  end
+
+  -- Returns float in [0, 1) without arguments, integer in [m, n] otherwise.
+  random = function(m, n)
+    state = (state * 16807) % 2147483647
+    local r = (state - 1) / 2147483646
+    if not m then
+      return r
+    end
+    return m + math.floor(r * (n - m + 1))
+  end
+end
+
+local UTF8_WORDS =
+{
+  "luatexts", "Привет", "мир", "данные", "日本語", "テキスト", "中文",
+  "Ελληνικά", "עברית", "العربية", "한국어", "emoji 😀", "💾🔧", "naïve",
+  "façade", "Größe", "ỹ̃", "∑∫√∞", "→←↑↓", "€£¥"
+}
+
+local corpora = { }
+
+-- Numeric array: integers and floats of all magnitudes.
+corpora[#corpora + 1] =
+{
+  name = "numbers";
+  make = function(scale)
+    local r = { }
+    for i = 1, 100000 * scale do
+      local kind = i % 4
+      if kind == 0 then
+        r[i] = random(0, 1000)
+      elseif kind == 1 then
+        r[i] = random(-2147483647, 2147483647)
+      elseif kind == 2 then
+        r[i] = random()
+      else
+        r[i] = (random() - 0.5) * 10 ^ random(-30, 30)
+      end
+    end
+    return r
+  end;
+}
+
+-- List of records with repeated keys, like a database query result.
+corpora[#corpora + 1] =
+{
+  name = "records";
+  make = function(scale)
+    local r = { }
+    for i = 1, 10000 * scale do
+      local tags = { }
+      for j = 1, random(0, 5) do
+        tags[j] = "tag" .. random(1, 50)
+      end
+      r[i] =
+      {
+        id = i;
+        name = "user" .. random(1, 100000);
+        email = "user" .. i .. "@example.com";
+        score = random() * 100;
+        active = random(0, 1) == 1;
+        tags = tags;
+      }
+    end
+    return r
+  end;
+}
+
+-- Chains of nested tables, kept well below default depth limits.
+corpora[#corpora + 1] =
+{
+  name = "nested";
+  make = function(scale)
+    local r = { }
+    for i = 1, 500 * scale do
+      local node = { }
+      r[i] = node
+      for level = 1, 100 do
+        local child = { }
+        node.level = level
+        node.value = random(0, 1000)
+        node.child = child
+        node = child
+      end
+    end
+    return r
+  end;
+}
+
+-- Array of UTF-8 text lines.
+corpora[#corpora + 1] =
+{
+  name = "utf8";
+  make = function(scale)
+    local r = { }
+    for i = 1, 20000 * scale do
+      local words = { }
+      for j = 1, random(1, 20) do
+        words[j] = UTF8_WORDS[random(1, #UTF8_WORDS)]
+      end
+      r[i] = table.concat(words, " ")
+    end
+    return r
+  end;
+}
+
+-- A few huge binary strings.
+corpora[#corpora + 1] =
+{
+  name = "huge";
+  make = function(scale)
+    local r = { }
+    for i = 1, 4 do
+      local chunk = { }
+      for j = 1, 1024 do
+        chunk[j] = string.char(random(0, 255))
+      end
+      r[i] = table.concat(chunk):rep(math.ceil(1024 * scale))
+    end
+    return r
+  end;
+}
+
+-- Counts values the way luatexts sees them: tables, keys and values.
+local count_values
+count_values = function(v)
+  if type(v) ~= "table" then
+    return 1
+  end
+  local n = 1
+  for k, v in pairs(v) do
+    n = n + count_values(k) + count_values(v)
+  end
+  return n
+end
+
+--------------------------------------------------------------------------------
+-- Codecs
+--------------------------------------------------------------------------------
+
+-- Lua source, as written by a naive serializer and read by loadstring().
+local save_lua_source
+do
+  local write
+  write = function(buf, v)
+    local t = type(v)
+    if t == "table" then
+      buf[#buf + 1] = "{"
+      for k, v in pairs(v) do
+        buf[#buf + 1] = "["
+        write(buf, k)
+        buf[#buf + 1] = "]="
+        write(buf, v)
+        buf[#buf + 1] = ","
+      end
+      buf[#buf + 1] = "}"
+    elseif t == "string" then
+      buf[#buf + 1] = ("%q"):format(v)
+    elseif t == "number" then
+      if math.type and math.type(v) == "integer" then
+        buf[#buf + 1] = ("%d"):format(v)
+      else
+        buf[#buf + 1] = ("%.17g"):format(v)
+      end
+    elseif t == "boolean" or t == "nil" then
+      buf[#buf + 1] = tostring(v)
+    else
+      error("can't save " .. t)
+    end
+  end
+
+  save_lua_source = function(v)
+    local buf = { "return " }
+    write(buf, v)
+    return table.concat(buf)
+  end
+end
+
+-- Writes an array of strings as luatexts UTF-8 strings (type 8),
+-- to measure the validating UTF-8 reader. No encoder here does that.
+local save_luatexts_utf8 = function(v)
+  local buf = { "1\nT\n", #v, "\n0\n" }
+  for i = 1, #v do
+    local s = v[i]
+    local _, continuation = s:gsub("[\128-\191]", "")
+    buf[#buf + 1] = "8\n"
+    buf[#buf + 1] = #s - continuation
+    buf[#buf + 1] = "\n"
+    buf[#buf + 1] = s
+    buf[#buf + 1] = "\n"
+  end
+  return table.concat(buf)
+end
+
+local luatexts_load = function(luatexts)
+  return function(data)
+    local ok, v = luatexts.load(data)
+    if not ok then
+      error(v)
+    end
+    return v
+  end
+end
+
+local codecs = { }
+
+do
+  local luatexts = require 'luatexts'
+  local load = luatexts_load(luatexts)
+
+  codecs[#codecs + 1] =
+  {
+    name = "luatexts";
+    own = true;
+    save = luatexts.save;
+    load = load;
+    load_from_file = function(filename)
+      local ok, v = luatexts.load_from_file(filename)
+      if not ok then
+        error(v)
+      end
+      return v
+    end;
+  }
+
+  codecs[#codecs + 1] =
+  {
+    name = "luatexts-8";
+    own = true;
+    corpus = "utf8";
+    save = save_luatexts_utf8;
+    load = load;
+  }
+
+  -- Same records with string back-references, next to the plain ones
+  -- (which have none, and must not pay for them). Only luatexts.lua
+  -- can save them.
+  codecs[#codecs + 1] =
+  {
+    name = "luatexts-dedup";
+    own = true;
+    corpus = "records";
+    save = require('luatexts.lua').save_dedup;
+    load = load;
+  }
+end
+
+do
+  local luatexts_lua = require 'luatexts.lua'
+  codecs[#codecs + 1] =
+  {
+    name = "luatexts.lua";
+    own = true;
+    save = luatexts_lua.save;
+    load = luatexts_load(luatexts_lua);
+  }
+end
+
+do
+  local luatexts_ffi = try_require('luatexts.ffi') -- LuaJIT only
+  if luatexts_ffi then
+    codecs[#codecs + 1] =
+    {
+      name = "luatexts.ffi";
+      own = true;
+      save = luatexts_ffi.save;
+      load = luatexts_load(luatexts_ffi);
+    }
+  end
+end
+
+do
+  local luabins = try_require('luabins')
+  if luabins then
+    codecs[#codecs + 1] =
+    {
+      name = "luabins";
+      save = luabins.save;
+      load = luatexts_load(luabins);
+    }
+  end
+end
+
+do
+  local cjson = try_require('cjson')
+  if cjson then
+    codecs[#codecs + 1] =
+    {
+      name = "cjson";
+      save = cjson.encode;
+      load = cjson.decode;
+    }
+  end
+end
+
+do
+  local dkjson = try_require('dkjson')
+  if dkjson then
+    codecs[#codecs + 1] =
+    {
+      name = "dkjson";
+      save = dkjson.encode;
+      load = function(data)
+        local v, _, err = dkjson.decode(data)
+        if err then
+          error(err)
+        end
+        return v
+      end;
+    }
+  end
+end
+
+do
+  local cmsgpack = try_require('cmsgpack')
+  if cmsgpack then
+    codecs[#codecs + 1] =
+    {
+      name = "cmsgpack";
+      save = cmsgpack.pack;
+      load = cmsgpack.unpack;
+    }
+  end
+end
+
+do
+  local msgpack = try_require('MessagePack')
+  if msgpack then
+    codecs[#codecs + 1] =
+    {
+      name = "MessagePack";
+      save = msgpack.pack;
+      load = msgpack.unpack;
+    }
+  end
+end
+
+codecs[#codecs + 1] =
+{
+  name = "lua";
+  save = save_lua_source;
+  load = function(data)
+    return assert(loadstring(data))()
+  end;
+}
+
+--------------------------------------------------------------------------------
+-- Measurements
+--------------------------------------------------------------------------------
+
+local read_file = function(filename)
+  local file = assert(io.open(filename, "rb"))
+  local data = file:read("*a")
+  file:close()
+  return data
+end
+
+local write_file = function(filename, data)
+  local file = assert(io.open(filename, "wb"))
+  file:write(data)
+  file:close()
+end
+
+-- Returns growth of Lua heap in KB during single fn() call,
+-- with garbage collector stopped. This is an upper bound for the peak
+-- memory the call needs, result included.
+local measure_heap = function(fn, ...)
+  collectgarbage("collect")
+  collectgarbage("collect")
+  collectgarbage("stop")
+  local before = collectgarbage("count")
+  local result = fn(...)
+  local after = collectgarbage("count")
+  collectgarbage("restart")
+  result = nil
+  return after - before
+end
+
+-- Returns number of fn() calls and CPU time they took.
+local measure_time = function(fn, ...)
+  fn(...) -- Warm up
+  collectgarbage("collect")
+
+  local iterations, seconds = 0, 0
+  local batch = 1
+  local start = os.clock()
+  repeat
+    for i = 1, batch do
+      fn(...)
+    end
+    iterations = iterations + batch
+    seconds = os.clock() - start
+    batch = batch * 2
+  until seconds >= MIN_TIME
+
+  return iterations, seconds
+end
+
+local COLUMNS =
+{
+  "corpus", "codec", "op", "bytes", "values",
+  "iterations", "seconds", "mb_per_s", "values_per_s", "heap_kb"
+}
+
+local write_header, write_row, write_footer
+if FORMAT == "tsv" then
+  write_header = function()
+    io.stdout:write(table.concat(COLUMNS, "\t"), "\n")
+  end
+
+  write_row = function(row)
+    local buf = { }
+    for i = 1, #COLUMNS do
+      local v = row[COLUMNS[i]]
+      buf[i] = type(v) == "number" and ("%.6g"):format(v) or tostring(v)
+    end
+    io.stdout:write(table.concat(buf, "\t"), "\n")
+    io.stdout:flush()
+  end
+
+  write_footer = function() end
+else
+  write_header = function()
+    io.stdout:write("return\n{\n")
+  end
+
+  write_row = function(row)
+    local buf = { }
+    for i = 1, #COLUMNS do
+      local k = COLUMNS[i]
+      local v = row[k]
+      buf[i] = k .. " = "
+        .. (type(v) == "number" and ("%.6g"):format(v) or ("%q"):format(v))
+    end
+    io.stdout:write("  { ", table.concat(buf, "; "), " };\n")
+    io.stdout:flush()
+  end
+
+  write_footer = function()
+    io.stdout:write("}\n")
+  end
+end
+
+-- Failures of other formats are skipped, failures of our own are errors
+local skip = function(codec, what, err)
+  if codec.own then
+    error(what .. " failed: " .. tostring(err))
+  end
+  log(what, "skipped:", tostring(err))
+end
+
+local measure = function(corpus, codec, op, bytes, values, fn, ...)
+  log(corpus, codec.name, op)
+
+  local ok, err = pcall(fn, ...)
+  if not ok then
+    skip(codec, corpus .. " " .. codec.name .. " " .. op, err)
+    return
+  end
+  err = nil -- Don't keep the result alive while measuring
+
+  local heap_kb = measure_heap(fn, ...)
+  local iterations, seconds = measure_time(fn, ...)
+
+  write_row
+  {
+    corpus = corpus;
+    codec = codec.name;
+    op = op;
+    bytes = bytes;
+    values = values;
+    iterations = iterations;
+    seconds = seconds;
+    mb_per_s = bytes * iterations / seconds / 1e6;
+    values_per_s = values * iterations / seconds;
+    heap_kb = heap_kb;
+  }
+end
+
+--------------------------------------------------------------------------------
+
+local selected = { }
+for name in CORPORA:gmatch("[^,]+") do
+  selected[name] = true
+end
+
+local filename = os.tmpname()
+
+write_header()
+
+-- Corpus is made anew for each codec, and neither the corpus nor the saved
+-- data is kept alive while the other one is made. Otherwise LuaJIT would
+-- find the strings it makes already interned, and measure less work.
+for i = 1, #corpora do
+  local corpus = corpora[i]
+  if selected.all or selected[corpus.name] then
+    for j = 1, #codecs do
+      local codec = codecs[j]
+      if not codec.corpus or codec.corpus == corpus.name then
+        random_seed(12345)
+        local value = corpus.make(SCALE)
+        local values = count_values(value)
+
+        local ok, data = pcall(codec.save, value)
+        if not ok then
+          skip(codec, corpus.name .. " " .. codec.name, data)
+        else
+          local bytes = #data
+          write_file(filename, data)
+          data = nil
+
+          measure(
+              corpus.name, codec, "save", bytes, values,
+              codec.save, value
+            )
+
+          value = nil
+          collectgarbage("collect")
+
+          measure(
+              corpus.name, codec, "load", bytes, values,
+              codec.load, read_file(filename)
+            )
+
+          -- Codecs without file loader read the file and load the string.
+          measure(
+              corpus.name, codec, "load_from_file", bytes, values,
+              codec.load_from_file or function(filename)
+                return codec.load(read_file(filename))
+              end,
+              filename
+            )
+        end
+
+        value = nil
+        collectgarbage("collect")
+      end
+    end
+  end
+end
+
+write_footer()
+
+os.remove(filename)
@@ -8,14 +8,26 @@ fi
 
 echo "----> Going pedantic all over the source"
 
-echo "--> c89..."
-gcc -O2 -fPIC -I/usr/include/lua5.1 -c src/c/luatexts.c -o /dev/null -Isrc/c/ -Wall --pedantic -Werror --std=c89
-
-echo "--> c99..."
-gcc -O2 -fPIC -I/usr/include/lua5.1 -c src/c/luatexts.c -o /dev/null -Isrc/c/ -Wall --pedantic -Werror --std=c99
-
-echo "--> c++98..."
-gcc -xc++ -O2 -fPIC -I/usr/include/lua5.1 -c src/c/luatexts.c -o /dev/null -Isrc/c/ -Wall --pedantic -Werror --std=c++98
+for SRC in src/c/luatexts.c src/c/fastfloat.c; do
+  for SIMD in "" "-mssse3" "-mavx2" "-mssse3 -DLUATEXTS_NO_CPU_DISPATCH" "-DLUATEXTS_NO_SIMD"; do
+    echo "--> ${SRC} ${SIMD}: c89..."
+    gcc -O2 -fPIC -I/usr/include/lua5.1 -c "${SRC}" -o /dev/null -Isrc/c/ -Wall --pedantic -Werror --std=c89 ${SIMD}
+
+    echo "--> ${SRC} ${SIMD}: c99..."
+    gcc -O2 -fPIC -I/usr/include/lua5.1 -c "${SRC}" -o /dev/null -Isrc/c/ -Wall --pedantic -Werror --std=c99 ${SIMD}
+
+    echo "--> ${SRC} ${SIMD}: c++98..."
+    gcc -xc++ -O2 -fPIC -I/usr/include/lua5.1 -c "${SRC}" -o /dev/null -Isrc/c/ -Wall --pedantic -Werror --std=c++98 ${SIMD}
+  done
+done
+
+echo "----> Testing plain Lua module"
+for LUA in lua5.1 lua5.2 lua5.3 lua5.4 luajit; do
+  if command -v "${LUA}" > /dev/null; then
+    echo "--> ${LUA}..."
+    LUA_PATH="src/lua/?.lua;;" "${LUA}" test/test-lua.lua
+  fi
+done
 
 echo "----> Making rock"
 sudo luarocks make rockspec/luatexts-scm-1.rockspec
@@ -0,0 +1,22 @@
+/*
+* fastfloat.h: Locale-independent decimal to double conversion
+*              See copyright information in file COPYRIGHT.
+*/
+
+#ifndef LUATEXTS_FASTFLOAT_H_INCLUDED_
+#define LUATEXTS_FASTFLOAT_H_INCLUDED_
+
+#include <stddef.h>
+
+/*
+* Converts plain decimal number ([+-]digits[.digits][(e|E)[+-]digits])
+* of exactly len bytes to double, rounding correctly (same as strtod()
+* in "C" locale does).
+*
+* Returns non-zero on success. Returns zero if data is not a plain decimal
+* number, or if it has more than 19 significant digits. Use strtod()
+* for these cases.
+*/
+int lts_fastfloat(const unsigned char * data, size_t len, double * dest);
+
+#endif /* LUATEXTS_FASTFLOAT_H_INCLUDED_ */
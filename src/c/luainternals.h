@@ -50,7 +50,7 @@ int luaO_log2 (unsigned int x);
 */
 
 #else
-/* LuaJIT does not have LUAI_BITSINT defined */
+/* LuaJIT and Lua 5.4 do not have LUAI_BITSINT defined */
 #define MAXBITS		26
 #endif
 
@@ -11,13 +11,20 @@ extern "C" {
 #include <lauxlib.h>
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <locale.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "luainternals.h"
+#include "fastfloat.h"
 
 /* TODO: Hide this mmap stuff in a separate file */
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -26,6 +33,88 @@ extern "C" {
 }
 #endif
 
+/* fileno() is POSIX, strict ANSI builds do not have it */
+#if defined(_POSIX_C_SOURCE)
+  #define LUATEXTS_HAVE_FILENO 1
+#endif
+
+/* Lua 5.1 keeps this in lualib.h */
+#ifndef LUA_FILEHANDLE
+  #define LUA_FILEHANDLE "FILE*"
+#endif
+
+/* Lua 5.2+ API compatibility */
+#if LUA_VERSION_NUM >= 502
+  #define lua_objlen lua_rawlen
+
+  /* Longer strings are not interned (LUAI_MAXSHORTLEN) */
+  #define LUATEXTS_MAXSHORTLEN (40)
+#endif
+
+/* Lua 5.3 dropped this one */
+#ifndef LUA_QL
+  #define LUA_QL(x) "'" x "'"
+#endif
+
+/*
+* Lua 5.3+ has a separate integer subtype. Integral values are loaded
+* as integers there, and integers are saved without a float round trip.
+* Define LUATEXTS_NO_INTEGERS to load everything as floats (like on 5.1).
+*/
+#if LUA_VERSION_NUM >= 503 && !defined(LUATEXTS_NO_INTEGERS)
+  #define LUATEXTS_USE_INTEGERS 1
+#endif
+
+/*
+* Vectorized scanning. Newline search uses AVX2 if compiler targets it
+* (e.g. -mavx2), SSE2 otherwise (always there on x86-64).
+* UTF-8 validation of non-ASCII data needs SSSE3 or AVX2. With GCC 4.9+
+* or clang on x86 both validators are always built, and are picked
+* at run time by the CPU features. Elsewhere, or if LUATEXTS_NO_CPU_DISPATCH
+* is defined, they are built only if compiler targets them (e.g. -mssse3,
+* -mavx2 or -march=native), and only ASCII is vectorized otherwise.
+* Define LUATEXTS_NO_SIMD to use portable code only.
+*/
+#if defined(__GNUC__) && !defined(LUATEXTS_NO_SIMD)
+  #if defined(__AVX2__)
+    #define LUATEXTS_USE_AVX2 1
+    #define LUATEXTS_USE_SSSE3 1
+    #define LUATEXTS_USE_SSE2 1
+    #include <immintrin.h>
+  #elif defined(__SSE2__) && !defined(LUATEXTS_NO_CPU_DISPATCH) \
+     && (defined(__x86_64__) || defined(__i386__)) \
+     && (defined(__clang__) || __GNUC__ > 4 \
+       || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+    #define LUATEXTS_USE_CPU_DISPATCH 1
+    #define LUATEXTS_USE_SSSE3 1
+    #define LUATEXTS_USE_SSE2 1
+    #include <immintrin.h>
+  #elif defined(__SSSE3__)
+    #define LUATEXTS_USE_SSSE3 1
+    #define LUATEXTS_USE_SSE2 1
+    #include <tmmintrin.h>
+  #elif defined(__SSE2__)
+    #define LUATEXTS_USE_SSE2 1
+    #include <emmintrin.h>
+  #endif
+#endif
+
+#if defined(LUATEXTS_USE_CPU_DISPATCH)
+  #define LUATEXTS_TARGET_SSSE3 __attribute__((target("ssse3")))
+  #define LUATEXTS_TARGET_AVX2 __attribute__((target("avx2")))
+  #if defined(__SSSE3__)
+    #define LUATEXTS_HAVE_SSSE3() (1)
+  #else
+    #define LUATEXTS_HAVE_SSSE3() (__builtin_cpu_supports("ssse3"))
+  #endif
+  #define LUATEXTS_HAVE_AVX2() (__builtin_cpu_supports("avx2"))
+#else
+  #define LUATEXTS_TARGET_SSSE3
+  #define LUATEXTS_TARGET_AVX2
+  #define LUATEXTS_HAVE_SSSE3() (1)
+  #define LUATEXTS_HAVE_AVX2() (1)
+#endif
+
 #define DO_XSPAM  0
 #define DO_XESPAM 0
 #define DO_SPAM   0
@@ -77,6 +166,12 @@ extern "C" {
 #define LUATEXTS_ETOOHUGE (6)
 #define LUATEXTS_EBADUTF8 (7)
 #define LUATEXTS_ECLIPPED (8)
+#define LUATEXTS_ECIRCULAR (9)
+#define LUATEXTS_EBADVALUE (10)
+#define LUATEXTS_ENOMEM   (11)
+#define LUATEXTS_EIO      (12)
+#define LUATEXTS_ETOODEEP (13)
+#define LUATEXTS_ELIMIT   (14)
 
 #define LUATEXTS_CNIL         '-' /* 0x2D (45)  */
 #define LUATEXTS_CFALSE       '0' /* 0x30 (48)  */
@@ -89,10 +184,16 @@ extern "C" {
 #define LUATEXTS_CFIXEDTABLE  'T' /* 0x54 (84)  */
 #define LUATEXTS_CSTREAMTABLE 't' /* 0x74 (116) */
 #define LUATEXTS_CSTRINGUTF8  '8' /* 0x38 (56)  */
+#define LUATEXTS_CHINTEDTABLE 'p' /* 0x70 (112) */
+#define LUATEXTS_CSTRINGREF   's' /* 0x73 (115) */
+#define LUATEXTS_CTABLEREF    'r' /* 0x72 (114) */
 
 /* WARNING: Make sure these match your luaconf.h */
 typedef lua_Number LUATEXTS_NUMBER;
-typedef unsigned long LUATEXTS_UINT;
+typedef uint64_t LUATEXTS_UINT;
+
+#define LUATEXTS_U64(hi, lo) \
+  ((((LUATEXTS_UINT)(hi)) << 32) | (LUATEXTS_UINT)(lo))
 
 #define luatexts_tonumber strtod
 
@@ -192,9 +293,17 @@ static const unsigned char * ltsLS_eat(lts_LoadState * ls, size_t len)
 
 #define EAT_NEWLINE(ls, msg) \
   do { \
+    LUATEXTS_ENSURE((ls), \
+        ltsLS_good((ls)) && ltsLS_unread((ls)) > 0, \
+        LUATEXTS_ECLIPPED, (msg ": clipped\n") \
+      ); \
     if (*(ls)->pos == '\r') \
     { \
       EAT_CHAR((ls), msg); \
+      LUATEXTS_ENSURE((ls), \
+          ltsLS_unread((ls)) > 0, \
+          LUATEXTS_ECLIPPED, (msg ": clipped\n") \
+        ); \
     } \
     LUATEXTS_ENSURE((ls), \
         *(ls)->pos == '\n', \
@@ -203,6 +312,90 @@ static const unsigned char * ltsLS_eat(lts_LoadState * ls, size_t len)
     EAT_CHAR((ls), msg); \
   } while (0);
 
+/* Eats '\n' or '\r\n' */
+static int ltsLS_eatnewline(lts_LoadState * ls)
+{
+  EAT_NEWLINE(ls, "eatnewline");
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Returns pointer to the first '\n' in data, or NULL if there is none.
+*/
+static const unsigned char * lts_findnl(
+    const unsigned char * data,
+    size_t len
+  )
+{
+  const unsigned char * pos = data;
+  const unsigned char * end = data + len;
+
+#if defined(LUATEXTS_USE_AVX2)
+  {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    while (end - pos >= 32)
+    {
+      int mask = _mm256_movemask_epi8(
+          _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)pos), nl)
+        );
+      if (mask != 0)
+      {
+        return pos + __builtin_ctz((unsigned int)mask);
+      }
+      pos += 32;
+    }
+  }
+#endif /* defined(LUATEXTS_USE_AVX2) */
+
+#if defined(LUATEXTS_USE_SSE2)
+  {
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (end - pos >= 16)
+    {
+      int mask = _mm_movemask_epi8(
+          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)pos), nl)
+        );
+      if (mask != 0)
+      {
+        return pos + __builtin_ctz((unsigned int)mask);
+      }
+      pos += 16;
+    }
+  }
+#endif /* defined(LUATEXTS_USE_SSE2) */
+
+  /* Word-at-a-time: skip words that have no '\n' byte in them */
+  {
+    const size_t ones = (size_t)-1 / 0xFF;
+    const size_t highs = ones * 0x80;
+    const size_t nls = ones * '\n';
+
+    while ((size_t)(end - pos) >= sizeof(size_t))
+    {
+      size_t word = 0;
+      memcpy(&word, pos, sizeof(size_t));
+      word ^= nls; /* Bytes that were '\n' are now zero */
+      if (((word - ones) & ~word & highs) != 0)
+      {
+        break;
+      }
+      pos += sizeof(size_t);
+    }
+  }
+
+  while (pos < end)
+  {
+    if (*pos == '\n')
+    {
+      return pos;
+    }
+    ++pos;
+  }
+
+  return NULL;
+}
+
 /*
 * UTF-8 handling implemented based on information here:
 * http://www.cl.cam.ac.uk/~mgk25/unicode.html#utf-8
@@ -355,6 +548,374 @@ static int ltsLS_eatutf8char(lts_LoadState * ls, size_t * len_bytes)
   return LUATEXTS_ESUCCESS;
 }
 
+/*
+* Vectorized UTF-8 validation
+*
+* Non-ASCII blocks are validated with the lookup algorithm
+* by John Keiser and Daniel Lemire ("Validating UTF-8 In Less Than One
+* Instruction Per Byte", 2020). On top of it we reject U+FFFE and U+FFFF,
+* same as ltsLS_eatutf8char() does.
+*
+* Each block starts at a character boundary. Character, clipped
+* by the end of a block, is left for the next block.
+*/
+
+#if defined(LUATEXTS_USE_SSSE3)
+
+#define LTS_U8_TOO_SHORT      (1 << 0)
+#define LTS_U8_TOO_LONG       (1 << 1)
+#define LTS_U8_OVERLONG_3     (1 << 2)
+#define LTS_U8_TOO_LARGE      (1 << 3)
+#define LTS_U8_SURROGATE      (1 << 4)
+#define LTS_U8_OVERLONG_2     (1 << 5)
+#define LTS_U8_TOO_LARGE_1000 (1 << 6)
+#define LTS_U8_OVERLONG_4     (1 << 6)
+#define LTS_U8_TWO_CONTS      (1 << 7)
+#define LTS_U8_CARRY \
+  (LTS_U8_TOO_SHORT | LTS_U8_TOO_LONG | LTS_U8_TWO_CONTS)
+
+/* Table, indexed by high nibble of the first byte */
+#define LTS_U8_BYTE_1_HIGH \
+  LTS_U8_TOO_LONG, LTS_U8_TOO_LONG, LTS_U8_TOO_LONG, LTS_U8_TOO_LONG, \
+  LTS_U8_TOO_LONG, LTS_U8_TOO_LONG, LTS_U8_TOO_LONG, LTS_U8_TOO_LONG, \
+  (char)LTS_U8_TWO_CONTS, (char)LTS_U8_TWO_CONTS, \
+  (char)LTS_U8_TWO_CONTS, (char)LTS_U8_TWO_CONTS, \
+  LTS_U8_TOO_SHORT | LTS_U8_OVERLONG_2, \
+  LTS_U8_TOO_SHORT, \
+  LTS_U8_TOO_SHORT | LTS_U8_OVERLONG_3 | LTS_U8_SURROGATE, \
+  LTS_U8_TOO_SHORT | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000 \
+    | LTS_U8_OVERLONG_4
+
+/* Table, indexed by low nibble of the first byte */
+#define LTS_U8_BYTE_1_LOW \
+  (char)(LTS_U8_CARRY | LTS_U8_OVERLONG_3 | LTS_U8_OVERLONG_2 \
+    | LTS_U8_OVERLONG_4), \
+  (char)(LTS_U8_CARRY | LTS_U8_OVERLONG_2), \
+  (char)LTS_U8_CARRY, \
+  (char)LTS_U8_CARRY, \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000 \
+    | LTS_U8_SURROGATE), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000), \
+  (char)(LTS_U8_CARRY | LTS_U8_TOO_LARGE | LTS_U8_TOO_LARGE_1000)
+
+/* Table, indexed by high nibble of the second byte */
+#define LTS_U8_BYTE_2_HIGH \
+  LTS_U8_TOO_SHORT, LTS_U8_TOO_SHORT, LTS_U8_TOO_SHORT, LTS_U8_TOO_SHORT, \
+  LTS_U8_TOO_SHORT, LTS_U8_TOO_SHORT, LTS_U8_TOO_SHORT, LTS_U8_TOO_SHORT, \
+  (char)(LTS_U8_TOO_LONG | LTS_U8_OVERLONG_2 | LTS_U8_TWO_CONTS \
+    | LTS_U8_OVERLONG_3 | LTS_U8_TOO_LARGE_1000 | LTS_U8_OVERLONG_4), \
+  (char)(LTS_U8_TOO_LONG | LTS_U8_OVERLONG_2 | LTS_U8_TWO_CONTS \
+    | LTS_U8_OVERLONG_3 | LTS_U8_TOO_LARGE), \
+  (char)(LTS_U8_TOO_LONG | LTS_U8_OVERLONG_2 | LTS_U8_TWO_CONTS \
+    | LTS_U8_SURROGATE | LTS_U8_TOO_LARGE), \
+  (char)(LTS_U8_TOO_LONG | LTS_U8_OVERLONG_2 | LTS_U8_TWO_CONTS \
+    | LTS_U8_SURROGATE | LTS_U8_TOO_LARGE), \
+  LTS_U8_TOO_SHORT, LTS_U8_TOO_SHORT, LTS_U8_TOO_SHORT, LTS_U8_TOO_SHORT
+
+/*
+* Returns number of trailing bytes of a character, clipped by the end
+* of a valid block (end points right after the block).
+*/
+static size_t lts_utf8clipped(const unsigned char * end)
+{
+  if (end[-1] >= 0xC0)
+  {
+    return 1;
+  }
+
+  if (end[-2] >= 0xE0)
+  {
+    return 2;
+  }
+
+  if (end[-3] >= 0xF0)
+  {
+    return 3;
+  }
+
+  return 0;
+}
+
+/* Returns non-zero if block has invalid data */
+LUATEXTS_TARGET_SSSE3
+static int lts_utf8bad16(__m128i input)
+{
+  const __m128i low_nibble = _mm_set1_epi8(0x0F);
+
+  __m128i prev1 = _mm_slli_si128(input, 1);
+  __m128i prev2 = _mm_slli_si128(input, 2);
+  __m128i prev3 = _mm_slli_si128(input, 3);
+
+  __m128i special_cases = _mm_and_si128(
+      _mm_and_si128(
+          _mm_shuffle_epi8(
+              _mm_setr_epi8(LTS_U8_BYTE_1_HIGH),
+              _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble)
+            ),
+          _mm_shuffle_epi8(
+              _mm_setr_epi8(LTS_U8_BYTE_1_LOW),
+              _mm_and_si128(prev1, low_nibble)
+            )
+        ),
+      _mm_shuffle_epi8(
+          _mm_setr_epi8(LTS_U8_BYTE_2_HIGH),
+          _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble)
+        )
+    );
+
+  /* Third and fourth bytes of a character must be continuation bytes */
+  __m128i must_be_cont = _mm_and_si128(
+      _mm_or_si128(
+          _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80))),
+          _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)))
+        ),
+      _mm_set1_epi8((char)0x80)
+    );
+
+  /* EF BF BE and EF BF BF (U+FFFE and U+FFFF) */
+  __m128i nonchar = _mm_and_si128(
+      _mm_and_si128(
+          _mm_cmpeq_epi8(prev2, _mm_set1_epi8((char)0xEF)),
+          _mm_cmpeq_epi8(prev1, _mm_set1_epi8((char)0xBF))
+        ),
+      _mm_cmpeq_epi8(_mm_max_epu8(input, _mm_set1_epi8((char)0xBE)), input)
+    );
+
+  __m128i error = _mm_or_si128(
+      _mm_xor_si128(must_be_cont, special_cases),
+      nonchar
+    );
+
+  return _mm_movemask_epi8(
+      _mm_cmpeq_epi8(error, _mm_setzero_si128())
+    ) != 0xFFFF;
+}
+
+/*
+* Eats valid 16-byte blocks, while at least 16 characters are left.
+* Returns position after the last eaten block.
+*/
+LUATEXTS_TARGET_SSSE3
+static const unsigned char * lts_utf8blocks16(
+    const unsigned char * pos,
+    const unsigned char * end,
+    size_t * left
+  )
+{
+  while (*left >= 16 && end - pos >= 16)
+  {
+    __m128i input = _mm_loadu_si128((const __m128i *)pos);
+    size_t clipped = 0;
+
+    if (_mm_movemask_epi8(input) == 0) /* ASCII */
+    {
+      pos += 16;
+      *left -= 16;
+      continue;
+    }
+
+    if (lts_utf8bad16(input))
+    {
+      break;
+    }
+
+    clipped = lts_utf8clipped(pos + 16);
+
+    /* Count all bytes, but continuation ones */
+    *left -= __builtin_popcount((unsigned int)_mm_movemask_epi8(
+        _mm_cmpgt_epi8(input, _mm_set1_epi8(-65))
+      )) - (clipped > 0);
+    pos += 16 - clipped;
+  }
+
+  return pos;
+}
+
+#endif /* defined(LUATEXTS_USE_SSSE3) */
+
+#if defined(LUATEXTS_USE_AVX2) || defined(LUATEXTS_USE_CPU_DISPATCH)
+
+/* Returns non-zero if block has invalid data */
+LUATEXTS_TARGET_AVX2
+static int lts_utf8bad32(__m256i input)
+{
+  const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+
+  /* Input, shifted by 16 bytes (crossing the lane boundary) */
+  __m256i shifted = _mm256_permute2x128_si256(input, input, 0x08);
+
+  __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+  __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+  __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+
+  __m256i special_cases = _mm256_and_si256(
+      _mm256_and_si256(
+          _mm256_shuffle_epi8(
+              _mm256_broadcastsi128_si256(_mm_setr_epi8(LTS_U8_BYTE_1_HIGH)),
+              _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble)
+            ),
+          _mm256_shuffle_epi8(
+              _mm256_broadcastsi128_si256(_mm_setr_epi8(LTS_U8_BYTE_1_LOW)),
+              _mm256_and_si256(prev1, low_nibble)
+            )
+        ),
+      _mm256_shuffle_epi8(
+          _mm256_broadcastsi128_si256(_mm_setr_epi8(LTS_U8_BYTE_2_HIGH)),
+          _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble)
+        )
+    );
+
+  /* Third and fourth bytes of a character must be continuation bytes */
+  __m256i must_be_cont = _mm256_and_si256(
+      _mm256_or_si256(
+          _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80))),
+          _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)))
+        ),
+      _mm256_set1_epi8((char)0x80)
+    );
+
+  /* EF BF BE and EF BF BF (U+FFFE and U+FFFF) */
+  __m256i nonchar = _mm256_and_si256(
+      _mm256_and_si256(
+          _mm256_cmpeq_epi8(prev2, _mm256_set1_epi8((char)0xEF)),
+          _mm256_cmpeq_epi8(prev1, _mm256_set1_epi8((char)0xBF))
+        ),
+      _mm256_cmpeq_epi8(
+          _mm256_max_epu8(input, _mm256_set1_epi8((char)0xBE)), input
+        )
+    );
+
+  __m256i error = _mm256_or_si256(
+      _mm256_xor_si256(must_be_cont, special_cases),
+      nonchar
+    );
+
+  return !_mm256_testz_si256(error, error);
+}
+
+/*
+* Eats valid 32-byte blocks, while at least 32 characters are left.
+* Returns position after the last eaten block.
+*/
+LUATEXTS_TARGET_AVX2
+static const unsigned char * lts_utf8blocks32(
+    const unsigned char * pos,
+    const unsigned char * end,
+    size_t * left
+  )
+{
+  while (*left >= 32 && end - pos >= 32)
+  {
+    __m256i input = _mm256_loadu_si256((const __m256i *)pos);
+    size_t clipped = 0;
+
+    if (_mm256_movemask_epi8(input) == 0) /* ASCII */
+    {
+      pos += 32;
+      *left -= 32;
+      continue;
+    }
+
+    if (lts_utf8bad32(input))
+    {
+      break;
+    }
+
+    clipped = lts_utf8clipped(pos + 32);
+
+    /* Count all bytes, but continuation ones */
+    *left -= __builtin_popcount((unsigned int)_mm256_movemask_epi8(
+        _mm256_cmpgt_epi8(input, _mm256_set1_epi8(-65))
+      )) - (clipped > 0);
+    pos += 32 - clipped;
+  }
+
+  return pos;
+}
+
+#endif /* LUATEXTS_USE_AVX2 || LUATEXTS_USE_CPU_DISPATCH */
+
+/*
+* Eats whole blocks of valid UTF-8 data while it is certain that all
+* characters in a block belong to the string (there are at least
+* block size characters left). Returns number of characters eaten.
+* Stops at the character boundary before any invalid data, leaving
+* the rest to ltsLS_eatutf8char(), so errors are reported the same way.
+*/
+static size_t ltsLS_eatutf8blocks(lts_LoadState * ls, size_t num_chars)
+{
+  const unsigned char * pos = ls->pos;
+  const unsigned char * end = NULL;
+  size_t left = num_chars;
+
+  if (LUATEXTS_UNLIKELY(!ltsLS_good(ls)))
+  {
+    return 0;
+  }
+
+  end = pos + ltsLS_unread(ls);
+
+#if defined(LUATEXTS_USE_AVX2) || defined(LUATEXTS_USE_CPU_DISPATCH)
+  if (LUATEXTS_HAVE_AVX2())
+  {
+    pos = lts_utf8blocks32(pos, end, &left);
+  }
+#endif /* LUATEXTS_USE_AVX2 || LUATEXTS_USE_CPU_DISPATCH */
+
+#if defined(LUATEXTS_USE_SSSE3)
+  if (LUATEXTS_HAVE_SSSE3())
+  {
+    pos = lts_utf8blocks16(pos, end, &left);
+  }
+#endif /* defined(LUATEXTS_USE_SSSE3) */
+
+#if defined(LUATEXTS_USE_SSE2)
+  /* ASCII only, in case there is no SSSE3 */
+  while (left >= 16 && end - pos >= 16)
+  {
+    if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)pos)) != 0)
+    {
+      break; /* Not ASCII */
+    }
+
+    pos += 16;
+    left -= 16;
+  }
+#endif /* defined(LUATEXTS_USE_SSE2) */
+
+  /* Word-at-a-time ASCII */
+  {
+    const size_t highs = ((size_t)-1 / 0xFF) * 0x80;
+
+    while (left >= sizeof(size_t) && (size_t)(end - pos) >= sizeof(size_t))
+    {
+      size_t word = 0;
+      memcpy(&word, pos, sizeof(size_t));
+      if ((word & highs) != 0)
+      {
+        break; /* Not ASCII */
+      }
+
+      pos += sizeof(size_t);
+      left -= sizeof(size_t);
+    }
+  }
+
+  ls->unread -= pos - ls->pos;
+  ls->pos = pos;
+
+  return num_chars - left;
+}
+
 /*
 * Eats specified number of UTF-8 characters. Returns NULL if failed.
 * Fails on invalid UTF-8 characters.
@@ -368,10 +929,12 @@ static int ltsLS_eatutf8(
 {
   const unsigned char * origin = ls->pos;
   size_t num_bytes = 0;
-  size_t i = 0;
+  size_t i = ltsLS_eatutf8blocks(ls, num_chars);
   int result = LUATEXTS_ESUCCESS;
 
-  for (i = 0; i < num_chars; ++i)
+  num_bytes = ls->pos - origin;
+
+  for (; i < num_chars; ++i)
   {
     result = ltsLS_eatutf8char(ls, &num_bytes);
 
@@ -399,39 +962,32 @@ static int ltsLS_readline(
     size_t * len
   )
 {
-  const unsigned char * origin = ls->pos;
-  const unsigned char * last = NULL;
+  const unsigned char * nl = NULL;
   size_t read = 0;
 
-  while (ltsLS_good(ls))
+  if (LUATEXTS_LIKELY(ltsLS_good(ls)))
   {
-    if (LUATEXTS_LIKELY(ltsLS_unread(ls) > 0))
-    {
-      const unsigned char * cur = ls->pos;
-      ++ls->pos;
-      --ls->unread;
+    nl = lts_findnl(ls->pos, ltsLS_unread(ls));
+  }
 
-      if (LUATEXTS_UNLIKELY(*cur == '\n'))
-      {
-        *dest = origin;
-        *len = (last != NULL && *last == '\r') ? read - 1 : read;
+  if (LUATEXTS_UNLIKELY(nl == NULL))
+  {
+    ltsLS_close(ls);
 
-        return LUATEXTS_ESUCCESS;
-      }
+    ESPAM(("readline: clipped\n"));
 
-      last = cur;
-      ++read;
-    }
-    else
-    {
-      ltsLS_close(ls);
-      break;
-    }
+    return LUATEXTS_ECLIPPED;
   }
 
-  ESPAM(("readline: clipped\n"));
+  read = nl - ls->pos;
+
+  *dest = ls->pos;
+  *len = (read > 0 && nl[-1] == '\r') ? read - 1 : read;
+
+  ls->pos = nl + 1;
+  ls->unread -= read + 1;
 
-  return LUATEXTS_ECLIPPED;
+  return LUATEXTS_ESUCCESS;
 }
 
 static const signed char uint_lookup_table_10[256] =
@@ -507,35 +1063,44 @@ static const signed char uint_lookup_table_36[256] =
     ) \
   { \
     LUATEXTS_UINT k = 0; \
-    if (LUATEXTS_UNLIKELY(!ltsLS_good(ls))) \
+    const unsigned char * pos = ls->pos; \
+    const unsigned char * end = NULL; \
+    if (LUATEXTS_UNLIKELY(!ltsLS_good(ls) || ltsLS_unread(ls) == 0)) \
     { \
       ESPAM((LUATEXTS_STRINGIFY(LUATEXTS_CONCAT(ltsLS_readuint, BASE)) \
         ": clipped\n")); \
+      ltsLS_close(ls); \
       return LUATEXTS_ECLIPPED; \
     } \
+    end = pos + ltsLS_unread(ls); \
     LUATEXTS_ENSURE(ls, \
-        LUATEXTS_CONCAT(uint_lookup_table_, BASE)[*ls->pos] >= 0, \
+        LUATEXTS_CONCAT(uint_lookup_table_, BASE)[*pos] >= 0, \
         LUATEXTS_EBADDATA, \
         (LUATEXTS_STRINGIFY(LUATEXTS_CONCAT(ltsLS_readuint, BASE)) \
           ": first character is not a number\n") \
       ); \
-    while (LUATEXTS_CONCAT(uint_lookup_table_, BASE)[*ls->pos] >= 0) \
+    /* Digits are eaten all at once after the loop */ \
+    while ( \
+        pos < end && LUATEXTS_CONCAT(uint_lookup_table_, BASE)[*pos] >= 0 \
+      ) \
     { \
       LUATEXTS_ENSURE(ls, \
           !( \
             (k >= LIMIT) && \
             ( \
               k != LIMIT || \
-              LUATEXTS_CONCAT(uint_lookup_table_, BASE)[*ls->pos] > TAIL \
+              LUATEXTS_CONCAT(uint_lookup_table_, BASE)[*pos] > TAIL \
             ) \
           ), \
           LUATEXTS_ETOOHUGE, \
           (LUATEXTS_STRINGIFY(LUATEXTS_CONCAT(ltsLS_readuint, BASE)) \
-            ": value does not fit to uint32_t\n") \
+            ": value does not fit to uint64_t\n") \
         ); \
-      k = k * BASE + LUATEXTS_CONCAT(uint_lookup_table_, BASE)[*ls->pos]; \
-      EAT_CHAR(ls, LUATEXTS_STRINGIFY(LUATEXTS_CONCAT(ltsLS_readuint, BASE))); \
+      k = k * BASE + LUATEXTS_CONCAT(uint_lookup_table_, BASE)[*pos]; \
+      ++pos; \
     } \
+    ls->unread -= pos - ls->pos; \
+    ls->pos = pos; \
     EAT_NEWLINE( \
         ls, LUATEXTS_STRINGIFY(LUATEXTS_CONCAT(ltsLS_readuint, BASE)) \
       ); \
@@ -543,490 +1108,7588 @@ static const signed char uint_lookup_table_36[256] =
     return LUATEXTS_ESUCCESS; \
   }
 
-DECLARE_READUINT(ltsLS_readuint, 10, 429496729,  5)
-DECLARE_READUINT(ltsLS_readuint, 16, 0xFFFFFFF,  0xF)
-DECLARE_READUINT(ltsLS_readuint, 36, 119304647,  3)
+/* LIMIT and TAIL are (2^64 - 1) / BASE and (2^64 - 1) % BASE */
+DECLARE_READUINT(
+    ltsLS_readuint, 10, LUATEXTS_U64(0x19999999, 0x99999999), 5
+  )
+DECLARE_READUINT(
+    ltsLS_readuint, 16, LUATEXTS_U64(0x0FFFFFFF, 0xFFFFFFFF), 0xF
+  )
+DECLARE_READUINT(
+    ltsLS_readuint, 36, LUATEXTS_U64(0x071C71C7, 0x1C71C71C), 15
+  )
 
 #undef DECLARE_READUINT
 
-static int ltsLS_readnumber(lts_LoadState * ls, LUATEXTS_NUMBER * dest)
+/* Longest number we would copy to convert in a non-"C" locale */
+#define LUATEXTS_MAXNUMBERLEN (200)
+
+/*
+* Number value as read from data. On Lua 5.3+ decimal integer literals
+* that fit lua_Integer are kept as integers, other numbers (including
+* 1e3, 0x10 and integer literals that overflow) are floats,
+* the same way Lua's own tonumber() does it.
+*/
+typedef struct lts_Number
 {
-  size_t len = 0;
-  const unsigned char * data = NULL;
-  int result = ltsLS_readline(ls, &data, &len);
-  char * endptr = NULL;
-  LUATEXTS_NUMBER value = 0;
+  LUATEXTS_NUMBER value;
+  lua_Integer ivalue;
+  int is_integer; /* Always zero without LUATEXTS_USE_INTEGERS */
+} lts_Number;
 
-  if (result != LUATEXTS_ESUCCESS)
+static void lts_pushnumber(lua_State * L, const lts_Number * number)
+{
+#if defined(LUATEXTS_USE_INTEGERS)
+  if (number->is_integer)
   {
-    ESPAM(("readnumber: failed to read line"));
-    return result;
+    lua_pushinteger(L, number->ivalue);
+    return;
   }
+#endif
 
-  LUATEXTS_ENSURE(ls,
-      len > 0,
-      LUATEXTS_EBADDATA, ("readnumber: empty line instead of number\n")
-    );
-
-  /*
-  * This is safe, since we're guaranteed to have
-  * at least one non-numeric trailing byte.
-  */
-  value = strtod((const char *)data, &endptr);
-  LUATEXTS_ENSURE(ls,
-      (const unsigned char *)endptr == data + len,
-      LUATEXTS_EGARBAGE, ("readnumber: garbage before eol\n")
-    );
+  lua_pushnumber(L, number->value);
+}
 
-  *dest = value;
+/* Unsigned values that do not fit lua_Integer are loaded as floats */
+static void lts_pushuint(lua_State * L, LUATEXTS_UINT value)
+{
+#if defined(LUATEXTS_USE_INTEGERS)
+  if (LUATEXTS_LIKELY(value <= (LUATEXTS_UINT)LUA_MAXINTEGER))
+  {
+    lua_pushinteger(L, (lua_Integer)value);
+    return;
+  }
+#endif
 
-  return LUATEXTS_ESUCCESS;
+  lua_pushnumber(L, (LUATEXTS_NUMBER)value);
 }
 
-static int load_value(lua_State * L, lts_LoadState * ls);
+#if defined(LUATEXTS_USE_INTEGERS)
 
-/*
-* TODO: generalize with load_stream_table.
-*/
-static int load_fixed_table(lua_State * L, lts_LoadState * ls)
+/* Returns non-zero if data is -?[0-9]+ and fits lua_Integer */
+static int lts_readinteger(
+    const unsigned char * data,
+    size_t len,
+    lua_Integer * dest
+  )
 {
-  LUATEXTS_UINT array_size = 0;
-  LUATEXTS_UINT hash_size = 0;
-
-  LUATEXTS_UINT i = 0;
+  const unsigned char * end = data + len;
+  LUATEXTS_UINT limit = (LUATEXTS_UINT)LUA_MAXINTEGER;
+  LUATEXTS_UINT k = 0;
+  int negative = 0;
 
-  int result = ltsLS_readuint10(ls, &array_size);
-  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  if (data < end && *data == '-')
   {
-    ESPAM(("load_fixed_table: failed to read array size"));
-    return result;
+    negative = 1;
+    ++limit; /* Two's complement has one more negative value */
+    ++data;
   }
 
-  result = ltsLS_readuint10(ls, &hash_size);
-  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  if (data == end)
   {
-    ESPAM(("load_fixed_table: failed to read hash size"));
-    return result;
+    return 0;
   }
 
-  LUATEXTS_ENSURE(ls,
-      array_size >= 0 && array_size <= MAXASIZE &&
-      hash_size >= 0 &&
-      (hash_size == 0 || ceillog2((unsigned int)hash_size) <= MAXBITS) &&
-      /*
-      * Simplification: Assuming minimum value size is one byte.
-      */
-      ltsLS_unread(ls) >= (array_size + hash_size * 2),
-      LUATEXTS_ETOOHUGE, ("load_fixed_table: too huge\n")
-    );
-  SPAM((
-      "load_fixed_table: size: %lu array + %lu hash = %lu total\n",
-      array_size, hash_size, array_size + hash_size
-    ));
-
-  lua_createtable(L, array_size, hash_size);
-
-  for (i = 0; i < array_size; ++i)
+  for (; data < end; ++data)
   {
-    result = load_value(L, ls); /* Load value. */
-    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+    unsigned int digit = (unsigned int)(*data - '0');
+    if (digit > 9 || k > (limit - digit) / 10)
     {
-      ESPAM(("load_fixed_table: failed to read array part value\n"));
-      return result;
+      return 0;
     }
-
-    lua_rawseti(L, -2, i + 1);
+    k = k * 10 + digit;
   }
 
-  for (i = 0; i < hash_size; ++i)
-  {
-    int key_type = LUA_TNONE;
+  /* Avoiding implementation-defined unsigned to signed conversion */
+  *dest = (negative && k != 0)
+    ? -(lua_Integer)(k - 1) - 1
+    : (lua_Integer)k
+    ;
 
-    result = load_value(L, ls); /* Load key. */
-    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
-    {
-      ESPAM(("load_fixed_table: failed to read key\n"));
+  return 1;
+}
+
+#endif /* defined(LUATEXTS_USE_INTEGERS) */
+
+static int ltsLS_readnumber(lts_LoadState * ls, lts_Number * dest)
+{
+  size_t len = 0;
+  const unsigned char * data = NULL;
+  int result = ltsLS_readline(ls, &data, &len);
+  char * endptr = NULL;
+  LUATEXTS_NUMBER value = 0;
+  double fast_value = 0;
+  char point = '.';
+
+  if (result != LUATEXTS_ESUCCESS)
+  {
+    ESPAM(("readnumber: failed to read line"));
+    return result;
+  }
+
+  LUATEXTS_ENSURE(ls,
+      len > 0,
+      LUATEXTS_EBADDATA, ("readnumber: empty line instead of number\n")
+    );
+
+  dest->is_integer = 0;
+
+#if defined(LUATEXTS_USE_INTEGERS)
+  if (lts_readinteger(data, len, &dest->ivalue))
+  {
+    dest->is_integer = 1;
+    return LUATEXTS_ESUCCESS;
+  }
+#endif
+
+  /* Plain decimal numbers (almost all of them) */
+  if (LUATEXTS_LIKELY(lts_fastfloat(data, len, &fast_value)))
+  {
+    dest->value = fast_value;
+    return LUATEXTS_ESUCCESS;
+  }
+
+  /*
+  * The rest (inf, nan, hex, too many digits) goes to strtod().
+  * Like Lua does, we replace '.' with the decimal point of current locale,
+  * so result does not depend on locale.
+  */
+  point = localeconv()->decimal_point[0];
+  if (LUATEXTS_LIKELY(point == '.'))
+  {
+    /*
+    * This is safe, since we're guaranteed to have
+    * at least one non-numeric trailing byte.
+    */
+    value = luatexts_tonumber((const char *)data, &endptr);
+    LUATEXTS_ENSURE(ls,
+        (const unsigned char *)endptr == data + len,
+        LUATEXTS_EGARBAGE, ("readnumber: garbage before eol\n")
+      );
+  }
+  else
+  {
+    char buf[LUATEXTS_MAXNUMBERLEN + 1];
+    size_t i = 0;
+
+    LUATEXTS_ENSURE(ls,
+        len <= LUATEXTS_MAXNUMBERLEN && memchr(data, point, len) == NULL,
+        LUATEXTS_EGARBAGE, ("readnumber: garbage in number\n")
+      );
+
+    for (i = 0; i < len; ++i)
+    {
+      buf[i] = (data[i] == '.') ? point : (char)data[i];
+    }
+    buf[len] = '\0';
+
+    value = luatexts_tonumber(buf, &endptr);
+    LUATEXTS_ENSURE(ls,
+        endptr == buf + len,
+        LUATEXTS_EGARBAGE, ("readnumber: garbage before eol\n")
+      );
+  }
+
+  dest->value = value;
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Default limit on table nesting depth.
+* Each nesting level takes up to two Lua stack slots while loading.
+*/
+#define LUATEXTS_DEFAULT_MAXDEPTH (1000)
+
+/* Number of frames kept on C stack before switching to heap */
+#define LUATEXTS_LOAD_STACKFRAMES (32)
+
+/*
+* Keys of heap buffers in the anchor table of lts_loadtuple(),
+* positive keys are taken by referenced strings.
+*/
+#define LUATEXTS_LOAD_ANCHOR_FRAMES  (0)
+#define LUATEXTS_LOAD_ANCHOR_STRINGS (-1)
+#define LUATEXTS_LOAD_ANCHOR_SHARED  (-2)
+
+typedef struct lts_LoadOptions
+{
+  size_t max_depth;
+
+  /* Resource limits, all unlimited by default */
+  size_t max_values;        /* Total, including table keys */
+  size_t max_tuple_size;
+  size_t max_string_length; /* In bytes */
+  size_t max_array_size;    /* Fixed table sizes, and hints for p tables */
+  size_t max_hash_size;
+
+  int dedup;                /* Share identical tables and long strings */
+} lts_LoadOptions;
+
+/* Reads optional non-negative option from options table at given index */
+static size_t lts_optsize(
+    lua_State * L,
+    int idx,
+    const char * name,
+    size_t def
+  )
+{
+  size_t result = def;
+
+  lua_getfield(L, idx, name);
+  if (!lua_isnil(L, -1))
+  {
+    lua_Number value = luaL_checknumber(L, -1);
+    if (value < 0)
+    {
+      luaL_argerror(
+          L, idx, lua_pushfstring(L, "%s must not be negative", name)
+        );
+    }
+    result = (value < (lua_Number)((size_t)-1))
+      ? (size_t)value
+      : (size_t)-1
+      ;
+  }
+  lua_pop(L, 1);
+
+  return result;
+}
+
+/* Reads optional options table at given stack index */
+static void load_options(lua_State * L, int idx, lts_LoadOptions * opts)
+{
+  opts->max_depth = LUATEXTS_DEFAULT_MAXDEPTH;
+  opts->max_values = (size_t)-1;
+  opts->max_tuple_size = (size_t)-1;
+  opts->max_string_length = (size_t)-1;
+  opts->max_array_size = (size_t)-1;
+  opts->max_hash_size = (size_t)-1;
+  opts->dedup = 0;
+
+  if (lua_isnoneornil(L, idx))
+  {
+    return;
+  }
+
+  luaL_checktype(L, idx, LUA_TTABLE);
+
+  luaL_checkstack(L, 2, "load-options");
+
+  opts->max_depth = lts_optsize(L, idx, "max_depth", opts->max_depth);
+  opts->max_values = lts_optsize(L, idx, "max_values", opts->max_values);
+  opts->max_tuple_size = lts_optsize(
+      L, idx, "max_tuple_size", opts->max_tuple_size
+    );
+  opts->max_string_length = lts_optsize(
+      L, idx, "max_string_length", opts->max_string_length
+    );
+  opts->max_array_size = lts_optsize(
+      L, idx, "max_array_size", opts->max_array_size
+    );
+  opts->max_hash_size = lts_optsize(
+      L, idx, "max_hash_size", opts->max_hash_size
+    );
+
+  lua_getfield(L, idx, "dedup");
+  opts->dedup = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+}
+
+/*
+* Runtime load metrics (see stats() and reset_stats()), one set per Lua state,
+* kept in registry. Collection is off until enabled with reset_stats().
+* Counters of a single load are added to the totals only if the load succeeds.
+*/
+
+#define LUATEXTS_METRICS_KEY "luatexts.Metrics"
+
+/* Value types, in the order of lts_Counters arrays */
+#define LUATEXTS_NTYPES (14)
+static const char lts_types[LUATEXTS_NTYPES + 1] = "-01NUHZS8sTtpr";
+
+static const char * const lts_errnames[LUATEXTS_ELIMIT + 1] =
+{
+  NULL,
+  "EFAILURE", "EBADSIZE", "EBADDATA", "EBADTYPE", "EGARBAGE", "ETOOHUGE",
+  "EBADUTF8", "ECLIPPED", "ECIRCULAR", "EBADVALUE", "ENOMEM", "EIO",
+  "ETOODEEP", "ELIMIT"
+};
+
+typedef struct lts_Counters
+{
+  size_t values[LUATEXTS_NTYPES];
+  size_t bytes[LUATEXTS_NTYPES]; /* Type, data and newlines; tables: header */
+  size_t tables_presized;        /* Slots tables were created with */
+  size_t tables_filled;          /* Items put to tables */
+  size_t tables_grown;           /* Tables that got more items than slots */
+  size_t max_depth;
+} lts_Counters;
+
+typedef struct lts_Metrics
+{
+  int enabled;
+  size_t loads;
+  lts_Counters counters;
+  double scan_time; /* Seconds of CPU time */
+  double load_time;
+  size_t errors[LUATEXTS_ELIMIT + 1];
+} lts_Metrics;
+
+/*
+* Non-zero once metrics were enabled in any Lua state, until then loads
+* do not look them up in registry. It is only ever set to one, so a race
+* between Lua states in different threads at worst makes them look it up.
+*/
+static int lts_metrics_used = 0;
+
+/* Returns NULL if metrics are not collected */
+static lts_Metrics * lts_getmetrics(lua_State * L)
+{
+  lts_Metrics * metrics = NULL;
+
+  if (LUATEXTS_LIKELY(!lts_metrics_used))
+  {
+    return NULL;
+  }
+
+  luaL_checkstack(L, 1, "metrics");
+  lua_getfield(L, LUA_REGISTRYINDEX, LUATEXTS_METRICS_KEY);
+  metrics = (lts_Metrics *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+
+  return (metrics != NULL && metrics->enabled) ? metrics : NULL;
+}
+
+static void ltsM_countvalue(
+    lts_Counters * counters,
+    unsigned char type,
+    size_t len
+  )
+{
+  const char * found = (const char *)memchr(lts_types, type, LUATEXTS_NTYPES);
+  if (LUATEXTS_LIKELY(found != NULL))
+  {
+    ++counters->values[found - lts_types];
+    counters->bytes[found - lts_types] += len;
+  }
+}
+
+/* Called when a table frame is complete */
+#define ltsM_closetable(counters, frame) \
+  do { \
+    if ((counters) != NULL) \
+    { \
+      (counters)->tables_filled += (frame)->items; \
+      if ((frame)->items > (frame)->presize) \
+      { \
+        ++(counters)->tables_grown; \
+      } \
+    } \
+  } while (0)
+
+static void ltsM_add(lts_Metrics * metrics, const lts_Counters * counters)
+{
+  lts_Counters * total = &metrics->counters;
+  size_t i = 0;
+
+  for (i = 0; i < LUATEXTS_NTYPES; ++i)
+  {
+    total->values[i] += counters->values[i];
+    total->bytes[i] += counters->bytes[i];
+  }
+
+  total->tables_presized += counters->tables_presized;
+  total->tables_filled += counters->tables_filled;
+  total->tables_grown += counters->tables_grown;
+  if (counters->max_depth > total->max_depth)
+  {
+    total->max_depth = counters->max_depth;
+  }
+}
+
+/* Adds CPU time since start to *total, returns current clock() value */
+static clock_t ltsM_addtime(double * total, clock_t start)
+{
+  clock_t now = clock();
+  *total += (double)(now - start) / CLOCKS_PER_SEC;
+  return now;
+}
+
+/*
+* Limits state of a single load.
+* Values are counted as they are read, so limits are checked
+* before anything is allocated for the value.
+*/
+typedef struct lts_Limits
+{
+  const lts_LoadOptions * opts;
+  size_t values_left;
+  lts_Counters * counters; /* NULL if metrics are not collected */
+} lts_Limits;
+
+static void ltsL_init(lts_Limits * limits, const lts_LoadOptions * opts)
+{
+  limits->opts = opts;
+  limits->values_left = opts->max_values;
+  limits->counters = NULL;
+}
+
+/* Called for each value (including keys) that is about to be read */
+#define ltsL_countvalue(ls, limits) \
+  do { \
+    LUATEXTS_ENSURE((ls), \
+        (limits)->values_left > 0, \
+        LUATEXTS_ELIMIT, ("limits: too many values\n") \
+      ); \
+    --(limits)->values_left; \
+  } while (0)
+
+#define ltsL_checkstring(ls, limits, len) \
+  LUATEXTS_ENSURE((ls), \
+      (len) <= (limits)->opts->max_string_length, \
+      LUATEXTS_ELIMIT, ("limits: string too long\n") \
+    )
+
+/* Checks tuple size, each value of the tuple must fit too */
+static int ltsL_checktuple(
+    const lts_Limits * limits,
+    LUATEXTS_UINT tuple_size
+  )
+{
+  if (LUATEXTS_UNLIKELY(
+      tuple_size > limits->opts->max_tuple_size ||
+      tuple_size > limits->values_left
+    ))
+  {
+    ESPAM(("limits: tuple too large\n"));
+    return LUATEXTS_ELIMIT;
+  }
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Checks fixed table sizes (already known to be not above MAXASIZE).
+* Table contents (array_size + 2 * hash_size values) must fit too.
+*/
+static int ltsL_checktable(
+    const lts_Limits * limits,
+    LUATEXTS_UINT array_size,
+    LUATEXTS_UINT hash_size
+  )
+{
+  /* Sizes are not checked yet, so the sum must not overflow */
+  if (LUATEXTS_UNLIKELY(
+      array_size > limits->opts->max_array_size ||
+      hash_size > limits->opts->max_hash_size ||
+      hash_size > limits->values_left / 2 ||
+      array_size > limits->values_left - hash_size * 2
+    ))
+  {
+    ESPAM(("limits: table too large\n"));
+    return LUATEXTS_ELIMIT;
+  }
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Size hints of a hinted streaming table are not trusted:
+* hint is capped by the number of key-value pairs that may fit
+* in the rest of the data (each pair takes at least four bytes),
+* and by the table size limit.
+* Wrong hint only affects how the table is preallocated.
+*/
+static int lts_sizehint(LUATEXTS_UINT hint, size_t limit, size_t unread)
+{
+  if (hint > limit)
+  {
+    hint = limit;
+  }
+
+  if (hint > unread / 4)
+  {
+    hint = unread / 4;
+  }
+
+  if (hint > MAXASIZE)
+  {
+    hint = MAXASIZE;
+  }
+
+  return (int)hint;
+}
+
+/* MurmurHash3 (x86_32) */
+static uint32_t lts_hash(const unsigned char * buf, size_t len, uint32_t seed)
+{
+  uint32_t h = seed;
+  uint32_t k = 0;
+  size_t i = 0;
+
+  for (i = 0; i + 4 <= len; i += 4)
+  {
+    memcpy(&k, buf + i, 4);
+    k *= 0xCC9E2D51U;
+    k = (k << 15) | (k >> 17);
+    k *= 0x1B873593U;
+
+    h ^= k;
+    h = (h << 13) | (h >> 19);
+    h = h * 5 + 0xE6546B64U;
+  }
+
+  k = 0;
+  switch (len & 3)
+  {
+    case 3:
+      k ^= (uint32_t)buf[i + 2] << 16;
+      /* Fallthrough */
+    case 2:
+      k ^= (uint32_t)buf[i + 1] << 8;
+      /* Fallthrough */
+    case 1:
+      k ^= (uint32_t)buf[i];
+      k *= 0xCC9E2D51U;
+      k = (k << 15) | (k >> 17);
+      k *= 0x1B873593U;
+      h ^= k;
+      break;
+
+    default:
+      break;
+  }
+
+  h ^= (uint32_t)len;
+  h ^= h >> 16;
+  h *= 0x85EBCA6BU;
+  h ^= h >> 13;
+  h *= 0xC2B2AE35U;
+  h ^= h >> 16;
+
+  return h;
+}
+
+/*
+* Tables being loaded are tracked with an explicit stack of frames,
+* so nesting depth does not cost C stack.
+*/
+typedef struct lts_Frame
+{
+  unsigned char type;         /* LUATEXTS_CFIXEDTABLE or CSTREAMTABLE */
+  unsigned char expect_value; /* Non-zero if key is on stack */
+  LUATEXTS_UINT array_left;
+  LUATEXTS_UINT hash_left;
+  LUATEXTS_UINT next_index;
+  size_t presize;             /* Slots the table was created with */
+  size_t items;               /* Items put to the table */
+  const unsigned char * start; /* Where table data starts, for dedup */
+  const unsigned char * hashed; /* Where hashed data ends, for dedup */
+  uint32_t hash;              /* Fingerprint of data so far, for dedup */
+  size_t number;              /* Table number, for dedup */
+  size_t select;              /* Spec node, for load_select(), or zero */
+} lts_Frame;
+
+/*
+* Tables shared by dedup option. Each complete table is fingerprinted
+* with a hash of its data, built bottom-up: data between nested tables
+* is hashed along with fingerprints of those, so each byte is hashed once,
+* however deep it is. If some table with the same data is already
+* loaded, that one is used instead. Data ranges of loaded tables
+* are kept in an open addressing hash table, which lives in userdata
+* in the anchor table. Loaded tables are kept in the map at index,
+* keyed by light userdata pointing at their data.
+*
+* Tables with the same data are the same, even if they contain back-references:
+* those are numbered from the start of the tuple. Data of a table that is
+* referenced from inside itself is unique, so it is never replaced.
+* Tables inside a replaced table (keys too, which are not shared otherwise)
+* take numbers of their counterparts in the shared one, so back-references
+* to them get what is actually in the loaded value.
+*/
+typedef struct lts_Shared
+{
+  const unsigned char * start; /* NULL if slot is free */
+  size_t len;
+  size_t number;               /* Table number */
+  uint32_t hash;
+} lts_Shared;
+
+typedef struct lts_Dedup
+{
+  const lts_LoadState * ls;
+  int index;           /* Data-to-table (and long string) map */
+  int anchor;          /* Anchor table, that keeps items */
+  int tables;          /* Table number-to-table map, or zero */
+  const size_t * seen; /* Tables read so far */
+  lts_Shared * items;
+  size_t count;
+  size_t capacity;     /* Zero or power of two */
+} lts_Dedup;
+
+/* Initial size of the hash table */
+#define LUATEXTS_DEDUP_MINSIZE (128)
+
+static void ltsDD_init(
+    lts_Dedup * dedup,
+    const lts_LoadState * ls,
+    int index,
+    int anchor,
+    int tables,
+    const size_t * seen
+  )
+{
+  dedup->ls = ls;
+  dedup->index = index;
+  dedup->anchor = anchor;
+  dedup->tables = tables;
+  dedup->seen = seen;
+  dedup->items = NULL;
+  dedup->count = 0;
+  dedup->capacity = 0;
+}
+
+/* Doubles hash table size, it is kept at most half full */
+static void ltsDD_grow(lua_State * L, lts_Dedup * dedup)
+{
+  size_t capacity = (dedup->capacity == 0)
+    ? LUATEXTS_DEDUP_MINSIZE
+    : 2 * dedup->capacity
+    ;
+  size_t i = 0;
+
+  lts_Shared * items = (lts_Shared *)lua_newuserdata(
+      L, capacity * sizeof(lts_Shared)
+    );
+  memset(items, 0, capacity * sizeof(lts_Shared));
+
+  for (i = 0; i < dedup->capacity; ++i)
+  {
+    const lts_Shared * item = &dedup->items[i];
+    if (item->start != NULL)
+    {
+      size_t j = item->hash & (capacity - 1);
+      while (items[j].start != NULL)
+      {
+        j = (j + 1) & (capacity - 1);
+      }
+      items[j] = *item;
+    }
+  }
+
+  lua_rawseti(L, dedup->anchor, LUATEXTS_LOAD_ANCHOR_SHARED);
+  dedup->items = items;
+  dedup->capacity = capacity;
+}
+
+/*
+* Called when table on top of the stack is complete, its data starts
+* at given position, and ends at the current one. Replaces the table
+* with one loaded before, if that has the same data.
+*/
+static int ltsDD_table(
+    lua_State * L,
+    lts_Dedup * dedup,
+    const unsigned char * start,
+    size_t number,
+    uint32_t hash
+  )
+{
+  size_t len = (size_t)(dedup->ls->pos - start);
+  size_t i = 0;
+
+  if (LUATEXTS_UNLIKELY(!lua_checkstack(L, 3)))
+  {
+    ESPAM(("dedup: stack overflow\n"));
+    return LUATEXTS_ETOOHUGE;
+  }
+
+  if (dedup->count * 2 >= dedup->capacity)
+  {
+    ltsDD_grow(L, dedup);
+  }
+
+  for (
+      i = hash & (dedup->capacity - 1);
+      dedup->items[i].start != NULL;
+      i = (i + 1) & (dedup->capacity - 1)
+    )
+  {
+    const lts_Shared * item = &dedup->items[i];
+    if (
+        item->hash == hash && item->len == len &&
+        memcmp(item->start, start, len) == 0
+      )
+    {
+      lua_pushlightuserdata(L, (void *)item->start);
+      lua_rawget(L, dedup->index);
+      lua_replace(L, -2);
+
+      /*
+      * Back-references to this table, and to the tables inside it
+      * (all read since its header), get the shared ones too
+      */
+      if (dedup->tables != 0)
+      {
+        size_t j = 0;
+        for (j = 0; j <= *dedup->seen - number; ++j)
+        {
+          lua_rawgeti(L, dedup->tables, (int)(item->number + j));
+          lua_rawseti(L, dedup->tables, (int)(number + j));
+        }
+      }
+
+      return LUATEXTS_ESUCCESS;
+    }
+  }
+
+  dedup->items[i].start = start;
+  dedup->items[i].len = len;
+  dedup->items[i].number = number;
+  dedup->items[i].hash = hash;
+  ++dedup->count;
+
+  lua_pushlightuserdata(L, (void *)start);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, dedup->index);
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Returns non-zero if the next complete value is a key of the table
+* at given depth. Key tables are not shared by dedup option,
+* so distinct keys stay distinct.
+*/
+static int ltsF_iskey(const lts_Frame * frames, size_t depth)
+{
+  const lts_Frame * frame = NULL;
+
+  if (depth == 0)
+  {
+    return 0; /* Tuple value */
+  }
+
+  frame = &frames[depth - 1];
+
+  return !frame->expect_value && !(
+      frame->type == LUATEXTS_CFIXEDTABLE && frame->array_left > 0
+    );
+}
+
+/*
+* Called when table on top of the stack is complete. Its frame is already
+* popped, depth frames are left. Finishes the table fingerprint, adds it
+* to the parent one, and shares the table, unless it is a key.
+*/
+static int ltsDD_close(
+    lua_State * L,
+    lts_Dedup * dedup,
+    lts_Frame * frames,
+    size_t depth,
+    const lts_Frame * frame
+  )
+{
+  const unsigned char * end = dedup->ls->pos;
+  uint32_t hash = lts_hash(
+      frame->hashed, (size_t)(end - frame->hashed), frame->hash
+    );
+
+  if (depth > 0)
+  {
+    lts_Frame * parent = &frames[depth - 1];
+    unsigned char bytes[sizeof(hash)];
+
+    memcpy(bytes, &hash, sizeof(hash));
+    parent->hash = lts_hash(
+        parent->hashed, (size_t)(frame->start - parent->hashed), parent->hash
+      );
+    parent->hash = lts_hash(bytes, sizeof(hash), parent->hash);
+    parent->hashed = end;
+  }
+
+  if (ltsF_iskey(frames, depth))
+  {
+    return LUATEXTS_ESUCCESS;
+  }
+
+  return ltsDD_table(L, dedup, frame->start, frame->number, hash);
+}
+
+/*
+* Called when a value is pushed to the stack.
+* Puts the value to the table being built, closing tables that are complete.
+* Top-level value is complete when *depth is zero on return.
+* Complete tables are counted if counters are not NULL,
+* and shared if dedup is not NULL.
+*/
+static int ltsF_complete(
+    lua_State * L,
+    lts_Frame * frames,
+    size_t * depth,
+    lts_Counters * counters,
+    lts_Dedup * dedup
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+
+  while (*depth > 0)
+  {
+    lts_Frame * frame = &frames[*depth - 1];
+
+    if (frame->type == LUATEXTS_CFIXEDTABLE && frame->array_left > 0)
+    {
+      lua_rawseti(L, -2, frame->next_index++);
+      --frame->array_left;
+      ++frame->items;
+    }
+    else if (!frame->expect_value)
+    {
+      int key_type = lua_type(L, -1);
+
+      /* If "key" is nil in stream table, this is the end of table. */
+      if (frame->type == LUATEXTS_CSTREAMTABLE && key_type == LUA_TNIL)
+      {
+        lua_pop(L, 1); /* Pop terminating nil */
+        ltsM_closetable(counters, frame);
+        --*depth;
+        if (dedup != NULL)
+        {
+          result = ltsDD_close(L, dedup, frames, *depth, frame);
+        }
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+        {
+          break;
+        }
+        continue; /* Table is complete */
+      }
+
+      /* Table key can't be nil or NaN */
+      if (LUATEXTS_UNLIKELY(
+          key_type == LUA_TNIL ||
+          (key_type == LUA_TNUMBER && luai_numisnan(lua_tonumber(L, -1)))
+        ))
+      {
+        ESPAM(("complete: key is nil or nan\n"));
+        return LUATEXTS_EBADDATA;
+      }
+
+      frame->expect_value = 1;
+      break; /* Wait for value */
+    }
+    else
+    {
+      lua_rawset(L, -3);
+      frame->expect_value = 0;
+      ++frame->items;
+      if (frame->type == LUATEXTS_CFIXEDTABLE)
+      {
+        --frame->hash_left;
+      }
+    }
+
+    if (
+        frame->type == LUATEXTS_CSTREAMTABLE ||
+        frame->array_left > 0 || frame->hash_left > 0
+      )
+    {
+      break; /* Wait for more values */
+    }
+
+    ltsM_closetable(counters, frame);
+    --*depth; /* Table is complete */
+    if (dedup != NULL)
+    {
+      result = ltsDD_close(L, dedup, frames, *depth, frame);
+    }
+    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+    {
+      break;
+    }
+  }
+
+  return result;
+}
+
+/*
+* Reads table header (everything between type and the first item)
+* and fills the frame for the table. Returns sizes to preallocate.
+*/
+static int ltsLS_readtable(
+    lts_LoadState * ls,
+    unsigned char type,
+    const lts_Limits * limits,
+    lts_Frame * frame,
+    int * narr,
+    int * nrec
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+
+  frame->type = LUATEXTS_CSTREAMTABLE;
+  frame->expect_value = 0;
+  frame->array_left = 0;
+  frame->hash_left = 0;
+  frame->next_index = 1;
+  frame->presize = 0;
+  frame->items = 0;
+  frame->start = NULL;
+  frame->hashed = NULL;
+  frame->hash = 0;
+  frame->number = 0;
+  frame->select = 0;
+
+  *narr = 0;
+  *nrec = 0;
+
+  switch (type)
+  {
+    case LUATEXTS_CFIXEDTABLE:
+      {
+        LUATEXTS_UINT array_size = 0;
+        LUATEXTS_UINT hash_size = 0;
+
+        result = ltsLS_readuint10(ls, &array_size);
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+        {
+          ESPAM(("readtable: failed to read table array size"));
+          return result;
+        }
+
+        result = ltsLS_readuint10(ls, &hash_size);
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+        {
+          ESPAM(("readtable: failed to read table hash size"));
+          return result;
+        }
+
+        /* Limits go first, so all loaders report them the same way */
+        result = ltsL_checktable(limits, array_size, hash_size);
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+        {
+          ltsLS_close(ls);
+          return result;
+        }
+
+        LUATEXTS_ENSURE(ls,
+            array_size <= MAXASIZE &&
+            hash_size <= MAXASIZE &&
+            (hash_size == 0 || ceillog2((unsigned int)hash_size) <= MAXBITS) &&
+            /*
+            * Simplification: Assuming minimum value size is one byte.
+            */
+            ltsLS_unread(ls) >= (array_size + hash_size * 2),
+            LUATEXTS_ETOOHUGE, ("readtable: table too huge\n")
+          );
+
+        SPAM((
+            "readtable: table size: %lu array + %lu hash = %lu total\n",
+            (unsigned long)array_size, (unsigned long)hash_size,
+            (unsigned long)(array_size + hash_size)
+          ));
+
+        frame->type = LUATEXTS_CFIXEDTABLE;
+        frame->array_left = array_size;
+        frame->hash_left = hash_size;
+
+        *narr = (int)array_size;
+        *nrec = (int)hash_size;
+      }
+      break;
+
+    case LUATEXTS_CHINTEDTABLE:
+      {
+        LUATEXTS_UINT array_hint = 0;
+        LUATEXTS_UINT hash_hint = 0;
+
+        result = ltsLS_readuint10(ls, &array_hint);
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+        {
+          ESPAM(("readtable: failed to read table array size hint"));
+          return result;
+        }
+
+        result = ltsLS_readuint10(ls, &hash_hint);
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+        {
+          ESPAM(("readtable: failed to read table hash size hint"));
+          return result;
+        }
+
+        /* The rest is the same as for the streaming table */
+        *narr = lts_sizehint(
+            array_hint, limits->opts->max_array_size, ltsLS_unread(ls)
+          );
+        *nrec = lts_sizehint(
+            hash_hint, limits->opts->max_hash_size, ltsLS_unread(ls)
+          );
+      }
+      break;
+
+    default: /* LUATEXTS_CSTREAMTABLE */
+      break;
+  }
+
+  frame->presize = (size_t)*narr + (size_t)*nrec;
+
+  return result;
+}
+
+typedef struct lts_String
+{
+  const unsigned char * str;
+  size_t len;
+} lts_String;
+
+/*
+* Strings of a tuple, for string back-references (s values).
+* Strings (S and 8 values) are numbered from one, in the order they appear
+* in the tuple, back-references are not numbered.
+*/
+typedef struct lts_Strings
+{
+  size_t seen;        /* Strings read so far, back-references may not exceed */
+  lts_String * items; /* Known strings */
+  size_t count;
+  size_t capacity;    /* Zero if strings are not to be recorded */
+  int cache;          /* Index of table with pushed strings, zero if none */
+  int intern;         /* Index of map to intern long strings, zero if none */
+} lts_Strings;
+
+static void ltsS_init(
+    lts_Strings * strings,
+    lts_String * items,
+    size_t capacity
+  )
+{
+  strings->seen = 0;
+  strings->items = items;
+  strings->count = 0;
+  strings->capacity = capacity;
+  strings->cache = 0;
+  strings->intern = 0;
+}
+
+/*
+* Called for each string read. Caller makes sure there is room
+* for one more item if strings are recorded.
+*/
+#define ltsS_add(strings, s, n) \
+  do { \
+    ++(strings)->seen; \
+    if ((strings)->capacity > 0) \
+    { \
+      (strings)->items[(strings)->count].str = (s); \
+      (strings)->items[(strings)->count].len = (n); \
+      ++(strings)->count; \
+    } \
+  } while (0)
+
+/* Reads back-reference number, fails if it is not of a string seen already */
+static int ltsLS_readstringref(
+    lts_LoadState * ls,
+    const lts_Strings * strings,
+    size_t * index
+  )
+{
+  LUATEXTS_UINT value = 0;
+
+  int result = ltsLS_readuint10(ls, &value);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    LUATEXTS_ENSURE(ls,
+        value >= 1 && value <= strings->seen,
+        LUATEXTS_EBADDATA, ("readstringref: bad string reference\n")
+      );
+    *index = (size_t)value;
+  }
+
+  return result;
+}
+
+/*
+* Pushes a string. Lua 5.2+ does not intern long strings,
+* so they are interned in the map at strings->intern, if there is one.
+*/
+static void lts_pushstring(
+    lua_State * L,
+    const lts_Strings * strings,
+    const unsigned char * str,
+    size_t len
+  )
+{
+  lua_pushlstring(L, (const char *)str, len);
+
+#if LUA_VERSION_NUM >= 502
+  if (strings->intern != 0 && len > LUATEXTS_MAXSHORTLEN)
+  {
+    lua_pushvalue(L, -1);
+    lua_rawget(L, strings->intern);
+    if (lua_isnil(L, -1))
+    {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_pushvalue(L, -1);
+      lua_rawset(L, strings->intern);
+    }
+    else
+    {
+      lua_replace(L, -2);
+    }
+  }
+#else
+  (void)strings;
+#endif
+}
+
+/*
+* Pushes referenced string. Strings pushed once are taken from the cache
+* table, if there is one, so they are not hashed again.
+*/
+static int lts_pushstringref(
+    lua_State * L,
+    const lts_Strings * strings,
+    size_t index
+  )
+{
+  const lts_String * item = NULL;
+
+  if (LUATEXTS_UNLIKELY(index > strings->count))
+  {
+    ESPAM(("pushstringref: string %lu is unknown\n", (unsigned long)index));
+    return LUATEXTS_EFAILURE; /* Should not happen */
+  }
+
+  item = &strings->items[index - 1];
+
+  if (strings->cache == 0 || index > INT_MAX)
+  {
+    lts_pushstring(L, strings, item->str, item->len);
+    return LUATEXTS_ESUCCESS;
+  }
+
+  lua_rawgeti(L, strings->cache, (int)index);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    lts_pushstring(L, strings, item->str, item->len);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, strings->cache, (int)index);
+  }
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/* Not an error: tuple references tables, load it again recording them */
+#define LUATEXTS_ERELOAD (16)
+
+/*
+* Tables of a tuple, for table back-references (r values).
+* Tables are numbered from one, in the order their headers appear
+* in the tuple, so a table may be referenced from inside itself.
+*/
+typedef struct lts_Tables
+{
+  size_t seen;                  /* Tables read so far (max. reference) */
+  size_t refs;                  /* References read so far */
+  const unsigned char ** items; /* Where each table starts, if recorded */
+  size_t count;
+  size_t capacity;              /* Zero if positions are not to be recorded */
+  int index;                    /* Index of number-to-table map, or zero */
+} lts_Tables;
+
+static void ltsT_init(
+    lts_Tables * tables,
+    const unsigned char ** items,
+    size_t capacity
+  )
+{
+  tables->seen = 0;
+  tables->refs = 0;
+  tables->items = items;
+  tables->count = 0;
+  tables->capacity = capacity;
+  tables->index = 0;
+}
+
+/* Called for each table header read, pos is where the table starts */
+#define ltsT_add(tables, pos) \
+  do { \
+    ++(tables)->seen; \
+    if ((tables)->count < (tables)->capacity) \
+    { \
+      (tables)->items[(tables)->count++] = (pos); \
+    } \
+  } while (0)
+
+/* Reads back-reference number, fails if it is not of a table seen already */
+static int ltsLS_readtableref(
+    lts_LoadState * ls,
+    lts_Tables * tables,
+    size_t * index
+  )
+{
+  LUATEXTS_UINT value = 0;
+
+  int result = ltsLS_readuint10(ls, &value);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    LUATEXTS_ENSURE(ls,
+        value >= 1 && value <= tables->seen,
+        LUATEXTS_EBADDATA, ("readtableref: bad table reference\n")
+      );
+    ++tables->refs;
+    *index = (size_t)value;
+  }
+
+  return result;
+}
+
+/*
+* Reads a value and pushes it to the stack.
+* If value is a table, fills the frame for it (frame type is zero otherwise),
+* table contents are to be read by the caller.
+* Tables are put to the map at tables->index, if any; table reference
+* without the map fails with LUATEXTS_ERELOAD.
+*/
+static int load_value(
+    lua_State * L,
+    lts_LoadState * ls,
+    lts_Limits * limits,
+    lts_Strings * strings,
+    lts_Tables * tables,
+    lts_Frame * frame
+  )
+{
+  const unsigned char * type = NULL;
+
+  int result = LUATEXTS_ESUCCESS;
+
+  frame->type = 0;
+
+  if (LUATEXTS_UNLIKELY(!ltsLS_good(ls)))
+  {
+    ESPAM(("load_value: clipped\n"));
+    return LUATEXTS_ECLIPPED;
+  }
+
+  ltsL_countvalue(ls, limits);
+
+  /* Read value type */
+  type = ls->pos;
+
+  EAT_CHAR(ls, "ltsLS_readuint10");
+
+  EAT_NEWLINE(ls, "ltsLS_readuint10");
+
+  /* Read value data if any, and push the value to Lua state */
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    SPAM((
+        "load_value: value type '%c' 0x%X (%d)\n",
+        isgraph(*type) ? *type : '?', *type, *type
+      ));
+
+    switch (*type)
+    {
+      case LUATEXTS_CNIL:
+        lua_pushnil(L);
+        break;
+
+      case LUATEXTS_CFALSE:
+        lua_pushboolean(L, 0);
+        break;
+
+      case LUATEXTS_CTRUE:
+        lua_pushboolean(L, 1);
+        break;
+
+      case LUATEXTS_CNUMBER:
+        {
+          lts_Number value;
+
+          result = ltsLS_readnumber(ls, &value);
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            lts_pushnumber(L, &value);
+          }
+        }
+        break;
+
+      case LUATEXTS_CUINT:
+        {
+          LUATEXTS_UINT value;
+
+          result = ltsLS_readuint10(ls, &value);
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            lts_pushuint(L, value);
+          }
+        }
+        break;
+
+      case LUATEXTS_CUINTHEX:
+        {
+          LUATEXTS_UINT value;
+
+          result = ltsLS_readuint16(ls, &value);
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            lts_pushuint(L, value);
+          }
+        }
+        break;
+
+      case LUATEXTS_CUINT36:
+        {
+          LUATEXTS_UINT value;
+
+          result = ltsLS_readuint36(ls, &value);
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            lts_pushuint(L, value);
+          }
+        }
+        break;
+
+      case LUATEXTS_CSTRING:
+        {
+          const unsigned char * str = NULL;
+
+          /* Read string size */
+          LUATEXTS_UINT len = 0;
+          result = ltsLS_readuint10(ls, &len);
+
+          /* Check size */
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            /* Implementation detail */
+            if (
+                LUATEXTS_UNLIKELY((lua_Integer)len < 0 || (size_t)len != len)
+              )
+            {
+              ESPAM(("string: value does not fit to lua_Integer\n"));
+              ltsLS_close(ls);
+              result = LUATEXTS_ETOOHUGE;
+            }
+            else
+            {
+              ltsL_checkstring(ls, limits, len);
+            }
+          }
+
+          /* Read string data */
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            str = ltsLS_eat(ls, len);
+            if (LUATEXTS_UNLIKELY(str == NULL))
+            {
+              ESPAM(("load_value: bad string size\n"));
+              ltsLS_close(ls);
+              result = LUATEXTS_EBADSIZE;
+            }
+          }
+
+          /* Eat newline after string data */
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            result = ltsLS_eatnewline(ls);
+          }
+
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            ltsS_add(strings, str, (size_t)len);
+            lts_pushstring(L, strings, str, (size_t)len);
+          }
+        }
+        break;
+
+      case LUATEXTS_CSTRINGUTF8:
+        {
+          const unsigned char * str = NULL;
+
+          /* Read string size */
+          LUATEXTS_UINT len_chars = 0;
+          size_t len_bytes = 0;
+          result = ltsLS_readuint10(ls, &len_chars);
+
+          /* Check size */
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            /* Implementation detail */
+            if (
+                LUATEXTS_UNLIKELY(
+                    (lua_Integer)len_chars < 0 || (size_t)len_chars != len_chars
+                  )
+              )
+            {
+              ESPAM(("stringutf8: value does not fit to lua_Integer\n"));
+              ltsLS_close(ls);
+              result = LUATEXTS_ETOOHUGE;
+            }
+            else
+            {
+              /* Each character is at least one byte */
+              ltsL_checkstring(ls, limits, len_chars);
+            }
+          }
+
+          /* Read string data */
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            result = ltsLS_eatutf8(ls, len_chars, &str, &len_bytes);
+          }
+
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            ltsL_checkstring(ls, limits, len_bytes);
+          }
+
+          /* Eat newline after string data */
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            result = ltsLS_eatnewline(ls);
+          }
+
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            ltsS_add(strings, str, len_bytes);
+            lts_pushstring(L, strings, str, len_bytes);
+          }
+        }
+        break;
+
+      case LUATEXTS_CSTRINGREF:
+        {
+          size_t index = 0;
+
+          result = ltsLS_readstringref(ls, strings, &index);
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            result = lts_pushstringref(L, strings, index);
+          }
+        }
+        break;
+
+      case LUATEXTS_CTABLEREF:
+        {
+          size_t index = 0;
+
+          if (LUATEXTS_UNLIKELY(tables->index == 0))
+          {
+            SPAM(("load_value: table reference, reloading\n"));
+            result = LUATEXTS_ERELOAD;
+            break;
+          }
+
+          result = ltsLS_readtableref(ls, tables, &index);
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            lua_rawgeti(L, tables->index, (int)index);
+          }
+        }
+        break;
+
+      case LUATEXTS_CFIXEDTABLE:
+      case LUATEXTS_CHINTEDTABLE:
+      case LUATEXTS_CSTREAMTABLE:
+        {
+          int narr = 0;
+          int nrec = 0;
+
+          result = ltsLS_readtable(ls, *type, limits, frame, &narr, &nrec);
+          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+          {
+            lua_createtable(L, narr, nrec);
+
+            if (limits->counters != NULL)
+            {
+              limits->counters->tables_presized += frame->presize;
+            }
+
+            ltsT_add(tables, type);
+            frame->start = type;
+            frame->hashed = type;
+            frame->number = tables->seen;
+            if (tables->index != 0)
+            {
+              if (LUATEXTS_UNLIKELY(tables->seen > INT_MAX))
+              {
+                ESPAM(("load_value: too many tables\n"));
+                ltsLS_close(ls);
+                result = LUATEXTS_ETOOHUGE;
+                break;
+              }
+
+              lua_pushvalue(L, -1);
+              lua_rawseti(L, tables->index, (int)tables->seen);
+            }
+          }
+        }
+        break;
+
+      default:
+        ESPAM(("load_value: unknown type char 0x%X (%d)\n", type[0], type[0]));
+        ltsLS_close(ls);
+        result = LUATEXTS_EBADTYPE;
+        break;
+    }
+  }
+
+  if (limits->counters != NULL && result == LUATEXTS_ESUCCESS)
+  {
+    ltsM_countvalue(limits->counters, *type, ls->pos - type);
+  }
+
+  return result;
+}
+
+/* Pushes error message for the given load error code */
+static void push_load_error(lua_State * L, int result)
+{
+  lts_Metrics * metrics = NULL;
+
+  luaL_checkstack(L, 1, "load-err");
+
+  metrics = lts_getmetrics(L);
+  if (metrics != NULL)
+  {
+    ++metrics->errors[
+        (result > 0 && result <= LUATEXTS_ELIMIT) ? result : LUATEXTS_EFAILURE
+      ];
+  }
+
+  switch (result)
+  {
+    case LUATEXTS_EBADSIZE:
+      lua_pushliteral(L, "load failed: corrupt data, bad size");
+      break;
+
+    case LUATEXTS_EBADDATA:
+      lua_pushliteral(L, "load failed: corrupt data");
+      break;
+
+    case LUATEXTS_EBADTYPE:
+      lua_pushliteral(L, "load failed: unknown data type");
+      break;
+
+    case LUATEXTS_EGARBAGE:
+      lua_pushliteral(L, "load failed: garbage before newline");
+      break;
+
+    case LUATEXTS_ETOOHUGE:
+      lua_pushliteral(L, "load failed: value too huge");
+      break;
+
+    case LUATEXTS_EBADUTF8:
+      lua_pushliteral(L, "load failed: invalid utf-8 data");
+      break;
+
+    case LUATEXTS_ECLIPPED:
+      lua_pushliteral(L, "load failed: corrupt data, truncated");
+      break;
+
+    case LUATEXTS_ENOMEM:
+      lua_pushliteral(L, "load failed: not enough memory");
+      break;
+
+    case LUATEXTS_ETOODEEP:
+      lua_pushliteral(L, "load failed: nesting too deep");
+      break;
+
+    case LUATEXTS_ELIMIT:
+      lua_pushliteral(L, "load failed: limit exceeded");
+      break;
+
+    /* should not happen */
+    case LUATEXTS_EFAILURE:
+    default:
+      lua_pushliteral(L, "load failed: internal error");
+      break;
+  }
+}
+
+static int lts_scanstrings(
+    lua_State * L,
+    const unsigned char * buf,
+    size_t len,
+    const lts_LoadOptions * opts,
+    int anchor,
+    lts_Strings * strings
+  );
+
+/*
+* Loads a tuple, leaves the stack as it was on error.
+* If record_tables is zero, tuple with table references is not loaded,
+* and LUATEXTS_ERELOAD is returned.
+* Loaded values are counted if counters are not NULL.
+*/
+static int lts_loadtuple(
+    lua_State * L,
+    const unsigned char * buf,
+    size_t len,
+    const lts_LoadOptions * opts,
+    int record_tables,
+    lts_Counters * counters,
+    size_t * count,
+    size_t * nread
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+  lts_LoadState ls;
+  lts_Limits limits;
+
+  LUATEXTS_UINT tuple_size = 0;
+  LUATEXTS_UINT values_left = 0;
+
+  /*
+  * Frames for shallow data live on C stack. If more is needed, they get
+  * userdata, kept in the anchor table at base + 1, so they are collected
+  * even if Lua throws an error on us. Strings are recorded (and referenced
+  * ones cached) in the anchor table too, only if the tuple references them.
+  * Table number-to-table map, if tables are recorded, is at base + 2.
+  * Dedup map, if dedup option is set, is next.
+  */
+  lts_Frame stack_frames[LUATEXTS_LOAD_STACKFRAMES];
+  lts_Frame * frames = stack_frames;
+  size_t capacity = LUATEXTS_LOAD_STACKFRAMES;
+  size_t depth = 0;
+  lts_Strings strings;
+  lts_Tables tables;
+  lts_Dedup dedup;
+  lts_Dedup * pdedup = NULL;
+  int anchored = 0;
+
+  int base = lua_gettop(L);
+
+  ltsLS_init(&ls, buf, len);
+  ltsL_init(&limits, opts);
+  limits.counters = counters;
+  ltsS_init(&strings, NULL, 0);
+  ltsT_init(&tables, NULL, 0);
+
+  if (record_tables)
+  {
+    luaL_checkstack(L, 2, "load-tables");
+    lua_newtable(L); /* Anchor table */
+    lua_newtable(L);
+    anchored = 1;
+    tables.index = base + 2;
+  }
+
+  if (opts->dedup)
+  {
+    luaL_checkstack(L, 2, "load-dedup");
+    if (!anchored)
+    {
+      lua_newtable(L); /* Anchor table */
+      anchored = 1;
+    }
+    lua_newtable(L);
+
+    ltsDD_init(
+        &dedup, &ls, lua_gettop(L), base + 1, tables.index, &tables.seen
+      );
+    pdedup = &dedup;
+    strings.intern = dedup.index;
+  }
+
+  /*
+  * Security note: tuple_size is only checked against the limits.
+  * Motivation: too complicated; we will fail if buffer is too small anyway.
+  */
+
+  result = ltsLS_readuint10(&ls, &tuple_size);
+  /* Check size */
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    /* Implementation detail */
+    if (LUATEXTS_UNLIKELY((lua_Integer)tuple_size < 0))
+    {
+      ESPAM(("tuple: size does not fit to lua_Integer\n"));
+      ltsLS_close(&ls);
+      result = LUATEXTS_ETOOHUGE;
+    }
+    else
+    {
+      result = ltsL_checktuple(&limits, tuple_size);
+    }
+  }
+
+  values_left = tuple_size;
+  while (values_left > 0 && result == LUATEXTS_ESUCCESS)
+  {
+    lts_Frame frame;
+
+    /* Value (and its copy for the string cache), and the anchor table */
+    if (LUATEXTS_UNLIKELY(!lua_checkstack(L, 3)))
+    {
+      ESPAM(("load_tuple: stack overflow\n"));
+      result = LUATEXTS_ETOOHUGE;
+      break;
+    }
+
+    /* Strings are recorded on the first string reference */
+    if (
+        LUATEXTS_UNLIKELY(strings.cache == 0) &&
+        ltsLS_unread(&ls) > 0 && *ls.pos == LUATEXTS_CSTRINGREF
+      )
+    {
+      if (!anchored)
+      {
+        lua_newtable(L);
+        lua_insert(L, base + 1);
+        anchored = 1;
+      }
+
+      result = lts_scanstrings(L, buf, len, opts, base + 1, &strings);
+      if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+      {
+        break;
+      }
+    }
+
+    result = load_value(L, &ls, &limits, &strings, &tables, &frame);
+    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+    {
+      break;
+    }
+
+    if (frame.type != 0)
+    {
+      if (counters != NULL && depth + 1 > counters->max_depth)
+      {
+        counters->max_depth = depth + 1;
+      }
+
+      if (LUATEXTS_UNLIKELY(depth >= opts->max_depth))
+      {
+        ESPAM(("load_tuple: nesting too deep\n"));
+        result = LUATEXTS_ETOODEEP;
+        break;
+      }
+
+      if (frame.array_left > 0 || frame.hash_left > 0 ||
+          frame.type == LUATEXTS_CSTREAMTABLE)
+      {
+        if (LUATEXTS_UNLIKELY(depth == capacity))
+        {
+          lts_Frame * heap_frames = NULL;
+
+          if (!anchored)
+          {
+            lua_newtable(L);
+            lua_insert(L, base + 1);
+            anchored = 1;
+          }
+
+          heap_frames = (lts_Frame *)lua_newuserdata(
+              L, 2 * capacity * sizeof(lts_Frame)
+            );
+          memcpy(heap_frames, frames, capacity * sizeof(lts_Frame));
+          lua_rawseti(L, base + 1, LUATEXTS_LOAD_ANCHOR_FRAMES);
+          frames = heap_frames;
+          capacity *= 2;
+        }
+
+        frames[depth++] = frame;
+        continue; /* Read table contents */
+      }
+
+      /* Empty table is complete right away */
+      if (pdedup != NULL)
+      {
+        result = ltsDD_close(L, pdedup, frames, depth, &frame);
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+        {
+          break;
+        }
+      }
+    }
+
+    result = ltsF_complete(L, frames, &depth, counters, pdedup);
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS) && depth == 0)
+    {
+      SPAM(("load_tuple: loaded value %lu of %lu\n",
+          tuple_size - values_left + 1, tuple_size
+        ));
+      --values_left;
+    }
+  }
+
+  /*
+  * Security note: ignoring unread bytes if any.
+  * Motivation: more casual, this is a text format after all.
+  */
+
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    if (pdedup != NULL)
+    {
+      lua_remove(L, dedup.index);
+    }
+
+    if (tables.index != 0)
+    {
+      lua_remove(L, tables.index);
+    }
+
+    if (anchored)
+    {
+      lua_remove(L, base + 1);
+    }
+
+    *count = tuple_size;
+
+    if (nread != NULL)
+    {
+      *nread = len - ltsLS_unread(&ls);
+    }
+  }
+  else
+  {
+    XESPAM(("load_tuple: error %d\n", result));
+
+    lua_settop(L, base); /* Discard intermediate results */
+  }
+
+  return result;
+}
+
+/*
+* Loads a tuple, pushes error message on error.
+* Tables are recorded only if the tuple turns out to reference them,
+* so data without table references does not pay for them.
+* Time of the abandoned first pass is counted as scanning time.
+*/
+static int luatexts_load(
+    lua_State * L,
+    const unsigned char * buf,
+    size_t len,
+    const lts_LoadOptions * opts,
+    size_t * count,
+    size_t * nread
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+  lts_Metrics * metrics = lts_getmetrics(L);
+  lts_Counters counters;
+  lts_Counters * pcounters = NULL;
+  clock_t start = 0;
+
+  if (metrics != NULL)
+  {
+    memset(&counters, 0, sizeof(counters));
+    pcounters = &counters;
+    start = clock();
+  }
+
+  result = lts_loadtuple(L, buf, len, opts, 0, pcounters, count, nread);
+  if (LUATEXTS_UNLIKELY(result == LUATEXTS_ERELOAD))
+  {
+    if (metrics != NULL)
+    {
+      memset(&counters, 0, sizeof(counters));
+      start = ltsM_addtime(&metrics->scan_time, start);
+    }
+
+    result = lts_loadtuple(L, buf, len, opts, 1, pcounters, count, nread);
+  }
+
+  if (metrics != NULL)
+  {
+    ltsM_addtime(&metrics->load_time, start);
+    if (result == LUATEXTS_ESUCCESS)
+    {
+      ++metrics->loads;
+      ltsM_add(metrics, &counters);
+    }
+  }
+
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    push_load_error(L, result);
+  }
+
+  return result;
+}
+
+static int lload(lua_State * L)
+{
+  size_t len = 0;
+  const unsigned char * buf = (const unsigned char *)luaL_checklstring(
+      L, 1, &len
+    );
+  size_t tuple_size = 0;
+  int result = 0;
+  lts_LoadOptions opts;
+
+  load_options(L, 2, &opts);
+
+  luaL_checkstack(L, 1, "lload");
+  lua_pushboolean(L, 1);
+
+  result = luatexts_load(L, buf, len, &opts, &tuple_size, NULL);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    luaL_checkstack(L, 1, "lload-err");
+    lua_pushnil(L);
+    lua_replace(L, -3); /* Replace pre-pushed true with nil */
+    return 2; /* Error message already on stack */
+  }
+
+  return tuple_size + 1;
+}
+
+/*
+* Returns given offset (1-based, as in string.sub()) as a 0-based one.
+* Offset one past the end of data is allowed.
+*/
+static size_t lts_checkoffset(lua_State * L, int idx, size_t len)
+{
+  lua_Number offset = (lua_Number)luaL_optinteger(L, idx, 1);
+
+  luaL_argcheck(
+      L, offset >= 1 && offset <= (lua_Number)len + 1, idx,
+      "offset out of range"
+    );
+
+  return (size_t)offset - 1;
+}
+
+/*
+* Loads a tuple at given offset of data,
+* returns next offset and the tuple.
+*/
+static int lload_at(lua_State * L)
+{
+  size_t len = 0;
+  const unsigned char * buf = (const unsigned char *)luaL_checklstring(
+      L, 1, &len
+    );
+  size_t offset = lts_checkoffset(L, 2, len);
+  size_t tuple_size = 0;
+  size_t nread = 0;
+  int result = 0;
+  lts_LoadOptions opts;
+
+  load_options(L, 3, &opts);
+  lua_settop(L, 1); /* Data string stays on stack, we're pointing into it */
+
+  luaL_checkstack(L, 1, "lload_at");
+  lua_pushboolean(L, 1);
+
+  result = luatexts_load(
+      L, buf + offset, len - offset, &opts, &tuple_size, &nread
+    );
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    luaL_checkstack(L, 1, "lload_at-err");
+    lua_pushnil(L);
+    lua_replace(L, -3); /* Replace pre-pushed true with nil */
+    return 2; /* Error message already on stack */
+  }
+
+  lua_pushinteger(L, (lua_Integer)(offset + nread + 1));
+  lua_replace(L, 2); /* Replace pre-pushed true with next offset */
+
+  return tuple_size + 1;
+}
+
+/* TODO: Hide this mmap stuff in a separate file */
+
+/*
+* Maps given regular file to memory for reading, with given mmap() flags,
+* and returns 0. File status is copied to st (if not NULL).
+* Empty file is an error, unless allow_empty is set,
+* then it is not mapped, and *buf is set to NULL.
+* On error pushes nil and error message (prefixed with fname), returns 2.
+*/
+static int lts_mapfile(
+    lua_State * L,
+    const char * fname,
+    const char * filename,
+    int allow_empty,
+    int map_flags,
+    const unsigned char ** buf,
+    size_t * size,
+    struct stat * st
+  )
+{
+  struct stat sb;
+
+  int fd = -1;
+
+  luaL_checkstack(L, 2, "lts_mapfile");
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1)
+  {
+    lua_pushnil(L);
+    lua_pushfstring(
+        L, "%s failed: can't open " LUA_QL("%s") " for reading: %s",
+        fname, filename, strerror(errno)
+      );
+    return 2;
+  }
+
+  if (fstat(fd, &sb) == -1)
+  {
+    lua_pushnil(L);
+    lua_pushfstring(
+        L, "%s failed: can't stat " LUA_QL("%s") ": %s",
+        fname, filename, strerror(errno)
+      );
+    close(fd);
+    return 2;
+  }
+
+  if (!S_ISREG(sb.st_mode))
+  {
+    lua_pushnil(L);
+    lua_pushfstring(
+        L, "%s failed: " LUA_QL("%s") " is not a file",
+        fname, filename
+      );
+    close(fd);
+    return 2;
+  }
+
+  if ((off_t)(size_t)sb.st_size != sb.st_size)
+  {
+    lua_pushnil(L);
+    lua_pushfstring(
+        L, "%s failed: " LUA_QL("%s") " is too large to map",
+        fname, filename
+      );
+    close(fd);
+    return 2;
+  }
+
+  *size = (size_t)sb.st_size;
+  *buf = NULL;
+
+  if (st != NULL)
+  {
+    *st = sb;
+  }
+
+  if (*size == 0)
+  {
+    close(fd);
+
+    if (allow_empty)
+    {
+      return 0;
+    }
+
+    lua_pushnil(L);
+    lua_pushfstring(
+        L, "%s failed: " LUA_QL("%s") " is empty",
+        fname, filename
+      );
+    return 2;
+  }
+
+  *buf = (const unsigned char *)mmap(
+      0, *size, PROT_READ, map_flags, fd, 0
+    );
+  if (*buf == MAP_FAILED)
+  {
+    *buf = NULL;
+    lua_pushnil(L);
+    lua_pushfstring(
+        L, "%s failed: " LUA_QL("%s") " mmap failed: %s",
+        fname, filename, strerror(errno)
+      );
+    close(fd);
+    return 2;
+  }
+
+  close(fd);
+
+  return 0;
+}
+
+/*
+* Mapped file handles
+*
+* Handle keeps the mapping of the last loaded version of the file,
+* and the loaded tuple (in registry). File is loaded again only
+* if its identity (device and inode), size or modification time changes.
+* If only the contents changed, the shared mapping is loaded again as is.
+*
+* Mapping that is being loaded is owned by the handle too,
+* so it is released by __gc if Lua throws an error on us.
+*/
+
+#define LUATEXTS_HANDLE_MT "luatexts.Handle"
+
+/* Nanoseconds of modification time, where struct stat has them */
+#if defined(__linux__) && defined(st_mtime)
+  #define LUATEXTS_MTIME_NSEC(st) ((long)(st).st_mtim.tv_nsec)
+#else
+  #define LUATEXTS_MTIME_NSEC(st) (0L)
+#endif
+
+typedef struct lts_Handle
+{
+  const unsigned char * buf;      /* Mapping of the loaded version */
+  size_t size;
+  const unsigned char * next_buf; /* Mapping being loaded */
+  size_t next_size;
+  struct stat st;                 /* Status of the loaded version */
+  int loaded;                     /* Non-zero if st and cache are valid */
+  int closed;
+  int cache_ref;                  /* Table with loaded tuple */
+  size_t cache_size;
+  int map_flags;
+  int sequential;                 /* Non-zero to advise sequential access */
+  lts_LoadOptions opts;
+  /* File name follows the structure */
+} lts_Handle;
+
+#define ltsH_filename(h) ((const char *)((h) + 1))
+
+static void ltsH_unmap(const unsigned char ** buf, size_t * size)
+{
+  if (*buf != NULL)
+  {
+    if (munmap((void *)*buf, *size) == -1)
+    {
+      ESPAM(("handle: munmap failed"));
+      /* What else can we do? */
+    }
+    *buf = NULL;
+  }
+  *size = 0;
+}
+
+static void ltsH_release(lua_State * L, lts_Handle * h)
+{
+  ltsH_unmap(&h->buf, &h->size);
+  ltsH_unmap(&h->next_buf, &h->next_size);
+
+  luaL_unref(L, LUA_REGISTRYINDEX, h->cache_ref);
+  h->cache_ref = LUA_NOREF;
+  h->cache_size = 0;
+  h->loaded = 0;
+}
+
+static int ltsH_gc(lua_State * L)
+{
+  lts_Handle * h = (lts_Handle *)luaL_checkudata(L, 1, LUATEXTS_HANDLE_MT);
+
+  ltsH_release(L, h);
+
+  return 0;
+}
+
+/* Pushes new handle for the given file */
+static lts_Handle * ltsH_push(
+    lua_State * L,
+    const char * filename,
+    size_t len,
+    const lts_LoadOptions * opts
+  )
+{
+  lts_Handle * h = NULL;
+
+  luaL_checkstack(L, 2, "ltsH_push");
+
+  h = (lts_Handle *)lua_newuserdata(L, sizeof(lts_Handle) + len + 1);
+  h->buf = NULL;
+  h->size = 0;
+  h->next_buf = NULL;
+  h->next_size = 0;
+  memset(&h->st, 0, sizeof(h->st));
+  h->loaded = 0;
+  h->closed = 0;
+  h->cache_ref = LUA_NOREF;
+  h->cache_size = 0;
+  h->map_flags = MAP_SHARED;
+  h->sequential = 0;
+  h->opts = *opts;
+  memcpy((char *)(h + 1), filename, len + 1);
+
+  luaL_getmetatable(L, LUATEXTS_HANDLE_MT);
+  lua_setmetatable(L, -2);
+
+  return h;
+}
+
+/* Maps file to h->next_buf, pushes nil and error message on error */
+static int ltsH_map(
+    lua_State * L,
+    lts_Handle * h,
+    const char * fname,
+    struct stat * st
+  )
+{
+  if (
+      lts_mapfile(
+          L, fname, ltsH_filename(h), 0, h->map_flags,
+          &h->next_buf, &h->next_size, st
+        ) != 0
+    )
+  {
+    return 2;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  if (h->sequential)
+  {
+    /* Only a hint, ignoring errors */
+    madvise((void *)h->next_buf, h->next_size, MADV_SEQUENTIAL);
+  }
+#endif /* MADV_SEQUENTIAL */
+
+  return 0;
+}
+
+static int lload_from_file(lua_State * L)
+{
+  size_t len = 0;
+  const char * filename = (const char *)luaL_checklstring(L, 1, &len);
+
+  size_t tuple_size = 0;
+  int result = 0;
+  lts_LoadOptions opts;
+  lts_Handle * h = NULL;
+  int idx = 0;
+
+  load_options(L, 2, &opts);
+
+  /* Mapping is owned by handle, so it is released if Lua throws an error */
+  h = ltsH_push(L, filename, len, &opts);
+  idx = lua_gettop(L);
+
+  if (ltsH_map(L, h, "load_from_file", NULL) != 0)
+  {
+    return 2;
+  }
+
+  luaL_checkstack(L, 1, "lloadff");
+  lua_pushboolean(L, 1);
+
+  result = luatexts_load(
+      L, h->next_buf, h->next_size, &opts, &tuple_size, NULL
+    );
+
+  ltsH_release(L, h);
+  lua_remove(L, idx);
+
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    luaL_checkstack(L, 1, "lloadff-err");
+    lua_pushnil(L);
+    lua_replace(L, -3); /* Replace pre-pushed true with nil */
+    return 2; /* Error message already on stack */
+  }
+
+  return tuple_size + 1;
+}
+
+static int lopen(lua_State * L)
+{
+  size_t len = 0;
+  const char * filename = (const char *)luaL_checklstring(L, 1, &len);
+  lts_LoadOptions opts;
+  lts_Handle * h = NULL;
+
+  load_options(L, 2, &opts);
+
+  h = ltsH_push(L, filename, len, &opts);
+
+  if (!lua_isnoneornil(L, 2))
+  {
+    lua_getfield(L, 2, "populate");
+#ifdef MAP_POPULATE
+    if (lua_toboolean(L, -1))
+    {
+      h->map_flags |= MAP_POPULATE;
+    }
+#endif /* MAP_POPULATE */
+    lua_pop(L, 1);
+
+    lua_getfield(L, 2, "sequential");
+    h->sequential = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+
+  return 1;
+}
+
+/* Returns true and the tuple, loading the file if it has changed */
+static int lhandle_load(lua_State * L)
+{
+  lts_Handle * h = (lts_Handle *)luaL_checkudata(L, 1, LUATEXTS_HANDLE_MT);
+  const unsigned char * buf = NULL;
+  size_t size = 0;
+  size_t tuple_size = 0;
+  size_t i = 0;
+  int result = 0;
+  struct stat st;
+
+  if (h->closed)
+  {
+    return luaL_error(L, "luatexts.open: attempt to use a closed handle");
+  }
+
+  lua_settop(L, 1);
+
+  /* Left from a load interrupted by Lua error */
+  ltsH_unmap(&h->next_buf, &h->next_size);
+
+  if (stat(ltsH_filename(h), &st) == -1)
+  {
+    luaL_checkstack(L, 2, "lhandle_load-err");
+    lua_pushnil(L);
+    lua_pushfstring(
+        L, "load failed: can't stat " LUA_QL("%s") ": %s",
+        ltsH_filename(h), strerror(errno)
+      );
+    return 2;
+  }
+
+  if (
+      h->loaded &&
+      st.st_dev == h->st.st_dev && st.st_ino == h->st.st_ino &&
+      st.st_size == h->st.st_size && st.st_mtime == h->st.st_mtime &&
+      LUATEXTS_MTIME_NSEC(st) == LUATEXTS_MTIME_NSEC(h->st)
+    )
+  {
+    /* Not changed, returning cached tuple */
+    if (!lua_checkstack(L, (int)h->cache_size + 2))
+    {
+      return luaL_error(L, "luatexts.open: too many values to return");
+    }
+
+    lua_pushboolean(L, 1);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, h->cache_ref);
+    for (i = 1; i <= h->cache_size; ++i)
+    {
+      lua_rawgeti(L, 3, (int)i);
+    }
+    lua_remove(L, 3);
+
+    return (int)h->cache_size + 1;
+  }
+
+  if (
+      h->buf != NULL &&
+      st.st_dev == h->st.st_dev && st.st_ino == h->st.st_ino &&
+      st.st_size == h->st.st_size
+    )
+  {
+    /* Same file of the same size, shared mapping shows new contents */
+    buf = h->buf;
+    size = h->size;
+  }
+  else
+  {
+    if (ltsH_map(L, h, "load", &st) != 0)
+    {
+      return 2;
+    }
+
+    buf = h->next_buf;
+    size = h->next_size;
+  }
+
+  luaL_checkstack(L, 1, "lhandle_load");
+  lua_pushboolean(L, 1);
+
+  result = luatexts_load(L, buf, size, &h->opts, &tuple_size, NULL);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    ltsH_unmap(&h->next_buf, &h->next_size);
+
+    luaL_checkstack(L, 1, "lhandle_load-err");
+    lua_pushnil(L);
+    lua_replace(L, -3); /* Replace pre-pushed true with nil */
+    return 2; /* Error message already on stack */
+  }
+
+  if (h->next_buf != NULL)
+  {
+    ltsH_unmap(&h->buf, &h->size);
+    h->buf = h->next_buf;
+    h->size = h->next_size;
+    h->next_buf = NULL;
+    h->next_size = 0;
+  }
+
+  /* Cache the tuple */
+  luaL_checkstack(L, 2, "lhandle_load-cache");
+  lua_createtable(L, (int)tuple_size, 0);
+  for (i = 1; i <= tuple_size; ++i)
+  {
+    lua_pushvalue(L, 2 + (int)i);
+    lua_rawseti(L, -2, (int)i);
+  }
+
+  luaL_unref(L, LUA_REGISTRYINDEX, h->cache_ref);
+  h->cache_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  h->cache_size = tuple_size;
+  h->st = st;
+  h->loaded = 1;
+
+  return tuple_size + 1;
+}
+
+static int lhandle_close(lua_State * L)
+{
+  lts_Handle * h = (lts_Handle *)luaL_checkudata(L, 1, LUATEXTS_HANDLE_MT);
+
+  ltsH_release(L, h);
+  h->closed = 1;
+
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static const luaL_Reg Handle[] =
+{
+  { "load", lhandle_load },
+  { "close", lhandle_close },
+
+  { NULL, NULL }
+};
+
+/*
+* Loading from file descriptors and io library handles
+*
+* Regular files are mapped (from the current position to the end).
+* Everything else (pipes, sockets, terminals) is read to the end of file
+* into a read buffer. Buffer is reused between calls: it is kept in registry
+* while it is not in use (and is taken from there while it is),
+* unless it grew too large.
+*/
+
+#define LUATEXTS_READBUF_MT "luatexts.ReadBuffer"
+#define LUATEXTS_READBUF_KEY "luatexts.ReadBuffer.cache"
+
+#define LUATEXTS_READ_MINBUFSIZE (65536)
+
+/* Larger buffers are freed after use */
+#define LUATEXTS_READ_KEEPBUFSIZE (1048576)
+
+typedef struct lts_ReadBuffer
+{
+  unsigned char * buf;
+  size_t len;
+  size_t capacity;
+} lts_ReadBuffer;
+
+static int ltsRB_gc(lua_State * L)
+{
+  lts_ReadBuffer * rb = (lts_ReadBuffer *)luaL_checkudata(
+      L, 1, LUATEXTS_READBUF_MT
+    );
+
+  free(rb->buf);
+  rb->buf = NULL;
+  rb->len = rb->capacity = 0;
+
+  return 0;
+}
+
+/* Pushes read buffer, taking it from registry if it is there */
+static lts_ReadBuffer * ltsRB_take(lua_State * L)
+{
+  lts_ReadBuffer * rb = NULL;
+
+  luaL_checkstack(L, 2, "ltsRB_take");
+
+  lua_getfield(L, LUA_REGISTRYINDEX, LUATEXTS_READBUF_KEY);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+
+    rb = (lts_ReadBuffer *)lua_newuserdata(L, sizeof(lts_ReadBuffer));
+    rb->buf = NULL;
+    rb->capacity = 0;
+
+    luaL_getmetatable(L, LUATEXTS_READBUF_MT);
+    lua_setmetatable(L, -2);
+  }
+  else
+  {
+    rb = (lts_ReadBuffer *)lua_touserdata(L, -1);
+
+    /* Nested load (say, from a __gc metamethod) gets a buffer of its own */
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUATEXTS_READBUF_KEY);
+  }
+
+  rb->len = 0;
+
+  return rb;
+}
+
+/* Puts read buffer at given index back to registry */
+static void ltsRB_give(lua_State * L, int idx)
+{
+  lts_ReadBuffer * rb = (lts_ReadBuffer *)lua_touserdata(L, idx);
+
+  if (rb->capacity > LUATEXTS_READ_KEEPBUFSIZE)
+  {
+    free(rb->buf);
+    rb->buf = NULL;
+    rb->capacity = 0;
+  }
+  rb->len = 0;
+
+  luaL_checkstack(L, 1, "ltsRB_give");
+  lua_pushvalue(L, idx);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUATEXTS_READBUF_KEY);
+}
+
+/* Makes sure there is room for at least len more bytes */
+static int ltsRB_reserve(lts_ReadBuffer * rb, size_t len)
+{
+  unsigned char * buf = NULL;
+  size_t capacity = rb->capacity;
+
+  if (rb->capacity - rb->len >= len)
+  {
+    return LUATEXTS_ESUCCESS;
+  }
+
+  if (LUATEXTS_UNLIKELY(rb->len + len < len))
+  {
+    return LUATEXTS_ENOMEM;
+  }
+
+  if (capacity < LUATEXTS_READ_MINBUFSIZE)
+  {
+    capacity = LUATEXTS_READ_MINBUFSIZE;
+  }
+
+  while (capacity - rb->len < len)
+  {
+    if (LUATEXTS_UNLIKELY(capacity * 2 < capacity))
+    {
+      capacity = rb->len + len;
+      break;
+    }
+    capacity *= 2;
+  }
+
+  buf = (unsigned char *)realloc(rb->buf, capacity);
+  if (LUATEXTS_UNLIKELY(buf == NULL))
+  {
+    return LUATEXTS_ENOMEM;
+  }
+
+  rb->buf = buf;
+  rb->capacity = capacity;
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Reads to the end of file from fd (or from fp, if it is not NULL),
+* size_hint is the expected data size. Sets *error to errno on read error.
+*/
+static int ltsRB_read(
+    lts_ReadBuffer * rb,
+    int fd,
+    FILE * fp,
+    size_t size_hint,
+    int * error
+  )
+{
+  /* One more byte, to see the end of file without growing the buffer */
+  int result = ltsRB_reserve(rb, size_hint + 1);
+
+  while (result == LUATEXTS_ESUCCESS)
+  {
+    size_t room = rb->capacity - rb->len;
+
+    if (fp != NULL)
+    {
+      size_t nread = fread(rb->buf + rb->len, 1, room, fp);
+      rb->len += nread;
+      if (nread < room)
+      {
+        if (ferror(fp))
+        {
+          *error = errno;
+          result = LUATEXTS_EIO;
+        }
+        break; /* End of file */
+      }
+    }
+    else
+    {
+      ssize_t nread = read(fd, rb->buf + rb->len, room);
+      if (nread < 0)
+      {
+        if (errno == EINTR)
+        {
+          continue;
+        }
+
+        *error = errno;
+        result = LUATEXTS_EIO;
+        break;
+      }
+
+      if (nread == 0)
+      {
+        break; /* End of file */
+      }
+
+      rb->len += (size_t)nread;
+    }
+
+    if (rb->len == rb->capacity)
+    {
+      result = ltsRB_reserve(rb, rb->capacity);
+    }
+  }
+
+  return result;
+}
+
+/*
+* Loads a tuple from fd, or from fp (with fd being its descriptor, or -1
+* if it is not known). Returns the same as lload().
+*/
+static int lts_loadfromfd(
+    lua_State * L,
+    const char * fname,
+    int fd,
+    FILE * fp,
+    const lts_LoadOptions * opts
+  )
+{
+  size_t tuple_size = 0;
+  size_t size_hint = 0;
+  int result = LUATEXTS_ESUCCESS;
+  int error = 0;
+  int idx = 0;
+  lts_ReadBuffer * rb = NULL;
+  struct stat sb;
+
+  luaL_checkstack(L, 3, "lts_loadfromfd");
+
+  if (fd != -1 && fstat(fd, &sb) == -1)
+  {
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s failed: can't stat: %s", fname, strerror(errno));
+    return 2;
+  }
+
+  if (fd != -1 && S_ISREG(sb.st_mode))
+  {
+    off_t pos = (fp != NULL) ? (off_t)ftell(fp) : lseek(fd, 0, SEEK_CUR);
+
+    if (
+        pos >= 0 && pos < sb.st_size &&
+        (off_t)(size_t)sb.st_size == sb.st_size
+      )
+    {
+      /* Mapping is owned by handle, so it is released on Lua error */
+      lts_Handle * h = ltsH_push(L, "", 0, opts);
+      idx = lua_gettop(L);
+
+      h->next_buf = (const unsigned char *)mmap(
+          0, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0
+        );
+      if (h->next_buf != MAP_FAILED)
+      {
+        h->next_size = (size_t)sb.st_size;
+
+#ifdef MADV_SEQUENTIAL
+        /* Only a hint, ignoring errors */
+        madvise((void *)h->next_buf, h->next_size, MADV_SEQUENTIAL);
+#endif /* MADV_SEQUENTIAL */
+
+        lua_pushboolean(L, 1);
+        result = luatexts_load(
+            L, h->next_buf + pos, h->next_size - (size_t)pos,
+            opts, &tuple_size, NULL
+          );
+
+        ltsH_release(L, h);
+        lua_remove(L, idx);
+
+        /* Data is consumed, as if it was read */
+        if (fp != NULL)
+        {
+          fseek(fp, 0, SEEK_END);
+        }
+        else
+        {
+          lseek(fd, 0, SEEK_END);
+        }
+
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+        {
+          lua_pushnil(L);
+          lua_replace(L, -3); /* Replace pre-pushed true with nil */
+          return 2; /* Error message already on stack */
+        }
+
+        return tuple_size + 1;
+      }
+
+      /* Can't map, reading then */
+      h->next_buf = NULL;
+      lua_pop(L, 1);
+    }
+
+    if (
+        pos >= 0 && pos < sb.st_size &&
+        (off_t)(size_t)sb.st_size == sb.st_size
+      )
+    {
+      size_hint = (size_t)(sb.st_size - pos);
+    }
+  }
+
+  rb = ltsRB_take(L);
+  idx = lua_gettop(L);
+
+  result = ltsRB_read(rb, fd, fp, size_hint, &error);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    ltsRB_give(L, idx);
+    lua_pop(L, 1);
+
+    lua_pushnil(L);
+    if (result == LUATEXTS_ENOMEM)
+    {
+      lua_pushfstring(L, "%s failed: not enough memory", fname);
+    }
+    else
+    {
+      lua_pushfstring(L, "%s failed: read error: %s", fname, strerror(error));
+    }
+    return 2;
+  }
+
+  lua_pushboolean(L, 1);
+  result = luatexts_load(L, rb->buf, rb->len, opts, &tuple_size, NULL);
+
+  ltsRB_give(L, idx);
+  lua_remove(L, idx);
+
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    luaL_checkstack(L, 1, "lts_loadfromfd-err");
+    lua_pushnil(L);
+    lua_replace(L, -3); /* Replace pre-pushed true with nil */
+    return 2; /* Error message already on stack */
+  }
+
+  return tuple_size + 1;
+}
+
+/* Returns FILE * of Lua io library file handle at given index */
+static FILE * lts_checkfile(lua_State * L, int idx)
+{
+  /* All Lua versions and LuaJIT 2 keep FILE * first in the handle */
+  FILE * fp = *(FILE **)luaL_checkudata(L, idx, LUA_FILEHANDLE);
+
+#if LUA_VERSION_NUM >= 502
+  /* Lua 5.2+ keeps FILE * of closed handle, but clears its close function */
+  if (((luaL_Stream *)lua_touserdata(L, idx))->closef == NULL)
+  {
+    fp = NULL;
+  }
+#endif
+
+  if (fp == NULL)
+  {
+    luaL_argerror(L, idx, "attempt to use a closed file");
+  }
+
+  return fp;
+}
+
+static int lload_from_fd(lua_State * L)
+{
+  int fd = (int)luaL_checkinteger(L, 1);
+  lts_LoadOptions opts;
+
+  luaL_argcheck(L, fd >= 0, 1, "invalid file descriptor");
+  load_options(L, 2, &opts);
+
+  return lts_loadfromfd(L, "load_from_fd", fd, NULL, &opts);
+}
+
+/* Reads from a Lua io library file handle, handle is not closed */
+static int lload_from_handle(lua_State * L)
+{
+  lts_LoadOptions opts;
+  FILE * fp = lts_checkfile(L, 1);
+
+  load_options(L, 2, &opts);
+
+#ifdef LUATEXTS_HAVE_FILENO
+  return lts_loadfromfd(L, "load_from_handle", fileno(fp), fp, &opts);
+#else
+  return lts_loadfromfd(L, "load_from_handle", -1, fp, &opts);
+#endif
+}
+
+/*
+* Record iteration
+*
+* Iterates over tuples, saved one after another in a file.
+* File is mapped once, and is unmapped when iteration is over
+* (or when iterator is collected).
+*/
+
+#define LUATEXTS_RECORDS_MT "luatexts.Records"
+
+typedef struct lts_Records
+{
+  const unsigned char * buf;
+  size_t size;
+  size_t offset;
+  lts_LoadOptions opts;
+} lts_Records;
+
+static void ltsR_release(lts_Records * r)
+{
+  if (r->buf != NULL)
+  {
+    if (munmap((void *)r->buf, r->size) == -1)
+    {
+      ESPAM(("records: munmap failed"));
+      /* What else can we do? */
+    }
+    r->buf = NULL;
+  }
+  r->offset = r->size = 0;
+}
+
+static int ltsR_gc(lua_State * L)
+{
+  lts_Records * r = (lts_Records *)luaL_checkudata(
+      L, 1, LUATEXTS_RECORDS_MT
+    );
+
+  ltsR_release(r);
+
+  return 0;
+}
+
+/*
+* Returns next offset and the next tuple, or nothing at the end of file.
+* Throws on load error.
+*/
+static int lrecords_next(lua_State * L)
+{
+  lts_Records * r = (lts_Records *)lua_touserdata(L, lua_upvalueindex(1));
+  size_t tuple_size = 0;
+  size_t nread = 0;
+  int result = 0;
+
+  lua_settop(L, 0);
+
+  if (r->offset >= r->size)
+  {
+    ltsR_release(r); /* Do not wait for GC to unmap */
+    return 0;
+  }
+
+  luaL_checkstack(L, 1, "lrecords_next");
+  lua_pushboolean(L, 1);
+
+  result = luatexts_load(
+      L, r->buf + r->offset, r->size - r->offset,
+      &r->opts, &tuple_size, &nread
+    );
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    ltsR_release(r); /* Iteration is over */
+    return lua_error(L); /* Error message already on stack */
+  }
+
+  r->offset += nread;
+
+  lua_pushinteger(L, (lua_Integer)(r->offset + 1));
+  lua_replace(L, 1); /* Replace pre-pushed true with next offset */
+
+  return tuple_size + 1;
+}
+
+static int lrecords(lua_State * L)
+{
+  const char * filename = (const char *)luaL_checkstring(L, 1);
+  lts_Records * r = NULL;
+  lts_LoadOptions opts;
+
+  load_options(L, 2, &opts);
+
+  luaL_checkstack(L, 2, "lrecords");
+
+  /* Allocate first, so we would not leak the mapping on memory error */
+  r = (lts_Records *)lua_newuserdata(L, sizeof(lts_Records));
+  r->buf = NULL;
+  r->size = 0;
+  r->offset = 0;
+  r->opts = opts;
+
+  luaL_getmetatable(L, LUATEXTS_RECORDS_MT);
+  lua_setmetatable(L, -2);
+
+  if (
+      lts_mapfile(
+          L, "records", filename, 1, MAP_SHARED, &r->buf, &r->size, NULL
+        ) != 0
+    )
+  {
+    return 2;
+  }
+
+#ifdef MADV_SEQUENTIAL
+  if (r->buf != NULL)
+  {
+    /* Only a hint, ignoring errors */
+    madvise((void *)r->buf, r->size, MADV_SEQUENTIAL);
+  }
+#endif /* MADV_SEQUENTIAL */
+
+  lua_pushcclosure(L, lrecords_next, 1);
+
+  return 1;
+}
+
+/*
+* Lazy loading
+*
+* Tables are loaded as empty proxy tables, each remembers the offset
+* of its data. Proxy table is loaded (one level deep) on first access
+* through its metatable. Nested tables become proxies in their turn.
+* When loaded, proxy loses its metatable and becomes a regular table.
+*
+* Proxy metatable is shared by all proxies of one load_lazy() call.
+* It keeps data string at [1], weak proxy-to-offset table at [2],
+* and load options (lts_LoadOptions in a userdata) at [3].
+*
+* If data has table references, each table gets exactly one proxy,
+* found by table number in the weak map at [6]. Table positions
+* are kept at [5] to tell numbers of tables and to find referenced ones.
+*
+* Value limits are checked when load_lazy() scans the data,
+* other limits are checked again as proxies are loaded.
+*/
+
+#define LUATEXTS_LAZY_DATA    (1)
+#define LUATEXTS_LAZY_OFFSETS (2)
+#define LUATEXTS_LAZY_OPTIONS (3)
+#define LUATEXTS_LAZY_STRINGS (4) /* Scanned on first string reference */
+#define LUATEXTS_LAZY_TABLES  (5) /* Only if there are table references */
+#define LUATEXTS_LAZY_INDEX   (6)
+
+#define ltsLS_istable(type) \
+  ( \
+    (type) == LUATEXTS_CFIXEDTABLE || \
+    (type) == LUATEXTS_CSTREAMTABLE || \
+    (type) == LUATEXTS_CHINTEDTABLE \
+  )
+
+/*
+* Skips one item: scalar value or a table header.
+* Scalar data is not validated beyond what is needed to find its end.
+* Fills the frame if item is a table (frame type is zero otherwise).
+* Strings are counted (and string references checked) if strings is not NULL,
+* same for tables.
+*/
+static int ltsLS_skipitem(
+    lts_LoadState * ls,
+    lts_Limits * limits,
+    lts_Strings * strings,
+    lts_Tables * tables,
+    lts_Frame * frame,
+    unsigned char * type
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+  const unsigned char * start = NULL;
+  int narr = 0;
+  int nrec = 0;
+
+  frame->type = 0;
+
+  LUATEXTS_ENSURE(ls,
+      ltsLS_good(ls) && ltsLS_unread(ls) > 0,
+      LUATEXTS_ECLIPPED, ("skipitem: clipped\n")
+    );
+
+  ltsL_countvalue(ls, limits);
+
+  start = ls->pos;
+  *type = *ls->pos;
+
+  EAT_CHAR(ls, "skipitem");
+  EAT_NEWLINE(ls, "skipitem");
+
+  switch (*type)
+  {
+    case LUATEXTS_CNIL:
+    case LUATEXTS_CFALSE:
+    case LUATEXTS_CTRUE:
+      break;
+
+    case LUATEXTS_CNUMBER:
+    case LUATEXTS_CUINT:
+    case LUATEXTS_CUINTHEX:
+    case LUATEXTS_CUINT36:
+      {
+        const unsigned char * line = NULL;
+        size_t len = 0;
+        result = ltsLS_readline(ls, &line, &len);
+      }
+      break;
+
+    case LUATEXTS_CSTRING:
+      {
+        LUATEXTS_UINT len = 0;
+        result = ltsLS_readuint10(ls, &len);
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          LUATEXTS_ENSURE(ls,
+              len < ltsLS_unread(ls),
+              LUATEXTS_EBADSIZE, ("skipitem: bad string size\n")
+            );
+          ltsL_checkstring(ls, limits, len);
+          if (strings != NULL)
+          {
+            ltsS_add(strings, ls->pos, (size_t)len);
+          }
+          ltsLS_eat(ls, (size_t)len);
+          result = ltsLS_eatnewline(ls);
+        }
+      }
+      break;
+
+    case LUATEXTS_CSTRINGUTF8:
+      {
+        LUATEXTS_UINT len_chars = 0;
+        const unsigned char * str = NULL;
+        size_t len_bytes = 0;
+        result = ltsLS_readuint10(ls, &len_chars);
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          LUATEXTS_ENSURE(ls,
+              len_chars < ltsLS_unread(ls),
+              LUATEXTS_EBADSIZE, ("skipitem: bad string size\n")
+            );
+          ltsL_checkstring(ls, limits, len_chars);
+          result = ltsLS_eatutf8(ls, (size_t)len_chars, &str, &len_bytes);
+        }
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          ltsL_checkstring(ls, limits, len_bytes);
+          if (strings != NULL)
+          {
+            ltsS_add(strings, str, len_bytes);
+          }
+          result = ltsLS_eatnewline(ls);
+        }
+      }
+      break;
+
+    case LUATEXTS_CSTRINGREF:
+      if (strings != NULL)
+      {
+        size_t index = 0;
+        result = ltsLS_readstringref(ls, strings, &index);
+      }
+      else
+      {
+        const unsigned char * line = NULL;
+        size_t len = 0;
+        result = ltsLS_readline(ls, &line, &len);
+      }
+      break;
+
+    case LUATEXTS_CTABLEREF:
+      if (tables != NULL)
+      {
+        size_t index = 0;
+        result = ltsLS_readtableref(ls, tables, &index);
+      }
+      else
+      {
+        const unsigned char * line = NULL;
+        size_t len = 0;
+        result = ltsLS_readline(ls, &line, &len);
+      }
+      break;
+
+    case LUATEXTS_CFIXEDTABLE:
+    case LUATEXTS_CHINTEDTABLE:
+    case LUATEXTS_CSTREAMTABLE:
+      result = ltsLS_readtable(ls, *type, limits, frame, &narr, &nrec);
+      if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS) && tables != NULL)
+      {
+        ltsT_add(tables, start);
+      }
+      break;
+
+    default:
+      ESPAM(("skipitem: unknown type char 0x%X (%d)\n", *type, *type));
+      ltsLS_close(ls);
+      result = LUATEXTS_EBADTYPE;
+      break;
+  }
+
+  return result;
+}
+
+/*
+* Doubles capacity of the frame stack, moving it from C stack
+* (stack_frames) to the heap on first call. Frames that are not
+* stack_frames are to be freed by the caller.
+*/
+static int lts_growframes(
+    lts_Frame ** frames,
+    lts_Frame * stack_frames,
+    size_t * capacity
+  )
+{
+  lts_Frame * heap_frames = (lts_Frame *)malloc(
+      2 * *capacity * sizeof(lts_Frame)
+    );
+  if (LUATEXTS_UNLIKELY(heap_frames == NULL))
+  {
+    return LUATEXTS_ENOMEM;
+  }
+
+  memcpy(heap_frames, *frames, *capacity * sizeof(lts_Frame));
+  if (*frames != stack_frames)
+  {
+    free(*frames);
+  }
+
+  *frames = heap_frames;
+  *capacity *= 2;
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Skips one value, including nested tables, without loading anything.
+* Frames live on C stack for shallow data, and on the heap for deeper one
+* (this code does not call Lua, so nothing may throw).
+*/
+static int ltsLS_skipvalue(
+    lts_LoadState * ls,
+    lts_Limits * limits,
+    lts_Strings * strings,
+    lts_Tables * tables
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+
+  lts_Frame stack_frames[LUATEXTS_LOAD_STACKFRAMES];
+  lts_Frame * frames = stack_frames;
+  size_t capacity = LUATEXTS_LOAD_STACKFRAMES;
+  size_t depth = 0;
+
+  do
+  {
+    lts_Frame frame;
+    unsigned char type = 0;
+    int is_nil = 0;
+
+    result = ltsLS_skipitem(ls, limits, strings, tables, &frame, &type);
+    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+    {
+      break;
+    }
+
+    if (frame.type != 0)
+    {
+      if (LUATEXTS_UNLIKELY(depth >= limits->opts->max_depth))
+      {
+        ESPAM(("skipvalue: nesting too deep\n"));
+        result = LUATEXTS_ETOODEEP;
+        break;
+      }
+
+      /* Fixed table frame simply counts values left */
+      frame.array_left += frame.hash_left * 2;
+
+      if (
+          frame.array_left > 0 ||
+          frame.type == LUATEXTS_CSTREAMTABLE
+        )
+      {
+        if (LUATEXTS_UNLIKELY(depth == capacity))
+        {
+          result = lts_growframes(&frames, stack_frames, &capacity);
+          if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+          {
+            break;
+          }
+        }
+
+        frames[depth++] = frame;
+        continue; /* Skip table contents */
+      }
+    }
+    else
+    {
+      is_nil = (type == LUATEXTS_CNIL);
+    }
+
+    /* A value is skipped, close tables that are complete */
+    while (depth > 0)
+    {
+      lts_Frame * top = &frames[depth - 1];
+
+      if (top->type == LUATEXTS_CFIXEDTABLE)
+      {
+        if (--top->array_left > 0)
+        {
+          break;
+        }
+      }
+      else if (top->expect_value)
+      {
+        top->expect_value = 0;
+        break;
+      }
+      else if (!is_nil)
+      {
+        top->expect_value = 1;
+        break;
+      }
+
+      --depth; /* Table is complete */
+      is_nil = 0;
+    }
+  }
+  while (depth > 0);
+
+  if (frames != stack_frames)
+  {
+    free(frames);
+  }
+
+  return result;
+}
+
+/*
+* Skips the whole tuple, recording strings and tables if their capacity
+* allows (either may be NULL). Nothing may throw here.
+*/
+static int lts_scanrefs(
+    const unsigned char * data,
+    size_t len,
+    const lts_LoadOptions * opts,
+    lts_Strings * strings,
+    lts_Tables * tables
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+  lts_LoadState ls;
+  lts_Limits limits;
+  LUATEXTS_UINT tuple_size = 0;
+  LUATEXTS_UINT i = 0;
+
+  ltsLS_init(&ls, data, len);
+  ltsL_init(&limits, opts);
+
+  result = ltsLS_readuint10(&ls, &tuple_size);
+  for (i = 0; i < tuple_size && result == LUATEXTS_ESUCCESS; ++i)
+  {
+    result = ltsLS_skipvalue(&ls, &limits, strings, tables);
+  }
+
+  return result;
+}
+
+/*
+* Strings of a tuple are recorded only after the whole tuple is scanned.
+* This is done on the first string reference that is loaded
+* (in two passes: count, then record). Records are kept in the anchor table.
+*/
+static int lts_scanstrings(
+    lua_State * L,
+    const unsigned char * buf,
+    size_t len,
+    const lts_LoadOptions * opts,
+    int anchor,
+    lts_Strings * strings
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+  lts_Strings scanned;
+
+  ltsS_init(&scanned, NULL, 0);
+  result = lts_scanrefs(buf, len, opts, &scanned, NULL);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    return result;
+  }
+
+  ltsS_init(
+      &scanned,
+      (lts_String *)lua_newuserdata(L, scanned.seen * sizeof(lts_String)),
+      scanned.seen
+    );
+  lua_rawseti(L, anchor, LUATEXTS_LOAD_ANCHOR_STRINGS);
+
+  result = lts_scanrefs(buf, len, opts, &scanned, NULL);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    strings->items = scanned.items;
+    strings->count = scanned.count;
+    strings->cache = anchor;
+  }
+
+  return result;
+}
+
+/*
+* Strings of lazy data are known only after whole data is scanned.
+* This is done on first string reference (in two passes: count, then record),
+* records are kept in the proxy metatable at mt.
+*/
+static int lts_lazystrings(lua_State * L, int mt, lts_Strings * strings)
+{
+  lua_rawgeti(L, mt, LUATEXTS_LAZY_STRINGS);
+  if (lua_isnil(L, -1))
+  {
+    int result = LUATEXTS_ESUCCESS;
+    const unsigned char * data = NULL;
+    size_t len = 0;
+    lts_LoadOptions opts;
+    lts_Strings scanned;
+    lts_Metrics * metrics = NULL;
+    clock_t start = 0;
+
+    lua_pop(L, 1);
+
+    metrics = lts_getmetrics(L);
+    if (metrics != NULL)
+    {
+      start = clock();
+    }
+
+    lua_rawgeti(L, mt, LUATEXTS_LAZY_OPTIONS);
+    opts = *(const lts_LoadOptions *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, mt, LUATEXTS_LAZY_DATA);
+    data = (const unsigned char *)lua_tolstring(L, -1, &len);
+    lua_pop(L, 1);
+
+    ltsS_init(&scanned, NULL, 0);
+    result = lts_scanrefs(data, len, &opts, &scanned, NULL);
+    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+    {
+      return result;
+    }
+
+    ltsS_init(
+        &scanned,
+        (lts_String *)lua_newuserdata(L, scanned.seen * sizeof(lts_String)),
+        scanned.seen
+      );
+    result = lts_scanrefs(data, len, &opts, &scanned, NULL);
+
+    if (metrics != NULL)
+    {
+      ltsM_addtime(&metrics->scan_time, start);
+    }
+
+    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+    {
+      lua_pop(L, 1);
+      return result;
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, mt, LUATEXTS_LAZY_STRINGS);
+  }
+
+  /* Records are referenced from the metatable, so they stay alive */
+  strings->items = (lts_String *)lua_touserdata(L, -1);
+  strings->count = lua_objlen(L, -1) / sizeof(lts_String);
+  lua_pop(L, 1);
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Table positions of lazy data are recorded (in two passes, as strings are)
+* when load_lazy() finds table references. Records are kept in the proxy
+* metatable at mt, with a new table number-to-proxy map, which is pushed.
+*/
+static int lts_lazytables(lua_State * L, int mt, lts_Tables * tables)
+{
+  int result = LUATEXTS_ESUCCESS;
+  const unsigned char * data = NULL;
+  size_t len = 0;
+  lts_LoadOptions opts;
+  lts_Tables scanned;
+  lts_Metrics * metrics = lts_getmetrics(L);
+  clock_t start = 0;
+
+  if (metrics != NULL)
+  {
+    start = clock();
+  }
+
+  lua_rawgeti(L, mt, LUATEXTS_LAZY_OPTIONS);
+  opts = *(const lts_LoadOptions *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+
+  lua_rawgeti(L, mt, LUATEXTS_LAZY_DATA);
+  data = (const unsigned char *)lua_tolstring(L, -1, &len);
+  lua_pop(L, 1);
+
+  ltsT_init(&scanned, NULL, 0);
+  result = lts_scanrefs(data, len, &opts, NULL, &scanned);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    return result;
+  }
+
+  if (LUATEXTS_UNLIKELY(scanned.seen > INT_MAX))
+  {
+    ESPAM(("lazytables: too many tables\n"));
+    return LUATEXTS_ETOOHUGE;
+  }
+
+  ltsT_init(
+      &scanned,
+      (const unsigned char **)lua_newuserdata(
+          L, scanned.seen * sizeof(const unsigned char *)
+        ),
+      scanned.seen
+    );
+  result = lts_scanrefs(data, len, &opts, NULL, &scanned);
+
+  if (metrics != NULL)
+  {
+    ltsM_addtime(&metrics->scan_time, start);
+  }
+
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    lua_pop(L, 1);
+    return result;
+  }
+
+  lua_rawseti(L, mt, LUATEXTS_LAZY_TABLES);
+
+  /* References were checked by the scan */
+  tables->seen = scanned.count;
+  tables->items = scanned.items;
+  tables->count = scanned.count;
+
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, mt, LUATEXTS_LAZY_INDEX);
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/* Returns number of table at pos, zero if there is no such table */
+static size_t ltsT_find(const lts_Tables * tables, const unsigned char * pos)
+{
+  size_t lo = 0;
+  size_t hi = tables->count;
+
+  /* Tables are recorded in order of their positions */
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+    if (tables->items[mid] < pos)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  return (lo < tables->count && tables->items[lo] == pos) ? lo + 1 : 0;
+}
+
+/*
+* Pushes proxy for table at offset. If tables are recorded,
+* the table with given number gets one proxy, which is reused.
+*/
+static void lts_pushproxy(
+    lua_State * L,
+    size_t offset,
+    int mt,
+    int offsets,
+    const lts_Tables * tables,
+    size_t number
+  )
+{
+  if (tables->index != 0)
+  {
+    lua_rawgeti(L, tables->index, (int)number);
+    if (!lua_isnil(L, -1))
+    {
+      return; /* Proxy, or a table it became when loaded */
+    }
+    lua_pop(L, 1);
+  }
+
+  lua_newtable(L);
+  lua_pushvalue(L, mt);
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, -1);
+  lua_pushnumber(L, (lua_Number)offset);
+  lua_rawset(L, offsets);
+
+  if (tables->index != 0)
+  {
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, tables->index, (int)number);
+  }
+}
+
+/*
+* Pushes a value. Tables (and referenced tables) are pushed as proxies,
+* and skipped. Proxy metatable and offsets table are expected at given
+* indices. Strings in skipped tables are counted in skip_strings,
+* if it is not NULL, same for tables.
+*/
+static int ltsLS_lazyvalue(
+    lua_State * L,
+    lts_LoadState * ls,
+    const unsigned char * data,
+    int mt,
+    int offsets,
+    lts_Limits * limits,
+    lts_Strings * strings,
+    lts_Strings * skip_strings,
+    lts_Tables * tables,
+    lts_Tables * skip_tables
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+
+  if (
+      ltsLS_good(ls) && ltsLS_unread(ls) > 0 &&
+      ltsLS_istable(*ls->pos)
+    )
+  {
+    const unsigned char * start = ls->pos;
+    size_t number = 0;
+
+    if (tables->index != 0)
+    {
+      number = ltsT_find(tables, start);
+      LUATEXTS_ENSURE(ls,
+          number != 0,
+          LUATEXTS_EFAILURE, ("lazyvalue: unknown table\n")
+        ); /* Should not happen */
+    }
+
+    result = ltsLS_skipvalue(ls, limits, skip_strings, skip_tables);
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+    {
+      lts_pushproxy(L, start - data, mt, offsets, tables, number);
+    }
+  }
+  else if (
+      ltsLS_good(ls) && ltsLS_unread(ls) > 0 &&
+      *ls->pos == LUATEXTS_CTABLEREF && tables->index != 0
+    )
+  {
+    size_t number = 0;
+
+    ltsL_countvalue(ls, limits);
+    EAT_CHAR(ls, "lazyvalue");
+    EAT_NEWLINE(ls, "lazyvalue");
+
+    result = ltsLS_readtableref(ls, tables, &number);
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+    {
+      lts_pushproxy(
+          L, tables->items[number - 1] - data, mt, offsets, tables, number
+        );
+    }
+  }
+  else
+  {
+    lts_Frame frame;
+
+    if (
+        ltsLS_good(ls) && ltsLS_unread(ls) > 0 &&
+        *ls->pos == LUATEXTS_CSTRINGREF && strings->items == NULL
+      )
+    {
+      result = lts_lazystrings(L, mt, strings);
+      if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+      {
+        return result;
+      }
+    }
+
+    /* Not a table, frame is unused */
+    result = load_value(L, ls, limits, strings, tables, &frame);
+  }
+
+  return result;
+}
+
+/*
+* Loads one level of proxy at idx (given its metatable at mt).
+* On error proxy is left empty, and error message is pushed.
+*/
+static int lts_lazyload(lua_State * L, int idx, int mt)
+{
+  int result = LUATEXTS_ESUCCESS;
+  int base = lua_gettop(L);
+  int offsets = base + 1;
+  const unsigned char * data = NULL;
+  size_t len = 0;
+  size_t offset = 0;
+  size_t depth = 1;
+  lts_LoadOptions opts;
+  lts_Limits limits;
+  lts_LoadState ls;
+  lts_Strings strings;
+  lts_Tables tables;
+  lts_Frame frame;
+  unsigned char type = 0;
+  int narr = 0;
+  int nrec = 0;
+
+  luaL_checkstack(L, 7, "lazy-load");
+
+  /* String references were checked when data was scanned */
+  ltsS_init(&strings, NULL, 0);
+  strings.seen = (size_t)-1 / 2;
+  ltsT_init(&tables, NULL, 0);
+
+  lua_rawgeti(L, mt, LUATEXTS_LAZY_OFFSETS);
+
+  lua_pushvalue(L, idx);
+  lua_rawget(L, offsets);
+  if (lua_isnil(L, -1))
+  {
+    lua_settop(L, base);
+    return LUATEXTS_ESUCCESS; /* Not a proxy, or already loaded */
+  }
+  offset = (size_t)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_rawgeti(L, mt, LUATEXTS_LAZY_OPTIONS);
+  opts = *(const lts_LoadOptions *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+
+  /* Values were counted when data was scanned */
+  opts.max_values = (size_t)-1;
+  ltsL_init(&limits, &opts);
+
+  /* Data string is referenced from the metatable, so it stays alive */
+  lua_rawgeti(L, mt, LUATEXTS_LAZY_DATA);
+  data = (const unsigned char *)lua_tolstring(L, -1, &len);
+  lua_pop(L, 1);
+
+  /* Table positions, same as data, stay alive */
+  lua_rawgeti(L, mt, LUATEXTS_LAZY_TABLES);
+  if (!lua_isnil(L, -1))
+  {
+    tables.count = lua_objlen(L, -1) / sizeof(const unsigned char *);
+    tables.seen = tables.count;
+    tables.items = (const unsigned char **)lua_touserdata(L, -1);
+    tables.index = offsets + 1;
+  }
+  lua_pop(L, 1);
+
+  lua_rawgeti(L, mt, LUATEXTS_LAZY_INDEX); /* At offsets + 1 */
+
+  ltsLS_init(&ls, data + offset, len - offset);
+
+  /* Header was checked by skipvalue already */
+  type = *ls.pos;
+  ltsLS_eat(&ls, 1);
+  result = ltsLS_eatnewline(&ls);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    result = ltsLS_readtable(&ls, type, &limits, &frame, &narr, &nrec);
+  }
+
+  lua_pushvalue(L, idx);
+
+  if (
+      frame.type == LUATEXTS_CFIXEDTABLE &&
+      frame.array_left == 0 && frame.hash_left == 0
+    )
+  {
+    depth = 0; /* Empty table */
+  }
+
+  while (depth > 0 && result == LUATEXTS_ESUCCESS)
+  {
+    /* Value, and a key under it */
+    if (LUATEXTS_UNLIKELY(!lua_checkstack(L, 6)))
+    {
+      result = LUATEXTS_ETOOHUGE;
+      break;
+    }
+
+    result = ltsLS_lazyvalue(
+        L, &ls, data, mt, offsets, &limits, &strings, NULL, &tables, NULL
+      );
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+    {
+      result = ltsF_complete(L, &frame, &depth, NULL, NULL);
+    }
+  }
+
+  lua_settop(L, offsets);
+
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    lua_pushvalue(L, idx);
+    lua_pushnil(L);
+    lua_rawset(L, offsets);
+
+    lua_pushnil(L);
+    lua_setmetatable(L, idx);
+  }
+  else
+  {
+    /* Do not leave partially loaded proxy */
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0)
+    {
+      lua_pop(L, 1);
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, idx);
+    }
+
+    push_load_error(L, result);
+    lua_replace(L, offsets);
+  }
+
+  lua_settop(L, base + ((result == LUATEXTS_ESUCCESS) ? 0 : 1));
+
+  return result;
+}
+
+/* Loads proxy at index 1 if needed, throws on error */
+static void lts_lazycheck(lua_State * L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checkstack(L, 1, "lazy-check");
+
+  if (lua_getmetatable(L, 1))
+  {
+    int result = lts_lazyload(L, 1, lua_gettop(L));
+    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+    {
+      lua_error(L); /* Error message is on stack */
+    }
+    lua_pop(L, 1); /* Pop metatable */
+  }
+}
+
+static int llazy_index(lua_State * L)
+{
+  lts_lazycheck(L);
+  lua_settop(L, 2);
+  lua_rawget(L, 1);
+  return 1;
+}
+
+static int llazy_newindex(lua_State * L)
+{
+  lts_lazycheck(L);
+  lua_settop(L, 3);
+  lua_rawset(L, 1);
+  return 0;
+}
+
+static int llazy_len(lua_State * L)
+{
+  lts_lazycheck(L);
+  lua_pushinteger(L, (lua_Integer)lua_objlen(L, 1));
+  return 1;
+}
+
+static int llazy_next(lua_State * L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 2);
+  if (lua_next(L, 1))
+  {
+    return 2;
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int llazy_pairs(lua_State * L)
+{
+  lts_lazycheck(L);
+  luaL_checkstack(L, 2, "lazy-pairs");
+  lua_pushcfunction(L, llazy_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+static const luaL_Reg LazyProxy[] =
+{
+  { "__index", llazy_index },
+  { "__newindex", llazy_newindex },
+  { "__len", llazy_len },
+  { "__pairs", llazy_pairs },
+
+  { NULL, NULL }
+};
+
+/*
+* Pushes values of a tuple, tables as proxies. Proxy metatable is at mt,
+* offsets table at mt + 1. Strings are checked while values are skipped,
+* tables are counted in skip_tables, if it is not NULL.
+*/
+static int lts_lazytuple(
+    lua_State * L,
+    const unsigned char * buf,
+    size_t len,
+    const lts_LoadOptions * opts,
+    int mt,
+    lts_Tables * tables,
+    lts_Tables * skip_tables,
+    LUATEXTS_UINT * tuple_size
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+  lts_Limits limits;
+  lts_LoadState ls;
+  lts_Strings strings;
+  LUATEXTS_UINT i = 0;
+
+  ltsLS_init(&ls, buf, len);
+  ltsL_init(&limits, opts);
+  ltsS_init(&strings, NULL, 0);
+
+  result = ltsLS_readuint10(&ls, tuple_size);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    /* Implementation detail */
+    if (LUATEXTS_UNLIKELY((lua_Integer)*tuple_size < 0))
+    {
+      ESPAM(("load_lazy: tuple size does not fit to lua_Integer\n"));
+      result = LUATEXTS_ETOOHUGE;
+    }
+    else
+    {
+      result = ltsL_checktuple(&limits, *tuple_size);
+    }
+  }
+
+  for (i = 0; i < *tuple_size && result == LUATEXTS_ESUCCESS; ++i)
+  {
+    if (LUATEXTS_UNLIKELY(!lua_checkstack(L, 4)))
+    {
+      result = LUATEXTS_ETOOHUGE;
+      break;
+    }
+
+    result = ltsLS_lazyvalue(
+        L, &ls, buf, mt, mt + 1, &limits, &strings, &strings,
+        tables, skip_tables
+      );
+  }
+
+  return result;
+}
+
+static int lload_lazy(lua_State * L)
+{
+  size_t len = 0;
+  const unsigned char * buf = (const unsigned char *)luaL_checklstring(
+      L, 1, &len
+    );
+  int result = LUATEXTS_ESUCCESS;
+  lts_LoadOptions opts;
+  lts_Tables tables;
+  lts_Tables counted;
+  LUATEXTS_UINT tuple_size = 0;
+  const luaL_Reg * reg = NULL;
+  int base = 0;
+
+  load_options(L, 2, &opts);
+  lua_settop(L, 1);
+  base = lua_gettop(L);
+
+  luaL_checkstack(L, 7, "lload-lazy");
+
+  /* Proxy metatable, at base + 1 */
+  lua_createtable(L, 6, 4);
+  for (reg = LazyProxy; reg->name != NULL; ++reg)
+  {
+    lua_pushcfunction(L, reg->func);
+    lua_setfield(L, -2, reg->name);
+  }
+
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, LUATEXTS_LAZY_DATA);
+
+  *(lts_LoadOptions *)lua_newuserdata(L, sizeof(lts_LoadOptions)) = opts;
+  lua_rawseti(L, -2, LUATEXTS_LAZY_OPTIONS);
+
+  /* Weak offsets table, at base + 2 */
+  lua_newtable(L);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, base + 1, LUATEXTS_LAZY_OFFSETS);
+
+  lua_pushnil(L); /* Table number-to-proxy map, if needed, at base + 3 */
+
+  lua_pushboolean(L, 1);
+
+  ltsT_init(&tables, NULL, 0);
+  ltsT_init(&counted, NULL, 0);
+
+  result = lts_lazytuple(
+      L, buf, len, &opts, base + 1, &tables, &counted, &tuple_size
+    );
+
+  /*
+  * Tables are recorded only if there are table references,
+  * then tuple is loaded again, so each table gets one proxy.
+  */
+  if (
+      result == LUATEXTS_ERELOAD ||
+      (result == LUATEXTS_ESUCCESS && counted.refs > 0)
+    )
+  {
+    lua_settop(L, base + 4);
+
+    result = lts_lazytables(L, base + 1, &tables);
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+    {
+      lua_replace(L, base + 3);
+      tables.index = base + 3;
+
+      result = lts_lazytuple(
+          L, buf, len, &opts, base + 1, &tables, NULL, &tuple_size
+        );
+    }
+  }
+
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    lua_settop(L, base);
+    lua_pushnil(L);
+    push_load_error(L, result);
+    return 2;
+  }
+
+  lua_remove(L, base + 1);
+  lua_remove(L, base + 1);
+  lua_remove(L, base + 1);
+
+  return (int)tuple_size + 1;
+}
+
+/*
+* Loads the proxy (if value is a proxy that is not loaded yet).
+* Useful on Lua 5.1, where pairs() and # do not trigger loading.
+*/
+static int lmaterialize(lua_State * L)
+{
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+
+  if (lua_type(L, 1) == LUA_TTABLE && lua_getmetatable(L, 1))
+  {
+    lua_getfield(L, -1, "__index");
+    if (lua_tocfunction(L, -1) == llazy_index)
+    {
+      lua_pop(L, 1);
+      if (lts_lazyload(L, 1, 2) != LUATEXTS_ESUCCESS)
+      {
+        lua_error(L);
+      }
+    }
+    lua_settop(L, 1);
+  }
+
+  return 1;
+}
+
+/*
+* Projection loading
+*
+* Spec of load_select() is compiled to a tree of nodes, kept in a table.
+* Node k is a map at [k] from wanted keys to child node numbers (zero means
+* that the value is wanted whole), the child for any other key ("*" in spec)
+* is at [-k], if there is one. Root node is 1.
+*
+* Values that are not wanted are skipped, nothing is created for them.
+* Tuples with table back-references are loaded in full, and then projected.
+*/
+
+#define LUATEXTS_SELECT_ANY "*"
+
+/* Also stops specs that contain themselves */
+#define LUATEXTS_SELECT_MAXDEPTH (200)
+
+/* Spec is argument 2 of load_select() */
+#define LUATEXTS_SELECT_SPEC (2)
+
+/* Returns non-zero if value at idx is the "*" key */
+static int ltsSel_isany(lua_State * L, int idx)
+{
+  return lua_type(L, idx) == LUA_TSTRING &&
+    !strcmp(lua_tostring(L, idx), LUATEXTS_SELECT_ANY);
+}
+
+/*
+* Pops a key, returns its child node in the node (created if there is none),
+* or zero if the value is wanted whole already.
+*/
+static lua_Integer ltsSel_child(
+    lua_State * L,
+    int nodes,
+    lua_Integer node,
+    lua_Integer * count
+  )
+{
+  lua_Integer child = 0;
+  int any = ltsSel_isany(L, -1);
+
+  luaL_checkstack(L, 3, "select-child");
+
+  if (any)
+  {
+    lua_pop(L, 1);
+    lua_rawgeti(L, nodes, -(int)node);
+  }
+  else
+  {
+    lua_rawgeti(L, nodes, (int)node);
+    lua_insert(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, -3);
+  }
+
+  if (!lua_isnil(L, -1))
+  {
+    child = lua_tointeger(L, -1);
+    lua_pop(L, any ? 1 : 3);
+    return child;
+  }
+  lua_pop(L, 1);
+
+  if (LUATEXTS_UNLIKELY(*count >= INT_MAX))
+  {
+    luaL_argerror(L, LUATEXTS_SELECT_SPEC, "spec too huge");
+  }
+
+  child = ++*count;
+  lua_newtable(L);
+  lua_rawseti(L, nodes, (int)child);
+
+  lua_pushinteger(L, child);
+  if (any)
+  {
+    lua_rawseti(L, nodes, -(int)node);
+  }
+  else
+  {
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+  }
+
+  return child;
+}
+
+/* Pops a key, its value in the node is wanted whole */
+static void ltsSel_whole(lua_State * L, int nodes, lua_Integer node)
+{
+  luaL_checkstack(L, 3, "select-whole");
+
+  if (ltsSel_isany(L, -1))
+  {
+    lua_pop(L, 1);
+    lua_pushinteger(L, 0);
+    lua_rawseti(L, nodes, -(int)node);
+    return;
+  }
+
+  lua_rawgeti(L, nodes, (int)node);
+  lua_insert(L, -2);
+  lua_pushinteger(L, 0);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/* Adds dot-separated path at idx to the node */
+static void ltsSel_path(
+    lua_State * L,
+    int nodes,
+    lua_Integer node,
+    int idx,
+    lua_Integer * count
+  )
+{
+  size_t len = 0;
+  const char * path = lua_tolstring(L, idx, &len);
+  const char * end = path + len;
+
+  while (node != 0)
+  {
+    const char * dot = (const char *)memchr(path, '.', (size_t)(end - path));
+
+    luaL_checkstack(L, 1, "select-path");
+    lua_pushlstring(L, path, (size_t)((dot != NULL ? dot : end) - path));
+
+    if (dot == NULL)
+    {
+      ltsSel_whole(L, nodes, node);
+      break;
+    }
+
+    node = ltsSel_child(L, nodes, node, count);
+    path = dot + 1;
+  }
+}
+
+/* Adds spec table at idx to the node */
+static void ltsSel_compile(
+    lua_State * L,
+    int nodes,
+    lua_Integer node,
+    int idx,
+    lua_Integer * count,
+    int depth
+  )
+{
+  if (LUATEXTS_UNLIKELY(depth > LUATEXTS_SELECT_MAXDEPTH))
+  {
+    luaL_argerror(L, LUATEXTS_SELECT_SPEC, "spec nested too deep");
+  }
+
+  luaL_checkstack(L, 3, "select-compile");
+
+  lua_pushnil(L);
+  while (lua_next(L, idx))
+  {
+    int type = lua_type(L, -1);
+
+    if (type == LUA_TSTRING)
+    {
+      ltsSel_path(L, nodes, node, lua_gettop(L), count);
+    }
+    else if (type == LUA_TBOOLEAN && lua_toboolean(L, -1))
+    {
+      lua_pushvalue(L, -2);
+      ltsSel_whole(L, nodes, node);
+    }
+    else if (type == LUA_TTABLE)
+    {
+      lua_Integer child = 0;
+
+      lua_pushvalue(L, -2);
+      child = ltsSel_child(L, nodes, node, count);
+      if (child != 0)
+      {
+        ltsSel_compile(L, nodes, child, lua_gettop(L), count, depth + 1);
+      }
+    }
+    else
+    {
+      luaL_argerror(
+          L, LUATEXTS_SELECT_SPEC, lua_pushfstring(
+              L, "bad spec value (%s), expected true, table or path",
+              luaL_typename(L, -1)
+            )
+        );
+    }
+
+    lua_pop(L, 1);
+  }
+}
+
+/*
+* Pops a key, returns non-zero if its value in the node is wanted,
+* and sets child node for it.
+*/
+static int ltsSel_lookup(
+    lua_State * L,
+    int nodes,
+    size_t node,
+    size_t * child
+  )
+{
+  lua_rawgeti(L, nodes, (int)node);
+  lua_insert(L, -2);
+  lua_rawget(L, -2);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    lua_rawgeti(L, nodes, -(int)node);
+  }
+
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 2);
+    return 0;
+  }
+
+  *child = (size_t)lua_tointeger(L, -1);
+  lua_pop(L, 2);
+
+  return 1;
+}
+
+/*
+* Reads table header and pushes a table for wanted items only.
+* It is presized only if the node wants all items.
+*/
+static int ltsLS_selecttable(
+    lua_State * L,
+    lts_LoadState * ls,
+    lts_Limits * limits,
+    lts_Tables * tables,
+    lts_Frame * frame,
+    int nodes,
+    size_t node
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+  const unsigned char * type = ls->pos;
+  int narr = 0;
+  int nrec = 0;
+
+  ltsL_countvalue(ls, limits);
+
+  EAT_CHAR(ls, "selecttable");
+  EAT_NEWLINE(ls, "selecttable");
+
+  result = ltsLS_readtable(ls, *type, limits, frame, &narr, &nrec);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    lua_rawgeti(L, nodes, -(int)node);
+    if (lua_isnil(L, -1))
+    {
+      narr = 0;
+      nrec = 0;
+    }
+    lua_pop(L, 1);
+
+    lua_createtable(L, narr, nrec);
+    ltsT_add(tables, type);
+  }
+
+  return result;
+}
+
+/*
+* Loads wanted parts of a tuple, leaves the stack as it was on error.
+* Tuple with table references is not loaded, LUATEXTS_ERELOAD is returned.
+*/
+static int lts_selecttuple(
+    lua_State * L,
+    const unsigned char * buf,
+    size_t len,
+    const lts_LoadOptions * opts,
+    int nodes,
+    size_t * count
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+  lts_LoadState ls;
+  lts_Limits limits;
+
+  LUATEXTS_UINT tuple_size = 0;
+  LUATEXTS_UINT values_left = 0;
+
+  /*
+  * As in lts_loadtuple(), but the anchor table at base + 1 is always there.
+  * Strings are not recorded while loading, see lts_scanstrings().
+  */
+  lts_Frame stack_frames[LUATEXTS_LOAD_STACKFRAMES];
+  lts_Frame * frames = stack_frames;
+  size_t capacity = LUATEXTS_LOAD_STACKFRAMES;
+  size_t depth = 0;
+  lts_Strings strings;
+  lts_Tables tables;
+
+  int base = lua_gettop(L);
+
+  ltsLS_init(&ls, buf, len);
+  ltsL_init(&limits, opts);
+  ltsS_init(&strings, NULL, 0);
+  ltsT_init(&tables, NULL, 0);
+
+  luaL_checkstack(L, 1, "select-tuple");
+  lua_newtable(L); /* Anchor table */
+
+  result = ltsLS_readuint10(&ls, &tuple_size);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    /* Implementation detail */
+    if (LUATEXTS_UNLIKELY((lua_Integer)tuple_size < 0))
+    {
+      ESPAM(("select_tuple: size does not fit to lua_Integer\n"));
+      ltsLS_close(&ls);
+      result = LUATEXTS_ETOOHUGE;
+    }
+    else
+    {
+      result = ltsL_checktuple(&limits, tuple_size);
+    }
+  }
+
+  values_left = tuple_size;
+  while (values_left > 0 && result == LUATEXTS_ESUCCESS)
+  {
+    lts_Frame frame;
+    lts_Frame * top = (depth > 0) ? &frames[depth - 1] : NULL;
+    size_t node = (top == NULL) ? 1 : 0; /* Keys are loaded whole */
+    int is_array = 0;
+
+    /* Value, key, node map and its item, and the anchor table */
+    if (LUATEXTS_UNLIKELY(!lua_checkstack(L, 5)))
+    {
+      ESPAM(("select_tuple: stack overflow\n"));
+      result = LUATEXTS_ETOOHUGE;
+      break;
+    }
+
+    if (top != NULL && top->select != 0)
+    {
+      is_array = (top->type == LUATEXTS_CFIXEDTABLE && top->array_left > 0);
+      if (is_array || top->expect_value)
+      {
+        if (is_array)
+        {
+          lts_pushuint(L, top->next_index);
+        }
+        else
+        {
+          lua_pushvalue(L, -1); /* Key */
+        }
+
+        if (!ltsSel_lookup(L, nodes, top->select, &node))
+        {
+          result = ltsLS_skipvalue(&ls, &limits, &strings, &tables);
+          if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+          {
+            break;
+          }
+
+          if (is_array)
+          {
+            --top->array_left;
+            ++top->next_index;
+          }
+          else
+          {
+            lua_pop(L, 1); /* Key */
+            top->expect_value = 0;
+            if (top->type == LUATEXTS_CFIXEDTABLE)
+            {
+              --top->hash_left;
+            }
+          }
+
+          if (
+              top->type == LUATEXTS_CSTREAMTABLE ||
+              top->array_left > 0 || top->hash_left > 0
+            )
+          {
+            continue; /* Wait for more values */
+          }
+
+          /* Table is complete, it is a value of the enclosing one now */
+          --depth;
+          node = (size_t)-1;
+        }
+      }
+    }
+
+    if (node == (size_t)-1)
+    {
+      frame.type = 0; /* Table is complete already */
+    }
+    else if (node != 0 && ltsLS_unread(&ls) > 0 && ltsLS_istable(*ls.pos))
+    {
+      result = ltsLS_selecttable(
+          L, &ls, &limits, &tables, &frame, nodes, node
+        );
+      frame.select = node;
+    }
+    else
+    {
+      /* Referenced strings are recorded */
+      if (
+          LUATEXTS_UNLIKELY(strings.cache == 0) &&
+          ltsLS_unread(&ls) > 0 && *ls.pos == LUATEXTS_CSTRINGREF
+        )
+      {
+        result = lts_scanstrings(L, buf, len, opts, base + 1, &strings);
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+        {
+          break;
+        }
+      }
+
+      result = load_value(L, &ls, &limits, &strings, &tables, &frame);
+    }
+
+    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+    {
+      break;
+    }
+
+    if (frame.type != 0)
+    {
+      if (LUATEXTS_UNLIKELY(depth >= opts->max_depth))
+      {
+        ESPAM(("select_tuple: nesting too deep\n"));
+        result = LUATEXTS_ETOODEEP;
+        break;
+      }
+
+      if (frame.array_left > 0 || frame.hash_left > 0 ||
+          frame.type == LUATEXTS_CSTREAMTABLE)
+      {
+        if (LUATEXTS_UNLIKELY(depth == capacity))
+        {
+          lts_Frame * heap_frames = (lts_Frame *)lua_newuserdata(
+              L, 2 * capacity * sizeof(lts_Frame)
+            );
+          memcpy(heap_frames, frames, capacity * sizeof(lts_Frame));
+          lua_rawseti(L, base + 1, LUATEXTS_LOAD_ANCHOR_FRAMES);
+          frames = heap_frames;
+          capacity *= 2;
+        }
+
+        frames[depth++] = frame;
+        continue; /* Read table contents */
+      }
+    }
+
+    result = ltsF_complete(L, frames, &depth, NULL, NULL);
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS) && depth == 0)
+    {
+      SPAM(("select_tuple: loaded value %lu of %lu\n",
+          tuple_size - values_left + 1, tuple_size
+        ));
+      --values_left;
+    }
+  }
+
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    lua_remove(L, base + 1);
+    *count = tuple_size;
+  }
+  else
+  {
+    XESPAM(("select_tuple: error %d\n", result));
+
+    lua_settop(L, base); /* Discard intermediate results */
+  }
+
+  return result;
+}
+
+/*
+* Replaces value at idx with its projection for the node.
+* Recursion is as deep as the spec is.
+*/
+static void lts_project(lua_State * L, int idx, int nodes, size_t node)
+{
+  int any = 0;
+
+  if (node == 0 || lua_type(L, idx) != LUA_TTABLE)
+  {
+    return;
+  }
+
+  luaL_checkstack(L, 5, "project");
+
+  lua_rawgeti(L, nodes, -(int)node);
+  any = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  lua_rawgeti(L, nodes, (int)node);
+
+  /* Key iteration is over the value if all keys are wanted, or the map */
+  lua_pushnil(L);
+  while (lua_next(L, any ? idx : -2))
+  {
+    size_t child = 0;
+
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_pushvalue(L, -1);
+    if (ltsSel_lookup(L, nodes, node, &child))
+    {
+      lua_rawget(L, idx);
+      if (!lua_isnil(L, -1))
+      {
+        lts_project(L, lua_gettop(L), nodes, child);
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, -5);
+      }
+      else
+      {
+        lua_pop(L, 1);
+      }
+    }
+    else
+    {
+      lua_pop(L, 1);
+    }
+  }
+
+  lua_pop(L, 1);
+  lua_replace(L, idx);
+}
+
+/* Loads parts of tuple values, selected by the spec */
+static int lload_select(lua_State * L)
+{
+  size_t len = 0;
+  const unsigned char * buf = (const unsigned char *)luaL_checklstring(
+      L, 1, &len
+    );
+  size_t tuple_size = 0;
+  lua_Integer nodes_count = 1;
+  int result = LUATEXTS_ESUCCESS;
+  lts_LoadOptions opts;
+  int base = 0;
+
+  luaL_checktype(L, LUATEXTS_SELECT_SPEC, LUA_TTABLE);
+  load_options(L, 3, &opts);
+  opts.dedup = 0; /* Projections are not shared */
+
+  lua_settop(L, 2);
+  base = lua_gettop(L);
+
+  /* Nodes, at base + 1 */
+  luaL_checkstack(L, 2, "lload-select");
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_rawseti(L, base + 1, 1);
+  ltsSel_compile(L, base + 1, 1, LUATEXTS_SELECT_SPEC, &nodes_count, 1);
+
+  lua_pushboolean(L, 1);
+
+  result = lts_selecttuple(L, buf, len, &opts, base + 1, &tuple_size);
+  if (result == LUATEXTS_ERELOAD)
+  {
+    SPAM(("load_select: table references, projecting full load\n"));
+
+    result = luatexts_load(L, buf, len, &opts, &tuple_size, NULL);
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+    {
+      int i = 0;
+
+      for (i = 0; i < (int)tuple_size; ++i)
+      {
+        lts_project(L, base + 3 + i, base + 1, 1);
+      }
+    }
+  }
+  else if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    push_load_error(L, result);
+  }
+
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    lua_pushnil(L);
+    lua_replace(L, base + 2);
+    lua_remove(L, base + 1);
+    return 2; /* Error message already on stack */
+  }
+
+  lua_remove(L, base + 1);
+
+  return (int)tuple_size + 1;
+}
+
+/*
+* Decode cache
+*
+* cached_load() results are kept in a small LRU cache, one per Lua state,
+* keyed by a hash of data bytes (and load options). Data is compared
+* in full on hash match, entries with colliding hashes replace each other.
+*
+* Cached tables are shared between callers, so they are returned
+* wrapped into read-only proxies: empty tables with a metatable of their own,
+* which points __index to the original table. Nested tables in the original
+* are replaced with their proxies when it is wrapped, so indexing
+* costs no function calls.
+*
+* Cache is a table in registry. It keeps cache state at [1],
+* hash-to-slot index at [2] and slot-to-entry table at [3].
+* Entry keeps data string at [1], followed by the wrapped tuple.
+*/
+
+#define LUATEXTS_CACHE_KEY "luatexts.Cache"
+
+#define LUATEXTS_CACHE_STATE   (1)
+#define LUATEXTS_CACHE_INDEX   (2)
+#define LUATEXTS_CACHE_ENTRIES (3)
+
+#define LUATEXTS_CACHE_DEFAULTSIZE (64)
+
+/* Slots are 1-based, zero means none */
+typedef struct lts_CacheSlot
+{
+  uint32_t hash;
+  size_t len;
+  size_t tuple_size;
+  lts_LoadOptions opts;
+  size_t prev; /* More recently used */
+  size_t next; /* Less recently used */
+} lts_CacheSlot;
+
+typedef struct lts_Cache
+{
+  size_t capacity;
+  size_t count;
+  size_t head; /* Most recently used */
+  size_t tail; /* Evicted first */
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+  lts_CacheSlot slots[1]; /* Actually capacity + 1 items, slots[0] unused */
+} lts_Cache;
+
+/* Options are folded to 32 bits here, they are compared in full anyway */
+static uint32_t ltsC_optshash(const lts_LoadOptions * opts)
+{
+  uint32_t h = (uint32_t)opts->max_depth;
+
+  h = h * 31 + (uint32_t)opts->max_values;
+  h = h * 31 + (uint32_t)opts->max_tuple_size;
+  h = h * 31 + (uint32_t)opts->max_string_length;
+  h = h * 31 + (uint32_t)opts->max_array_size;
+  h = h * 31 + (uint32_t)opts->max_hash_size;
+  h = h * 31 + (uint32_t)opts->dedup;
+
+  return h;
+}
+
+static int ltsC_sameopts(const lts_LoadOptions * a, const lts_LoadOptions * b)
+{
+  return a->max_depth == b->max_depth &&
+    a->max_values == b->max_values &&
+    a->max_tuple_size == b->max_tuple_size &&
+    a->max_string_length == b->max_string_length &&
+    a->max_array_size == b->max_array_size &&
+    a->max_hash_size == b->max_hash_size &&
+    a->dedup == b->dedup;
+}
+
+static void ltsC_unlink(lts_Cache * cache, size_t slot)
+{
+  lts_CacheSlot * s = &cache->slots[slot];
+
+  if (s->prev != 0)
+  {
+    cache->slots[s->prev].next = s->next;
+  }
+  else
+  {
+    cache->head = s->next;
+  }
+
+  if (s->next != 0)
+  {
+    cache->slots[s->next].prev = s->prev;
+  }
+  else
+  {
+    cache->tail = s->prev;
+  }
+
+  s->prev = s->next = 0;
+}
+
+static void ltsC_linkhead(lts_Cache * cache, size_t slot)
+{
+  lts_CacheSlot * s = &cache->slots[slot];
+
+  s->prev = 0;
+  s->next = cache->head;
+  if (cache->head != 0)
+  {
+    cache->slots[cache->head].prev = slot;
+  }
+  else
+  {
+    cache->tail = slot;
+  }
+  cache->head = slot;
+}
+
+/* Pushes a new empty cache with given capacity */
+static void ltsC_push(lua_State * L, size_t capacity)
+{
+  lts_Cache * cache = NULL;
+
+  luaL_checkstack(L, 2, "cache");
+
+  lua_createtable(L, 3, 0);
+
+  cache = (lts_Cache *)lua_newuserdata(
+      L, sizeof(lts_Cache) + capacity * sizeof(lts_CacheSlot)
+    );
+  memset(cache, 0, sizeof(lts_Cache));
+  cache->capacity = capacity;
+  lua_rawseti(L, -2, LUATEXTS_CACHE_STATE);
+
+  lua_newtable(L);
+  lua_rawseti(L, -2, LUATEXTS_CACHE_INDEX);
+
+  lua_createtable(L, (int)capacity, 0);
+  lua_rawseti(L, -2, LUATEXTS_CACHE_ENTRIES);
+}
+
+/* Pushes cache table, returns its state */
+static lts_Cache * ltsC_get(lua_State * L)
+{
+  lts_Cache * cache = NULL;
+
+  luaL_checkstack(L, 2, "cache");
+
+  lua_getfield(L, LUA_REGISTRYINDEX, LUATEXTS_CACHE_KEY);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    ltsC_push(L, LUATEXTS_CACHE_DEFAULTSIZE);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUATEXTS_CACHE_KEY);
+  }
+
+  lua_rawgeti(L, -1, LUATEXTS_CACHE_STATE);
+  cache = (lts_Cache *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+
+  return cache;
+}
+
+/*
+* Read-only proxies
+*/
+
+static int lreadonly_newindex(lua_State * L)
+{
+  return luaL_error(
+      L, "luatexts.cached_load: attempt to modify read-only table"
+    );
+}
+
+/* Returns non-zero if value at idx is a read-only proxy */
+static int lts_isreadonly(lua_State * L, int idx)
+{
+  int result = 0;
+
+  luaL_checkstack(L, 2, "read-only");
+
+  if (lua_getmetatable(L, idx))
+  {
+    lua_pushliteral(L, "__newindex");
+    lua_rawget(L, -2);
+    result = (lua_tocfunction(L, -1) == lreadonly_newindex);
+    lua_pop(L, 2);
+  }
+
+  return result;
+}
+
+/* Pushes original table of proxy at idx */
+static void lts_rooriginal(lua_State * L, int idx)
+{
+  luaL_checktype(L, idx, LUA_TTABLE);
+  luaL_checkstack(L, 2, "read-only");
+
+  if (!lua_getmetatable(L, idx))
+  {
+    luaL_argerror(L, idx, "not a read-only table");
+  }
+  lua_pushliteral(L, "__index");
+  lua_rawget(L, -2);
+  lua_remove(L, -2);
+}
+
+static int lreadonly_len(lua_State * L)
+{
+  lts_rooriginal(L, 1);
+  lua_pushinteger(L, (lua_Integer)lua_objlen(L, -1));
+  return 1;
+}
+
+/* Iterates the original table, so it is not handed out to the caller */
+static int lreadonly_next(lua_State * L)
+{
+  lua_settop(L, 2);
+  lts_rooriginal(L, 1);
+  lua_pushvalue(L, 2);
+  if (lua_next(L, 3))
+  {
+    return 2;
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+static int lreadonly_pairs(lua_State * L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checkstack(L, 3, "read-only-pairs");
+  lua_pushcfunction(L, lreadonly_next);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+/*
+* Helpers for Lua 5.1 and LuaJIT, where # and pairs() do not see
+* through read-only proxies. Other tables are taken as they are.
+*/
+
+static int lpairs(lua_State * L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checkstack(L, 3, "lpairs");
+  if (lts_isreadonly(L, 1))
+  {
+    lua_pushcfunction(L, lreadonly_next);
+  }
+  else
+  {
+    lua_pushcfunction(L, llazy_next);
+  }
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+/* Proxy values are looked up with __index, there is no function call */
+static int lipairs_next(lua_State * L)
+{
+  lua_Integer i = luaL_checkinteger(L, 2) + 1;
+  lua_settop(L, 1);
+  lua_pushinteger(L, i);
+  lua_pushvalue(L, -1);
+  lua_gettable(L, 1);
+  return lua_isnil(L, -1) ? 1 : 2;
+}
+
+static int lipairs(lua_State * L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checkstack(L, 3, "lipairs");
+  lua_pushcfunction(L, lipairs_next);
+  lua_pushvalue(L, 1);
+  lua_pushinteger(L, 0);
+  return 3;
+}
+
+static int llen(lua_State * L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  if (lts_isreadonly(L, 1))
+  {
+    lts_rooriginal(L, 1);
+  }
+  else
+  {
+    lua_settop(L, 1);
+  }
+  lua_pushinteger(L, (lua_Integer)lua_objlen(L, -1));
+  return 1;
+}
+
+/*
+* Replaces value on top of the stack with its read-only proxy,
+* if it is a table. Proxies are remembered in seen table, new ones are queued
+* so their originals are wrapped in turn. Proxy metatable functions
+* are at fns, fns + 1 and fns + 2.
+*/
+static void lts_rowrap(
+    lua_State * L,
+    int seen,
+    int queue,
+    size_t * queued,
+    int fns
+  )
+{
+  if (lua_type(L, -1) != LUA_TTABLE)
+  {
+    return;
+  }
+
+  lua_pushvalue(L, -1);
+  lua_rawget(L, seen);
+  if (!lua_isnil(L, -1))
+  {
+    lua_replace(L, -2);
+    return;
+  }
+  lua_pop(L, 1);
+
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, queue, (int)++*queued);
+
+  lua_newtable(L); /* Proxy */
+
+  lua_createtable(L, 0, 5);
+  lua_pushvalue(L, -3);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, fns);
+  lua_setfield(L, -2, "__newindex");
+  lua_pushvalue(L, fns + 1);
+  lua_setfield(L, -2, "__len");
+  lua_pushvalue(L, fns + 2);
+  lua_setfield(L, -2, "__pairs");
+  lua_pushliteral(L, "read-only");
+  lua_setfield(L, -2, "__metatable");
+  lua_setmetatable(L, -2);
+
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, seen);
+
+  lua_replace(L, -2);
+}
+
+/*
+* Replaces tables among count values at first with read-only proxies.
+* Tables are changed in place: nested tables (keys too) are replaced
+* with their proxies. Tables are walked breadth-first, without recursion.
+*/
+static void lts_readonly(lua_State * L, int first, size_t count)
+{
+  size_t queued = 0;
+  size_t i = 0;
+  int base = lua_gettop(L);
+  int seen = base + 1;
+  int queue = base + 2;
+  int keys = base + 3;
+  int fns = base + 4;
+
+  luaL_checkstack(L, 12, "read-only");
+
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_newtable(L);
+  lua_pushcfunction(L, lreadonly_newindex);
+  lua_pushcfunction(L, lreadonly_len);
+  lua_pushcfunction(L, lreadonly_pairs);
+
+  for (i = 0; i < count; ++i)
+  {
+    lua_pushvalue(L, first + (int)i);
+    lts_rowrap(L, seen, queue, &queued, fns);
+    lua_replace(L, first + (int)i);
+  }
+
+  for (i = 1; i <= queued; ++i)
+  {
+    size_t nkeys = 0;
+    size_t j = 0;
+    int t = lua_gettop(L) + 1;
+
+    lua_rawgeti(L, queue, (int)i);
+
+    /* Changing values of existing keys is allowed while traversing */
+    lua_pushnil(L);
+    while (lua_next(L, t))
+    {
+      if (lua_type(L, -1) == LUA_TTABLE)
+      {
+        lts_rowrap(L, seen, queue, &queued, fns);
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, t);
+      }
+      else
+      {
+        lua_pop(L, 1);
+      }
+
+      if (lua_type(L, -1) == LUA_TTABLE)
+      {
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, keys, (int)++nkeys);
+      }
+    }
+
+    /* Adding keys is not, table keys are replaced afterwards */
+    for (j = 1; j <= nkeys; ++j)
+    {
+      lua_rawgeti(L, keys, (int)j);
+      lua_pushvalue(L, -1);
+      lua_rawget(L, t);
+
+      lua_pushvalue(L, -2);
+      lua_pushnil(L);
+      lua_rawset(L, t);
+
+      lua_insert(L, -2);
+      lts_rowrap(L, seen, queue, &queued, fns);
+      lua_insert(L, -2);
+      lua_rawset(L, t);
+    }
+
+    lua_pop(L, 1);
+  }
+
+  lua_settop(L, base);
+}
+
+/* Pushes true and the cached tuple, if data is in the cache */
+static int ltsC_lookup(
+    lua_State * L,
+    int cidx,
+    lts_Cache * cache,
+    uint32_t hash,
+    const unsigned char * buf,
+    size_t len,
+    const lts_LoadOptions * opts,
+    int data_idx
+  )
+{
+  const lts_CacheSlot * s = NULL;
+  size_t slot = 0;
+  size_t i = 0;
+
+  luaL_checkstack(L, 3, "cache-lookup");
+
+  lua_rawgeti(L, cidx, LUATEXTS_CACHE_INDEX);
+  lua_pushnumber(L, (lua_Number)hash);
+  lua_rawget(L, -2);
+  slot = (size_t)lua_tonumber(L, -1);
+  lua_pop(L, 2);
+
+  if (slot == 0)
+  {
+    return 0;
+  }
+
+  s = &cache->slots[slot];
+  if (s->hash != hash || s->len != len || !ltsC_sameopts(&s->opts, opts))
+  {
+    return 0;
+  }
+
+  if (!lua_checkstack(L, (int)s->tuple_size + 3))
+  {
+    return 0; /* Too huge to push, loading fails the same way */
+  }
+
+  lua_rawgeti(L, cidx, LUATEXTS_CACHE_ENTRIES);
+  lua_rawgeti(L, -1, (int)slot);
+  lua_remove(L, -2);
+  lua_rawgeti(L, -1, 1);
+  if (
+      !lua_rawequal(L, -1, data_idx) &&
+      memcmp(lua_tostring(L, -1), buf, len) != 0
+    )
+  {
+    lua_pop(L, 2);
+    return 0;
+  }
+  lua_pop(L, 1);
+
+  ltsC_unlink(cache, slot);
+  ltsC_linkhead(cache, slot);
+
+  lua_pushboolean(L, 1);
+  for (i = 0; i < s->tuple_size; ++i)
+  {
+    lua_rawgeti(L, -2 - (int)i, (int)i + 2);
+  }
+  lua_remove(L, -2 - (int)s->tuple_size);
+
+  return 1;
+}
+
+/* Stores tuple of tuple_size values on top of the stack in the cache */
+static void ltsC_store(
+    lua_State * L,
+    int cidx,
+    lts_Cache * cache,
+    uint32_t hash,
+    size_t len,
+    const lts_LoadOptions * opts,
+    int data_idx,
+    size_t tuple_size
+  )
+{
+  lts_CacheSlot * s = NULL;
+  size_t slot = 0;
+  size_t i = 0;
+  int first = lua_gettop(L) - (int)tuple_size + 1;
+
+  if (cache->capacity == 0)
+  {
+    return;
+  }
+
+  luaL_checkstack(L, 4, "cache-store");
+
+  lua_rawgeti(L, cidx, LUATEXTS_CACHE_INDEX);
+  lua_pushnumber(L, (lua_Number)hash);
+  lua_rawget(L, -2);
+  slot = (size_t)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  if (slot != 0)
+  {
+    ltsC_unlink(cache, slot); /* Hash collision, replacing */
+  }
+  else if (cache->count < cache->capacity)
+  {
+    slot = ++cache->count;
+  }
+  else
+  {
+    slot = cache->tail;
+    ltsC_unlink(cache, slot);
+    ++cache->evictions;
+
+    lua_pushnumber(L, (lua_Number)cache->slots[slot].hash);
+    lua_pushnil(L);
+    lua_rawset(L, -3);
+  }
+
+  lua_pushnumber(L, (lua_Number)hash);
+  lua_pushnumber(L, (lua_Number)slot);
+  lua_rawset(L, -3);
+  lua_pop(L, 1); /* Index */
+
+  lua_rawgeti(L, cidx, LUATEXTS_CACHE_ENTRIES);
+  lua_createtable(L, (int)tuple_size + 1, 0);
+  lua_pushvalue(L, data_idx);
+  lua_rawseti(L, -2, 1);
+  for (i = 0; i < tuple_size; ++i)
+  {
+    lua_pushvalue(L, first + (int)i);
+    lua_rawseti(L, -2, (int)i + 2);
+  }
+  lua_rawseti(L, -2, (int)slot);
+  lua_pop(L, 1); /* Entries */
+
+  s = &cache->slots[slot];
+  s->hash = hash;
+  s->len = len;
+  s->tuple_size = tuple_size;
+  s->opts = *opts;
+  ltsC_linkhead(cache, slot);
+}
+
+static int lcached_load(lua_State * L)
+{
+  size_t len = 0;
+  const unsigned char * buf = (const unsigned char *)luaL_checklstring(
+      L, 1, &len
+    );
+  size_t tuple_size = 0;
+  int result = 0;
+  uint32_t hash = 0;
+  lts_Cache * cache = NULL;
+  lts_LoadOptions opts;
+
+  load_options(L, 2, &opts);
+  lua_settop(L, 1);
+
+  /* Cache table is kept at 2, in case cache is reset while we load */
+  cache = ltsC_get(L);
+
+  hash = lts_hash(buf, len, ltsC_optshash(&opts));
+  if (ltsC_lookup(L, 2, cache, hash, buf, len, &opts, 1))
+  {
+    ++cache->hits;
+    return (int)lua_gettop(L) - 2;
+  }
+  ++cache->misses;
+
+  luaL_checkstack(L, 1, "lcached_load");
+  lua_pushboolean(L, 1);
+
+  result = luatexts_load(L, buf, len, &opts, &tuple_size, NULL);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    luaL_checkstack(L, 1, "lcached_load-err");
+    lua_pushnil(L);
+    lua_replace(L, -3); /* Replace pre-pushed true with nil */
+    return 2; /* Error message already on stack */
+  }
+
+  lts_readonly(L, 4, tuple_size);
+  ltsC_store(L, 2, cache, hash, len, &opts, 1, tuple_size);
+
+  return (int)tuple_size + 1;
+}
+
+static int lcache_stats(lua_State * L)
+{
+  const lts_Cache * cache = ltsC_get(L);
+
+  luaL_checkstack(L, 2, "lcache_stats");
+
+  lua_createtable(L, 0, 5);
+
+  lts_pushuint(L, (LUATEXTS_UINT)cache->hits);
+  lua_setfield(L, -2, "hits");
+  lts_pushuint(L, (LUATEXTS_UINT)cache->misses);
+  lua_setfield(L, -2, "misses");
+  lts_pushuint(L, (LUATEXTS_UINT)cache->evictions);
+  lua_setfield(L, -2, "evictions");
+  lts_pushuint(L, (LUATEXTS_UINT)cache->count);
+  lua_setfield(L, -2, "entries");
+  lts_pushuint(L, (LUATEXTS_UINT)cache->capacity);
+  lua_setfield(L, -2, "size");
+
+  return 1;
+}
+
+static int lreset_cache(lua_State * L)
+{
+  size_t capacity = 0;
+
+  lua_settop(L, 1);
+  capacity = ltsC_get(L)->capacity;
+
+  if (!lua_isnil(L, 1))
+  {
+    lua_Number size = luaL_checknumber(L, 1);
+    luaL_argcheck(
+        L, size >= 0 && size <= (lua_Number)INT_MAX, 1, "invalid cache size"
+      );
+    capacity = (size_t)size;
+  }
+
+  ltsC_push(L, capacity);
+  lua_setfield(L, LUA_REGISTRYINDEX, LUATEXTS_CACHE_KEY);
+
+  return 0;
+}
+
+/*
+* Validation
+*
+* Checks data the same way luatexts_load() does, but builds no Lua values
+* (and does not touch Lua state at all until the data is checked),
+* collecting some statistics instead.
+*/
+
+typedef struct lts_Stats
+{
+  size_t tuple_size;
+  size_t values;         /* Total, including table keys */
+  size_t nils;           /* Not counting stream table terminators */
+  size_t booleans;
+  size_t numbers;
+  size_t strings;        /* Not counting string references */
+  size_t string_refs;
+  size_t tables;         /* Not counting table references */
+  size_t table_refs;
+  size_t string_bytes;   /* Total length of all strings */
+  size_t max_depth;      /* Deepest table nesting level, 0 if no tables */
+  size_t max_table_size; /* Most items (array values or hash pairs) */
+} lts_Stats;
+
+/*
+* Checks one item: scalar value or a table header.
+* Fills the frame if item is a table (frame type is zero otherwise).
+* Sets *is_bad_key if value may not be a table key (that is, nil or NaN).
+*/
+static int ltsLS_checkitem(
+    lts_LoadState * ls,
+    lts_Limits * limits,
+    lts_Frame * frame,
+    unsigned char * type,
+    int * is_bad_key,
+    lts_Stats * stats
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+
+  frame->type = 0;
+  *is_bad_key = 0;
+
+  LUATEXTS_ENSURE(ls,
+      ltsLS_good(ls) && ltsLS_unread(ls) > 0,
+      LUATEXTS_ECLIPPED, ("checkitem: clipped\n")
+    );
+
+  *type = *ls->pos;
+
+  ltsL_countvalue(ls, limits);
+
+  EAT_CHAR(ls, "checkitem");
+  EAT_NEWLINE(ls, "checkitem");
+
+  ++stats->values;
+
+  switch (*type)
+  {
+    case LUATEXTS_CNIL:
+      ++stats->nils;
+      *is_bad_key = 1;
+      break;
+
+    case LUATEXTS_CFALSE:
+    case LUATEXTS_CTRUE:
+      ++stats->booleans;
+      break;
+
+    case LUATEXTS_CNUMBER:
+      {
+        lts_Number value;
+
+        result = ltsLS_readnumber(ls, &value);
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          ++stats->numbers;
+          *is_bad_key = !value.is_integer && luai_numisnan(value.value);
+        }
+      }
+      break;
+
+    case LUATEXTS_CUINT:
+    case LUATEXTS_CUINTHEX:
+    case LUATEXTS_CUINT36:
+      {
+        LUATEXTS_UINT value;
+
+        result = (*type == LUATEXTS_CUINT)
+          ? ltsLS_readuint10(ls, &value)
+          : (*type == LUATEXTS_CUINTHEX)
+            ? ltsLS_readuint16(ls, &value)
+            : ltsLS_readuint36(ls, &value)
+          ;
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          ++stats->numbers;
+        }
+      }
+      break;
+
+    case LUATEXTS_CSTRING:
+      {
+        LUATEXTS_UINT len = 0;
+
+        result = ltsLS_readuint10(ls, &len);
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          LUATEXTS_ENSURE(ls,
+              (lua_Integer)len >= 0 && (size_t)len == len,
+              LUATEXTS_ETOOHUGE, ("checkitem: string too huge\n")
+            );
+          ltsL_checkstring(ls, limits, len);
+          LUATEXTS_ENSURE(ls,
+              ltsLS_eat(ls, (size_t)len) != NULL,
+              LUATEXTS_EBADSIZE, ("checkitem: bad string size\n")
+            );
+          result = ltsLS_eatnewline(ls);
+        }
+
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          ++stats->strings;
+          stats->string_bytes += (size_t)len;
+        }
+      }
+      break;
+
+    case LUATEXTS_CSTRINGUTF8:
+      {
+        LUATEXTS_UINT len_chars = 0;
+        const unsigned char * str = NULL;
+        size_t len_bytes = 0;
+
+        result = ltsLS_readuint10(ls, &len_chars);
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          LUATEXTS_ENSURE(ls,
+              (lua_Integer)len_chars >= 0 && (size_t)len_chars == len_chars,
+              LUATEXTS_ETOOHUGE, ("checkitem: string too huge\n")
+            );
+          ltsL_checkstring(ls, limits, len_chars);
+          result = ltsLS_eatutf8(ls, (size_t)len_chars, &str, &len_bytes);
+        }
+
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          ltsL_checkstring(ls, limits, len_bytes);
+          result = ltsLS_eatnewline(ls);
+        }
+
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          ++stats->strings;
+          stats->string_bytes += len_bytes;
+        }
+      }
+      break;
+
+    case LUATEXTS_CSTRINGREF:
+      {
+        LUATEXTS_UINT index = 0;
+
+        result = ltsLS_readuint10(ls, &index);
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          LUATEXTS_ENSURE(ls,
+              index >= 1 && index <= stats->strings,
+              LUATEXTS_EBADDATA, ("checkitem: bad string reference\n")
+            );
+          ++stats->string_refs;
+        }
+      }
+      break;
+
+    case LUATEXTS_CTABLEREF:
+      {
+        LUATEXTS_UINT index = 0;
+
+        result = ltsLS_readuint10(ls, &index);
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          LUATEXTS_ENSURE(ls,
+              index >= 1 && index <= stats->tables,
+              LUATEXTS_EBADDATA, ("checkitem: bad table reference\n")
+            );
+          ++stats->table_refs;
+        }
+      }
+      break;
+
+    case LUATEXTS_CFIXEDTABLE:
+    case LUATEXTS_CHINTEDTABLE:
+    case LUATEXTS_CSTREAMTABLE:
+      {
+        int narr = 0;
+        int nrec = 0;
+
+        result = ltsLS_readtable(ls, *type, limits, frame, &narr, &nrec);
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          ++stats->tables;
+          frame->next_index = 0; /* Counts items here */
+        }
+      }
+      break;
+
+    default:
+      ESPAM(("checkitem: unknown type char 0x%X (%d)\n", *type, *type));
+      ltsLS_close(ls);
+      result = LUATEXTS_EBADTYPE;
+      break;
+  }
+
+  return result;
+}
+
+/* Called when table is complete */
+#define ltsLS_closeframe(frame, stats) \
+  do { \
+    if ((frame)->next_index > (stats)->max_table_size) \
+    { \
+      (stats)->max_table_size = (size_t)(frame)->next_index; \
+    } \
+  } while (0)
+
+/* Checks a tuple. Nothing may throw here, frames are kept on C heap. */
+static int luatexts_validate(
+    const unsigned char * buf,
+    size_t len,
+    const lts_LoadOptions * opts,
+    lts_Stats * stats
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+  lts_LoadState ls;
+  lts_Limits limits;
+
+  LUATEXTS_UINT tuple_size = 0;
+  LUATEXTS_UINT values_left = 0;
+
+  lts_Frame stack_frames[LUATEXTS_LOAD_STACKFRAMES];
+  lts_Frame * frames = stack_frames;
+  size_t capacity = LUATEXTS_LOAD_STACKFRAMES;
+  size_t depth = 0;
+
+  memset(stats, 0, sizeof(lts_Stats));
+
+  ltsLS_init(&ls, buf, len);
+  ltsL_init(&limits, opts);
+
+  result = ltsLS_readuint10(&ls, &tuple_size);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    /* Same as in luatexts_load() */
+    if (LUATEXTS_UNLIKELY((lua_Integer)tuple_size < 0))
+    {
+      ESPAM(("validate: size does not fit to lua_Integer\n"));
+      result = LUATEXTS_ETOOHUGE;
+    }
+    else
+    {
+      result = ltsL_checktuple(&limits, tuple_size);
+    }
+  }
+
+  values_left = tuple_size;
+  while (values_left > 0 && result == LUATEXTS_ESUCCESS)
+  {
+    lts_Frame frame;
+    unsigned char type = 0;
+    int is_bad_key = 0;
+    int is_nil = 0;
+
+    result = ltsLS_checkitem(
+        &ls, &limits, &frame, &type, &is_bad_key, stats
+      );
+    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+    {
+      break;
+    }
+
+    if (frame.type != 0)
+    {
+      if (LUATEXTS_UNLIKELY(depth >= opts->max_depth))
+      {
+        ESPAM(("validate: nesting too deep\n"));
+        result = LUATEXTS_ETOODEEP;
+        break;
+      }
+
+      if (depth + 1 > stats->max_depth)
+      {
+        stats->max_depth = depth + 1;
+      }
+
+      if (frame.array_left > 0 || frame.hash_left > 0 ||
+          frame.type == LUATEXTS_CSTREAMTABLE)
+      {
+        if (LUATEXTS_UNLIKELY(depth == capacity))
+        {
+          result = lts_growframes(&frames, stack_frames, &capacity);
+          if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+          {
+            break;
+          }
+        }
+
+        frames[depth++] = frame;
+        continue; /* Check table contents */
+      }
+    }
+
+    /* A value is checked, close tables that are complete */
+    is_nil = (frame.type == 0 && type == LUATEXTS_CNIL);
+    while (depth > 0)
+    {
+      lts_Frame * top = &frames[depth - 1];
+      int is_end = 0;
+
+      if (top->type == LUATEXTS_CFIXEDTABLE && top->array_left > 0)
+      {
+        --top->array_left;
+        ++top->next_index;
+      }
+      else if (top->expect_value)
+      {
+        top->expect_value = 0;
+        ++top->next_index;
+        if (top->type == LUATEXTS_CFIXEDTABLE)
+        {
+          --top->hash_left;
+        }
+      }
+      else if (top->type == LUATEXTS_CSTREAMTABLE && is_nil)
+      {
+        /* End of stream table, terminating nil is not a value */
+        --stats->values;
+        --stats->nils;
+        is_end = 1;
+      }
+      else if (LUATEXTS_UNLIKELY(is_bad_key))
+      {
+        ESPAM(("validate: key is nil or nan\n"));
+        result = LUATEXTS_EBADDATA;
+        break;
+      }
+      else
+      {
+        top->expect_value = 1;
+        break; /* Wait for value */
+      }
+
+      if (
+          (top->type == LUATEXTS_CSTREAMTABLE)
+            ? !is_end
+            : (top->array_left > 0 || top->hash_left > 0)
+        )
+      {
+        break; /* Wait for more values */
+      }
+
+      ltsLS_closeframe(top, stats);
+      --depth; /* Table is complete, it is a value for enclosing table */
+      is_nil = 0;
+      is_bad_key = 0;
+    }
+
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS) && depth == 0)
+    {
+      --values_left;
+    }
+  }
+
+  if (frames != stack_frames)
+  {
+    free(frames);
+  }
+
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    stats->tuple_size = (size_t)tuple_size;
+  }
+
+  return result;
+}
+
+#undef ltsLS_closeframe
+
+static int lvalidate(lua_State * L)
+{
+  size_t len = 0;
+  const unsigned char * buf = (const unsigned char *)luaL_checklstring(
+      L, 1, &len
+    );
+  int result = LUATEXTS_ESUCCESS;
+  lts_LoadOptions opts;
+  lts_Stats stats;
+
+  load_options(L, 2, &opts);
+
+  result = luatexts_validate(buf, len, &opts, &stats);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    luaL_checkstack(L, 1, "lvalidate-err");
+    lua_pushnil(L);
+    push_load_error(L, result);
+    return 2;
+  }
+
+  luaL_checkstack(L, 3, "lvalidate");
+  lua_pushboolean(L, 1);
+  lua_createtable(L, 0, 12);
+
+#define LTS_SETSTAT(name) \
+  lts_pushuint(L, (LUATEXTS_UINT)stats.name); \
+  lua_setfield(L, -2, #name);
+
+  LTS_SETSTAT(tuple_size);
+  LTS_SETSTAT(values);
+  LTS_SETSTAT(nils);
+  LTS_SETSTAT(booleans);
+  LTS_SETSTAT(numbers);
+  LTS_SETSTAT(strings);
+  LTS_SETSTAT(string_refs);
+  LTS_SETSTAT(tables);
+  LTS_SETSTAT(table_refs);
+  LTS_SETSTAT(string_bytes);
+  LTS_SETSTAT(max_depth);
+  LTS_SETSTAT(max_table_size);
+
+#undef LTS_SETSTAT
+
+  return 2;
+}
+
+/*
+* Push decoder
+*
+* Same format as luatexts_load(), but data is given in chunks,
+* and decoding state survives chunk boundaries.
+*
+* Nesting is handled with an explicit heap-allocated frame stack,
+* values being built are kept on the Lua stack while decoding a chunk,
+* and are moved to the spill table between the chunks.
+*/
+
+#define LUATEXTS_DECODER_MT "luatexts.Decoder"
+
+/* Not an error: decoder needs more data to continue */
+#define LUATEXTS_EAGAIN (15)
+
+/*
+* Maximum length of a partial line the decoder is willing to accumulate
+* (numbers and sizes only, string data is not limited by this).
+*/
+#define LUATEXTS_DECODER_MAXLINE (1024)
+
+/* Decoder states */
+#define LTSD_TUPLESIZE (0)  /* Reading tuple size line */
+#define LTSD_TYPE      (1)  /* Reading value type character */
+#define LTSD_TYPEEOL   (2)  /* Reading newline after value type */
+#define LTSD_NUMBER    (3)  /* Reading N value line */
+#define LTSD_UINT      (4)  /* Reading U, H or Z value line */
+#define LTSD_STRSIZE   (5)  /* Reading S size line */
+#define LTSD_STRDATA   (6)  /* Reading S data */
+#define LTSD_U8SIZE    (7)  /* Reading 8 size line */
+#define LTSD_U8DATA    (8)  /* Reading 8 data */
+#define LTSD_STREOL    (9)  /* Reading newline after string data */
+#define LTSD_ARRAYSIZE (10) /* Reading T array size (or p hint) line */
+#define LTSD_HASHSIZE  (11) /* Reading T hash size (or p hint) line */
+#define LTSD_STRREF    (12) /* Reading s value line */
+#define LTSD_TABLEREF  (13) /* Reading r value line */
+#define LTSD_DONE      (14) /* Tuple is complete */
+#define LTSD_FAILED    (15) /* Decoding failed, see status */
+
+typedef struct lts_Decoder
+{
+  int state;
+  int status;       /* Error code if state is LTSD_FAILED */
+  int busy;         /* Set while feed() is running */
+  int cr;           /* Set if '\r' was eaten while reading newline */
+  unsigned char type;
+
+  lts_LoadOptions opts;
+  lts_Limits limits; /* Per tuple */
+
+  LUATEXTS_UINT tuple_left;
+  LUATEXTS_UINT tuple_size;
+  LUATEXTS_UINT array_size;
+  LUATEXTS_UINT str_left; /* Bytes (S) or characters (8) */
+
+  /* Partial line or string data */
+  unsigned char * scratch;
+  size_t scratch_len;
+  size_t scratch_capacity;
+
+  /* Partial UTF-8 character */
+  unsigned char u8[4];
+  size_t u8_len;
+
+  lts_Frame * frames;
+  size_t depth;
+  size_t frames_capacity;
+
+  /* Values on stack between feed() calls */
+  int num_values;
+  int spill_ref;
+
+  /* Strings and tables of the current tuple, for back-references */
+  int num_strings;
+  int strings_ref;
+  int num_tables;
+  int tables_ref;
+
+  /* Fed chunks not yet consumed */
+  int queue_ref;
+  int queue_head;
+  int queue_tail;
+  size_t queue_offset;
+} lts_Decoder;
+
+static int ltsD_reserve(lts_Decoder * d, size_t len)
+{
+  if (d->scratch_capacity - d->scratch_len < len)
+  {
+    size_t capacity = (d->scratch_capacity < 64) ? 64 : d->scratch_capacity;
+    unsigned char * scratch = NULL;
+
+    while (capacity - d->scratch_len < len)
+    {
+      if (capacity * 2 < capacity) /* Overflow */
+      {
+        return LUATEXTS_ENOMEM;
+      }
+      capacity *= 2;
+    }
+
+    scratch = (unsigned char *)realloc(d->scratch, capacity);
+    if (scratch == NULL)
+    {
+      return LUATEXTS_ENOMEM;
+    }
+
+    d->scratch = scratch;
+    d->scratch_capacity = capacity;
+  }
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/* Moves len bytes from ls to scratch buffer */
+static int ltsD_stash(lts_Decoder * d, lts_LoadState * ls, size_t len)
+{
+  int result = LUATEXTS_ESUCCESS;
+
+  /* Buffers may be NULL when empty, memcpy() must not see them */
+  if (len == 0)
+  {
+    return LUATEXTS_ESUCCESS;
+  }
+
+  result = ltsD_reserve(d, len);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    return result;
+  }
+
+  memcpy(d->scratch + d->scratch_len, ls->pos, len);
+  d->scratch_len += len;
+  ltsLS_eat(ls, len);
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Makes a complete line (with newline) available in line state.
+* Line is taken from ls directly if possible, otherwise it is assembled
+* in scratch buffer (and stays valid until scratch buffer is touched).
+* Returns LUATEXTS_EAGAIN if line is not complete yet.
+*/
+static int ltsD_getline(
+    lts_Decoder * d,
+    lts_LoadState * ls,
+    lts_LoadState * line
+  )
+{
+  const unsigned char * nl = lts_findnl(ls->pos, ltsLS_unread(ls));
+  size_t len = (nl != NULL) ? (size_t)(nl - ls->pos + 1) : ltsLS_unread(ls);
+  int result = LUATEXTS_ESUCCESS;
+
+  if (LUATEXTS_LIKELY(d->scratch_len == 0 && nl != NULL))
+  {
+    ltsLS_init(line, ls->pos, len);
+    ltsLS_eat(ls, len);
+    return LUATEXTS_ESUCCESS;
+  }
+
+  if (LUATEXTS_UNLIKELY(d->scratch_len + len > LUATEXTS_DECODER_MAXLINE))
+  {
+    ESPAM(("decoder getline: line too long\n"));
+    return LUATEXTS_ETOOHUGE;
+  }
+
+  result = ltsD_stash(d, ls, len);
+  if (result != LUATEXTS_ESUCCESS)
+  {
+    return result;
+  }
+
+  if (nl == NULL)
+  {
+    return LUATEXTS_EAGAIN;
+  }
+
+  ltsLS_init(line, d->scratch, d->scratch_len);
+  d->scratch_len = 0;
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/* Eats newline, possibly split between chunks */
+static int ltsD_eateol(lts_Decoder * d, lts_LoadState * ls)
+{
+  if (!d->cr && *ls->pos == '\r')
+  {
+    d->cr = 1;
+    ltsLS_eat(ls, 1);
+    if (ltsLS_unread(ls) == 0)
+    {
+      return LUATEXTS_EAGAIN;
+    }
+  }
+
+  if (LUATEXTS_UNLIKELY(*ls->pos != '\n'))
+  {
+    ESPAM(("decoder eateol: garbage\n"));
+    return LUATEXTS_EGARBAGE;
+  }
+
+  ltsLS_eat(ls, 1);
+  d->cr = 0;
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Eats UTF-8 characters while they are available.
+* Partial character at the end of data is kept in d->u8.
+* Eaten bytes are appended to the scratch buffer.
+*/
+static int ltsD_eatutf8(lts_Decoder * d, lts_LoadState * ls)
+{
+  const unsigned char * origin = NULL;
+  size_t num_bytes = 0;
+  int result = LUATEXTS_ESUCCESS;
+
+  /* Complete the partial character first */
+  if (d->u8_len > 0)
+  {
+    size_t exp_len = (size_t)utf8_char_len[d->u8[0]];
+    size_t len = exp_len - d->u8_len;
+    lts_LoadState u8ls;
+
+    if (len > ltsLS_unread(ls))
+    {
+      len = ltsLS_unread(ls);
+    }
+
+    if (len > 0)
+    {
+      memcpy(d->u8 + d->u8_len, ls->pos, len);
+      d->u8_len += len;
+      ltsLS_eat(ls, len);
+    }
+
+    if (d->u8_len < exp_len)
+    {
+      return LUATEXTS_EAGAIN;
+    }
+
+    ltsLS_init(&u8ls, d->u8, d->u8_len);
+    result = ltsLS_eatutf8char(&u8ls, &num_bytes);
+    if (result != LUATEXTS_ESUCCESS)
+    {
+      return result;
+    }
+
+    result = ltsD_reserve(d, d->u8_len);
+    if (result != LUATEXTS_ESUCCESS)
+    {
+      return result;
+    }
+
+    memcpy(d->scratch + d->scratch_len, d->u8, d->u8_len);
+    d->scratch_len += d->u8_len;
+    d->u8_len = 0;
+    --d->str_left;
+  }
+
+  origin = ls->pos;
+  d->str_left -= ltsLS_eatutf8blocks(ls, d->str_left);
+  num_bytes = ls->pos - origin;
+
+  while (d->str_left > 0 && ltsLS_unread(ls) > 0)
+  {
+    lts_LoadState cur = *ls;
+    result = ltsLS_eatutf8char(&cur, &num_bytes);
+    if (result == LUATEXTS_ECLIPPED)
+    {
+      break; /* Partial character, handled below */
+    }
+    else if (result != LUATEXTS_ESUCCESS)
+    {
+      return result;
+    }
+
+    *ls = cur;
+    --d->str_left;
+  }
+
+  result = ltsD_reserve(d, num_bytes);
+  if (result != LUATEXTS_ESUCCESS)
+  {
+    return result;
+  }
+
+  if (num_bytes > 0)
+  {
+    memcpy(d->scratch + d->scratch_len, origin, num_bytes);
+    d->scratch_len += num_bytes;
+  }
+
+  if (d->str_left > 0)
+  {
+    /* Keep the partial character (if any) for the next chunk */
+    d->u8_len = ltsLS_unread(ls);
+    if (d->u8_len > 0)
+    {
+      memcpy(d->u8, ls->pos, d->u8_len);
+      ltsLS_eat(ls, d->u8_len);
+    }
+
+    return LUATEXTS_EAGAIN;
+  }
+
+  return LUATEXTS_ESUCCESS;
+}
+
+static int ltsD_pushframe(
+    lts_Decoder * d,
+    unsigned char type,
+    LUATEXTS_UINT array_size,
+    LUATEXTS_UINT hash_size
+  )
+{
+  lts_Frame * frame = NULL;
+
+  if (LUATEXTS_UNLIKELY(d->depth >= d->opts.max_depth))
+  {
+    ESPAM(("decoder: nesting too deep\n"));
+    return LUATEXTS_ETOODEEP;
+  }
+
+  if (d->depth == d->frames_capacity)
+  {
+    size_t capacity = (d->frames_capacity == 0) ? 16 : d->frames_capacity * 2;
+    lts_Frame * frames = (lts_Frame *)realloc(
+        d->frames, capacity * sizeof(lts_Frame)
+      );
+    if (frames == NULL)
+    {
+      return LUATEXTS_ENOMEM;
+    }
+
+    d->frames = frames;
+    d->frames_capacity = capacity;
+  }
+
+  frame = &d->frames[d->depth++];
+  frame->type = type;
+  frame->expect_value = 0;
+  frame->array_left = array_size;
+  frame->hash_left = hash_size;
+  frame->next_index = 1;
+  frame->presize = 0;
+  frame->items = 0;
+  frame->start = NULL;
+  frame->hashed = NULL;
+  frame->hash = 0;
+  frame->number = 0;
+  frame->select = 0;
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/* Called when value is pushed to the stack */
+static int ltsD_complete(lua_State * L, lts_Decoder * d)
+{
+  int result = ltsF_complete(L, d->frames, &d->depth, NULL, NULL);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    return result;
+  }
+
+  if (d->depth == 0)
+  {
+    ++d->num_values;
+    if (--d->tuple_left == 0)
+    {
+      d->state = LTSD_DONE;
+      return LUATEXTS_ESUCCESS;
+    }
+  }
+
+  d->state = LTSD_TYPE;
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/* Records string on top of the stack, so it may be referenced */
+static void ltsD_addstring(lua_State * L, lts_Decoder * d)
+{
+  if (d->num_strings < INT_MAX)
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, d->strings_ref);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, ++d->num_strings);
+    lua_pop(L, 1);
+  }
+}
+
+/* Records table on top of the stack, so it may be referenced */
+static void ltsD_addtable(lua_State * L, lts_Decoder * d)
+{
+  if (d->num_tables < INT_MAX)
+  {
+    lua_rawgeti(L, LUA_REGISTRYINDEX, d->tables_ref);
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, ++d->num_tables);
+    lua_pop(L, 1);
+  }
+}
+
+#define LTSD_CHECKSTACK(L, n) \
+  do { \
+    if (LUATEXTS_UNLIKELY(!lua_checkstack((L), (n)))) \
+    { \
+      ESPAM(("decoder: stack overflow\n")); \
+      return LUATEXTS_ETOOHUGE; \
+    } \
+  } while (0)
+
+/* Pushes fixed table with sizes read and completes it if it is empty */
+static int ltsD_fixedtable(
+    lua_State * L,
+    lts_Decoder * d,
+    lts_LoadState * ls,
+    LUATEXTS_UINT hash_size
+  )
+{
+  LUATEXTS_UINT array_size = d->array_size;
+  int result = LUATEXTS_ESUCCESS;
+
+  /* Limits go first, as in ltsLS_readtable() */
+  result = ltsL_checktable(&d->limits, array_size, hash_size);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    return result;
+  }
+
+  if (LUATEXTS_UNLIKELY(
+      !(
+        array_size <= MAXASIZE &&
+        hash_size <= MAXASIZE &&
+        (hash_size == 0 || ceillog2((unsigned int)hash_size) <= MAXBITS)
+      )
+    ))
+  {
+    ESPAM(("decoder: table too huge\n"));
+    return LUATEXTS_ETOOHUGE;
+  }
+
+  LTSD_CHECKSTACK(L, 3);
+
+  /*
+  * We do not know how much data is there yet,
+  * so do not preallocate more than the current chunk may hold.
+  */
+  lua_createtable(
+      L,
+      (array_size <= ltsLS_unread(ls)) ? array_size : ltsLS_unread(ls),
+      (hash_size <= ltsLS_unread(ls) / 2) ? hash_size : ltsLS_unread(ls) / 2
+    );
+  ltsD_addtable(L, d);
+
+  if (array_size == 0 && hash_size == 0)
+  {
+    if (LUATEXTS_UNLIKELY(d->depth >= d->opts.max_depth))
+    {
+      ESPAM(("decoder: nesting too deep\n"));
+      return LUATEXTS_ETOODEEP;
+    }
+
+    return ltsD_complete(L, d);
+  }
+
+  result = ltsD_pushframe(d, LUATEXTS_CFIXEDTABLE, array_size, hash_size);
+  if (result == LUATEXTS_ESUCCESS)
+  {
+    d->state = LTSD_TYPE;
+  }
+
+  return result;
+}
+
+/* Called when both size hints of p table are read */
+static int ltsD_hintedtable(
+    lua_State * L,
+    lts_Decoder * d,
+    lts_LoadState * ls,
+    LUATEXTS_UINT hash_hint
+  )
+{
+  int result = LUATEXTS_ESUCCESS;
+
+  LTSD_CHECKSTACK(L, 3);
+
+  result = ltsD_pushframe(d, LUATEXTS_CSTREAMTABLE, 0, 0);
+  if (result == LUATEXTS_ESUCCESS)
+  {
+    /* Same as for T, do not trust hints beyond the current chunk */
+    lua_createtable(
+        L,
+        lts_sizehint(
+            d->array_size, d->opts.max_array_size, ltsLS_unread(ls)
+          ),
+        lts_sizehint(hash_hint, d->opts.max_hash_size, ltsLS_unread(ls))
+      );
+    ltsD_addtable(L, d);
+    d->state = LTSD_TYPE;
+  }
+
+  return result;
+}
+
+/* Dispatches on value type after its newline is eaten */
+static int ltsD_value(lua_State * L, lts_Decoder * d)
+{
+  LTSD_CHECKSTACK(L, 3);
+
+  if (LUATEXTS_UNLIKELY(d->limits.values_left == 0))
+  {
+    ESPAM(("decoder: too many values\n"));
+    return LUATEXTS_ELIMIT;
+  }
+  --d->limits.values_left;
+
+  switch (d->type)
+  {
+    case LUATEXTS_CNIL:
+      lua_pushnil(L);
+      return ltsD_complete(L, d);
+
+    case LUATEXTS_CFALSE:
+      lua_pushboolean(L, 0);
+      return ltsD_complete(L, d);
+
+    case LUATEXTS_CTRUE:
+      lua_pushboolean(L, 1);
+      return ltsD_complete(L, d);
+
+    case LUATEXTS_CNUMBER:
+      d->state = LTSD_NUMBER;
+      return LUATEXTS_ESUCCESS;
+
+    case LUATEXTS_CUINT:
+    case LUATEXTS_CUINTHEX:
+    case LUATEXTS_CUINT36:
+      d->state = LTSD_UINT;
+      return LUATEXTS_ESUCCESS;
+
+    case LUATEXTS_CSTRING:
+      d->state = LTSD_STRSIZE;
+      return LUATEXTS_ESUCCESS;
+
+    case LUATEXTS_CSTRINGUTF8:
+      d->state = LTSD_U8SIZE;
+      return LUATEXTS_ESUCCESS;
+
+    case LUATEXTS_CSTRINGREF:
+      d->state = LTSD_STRREF;
+      return LUATEXTS_ESUCCESS;
+
+    case LUATEXTS_CTABLEREF:
+      d->state = LTSD_TABLEREF;
+      return LUATEXTS_ESUCCESS;
+
+    case LUATEXTS_CFIXEDTABLE:
+    case LUATEXTS_CHINTEDTABLE:
+      d->state = LTSD_ARRAYSIZE;
+      return LUATEXTS_ESUCCESS;
+
+    case LUATEXTS_CSTREAMTABLE:
+      {
+        int result = ltsD_pushframe(d, LUATEXTS_CSTREAMTABLE, 0, 0);
+        if (result == LUATEXTS_ESUCCESS)
+        {
+          lua_newtable(L);
+          ltsD_addtable(L, d);
+          d->state = LTSD_TYPE;
+        }
+        return result;
+      }
+
+    default:
+      ESPAM(("decoder: unknown type char 0x%X (%d)\n", d->type, d->type));
+      return LUATEXTS_EBADTYPE;
+  }
+}
+
+/*
+* Decodes data from ls until tuple is complete (LUATEXTS_ESUCCESS),
+* data is exhausted (LUATEXTS_EAGAIN), or error.
+*/
+static int ltsD_run(lua_State * L, lts_Decoder * d, lts_LoadState * ls)
+{
+  int result = LUATEXTS_ESUCCESS;
+
+  while (d->state != LTSD_DONE)
+  {
+    lts_LoadState line;
+    LUATEXTS_UINT value = 0;
+
+    if (!ltsLS_good(ls) || ltsLS_unread(ls) == 0)
+    {
+      return LUATEXTS_EAGAIN;
+    }
+
+    switch (d->state)
+    {
+      case LTSD_TYPE:
+        /* Fast path: whole type line is in the chunk */
+        if (ltsLS_unread(ls) >= 2 && ls->pos[1] == '\n')
+        {
+          d->type = ls->pos[0];
+          ltsLS_eat(ls, 2);
+          result = ltsD_value(L, d);
+        }
+        else
+        {
+          d->type = ls->pos[0];
+          ltsLS_eat(ls, 1);
+          d->state = LTSD_TYPEEOL;
+        }
+        break;
+
+      case LTSD_TYPEEOL:
+        result = ltsD_eateol(d, ls);
+        if (result == LUATEXTS_ESUCCESS)
+        {
+          result = ltsD_value(L, d);
+        }
+        break;
+
+      case LTSD_TUPLESIZE:
+      case LTSD_UINT:
+      case LTSD_STRSIZE:
+      case LTSD_U8SIZE:
+      case LTSD_ARRAYSIZE:
+      case LTSD_HASHSIZE:
+      case LTSD_STRREF:
+      case LTSD_TABLEREF:
+        result = ltsD_getline(d, ls, &line);
+        if (result != LUATEXTS_ESUCCESS)
+        {
+          break;
+        }
+
+        if (d->state == LTSD_UINT && d->type == LUATEXTS_CUINTHEX)
+        {
+          result = ltsLS_readuint16(&line, &value);
+        }
+        else if (d->state == LTSD_UINT && d->type == LUATEXTS_CUINT36)
+        {
+          result = ltsLS_readuint36(&line, &value);
+        }
+        else
+        {
+          result = ltsLS_readuint10(&line, &value);
+        }
+
+        if (result != LUATEXTS_ESUCCESS)
+        {
+          break;
+        }
+
+        switch (d->state)
+        {
+          case LTSD_TUPLESIZE:
+            if (LUATEXTS_UNLIKELY((lua_Integer)value < 0))
+            {
+              ESPAM(("decoder: tuple size does not fit to lua_Integer\n"));
+              result = LUATEXTS_ETOOHUGE;
+              break;
+            }
+            result = ltsL_checktuple(&d->limits, value);
+            if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+            {
+              break;
+            }
+            d->tuple_size = d->tuple_left = value;
+            d->state = (value == 0) ? LTSD_DONE : LTSD_TYPE;
+            break;
+
+          case LTSD_UINT:
+            lts_pushuint(L, value);
+            result = ltsD_complete(L, d);
+            break;
+
+          case LTSD_STRSIZE:
+          case LTSD_U8SIZE:
+            if (
+                LUATEXTS_UNLIKELY(
+                    (lua_Integer)value < 0 || (size_t)value != value
+                  )
+              )
+            {
+              ESPAM(("decoder: string size does not fit to lua_Integer\n"));
+              result = LUATEXTS_ETOOHUGE;
+              break;
+            }
+            /* For 8 this is in characters, bytes are checked at the end */
+            if (LUATEXTS_UNLIKELY(value > d->opts.max_string_length))
+            {
+              ESPAM(("decoder: string too long\n"));
+              result = LUATEXTS_ELIMIT;
+              break;
+            }
+            d->str_left = value;
+            d->state = (d->state == LTSD_STRSIZE) ? LTSD_STRDATA : LTSD_U8DATA;
+            break;
+
+          case LTSD_ARRAYSIZE:
+            d->array_size = value;
+            d->state = LTSD_HASHSIZE;
+            break;
+
+          case LTSD_HASHSIZE:
+            result = (d->type == LUATEXTS_CHINTEDTABLE)
+              ? ltsD_hintedtable(L, d, ls, value)
+              : ltsD_fixedtable(L, d, ls, value)
+              ;
+            break;
+
+          case LTSD_STRREF:
+            if (
+                LUATEXTS_UNLIKELY(
+                    value < 1 || value > (LUATEXTS_UINT)d->num_strings
+                  )
+              )
+            {
+              ESPAM(("decoder: bad string reference\n"));
+              result = LUATEXTS_EBADDATA;
+              break;
+            }
+            lua_rawgeti(L, LUA_REGISTRYINDEX, d->strings_ref);
+            lua_rawgeti(L, -1, (int)value);
+            lua_remove(L, -2);
+            result = ltsD_complete(L, d);
+            break;
+
+          case LTSD_TABLEREF:
+            if (
+                LUATEXTS_UNLIKELY(
+                    value < 1 || value > (LUATEXTS_UINT)d->num_tables
+                  )
+              )
+            {
+              ESPAM(("decoder: bad table reference\n"));
+              result = LUATEXTS_EBADDATA;
+              break;
+            }
+            lua_rawgeti(L, LUA_REGISTRYINDEX, d->tables_ref);
+            lua_rawgeti(L, -1, (int)value);
+            lua_remove(L, -2);
+            result = ltsD_complete(L, d);
+            break;
+
+          default: /* Should not happen */
+            result = LUATEXTS_EFAILURE;
+            break;
+        }
+        break;
+
+      case LTSD_NUMBER:
+        result = ltsD_getline(d, ls, &line);
+        if (result == LUATEXTS_ESUCCESS)
+        {
+          lts_Number number;
+          result = ltsLS_readnumber(&line, &number);
+          if (result == LUATEXTS_ESUCCESS)
+          {
+            lts_pushnumber(L, &number);
+            result = ltsD_complete(L, d);
+          }
+        }
+        break;
+
+      case LTSD_STRDATA:
+        /* Fast path: whole string with newline is in the chunk */
+        if (
+            d->scratch_len == 0 &&
+            ltsLS_unread(ls) > d->str_left &&
+            ls->pos[d->str_left] == '\n'
+          )
+        {
+          lua_pushlstring(L, (const char *)ls->pos, d->str_left);
+          ltsD_addstring(L, d);
+          ltsLS_eat(ls, d->str_left + 1);
+          result = ltsD_complete(L, d);
+        }
+        else
+        {
+          size_t len = (ltsLS_unread(ls) < d->str_left)
+            ? ltsLS_unread(ls)
+            : d->str_left
+            ;
+          result = ltsD_stash(d, ls, len);
+          d->str_left -= len;
+          if (result == LUATEXTS_ESUCCESS && d->str_left == 0)
+          {
+            d->state = LTSD_STREOL;
+          }
+        }
+        break;
+
+      case LTSD_U8DATA:
+        result = ltsD_eatutf8(d, ls);
+        if (result == LUATEXTS_ESUCCESS)
+        {
+          d->state = LTSD_STREOL;
+        }
+        break;
+
+      case LTSD_STREOL:
+        result = ltsD_eateol(d, ls);
+        if (
+            result == LUATEXTS_ESUCCESS &&
+            LUATEXTS_UNLIKELY(d->scratch_len > d->opts.max_string_length)
+          )
+        {
+          ESPAM(("decoder: string too long\n"));
+          result = LUATEXTS_ELIMIT;
+        }
+        if (result == LUATEXTS_ESUCCESS)
+        {
+          lua_pushlstring(L, (const char *)d->scratch, d->scratch_len);
+          ltsD_addstring(L, d);
+          d->scratch_len = 0;
+          result = ltsD_complete(L, d);
+        }
+        break;
+
+      default: /* Should not happen */
+        result = LUATEXTS_EFAILURE;
+        break;
+    }
+
+    if (result != LUATEXTS_ESUCCESS)
+    {
       return result;
     }
+  }
+
+  return LUATEXTS_ESUCCESS;
+}
+
+#undef LTSD_CHECKSTACK
+
+static void ltsD_reset(lts_Decoder * d)
+{
+  d->state = LTSD_TUPLESIZE;
+  d->cr = 0;
+  d->tuple_left = 0;
+  d->tuple_size = 0;
+  d->scratch_len = 0;
+  d->u8_len = 0;
+  d->depth = 0;
+  d->num_values = 0;
+  ltsL_init(&d->limits, &d->opts);
+}
+
+static int ldecoder_gc(lua_State * L)
+{
+  lts_Decoder * d = (lts_Decoder *)luaL_checkudata(L, 1, LUATEXTS_DECODER_MT);
+
+  free(d->scratch);
+  d->scratch = NULL;
+  d->scratch_capacity = 0;
+
+  free(d->frames);
+  d->frames = NULL;
+  d->frames_capacity = 0;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, d->spill_ref);
+  d->spill_ref = LUA_NOREF;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, d->strings_ref);
+  d->strings_ref = LUA_NOREF;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, d->tables_ref);
+  d->tables_ref = LUA_NOREF;
+
+  luaL_unref(L, LUA_REGISTRYINDEX, d->queue_ref);
+  d->queue_ref = LUA_NOREF;
+
+  d->state = LTSD_FAILED;
+  d->status = LUATEXTS_EFAILURE;
+
+  return 0;
+}
+
+/*
+* Returns "more" if it needs more data,
+* true and a tuple if it is complete, or nil and error message.
+* Call without chunk to continue decoding data left from previous calls.
+*/
+static int ldecoder_feed(lua_State * L)
+{
+  lts_Decoder * d = (lts_Decoder *)luaL_checkudata(L, 1, LUATEXTS_DECODER_MT);
+  int result = LUATEXTS_EAGAIN;
+  int i = 0;
+
+  if (!lua_isnoneornil(L, 2))
+  {
+    luaL_checkstring(L, 2);
+  }
+  lua_settop(L, 2);
+
+  if (LUATEXTS_UNLIKELY(d->busy))
+  {
+    /* Previous call was interrupted by Lua error */
+    d->state = LTSD_FAILED;
+    d->status = LUATEXTS_EFAILURE;
+    d->busy = 0;
+  }
+
+  if (LUATEXTS_UNLIKELY(d->state == LTSD_FAILED))
+  {
+    lua_pushnil(L);
+    push_load_error(L, d->status);
+    return 2;
+  }
+
+  luaL_checkstack(L, d->num_values + 3, "decoder-feed");
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, d->queue_ref); /* Index 3 */
+  lua_rawgeti(L, LUA_REGISTRYINDEX, d->spill_ref); /* Index 4 */
+  lua_pushboolean(L, 1); /* Index 5 */
+
+  if (lua_type(L, 2) == LUA_TSTRING && lua_objlen(L, 2) > 0)
+  {
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, 3, ++d->queue_tail);
+  }
+
+  d->busy = 1;
+
+  /* Restore values from previous chunks */
+  for (i = 1; i <= d->num_values; ++i)
+  {
+    lua_rawgeti(L, 4, i);
+    lua_pushnil(L);
+    lua_rawseti(L, 4, i);
+  }
+
+  while (d->queue_head <= d->queue_tail)
+  {
+    lts_LoadState ls;
+    size_t len = 0;
+    const unsigned char * chunk = NULL;
+
+    /* Chunk stays referenced by the queue while we use it */
+    lua_rawgeti(L, 3, d->queue_head);
+    chunk = (const unsigned char *)lua_tolstring(L, -1, &len);
+    lua_pop(L, 1);
+
+    ltsLS_init(&ls, chunk + d->queue_offset, len - d->queue_offset);
+    result = ltsD_run(L, d, &ls);
+
+    if (result == LUATEXTS_ESUCCESS && ltsLS_unread(&ls) > 0)
+    {
+      d->queue_offset = len - ltsLS_unread(&ls);
+      break;
+    }
+
+    /* Chunk is consumed */
+    lua_pushnil(L);
+    lua_rawseti(L, 3, d->queue_head++);
+    d->queue_offset = 0;
+
+    if (result != LUATEXTS_EAGAIN)
+    {
+      break;
+    }
+  }
+
+  d->busy = 0;
+
+  if (result == LUATEXTS_EAGAIN)
+  {
+    /* Store values until the next call */
+    d->num_values = lua_gettop(L) - 5;
+    for (i = d->num_values; i > 0; --i)
+    {
+      lua_rawseti(L, 4, i);
+    }
+
+    lua_pushliteral(L, "more");
+    return 1;
+  }
+
+  if (result != LUATEXTS_ESUCCESS)
+  {
+    XESPAM(("decoder: error %d\n", result));
+
+    d->state = LTSD_FAILED;
+    d->status = result;
+
+    /* Drop data we don't need anymore */
+    lua_settop(L, 2);
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, d->queue_ref);
+    d->queue_head = 1;
+    d->queue_tail = 0;
+    d->queue_offset = 0;
+
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, d->strings_ref);
+    d->num_strings = 0;
+
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, d->tables_ref);
+    d->num_tables = 0;
+
+    lua_pushnil(L);
+    push_load_error(L, result);
+    return 2;
+  }
+
+  /* Tuple complete, get ready for the next one */
+  ltsD_reset(d);
+
+  if (d->num_strings > 0)
+  {
+    luaL_checkstack(L, 1, "decoder-feed");
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, d->strings_ref);
+    d->num_strings = 0;
+  }
+
+  if (d->num_tables > 0)
+  {
+    luaL_checkstack(L, 1, "decoder-feed");
+    lua_newtable(L);
+    lua_rawseti(L, LUA_REGISTRYINDEX, d->tables_ref);
+    d->num_tables = 0;
+  }
+
+  return lua_gettop(L) - 4;
+}
+
+static int ldecoder(lua_State * L)
+{
+  lts_Decoder * d = NULL;
+  lts_LoadOptions opts;
+
+  load_options(L, 1, &opts);
+
+  luaL_checkstack(L, 2, "decoder");
+
+  d = (lts_Decoder *)lua_newuserdata(L, sizeof(lts_Decoder));
+  d->opts = opts;
+  d->status = LUATEXTS_ESUCCESS;
+  d->busy = 0;
+  d->scratch = NULL;
+  d->scratch_capacity = 0;
+  d->frames = NULL;
+  d->frames_capacity = 0;
+  d->spill_ref = LUA_NOREF;
+  d->num_strings = 0;
+  d->strings_ref = LUA_NOREF;
+  d->num_tables = 0;
+  d->tables_ref = LUA_NOREF;
+  d->queue_ref = LUA_NOREF;
+  d->queue_head = 1;
+  d->queue_tail = 0;
+  d->queue_offset = 0;
+  ltsD_reset(d);
+
+  luaL_getmetatable(L, LUATEXTS_DECODER_MT);
+  lua_setmetatable(L, -2);
+
+  lua_newtable(L);
+  d->spill_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  lua_newtable(L);
+  d->queue_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  lua_newtable(L);
+  d->strings_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  lua_newtable(L);
+  d->tables_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  return 1;
+}
+
+static const luaL_Reg Decoder[] =
+{
+  { "feed", ldecoder_feed },
+
+  { NULL, NULL }
+};
+
+/*
+* Saving
+*/
+
+#define LUATEXTS_SAVESTATE_MT "luatexts.SaveState"
+
+#define LUATEXTS_SAVE_MINBUFSIZE (4096)
+
+/* Size of fixed buffer used when saving to a file */
+#define LUATEXTS_SAVE_STREAMBUFSIZE (65536)
+
+/*
+* Limit on table nesting depth while saving, tables are saved recursively.
+* Same as the loader default, so whatever is saved loads with default options.
+*/
+#define LUATEXTS_SAVE_MAXDEPTH (LUATEXTS_DEFAULT_MAXDEPTH)
+
+struct lts_SaveState;
+
+/*
+* Writes out all buffered data, followed by extra_len bytes from extra.
+* Returns LUATEXTS_ESUCCESS or LUATEXTS_EIO (setting ss->error to errno).
+*/
+typedef int (*lts_FlushFn)(
+    struct lts_SaveState * ss,
+    const unsigned char * extra,
+    size_t extra_len
+  );
+
+/*
+* Note that we do not use luaL_Buffer here: it requires balanced stack usage
+* between buffer operations, and we have to keep table iteration state
+* on the stack while writing.
+*
+* Instead the state lives in a userdata, so the buffer is collected
+* even if Lua error is thrown in the middle of the save.
+*/
+typedef struct lts_SaveState
+{
+  unsigned char * buf;
+  size_t len;
+  size_t capacity;
+
+  /*
+  * If flush is not NULL, the buffer is of fixed size,
+  * and is flushed to fd or fp when full.
+  */
+  lts_FlushFn flush;
+  int fd;
+  int own_fd; /* If set, fd is closed on GC */
+  FILE * fp;
+  int error;  /* errno value for LUATEXTS_EIO */
+
+  /* If set, tables are saved as streaming-friendly tables */
+  int stream_tables;
+  int size_hints; /* If set, streaming tables carry size hints */
+
+  size_t depth; /* Tables being saved */
+} lts_SaveState;
+
+static void ltsSS_release(lts_SaveState * ss)
+{
+  free(ss->buf);
+  ss->buf = NULL;
+  ss->len = 0;
+  ss->capacity = 0;
+
+  if (ss->own_fd)
+  {
+    close(ss->fd);
+    ss->own_fd = 0;
+    ss->fd = -1;
+  }
+}
+
+static int ltsSS_gc(lua_State * L)
+{
+  lts_SaveState * ss = (lts_SaveState *)luaL_checkudata(
+      L, 1, LUATEXTS_SAVESTATE_MT
+    );
+
+  ltsSS_release(ss);
+
+  return 0;
+}
+
+static lts_SaveState * ltsSS_push(lua_State * L)
+{
+  lts_SaveState * ss = NULL;
+
+  luaL_checkstack(L, 2, "ltsSS_push");
+
+  ss = (lts_SaveState *)lua_newuserdata(L, sizeof(lts_SaveState));
+  ss->buf = NULL;
+  ss->len = 0;
+  ss->capacity = 0;
+  ss->flush = NULL;
+  ss->fd = -1;
+  ss->own_fd = 0;
+  ss->fp = NULL;
+  ss->error = 0;
+  ss->stream_tables = 0;
+  ss->size_hints = 0;
+  ss->depth = 0;
+
+  luaL_getmetatable(L, LUATEXTS_SAVESTATE_MT);
+  lua_setmetatable(L, -2);
+
+  return ss;
+}
+
+static int ltsSS_flushfd(
+    lts_SaveState * ss,
+    const unsigned char * extra,
+    size_t extra_len
+  )
+{
+  struct iovec iov[2];
+  struct iovec * cur = iov;
+  int iovcnt = 0;
+
+  if (ss->len > 0)
+  {
+    iov[iovcnt].iov_base = (void *)ss->buf;
+    iov[iovcnt].iov_len = ss->len;
+    ++iovcnt;
+  }
+
+  if (extra_len > 0)
+  {
+    iov[iovcnt].iov_base = (void *)extra;
+    iov[iovcnt].iov_len = extra_len;
+    ++iovcnt;
+  }
+
+  while (iovcnt > 0)
+  {
+    ssize_t written = writev(ss->fd, cur, iovcnt);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+
+      ss->error = errno;
+      return LUATEXTS_EIO;
+    }
+
+    /* Skip what was written, handling partial writes */
+    while (iovcnt > 0 && (size_t)written >= cur->iov_len)
+    {
+      written -= cur->iov_len;
+      ++cur;
+      --iovcnt;
+    }
+
+    if (iovcnt > 0)
+    {
+      cur->iov_base = (void *)((unsigned char *)cur->iov_base + written);
+      cur->iov_len -= written;
+    }
+  }
+
+  ss->len = 0;
+
+  return LUATEXTS_ESUCCESS;
+}
+
+static int ltsSS_flushfile(
+    lts_SaveState * ss,
+    const unsigned char * extra,
+    size_t extra_len
+  )
+{
+  if (
+      (ss->len > 0 && fwrite(ss->buf, 1, ss->len, ss->fp) != ss->len) ||
+      (extra_len > 0 && fwrite(extra, 1, extra_len, ss->fp) != extra_len)
+    )
+  {
+    ss->error = errno;
+    return LUATEXTS_EIO;
+  }
+
+  ss->len = 0;
+
+  return LUATEXTS_ESUCCESS;
+}
+
+/*
+* Returns pointer to at least len bytes of free space at the end of buffer,
+* or NULL if out of memory or if flush failed (see ss->error).
+*
+* When streaming, len must not exceed LUATEXTS_SAVE_STREAMBUFSIZE.
+*/
+static unsigned char * ltsSS_reserve(lts_SaveState * ss, size_t len)
+{
+  if (LUATEXTS_UNLIKELY(ss->capacity - ss->len < len) && ss->flush != NULL)
+  {
+    if (ss->flush(ss, NULL, 0) != LUATEXTS_ESUCCESS)
+    {
+      return NULL;
+    }
+  }
+
+  if (LUATEXTS_UNLIKELY(ss->capacity - ss->len < len))
+  {
+    size_t capacity = (ss->capacity < LUATEXTS_SAVE_MINBUFSIZE)
+      ? LUATEXTS_SAVE_MINBUFSIZE
+      : ss->capacity
+      ;
+    unsigned char * buf = NULL;
+
+    while (capacity - ss->len < len)
+    {
+      if (capacity * 2 < capacity) /* Overflow */
+      {
+        return NULL;
+      }
+      capacity *= 2;
+    }
+
+    buf = (unsigned char *)realloc(ss->buf, capacity);
+    if (buf == NULL)
+    {
+      return NULL;
+    }
+
+    ss->buf = buf;
+    ss->capacity = capacity;
+  }
+
+  return ss->buf + ss->len;
+}
+
+#define ltsSS_failure(ss) \
+  (((ss)->error != 0) ? LUATEXTS_EIO : LUATEXTS_ENOMEM)
+
+static int ltsSS_write(
+    lts_SaveState * ss,
+    const unsigned char * data,
+    size_t len
+  )
+{
+  unsigned char * dest = NULL;
+
+  /*
+  * When streaming, large chunks are not copied to the buffer,
+  * but written out together with it in a single call.
+  */
+  if (ss->flush != NULL && len > ss->capacity / 2)
+  {
+    return ss->flush(ss, data, len);
+  }
+
+  dest = ltsSS_reserve(ss, len);
+  if (LUATEXTS_UNLIKELY(dest == NULL))
+  {
+    ESPAM(("ltsSS_write: out of memory or write error\n"));
+    return ltsSS_failure(ss);
+  }
 
-    /* Table key can't be nil or NaN */
-    key_type = lua_type(L, -1);
-    LUATEXTS_ENSURE(ls,
-        key_type != LUA_TNIL &&
-        !(key_type == LUA_TNUMBER && luai_numisnan(lua_tonumber(L, -1))),
-        LUATEXTS_EBADDATA, ("load_fixed_table: key is nil or nan\n")
-      );
+  memcpy(dest, data, len);
+  ss->len += len;
 
-    result = load_value(L, ls); /* Load value. */
-    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
-    {
-      ESPAM(("load_fixed_table: failed to read value\n"));
-      return result;
-    }
+  return LUATEXTS_ESUCCESS;
+}
 
-    lua_rawset(L, -3);
+/* Writes a type character and a newline. */
+static int ltsSS_writetype(lts_SaveState * ss, unsigned char type)
+{
+  unsigned char * dest = ltsSS_reserve(ss, 2);
+  if (LUATEXTS_UNLIKELY(dest == NULL))
+  {
+    ESPAM(("ltsSS_writetype: out of memory or write error\n"));
+    return ltsSS_failure(ss);
   }
 
+  dest[0] = type;
+  dest[1] = '\n';
+  ss->len += 2;
+
   return LUATEXTS_ESUCCESS;
 }
 
-/*
-* TODO: generalize with load_fixed_table.
-*/
-static int load_stream_table(lua_State * L, lts_LoadState * ls)
+/* Writes base 10 unsigned value, followed by a newline. */
+static int ltsSS_writeuint(lts_SaveState * ss, size_t value)
 {
-  lua_newtable(L);
+  /* Enough for 64-bit value and a newline */
+  unsigned char tmp[24];
+  unsigned char * cur = tmp + sizeof(tmp);
 
-  while (1) /* We're limited by buffer length */
+  *--cur = '\n';
+  do
   {
-    int key_type = LUA_TNONE;
+    *--cur = (unsigned char)('0' + value % 10);
+    value /= 10;
+  }
+  while (value != 0);
 
-    int result = load_value(L, ls); /* Load key. */
-    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  return ltsSS_write(ss, cur, tmp + sizeof(tmp) - cur);
+}
+
+/*
+* Writes number value, followed by a newline.
+* Integral values are formatted by hand, the rest goes through sprintf
+* with enough digits to survive a round trip.
+*/
+static int ltsSS_writenumber(lts_SaveState * ss, LUATEXTS_NUMBER value)
+{
+  /* 9007199254740992 is 2^53, all integers up to it are exact in double */
+  if (
+      value == value && value != 0 &&
+      value >= -9007199254740992.0 && value <= 9007199254740992.0 &&
+      value >= -(LUATEXTS_NUMBER)LONG_MAX &&
+      value <= (LUATEXTS_NUMBER)LONG_MAX &&
+      (LUATEXTS_NUMBER)(long)value == value
+    )
+  {
+    unsigned char tmp[24];
+    unsigned char * cur = tmp + sizeof(tmp);
+    long v = (long)value;
+    unsigned long u = (v < 0) ? 0UL - (unsigned long)v : (unsigned long)v;
+
+    *--cur = '\n';
+#if defined(LUATEXTS_USE_INTEGERS)
+    /* Keep float subtype on load */
+    *--cur = '0';
+    *--cur = '.';
+#endif
+    do
     {
-      ESPAM(("load_stream_table: failed to read key\n"));
-      return result;
+      *--cur = (unsigned char)('0' + u % 10);
+      u /= 10;
     }
+    while (u != 0);
 
-    /* If "key" is nil, this is the end of table (no value expected). */
-    key_type = lua_type(L, -1);
-    if (key_type == LUA_TNIL)
+    if (v < 0)
     {
-      lua_pop(L, 1); /* Pop terminating nil */
-      break;
+      *--cur = '-';
     }
 
-    LUATEXTS_ENSURE(ls,
-        !(key_type == LUA_TNUMBER && luai_numisnan(lua_tonumber(L, -1))),
-        LUATEXTS_EBADDATA, ("load_stream_table: key is nan\n")
-      );
+    return ltsSS_write(ss, cur, tmp + sizeof(tmp) - cur);
+  }
+  else
+  {
+    char tmp[64];
+    int len = sprintf(tmp, "%.17g\n", (double)value);
+
+    /*
+    * sprintf() writes the decimal point of current locale,
+    * data always has '.' (see lts_readnumber()).
+    */
+    const char * point = localeconv()->decimal_point;
+    if (LUATEXTS_UNLIKELY(point[0] != '.' || point[1] != '\0'))
+    {
+      char * pos = strstr(tmp, point);
+      if (pos != NULL && point[0] != '\0')
+      {
+        size_t point_len = strlen(point);
+        *pos = '.';
+        memmove(
+            pos + 1, pos + point_len,
+            (size_t)len - (size_t)(pos - tmp) - point_len + 1
+          );
+        len -= (int)point_len - 1;
+      }
+    }
 
-    result = load_value(L, ls); /* Load value. */
-    if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+#if defined(LUATEXTS_USE_INTEGERS)
+    /* Make sure that integral float is not loaded as integer (e.g. -0) */
+    if (tmp[strspn(tmp, "-0123456789")] == '\n')
     {
-      ESPAM(("load_stream_table: failed to read value\n"));
-      return result;
+      memcpy(tmp + len - 1, ".0\n", 3);
+      len += 2;
     }
+#endif
 
-    lua_rawset(L, -3);
+    return ltsSS_write(ss, (const unsigned char *)tmp, len);
   }
+}
 
-  return LUATEXTS_ESUCCESS;
+#if defined(LUATEXTS_USE_INTEGERS)
+
+/* Writes integer value, followed by a newline. */
+static int ltsSS_writeinteger(lts_SaveState * ss, lua_Integer value)
+{
+  /* Enough for 64-bit value, sign and a newline */
+  unsigned char tmp[24];
+  unsigned char * cur = tmp + sizeof(tmp);
+  LUATEXTS_UINT u = (value < 0)
+    ? (LUATEXTS_UINT)0 - (LUATEXTS_UINT)value
+    : (LUATEXTS_UINT)value
+    ;
+
+  *--cur = '\n';
+  do
+  {
+    *--cur = (unsigned char)('0' + u % 10);
+    u /= 10;
+  }
+  while (u != 0);
+
+  if (value < 0)
+  {
+    *--cur = '-';
+  }
+
+  return ltsSS_write(ss, cur, tmp + sizeof(tmp) - cur);
 }
 
-static int load_value(lua_State * L, lts_LoadState * ls)
+#endif /* defined(LUATEXTS_USE_INTEGERS) */
+
+static int save_value(lua_State * L, lts_SaveState * ss, int idx, int visited);
+
+/* Returns non-zero if value at idx is a key that belongs to the array part */
+static int is_array_key(lua_State * L, int idx, size_t array_size)
 {
-  size_t len = 0;
-  const unsigned char * type = NULL;
+  LUATEXTS_NUMBER k = 0;
 
-  int result = LUATEXTS_ESUCCESS;
+  if (lua_type(L, idx) != LUA_TNUMBER)
+  {
+    return 0;
+  }
 
-  if (LUATEXTS_UNLIKELY(!ltsLS_good(ls)))
+  k = lua_tonumber(L, idx);
+
+  return k >= 1 && k <= array_size && (LUATEXTS_NUMBER)(size_t)k == k;
+}
+
+/* Marks table as being saved. Fails if it is already being saved. */
+static int visit_table(lua_State * L, int idx, int visited)
+{
+  luaL_checkstack(L, 2, "visit-table");
+
+  lua_pushvalue(L, idx);
+  lua_rawget(L, visited);
+  if (LUATEXTS_UNLIKELY(lua_toboolean(L, -1)))
   {
-    ESPAM(("load_value: clipped\n"));
-    return LUATEXTS_ECLIPPED;
+    lua_pop(L, 1);
+    ESPAM(("visit_table: circular reference\n"));
+    return LUATEXTS_ECIRCULAR;
   }
+  lua_pop(L, 1);
 
-  /* Read value type */
-  type = ls->pos;
+  lua_pushvalue(L, idx);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, visited);
 
-  EAT_CHAR(ls, "ltsLS_readuint10");
+  return LUATEXTS_ESUCCESS;
+}
 
-  EAT_NEWLINE(ls, "ltsLS_readuint10");
+/* Same table may be saved again if it is not nested in itself */
+static void leave_table(lua_State * L, int idx, int visited)
+{
+  lua_pushvalue(L, idx);
+  lua_pushnil(L);
+  lua_rawset(L, visited);
+}
 
-  /* Read value data if any, and push the value to Lua state */
-  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+/*
+* Saves table as a fixed-size table.
+* Array and hash part are split the same way the luatexts.lua does it.
+*/
+static int save_table(lua_State * L, lts_SaveState * ss, int idx, int visited)
+{
+  size_t array_size = lua_objlen(L, idx);
+  size_t hash_size = 0;
+  size_t i = 0;
+
+  int result = visit_table(L, idx, visited);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
   {
-    SPAM((
-        "load_value: value type '%c' 0x%X (%d)\n",
-        isgraph(*type) ? *type : '?', *type, *type
-      ));
+    return result;
+  }
 
-    luaL_checkstack(L, 1, "load-value");
+  luaL_checkstack(L, 3, "save-table");
 
-    switch (*type)
+  /* Count hash part size (we do not want to patch output afterwards) */
+  lua_pushnil(L);
+  while (lua_next(L, idx) != 0)
+  {
+    lua_pop(L, 1); /* Pop value */
+    if (!is_array_key(L, -1, array_size))
     {
-      case LUATEXTS_CNIL:
-        lua_pushnil(L);
-        break;
+      ++hash_size;
+    }
+  }
 
-      case LUATEXTS_CFALSE:
-        lua_pushboolean(L, 0);
-        break;
+  result = ltsSS_writetype(ss, LUATEXTS_CFIXEDTABLE);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    result = ltsSS_writeuint(ss, array_size);
+  }
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    result = ltsSS_writeuint(ss, hash_size);
+  }
 
-      case LUATEXTS_CTRUE:
-        lua_pushboolean(L, 1);
-        break;
+  for (i = 0; i < array_size && result == LUATEXTS_ESUCCESS; ++i)
+  {
+    lua_rawgeti(L, idx, i + 1);
+    result = save_value(L, ss, lua_gettop(L), visited);
+    lua_pop(L, 1);
+  }
 
-      case LUATEXTS_CNUMBER:
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS) && hash_size > 0)
+  {
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0)
+    {
+      if (!is_array_key(L, -2, array_size))
+      {
+        result = save_value(L, ss, lua_gettop(L) - 1, visited); /* Key */
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
         {
-          lua_Number value;
-
-          result = ltsLS_readnumber(ls, &value);
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            lua_pushnumber(L, value);
-          }
+          result = save_value(L, ss, lua_gettop(L), visited); /* Value */
         }
-        break;
 
-      case LUATEXTS_CUINT:
+        if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
         {
-          LUATEXTS_UINT value;
-
-          result = ltsLS_readuint10(ls, &value);
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            /* TODO: Maybe do lua_pushinteger if value fits? */
-            lua_pushnumber(L, value);
-          }
+          lua_pop(L, 2); /* Pop key and value */
+          break;
         }
-        break;
+      }
 
-      case LUATEXTS_CUINTHEX:
-        {
-          LUATEXTS_UINT value;
+      lua_pop(L, 1); /* Pop value */
+    }
+  }
 
-          result = ltsLS_readuint16(ls, &value);
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            /* TODO: Maybe do lua_pushinteger if value fits? */
-            lua_pushnumber(L, value);
-          }
-        }
-        break;
+  leave_table(L, idx, visited);
 
-      case LUATEXTS_CUINT36:
-        {
-          LUATEXTS_UINT value;
+  return result;
+}
 
-          result = ltsLS_readuint36(ls, &value);
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            /* TODO: Maybe do lua_pushinteger if value fits? */
-            lua_pushnumber(L, value);
-          }
-        }
-        break;
+/*
+* Saves table as a streaming-friendly table, with size hints if ss asks
+* for them. All key-value pairs go to the single list,
+* as luatexts.lua save_cat() and save_cat_hinted() do.
+*/
+static int save_stream_table(
+    lua_State * L,
+    lts_SaveState * ss,
+    int idx,
+    int visited
+  )
+{
+  int result = visit_table(L, idx, visited);
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  {
+    return result;
+  }
 
-      case LUATEXTS_CSTRING:
-        {
-          const unsigned char * str = NULL;
+  luaL_checkstack(L, 3, "save-stream-table");
 
-          /* Read string size */
-          LUATEXTS_UINT len = 0;
-          result = ltsLS_readuint10(ls, &len);
+  if (ss->size_hints)
+  {
+    /* Hints let loader preallocate the table */
+    size_t array_hint = lua_objlen(L, idx);
+    size_t num_pairs = 0;
 
-          /* Check size */
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            /* Implementation detail */
-            if (LUATEXTS_UNLIKELY((lua_Integer)len < 0))
-            {
-              ESPAM(("string: value does not fit to lua_Integer\n"));
-              ltsLS_close(ls);
-              result = LUATEXTS_ETOOHUGE;
-            }
-          }
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0)
+    {
+      lua_pop(L, 1); /* Pop value */
+      ++num_pairs;
+    }
 
-          /* Read string data */
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            str = ltsLS_eat(ls, len);
-            if (LUATEXTS_UNLIKELY(str == NULL))
-            {
-              ESPAM(("load_value: bad string size\n"));
-              ltsLS_close(ls);
-              result = LUATEXTS_EBADSIZE;
-            }
-          }
+    result = ltsSS_writetype(ss, LUATEXTS_CHINTEDTABLE);
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+    {
+      result = ltsSS_writeuint(ss, array_hint);
+    }
+    if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+    {
+      result = ltsSS_writeuint(
+          ss, (num_pairs > array_hint) ? num_pairs - array_hint : 0
+        );
+    }
+  }
+  else
+  {
+    result = ltsSS_writetype(ss, LUATEXTS_CSTREAMTABLE);
+  }
 
-          /* Eat newline after string data */
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            size_t empty = 0;
-            const unsigned char * nl = NULL;
-            result = ltsLS_readline(ls, &nl, &empty);
-            if (
-                LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS)
-                  && LUATEXTS_UNLIKELY(empty != 0)
-              )
-            {
-              ESPAM(("load_value: string: garbage before eol\n"));
-              ltsLS_close(ls);
-              result = LUATEXTS_EGARBAGE;
-            }
-          }
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0)
+    {
+      result = save_value(L, ss, lua_gettop(L) - 1, visited); /* Key */
+      if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+      {
+        result = save_value(L, ss, lua_gettop(L), visited); /* Value */
+      }
 
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            lua_pushlstring(L, (const char *)str, len);
-          }
-        }
+      if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+      {
+        lua_pop(L, 2); /* Pop key and value */
         break;
+      }
 
-      case LUATEXTS_CSTRINGUTF8:
-        {
-          const unsigned char * str = NULL;
+      lua_pop(L, 1); /* Pop value */
+    }
+  }
 
-          /* Read string size */
-          LUATEXTS_UINT len_chars = 0;
-          size_t len_bytes = 0;
-          result = ltsLS_readuint10(ls, &len_chars);
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  {
+    result = ltsSS_writetype(ss, LUATEXTS_CNIL); /* End of table */
+  }
 
-          /* Check size */
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            /* Implementation detail */
-            if (LUATEXTS_UNLIKELY((lua_Integer)len < 0))
-            {
-              ESPAM(("stringutf8: value does not fit to lua_Integer\n"));
-              ltsLS_close(ls);
-              result = LUATEXTS_ETOOHUGE;
-            }
-          }
+  leave_table(L, idx, visited);
 
-          /* Read string data */
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            result = ltsLS_eatutf8(ls, len_chars, &str, &len_bytes);
-          }
+  return result;
+}
+
+static int save_value(lua_State * L, lts_SaveState * ss, int idx, int visited)
+{
+  int result = LUATEXTS_ESUCCESS;
+
+  switch (lua_type(L, idx))
+  {
+    case LUA_TNIL:
+      result = ltsSS_writetype(ss, LUATEXTS_CNIL);
+      break;
 
-          /* Eat newline after string data */
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            size_t empty = 0;
-            const unsigned char * nl = NULL;
-            result = ltsLS_readline(ls, &nl, &empty);
-            if (
-                LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS)
-                  && LUATEXTS_UNLIKELY(empty != 0)
-              )
-            {
-              ESPAM(("load_value: utf8: garbage before eol\n"));
-              ltsLS_close(ls);
-              result = LUATEXTS_EGARBAGE;
-            }
-          }
+    case LUA_TBOOLEAN:
+      result = ltsSS_writetype(
+          ss, lua_toboolean(L, idx) ? LUATEXTS_CTRUE : LUATEXTS_CFALSE
+        );
+      break;
 
-          if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-          {
-            lua_pushlstring(L, (const char *)str, len_bytes);
-          }
+    case LUA_TNUMBER:
+      result = ltsSS_writetype(ss, LUATEXTS_CNUMBER);
+      if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+      {
+#if defined(LUATEXTS_USE_INTEGERS)
+        result = lua_isinteger(L, idx)
+          ? ltsSS_writeinteger(ss, lua_tointeger(L, idx))
+          : ltsSS_writenumber(ss, lua_tonumber(L, idx))
+          ;
+#else
+        result = ltsSS_writenumber(ss, lua_tonumber(L, idx));
+#endif
+      }
+      break;
+
+    case LUA_TSTRING:
+      {
+        size_t len = 0;
+        const unsigned char * str = (const unsigned char *)lua_tolstring(
+            L, idx, &len
+          );
+
+        result = ltsSS_writetype(ss, LUATEXTS_CSTRING);
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          result = ltsSS_writeuint(ss, len);
         }
-        break;
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          result = ltsSS_write(ss, str, len);
+        }
+        if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+        {
+          result = ltsSS_write(ss, (const unsigned char *)"\n", 1);
+        }
+      }
+      break;
 
-      case LUATEXTS_CFIXEDTABLE:
-        result = load_fixed_table(L, ls);
+    case LUA_TTABLE:
+      if (LUATEXTS_UNLIKELY(ss->depth >= LUATEXTS_SAVE_MAXDEPTH))
+      {
+        ESPAM(("save_value: nesting too deep\n"));
+        result = LUATEXTS_ETOODEEP;
         break;
+      }
 
-      case LUATEXTS_CSTREAMTABLE:
-        result = load_stream_table(L, ls);
-        break;
+      ++ss->depth;
+      result = (ss->stream_tables)
+        ? save_stream_table(L, ss, idx, visited)
+        : save_table(L, ss, idx, visited)
+        ;
+      --ss->depth;
+      break;
 
-      default:
-        ESPAM(("load_value: unknown type char 0x%X (%d)\n", type[0], type[0]));
-        ltsLS_close(ls);
-        result = LUATEXTS_EBADTYPE;
-        break;
-    }
+    default:
+      ESPAM((
+          "save_value: can't save value of type %s\n",
+          luaL_typename(L, idx)
+        ));
+      result = LUATEXTS_EBADVALUE;
+      break;
   }
 
   return result;
 }
 
-static int luatexts_load(
+/*
+* Saves values from stack index first to stack index last inclusive
+* to the given save state, flushing it at the end if streaming.
+* On failure pushes error message.
+*/
+static int luatexts_save(
     lua_State * L,
-    const unsigned char * buf,
-    size_t len,
-    size_t * count
+    lts_SaveState * ss,
+    int first,
+    int last
   )
 {
   int result = LUATEXTS_ESUCCESS;
-  lts_LoadState ls;
-
-  LUATEXTS_UINT tuple_size = 0;
-  LUATEXTS_UINT i = 0;
+  int visited = 0;
+  int i = 0;
 
-  int base = lua_gettop(L);
+  luaL_checkstack(L, 2, "save");
 
-  ltsLS_init(&ls, buf, len);
+  lua_newtable(L);
+  visited = lua_gettop(L);
 
-  /*
-  * Security note: not checking tuple_size for sanity.
-  * Motivation: too complicated; we will fail if buffer is too small anyway.
-  */
+  result = ltsSS_writeuint(ss, (size_t)(last - first + 1));
 
-  result = ltsLS_readuint10(&ls, &tuple_size);
-  /* Check size */
-  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
+  for (i = first; i <= last && result == LUATEXTS_ESUCCESS; ++i)
   {
-    /* Implementation detail */
-    if (LUATEXTS_UNLIKELY((lua_Integer)tuple_size < 0))
-    {
-      ESPAM(("tuple: size does not fit to lua_Integer\n"));
-      ltsLS_close(&ls);
-      result = LUATEXTS_ETOOHUGE;
-    }
+    result = save_value(L, ss, i, visited);
   }
 
-  for (i = 0; i < tuple_size && result == LUATEXTS_ESUCCESS; ++i)
+  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS) && ss->flush != NULL)
   {
-    SPAM(("load_tuple: loading value %lu of %lu\n", i + 1, tuple_size));
-    result = load_value(L, &ls);
+    result = ss->flush(ss, NULL, 0);
   }
 
-  /*
-  * Security note: ignoring unread bytes if any.
-  * Motivation: more casual, this is a text format after all.
-  */
+  lua_pop(L, 1); /* Pop visited table */
 
-  if (LUATEXTS_LIKELY(result == LUATEXTS_ESUCCESS))
-  {
-    *count = tuple_size;
-  }
-  else
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
   {
-    XESPAM(("load_tuple: error %d\n", result));
-
-    lua_settop(L, base); /* Discard intermediate results */
-
-    luaL_checkstack(L, 1, "load-err");
+    XESPAM(("save: error %d\n", result));
 
     switch (result)
     {
-      case LUATEXTS_EBADSIZE:
-        lua_pushliteral(L, "load failed: corrupt data, bad size");
-        break;
-
-      case LUATEXTS_EBADDATA:
-        lua_pushliteral(L, "load failed: corrupt data");
-        break;
-
-      case LUATEXTS_EBADTYPE:
-        lua_pushliteral(L, "load failed: unknown data type");
+      case LUATEXTS_ECIRCULAR:
+        lua_pushliteral(L, "save failed: circular table reference detected");
         break;
 
-      case LUATEXTS_EGARBAGE:
-        lua_pushliteral(L, "load failed: garbage before newline");
+      case LUATEXTS_EBADVALUE:
+        lua_pushliteral(L, "save failed: unsupported value type");
         break;
 
-      case LUATEXTS_ETOOHUGE:
-        lua_pushliteral(L, "load failed: value too huge");
+      case LUATEXTS_ETOODEEP:
+        lua_pushliteral(L, "save failed: nesting too deep");
         break;
 
-      case LUATEXTS_EBADUTF8:
-        lua_pushliteral(L, "load failed: invalid utf-8 data");
+      case LUATEXTS_ENOMEM:
+        lua_pushliteral(L, "save failed: not enough memory");
         break;
 
-      case LUATEXTS_ECLIPPED:
-        lua_pushliteral(L, "load failed: corrupt data, truncated");
+      case LUATEXTS_EIO:
+        lua_pushfstring(L, "save failed: write error: %s", strerror(ss->error));
         break;
 
       /* should not happen */
       case LUATEXTS_EFAILURE:
       default:
-        lua_pushliteral(L, "load failed: internal error");
+        lua_pushliteral(L, "save failed: internal error");
         break;
     }
   }
@@ -1034,139 +8697,332 @@ static int luatexts_load(
   return result;
 }
 
-static int lload(lua_State * L)
+static int lsave(lua_State * L)
 {
-  size_t len = 0;
-  const unsigned char * buf = (const unsigned char *)luaL_checklstring(
-      L, 1, &len
-    );
-  size_t tuple_size = 0;
   int result = 0;
+  int top = lua_gettop(L);
+  lts_SaveState * ss = ltsSS_push(L);
 
-  luaL_checkstack(L, 1, "lload");
-  lua_pushboolean(L, 1);
-
-  result = luatexts_load(L, buf, len, &tuple_size);
+  result = luatexts_save(L, ss, 1, top);
   if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
   {
-    luaL_checkstack(L, 1, "lload-err");
+    ltsSS_release(ss);
+    luaL_checkstack(L, 1, "lsave-err");
     lua_pushnil(L);
-    lua_replace(L, -3); /* Replace pre-pushed true with nil */
-    return 2; /* Error message already on stack */
+    lua_insert(L, -2); /* Put nil before error message */
+    return 2;
   }
 
-  return tuple_size + 1;
+  lua_pushlstring(L, (const char *)ss->buf, ss->len);
+
+  /* Release buffer right away instead of waiting for GC */
+  ltsSS_release(ss);
+
+  return 1;
 }
 
-/* TODO: Hide this mmap stuff in a separate file */
-/* TODO: Support fd as an argument instead of a filename */
 /*
-* TODO: Not quite exception-safe.
-*       Must put close() and unmap() calls to __gc somewhere,
-*       so they would be called on error.
+* Pushes a save state with a fixed-size buffer for streaming
+* and streaming-friendly tables. Throws on allocation failure,
+* fname is the calling function name for the message.
 */
-static int lload_from_file(lua_State * L)
+static lts_SaveState * ltsSS_pushstream(
+    lua_State * L,
+    lts_FlushFn flush,
+    const char * fname
+  )
 {
-  const char * filename = (const char *)luaL_checkstring(L, 1);
+  lts_SaveState * ss = ltsSS_push(L);
 
-  size_t tuple_size = 0;
+  ss->buf = (unsigned char *)malloc(LUATEXTS_SAVE_STREAMBUFSIZE);
+  if (ss->buf == NULL)
+  {
+    luaL_error(L, "luatexts.%s: not enough memory", fname);
+    return NULL; /* Unreachable */
+  }
+
+  ss->capacity = LUATEXTS_SAVE_STREAMBUFSIZE;
+  ss->flush = flush;
+  ss->stream_tables = 1;
+
+  return ss;
+}
+
+/*
+* Writes stream-friendly output to a file descriptor.
+* File descriptor is not closed.
+* If filename is given, file is created or truncated.
+* The fname is the calling function name for error messages.
+*/
+static int luatexts_savetofile(
+    lua_State * L,
+    const char * fname,
+    int size_hints
+  )
+{
+  int top = lua_gettop(L);
   int result = 0;
+  lts_SaveState * ss = NULL;
 
-  const unsigned char * buf = NULL;
+  if (lua_type(L, 1) == LUA_TNUMBER)
+  {
+    ss = ltsSS_pushstream(L, ltsSS_flushfd, fname);
+    ss->fd = (int)lua_tointeger(L, 1);
+  }
+  else
+  {
+    const char * filename = luaL_checkstring(L, 1);
 
-  struct stat sb;
+    ss = ltsSS_pushstream(L, ltsSS_flushfd, fname);
+    ss->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (ss->fd == -1)
+    {
+      luaL_checkstack(L, 2, "lsavetf-err");
+      lua_pushnil(L);
+      lua_pushfstring(
+          L, "%s failed: can't open " LUA_QL("%s") " for writing: %s",
+          fname, filename, strerror(errno)
+        );
+      ltsSS_release(ss);
+      return 2;
+    }
+    ss->own_fd = 1;
+  }
 
-  int fd = open(filename, O_RDONLY);
-  if (fd == -1)
+  ss->size_hints = size_hints;
+
+  result = luatexts_save(L, ss, 2, top);
+
+  if (ss->own_fd)
   {
-    luaL_checkstack(L, 2, "lloadff-err");
-    lua_pushnil(L);
-    lua_pushfstring(
-        L, "load_from_file failed: can't open " LUA_QL("%s") " for reading: %s",
-        filename, strerror(errno)
-      );
-    return 2;
+    ss->own_fd = 0;
+    if (close(ss->fd) == -1 && result == LUATEXTS_ESUCCESS)
+    {
+      ss->error = errno;
+      result = LUATEXTS_EIO;
+      lua_pushfstring(L, "save failed: write error: %s", strerror(ss->error));
+    }
   }
 
-  if (fstat(fd, &sb) == -1)
+  ltsSS_release(ss);
+
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
   {
-    luaL_checkstack(L, 2, "lloadff-err");
+    luaL_checkstack(L, 1, "lsavetf-err");
     lua_pushnil(L);
-    lua_pushfstring(
-        L, "load_from_file failed: can't stat " LUA_QL("%s") ": %s",
-        filename, strerror(errno)
-      );
-    close(fd);
+    lua_insert(L, -2); /* Put nil before error message */
     return 2;
   }
 
-  if (!S_ISREG(sb.st_mode))
+  luaL_checkstack(L, 1, "lsavetf");
+  lua_pushboolean(L, 1);
+
+  return 1;
+}
+
+/*
+* Writes stream-friendly output to a Lua io library file handle.
+* Handle is not flushed or closed.
+* The fname is the calling function name for error messages.
+*/
+static int luatexts_savetohandle(
+    lua_State * L,
+    const char * fname,
+    int size_hints
+  )
+{
+  int top = lua_gettop(L);
+  int result = 0;
+  lts_SaveState * ss = NULL;
+  FILE * fp = lts_checkfile(L, 1);
+
+  ss = ltsSS_pushstream(L, ltsSS_flushfile, fname);
+  ss->fp = fp;
+  ss->size_hints = size_hints;
+
+  result = luatexts_save(L, ss, 2, top);
+
+  ltsSS_release(ss);
+
+  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
   {
-    luaL_checkstack(L, 2, "lloadff-err");
+    luaL_checkstack(L, 1, "lsaveth-err");
     lua_pushnil(L);
-    lua_pushfstring(
-        L, "load_from_file failed: " LUA_QL("%s") " is not a file",
-        filename
-      );
-    close(fd);
+    lua_insert(L, -2); /* Put nil before error message */
     return 2;
   }
 
-  if (sb.st_size == 0)
+  luaL_checkstack(L, 1, "lsaveth");
+  lua_pushboolean(L, 1);
+
+  return 1;
+}
+
+static int lsave_to_file(lua_State * L)
+{
+  return luatexts_savetofile(L, "save_to_file", 0);
+}
+
+static int lsave_to_file_hinted(lua_State * L)
+{
+  return luatexts_savetofile(L, "save_to_file_hinted", 1);
+}
+
+static int lsave_to_handle(lua_State * L)
+{
+  return luatexts_savetohandle(L, "save_to_handle", 0);
+}
+
+static int lsave_to_handle_hinted(lua_State * L)
+{
+  return luatexts_savetohandle(L, "save_to_handle_hinted", 1);
+}
+
+/*
+* Metrics
+*/
+
+static int lstats(lua_State * L)
+{
+  const lts_Metrics * metrics = NULL;
+  const lts_Counters * counters = NULL;
+  size_t created = 0;
+  size_t i = 0;
+
+  luaL_checkstack(L, 5, "lstats");
+
+  lua_getfield(L, LUA_REGISTRYINDEX, LUATEXTS_METRICS_KEY);
+  metrics = (const lts_Metrics *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (metrics == NULL)
   {
-    luaL_checkstack(L, 2, "lloadff-err");
-    lua_pushnil(L);
-    lua_pushfstring(
-        L, "load_from_file failed: " LUA_QL("%s") " is empty",
-        filename
-      );
-    close(fd);
-    return 2;
+    return luaL_error(L, "luatexts.stats: metrics are not initialized");
   }
 
-  buf = (const unsigned char *)mmap(
-      0, sb.st_size, PROT_READ, MAP_SHARED, fd, 0
-    );
-  if (buf == MAP_FAILED)
+  counters = &metrics->counters;
+
+  lua_createtable(L, 0, 8);
+
+  lua_pushboolean(L, metrics->enabled);
+  lua_setfield(L, -2, "enabled");
+
+  lts_pushuint(L, (LUATEXTS_UINT)metrics->loads);
+  lua_setfield(L, -2, "loads");
+
+  lua_createtable(L, 0, LUATEXTS_NTYPES);
+  lua_createtable(L, 0, LUATEXTS_NTYPES);
+  for (i = 0; i < LUATEXTS_NTYPES; ++i)
   {
-    luaL_checkstack(L, 2, "lloadff-err");
-    lua_pushnil(L);
-    lua_pushfstring(
-        L, "load_from_file failed: " LUA_QL("%s") " mmap failed: %s",
-        filename, strerror(errno)
-      );
-    close(fd);
-    return 2;
+    lua_pushlstring(L, &lts_types[i], 1);
+    lts_pushuint(L, (LUATEXTS_UINT)counters->values[i]);
+    lua_rawset(L, -4);
+
+    lua_pushlstring(L, &lts_types[i], 1);
+    lts_pushuint(L, (LUATEXTS_UINT)counters->bytes[i]);
+    lua_rawset(L, -3);
+
+    /* Table references are not counted, the tables exist already */
+    if (
+        lts_types[i] == LUATEXTS_CFIXEDTABLE ||
+        lts_types[i] == LUATEXTS_CSTREAMTABLE ||
+        lts_types[i] == LUATEXTS_CHINTEDTABLE
+      )
+    {
+      created += counters->values[i];
+    }
+  }
+  lua_setfield(L, -3, "bytes");
+  lua_setfield(L, -2, "values");
+
+  lua_createtable(L, 0, 4);
+  lts_pushuint(L, (LUATEXTS_UINT)created);
+  lua_setfield(L, -2, "created");
+  lts_pushuint(L, (LUATEXTS_UINT)counters->tables_presized);
+  lua_setfield(L, -2, "presized");
+  lts_pushuint(L, (LUATEXTS_UINT)counters->tables_filled);
+  lua_setfield(L, -2, "filled");
+  lts_pushuint(L, (LUATEXTS_UINT)counters->tables_grown);
+  lua_setfield(L, -2, "grown");
+  lua_setfield(L, -2, "tables");
+
+  lts_pushuint(L, (LUATEXTS_UINT)counters->max_depth);
+  lua_setfield(L, -2, "max_depth");
+
+  lua_createtable(L, 0, 2);
+  lua_pushnumber(L, (lua_Number)metrics->scan_time);
+  lua_setfield(L, -2, "scan");
+  lua_pushnumber(L, (lua_Number)metrics->load_time);
+  lua_setfield(L, -2, "load");
+  lua_setfield(L, -2, "time");
+
+  lua_createtable(L, 0, LUATEXTS_ELIMIT);
+  for (i = LUATEXTS_EFAILURE; i <= LUATEXTS_ELIMIT; ++i)
+  {
+    lts_pushuint(L, (LUATEXTS_UINT)metrics->errors[i]);
+    lua_setfield(L, -2, lts_errnames[i]);
   }
+  lua_setfield(L, -2, "errors");
 
-  close(fd);
+  return 1;
+}
 
-  luaL_checkstack(L, 1, "lloadff");
-  lua_pushboolean(L, 1);
+static int lreset_stats(lua_State * L)
+{
+  lts_Metrics * metrics = NULL;
+  int enabled = 0;
 
-  result = luatexts_load(L, buf, sb.st_size, &tuple_size);
-  if (LUATEXTS_UNLIKELY(result != LUATEXTS_ESUCCESS))
+  luaL_checkstack(L, 1, "lreset_stats");
+
+  lua_getfield(L, LUA_REGISTRYINDEX, LUATEXTS_METRICS_KEY);
+  metrics = (lts_Metrics *)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (metrics == NULL)
   {
-    luaL_checkstack(L, 1, "lloadff-err");
-    lua_pushnil(L);
-    lua_replace(L, -3); /* Replace pre-pushed true with nil */
-    return 2; /* Error message already on stack */
+    return luaL_error(
+        L, "luatexts.reset_stats: metrics are not initialized"
+      );
   }
 
-  if (munmap((void *)buf, sb.st_size) == -1)
+  enabled = lua_isnoneornil(L, 1) ? metrics->enabled : lua_toboolean(L, 1);
+
+  memset(metrics, 0, sizeof(lts_Metrics));
+  metrics->enabled = enabled;
+  if (enabled)
   {
-    ESPAM(("lloadff: munmap failed"));
-    /* What else can we do? */
+    lts_metrics_used = 1;
   }
 
-  return tuple_size + 1;
+  return 0;
 }
 
 /* Lua module API */
-static const struct luaL_reg R[] =
+static const luaL_Reg R[] =
 {
   { "load", lload },
   { "load_from_file", lload_from_file },
+  { "load_from_fd", lload_from_fd },
+  { "load_from_handle", lload_from_handle },
+  { "open", lopen },
+  { "load_at", lload_at },
+  { "records", lrecords },
+  { "load_lazy", lload_lazy },
+  { "materialize", lmaterialize },
+  { "cached_load", lcached_load },
+  { "load_select", lload_select },
+  { "cache_stats", lcache_stats },
+  { "reset_cache", lreset_cache },
+  { "pairs", lpairs },
+  { "ipairs", lipairs },
+  { "len", llen },
+  { "validate", lvalidate },
+  { "decoder", ldecoder },
+  { "save", lsave },
+  { "save_to_file", lsave_to_file },
+  { "save_to_handle", lsave_to_handle },
+  { "save_to_file_hinted", lsave_to_file_hinted },
+  { "save_to_handle_hinted", lsave_to_handle_hinted },
+  { "stats", lstats },
+  { "reset_stats", lreset_stats },
 
   { NULL, NULL }
 };
@@ -1180,7 +9036,79 @@ LUALIB_API int luaopen_luatexts(lua_State * L)
   /*
   * Register module
   */
+#if LUA_VERSION_NUM >= 502
+  luaL_newlib(L, R);
+#else
   luaL_register(L, "luatexts", R);
+#endif
+
+  /*
+  * Register decoder metatable
+  */
+  luaL_newmetatable(L, LUATEXTS_DECODER_MT);
+  lua_pushcfunction(L, ldecoder_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+  luaL_setfuncs(L, Decoder, 0);
+#else
+  luaL_register(L, NULL, Decoder);
+#endif
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  /*
+  * Register file handle metatable
+  */
+  luaL_newmetatable(L, LUATEXTS_HANDLE_MT);
+  lua_pushcfunction(L, ltsH_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_newtable(L);
+#if LUA_VERSION_NUM >= 502
+  luaL_setfuncs(L, Handle, 0);
+#else
+  luaL_register(L, NULL, Handle);
+#endif
+  lua_setfield(L, -2, "__index");
+  lua_pop(L, 1);
+
+  /*
+  * Register read buffer metatable
+  */
+  luaL_newmetatable(L, LUATEXTS_READBUF_MT);
+  lua_pushcfunction(L, ltsRB_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  /*
+  * Register records iterator state metatable
+  */
+  luaL_newmetatable(L, LUATEXTS_RECORDS_MT);
+  lua_pushcfunction(L, ltsR_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  /*
+  * Register save state metatable
+  */
+  luaL_newmetatable(L, LUATEXTS_SAVESTATE_MT);
+  lua_pushcfunction(L, ltsSS_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  /*
+  * Create metrics, unless some other copy of the module did it
+  */
+  lua_getfield(L, LUA_REGISTRYINDEX, LUATEXTS_METRICS_KEY);
+  if (lua_isnil(L, -1))
+  {
+    lts_Metrics * metrics = (lts_Metrics *)lua_newuserdata(
+        L, sizeof(lts_Metrics)
+      );
+    memset(metrics, 0, sizeof(lts_Metrics));
+    lua_setfield(L, LUA_REGISTRYINDEX, LUATEXTS_METRICS_KEY);
+  }
+  lua_pop(L, 1);
 
   /*
   * Register module information
@@ -34,12 +34,54 @@ function save_number(v) {
   return 'N\n' + v.toString() + '\n';
 }
 
+// Set by LUATEXTS.save_dedup() only: number of the first occurrence
+// of each string (strings saved in full are numbered from one).
+var string_index = null;
+var num_strings = 0;
+
 // TODO: Ensure the string is in UTF-8 somehow.
 function save_string(v) {
+  if (string_index !== null) {
+    var key = '~' + v; // Avoid clashes with Object.prototype properties
+    var index = string_index.hasOwnProperty(key) ? string_index[key] : 0;
+    // Back-reference is saved if it is shorter than the string
+    if (
+        index > 0 &&
+        index.toString().length <= v.length.toString().length + v.length
+      ) {
+      return 's\n' + index + '\n';
+    }
+    ++num_strings;
+    if (index === 0) {
+      string_index[key] = num_strings;
+    }
+  }
+
   return '8\n' + v.length + '\n' + v + '\n';
 }
 
+// Set by LUATEXTS.save_dedup() only: number of each object and array
+// saved so far (tables are numbered from one, in order).
+var tables = null;
+
+// Returns back-reference to a table saved before, or null.
+function save_table_ref(v) {
+  if (tables !== null) {
+    var index = tables.get(v);
+    if (index !== undefined) {
+      return 'r\n' + index + '\n';
+    }
+    tables.set(v, tables.size + 1);
+  }
+  return null;
+}
+
 function save_object(v) {
+  var ref = save_table_ref(v);
+  if (ref !== null) {
+    return ref;
+  }
+
   var size = 0;
   var result = '';
 
@@ -53,6 +95,11 @@ function save_object(v) {
 
 // Saves array as one-based table.
 function save_array(v) {
+  var ref = save_table_ref(v);
+  if (ref !== null) {
+    return ref;
+  }
+
   var result = 'T\n' + v.length + '\n0\n';
   for (var i = 0; i < v.length; ++i) {
     result += save_value(v[i]);
@@ -92,6 +139,20 @@ LUATEXTS.save = function() {
   return result;
 }
 
+// Same as LUATEXTS.save(), but saves repeated strings, objects and arrays
+// as back-references.
+LUATEXTS.save_dedup = function() {
+  string_index = { };
+  num_strings = 0;
+  tables = new Map();
+  try {
+    return LUATEXTS.save.apply(null, arguments);
+  } finally {
+    string_index = null;
+    tables = null;
+  }
+}
+
 // Sorry, no LUATEXTS.load() yet. Patches are welcome.
 
 // -----------------------------------------------------------------------------
@@ -2,6 +2,6 @@
 // https://github.com/agladysh/luatexts/
 // Copyright (c) LUATEXTS authors. Licensed under the terms of the MIT license:
 // https://github.com/agladysh/luatexts/tree/master/COPYRIGHT
-var LUATEXTS=function(f){function g(a){var b=typeof a;if(b!=="object")return b;else if(a===null)return"null";else if(a.constructor==Array)return"array";return"object"}function h(){return"-\n"}function i(a){throw Error("luatexts does not support values of type "+g(a));}function d(a){return(j[g(a)]||i)(a)}var j={undefined:h,"null":h,"boolean":function(a){return a?"1\n":"0\n"},number:function(a){return"N\n"+a.toString()+"\n"},string:function(a){return"8\n"+a.length+"\n"+a+"\n"},object:function(a){var b=
-0,c="",e;for(e in a)c+=d(e)+d(a[e]),++b;return"T\n0\n"+b+"\n"+c},array:function(a){for(var b="T\n"+a.length+"\n0\n",c=0;c<a.length;++c)b+=d(a[c]);return b},"function":i};f.save=function(){for(var a=arguments.length.toString()+"\n",b=0;b<arguments.length;++b)a+=d(arguments[b]);return a};return f}(LUATEXTS||{});
+var LUATEXTS=function(f){function g(a){var b=typeof a;if(b!=="object")return b;else if(a===null)return"null";else if(a.constructor==Array)return"array";return"object"}function h(){return"-\n"}function i(a){throw Error("luatexts does not support values of type "+g(a));}function d(a){return(j[g(a)]||i)(a)}function n(a){if(m!==null){var b=m.get(a);if(b!==undefined)return"r\n"+b+"\n";m.set(a,m.size+1)}return null}var k=null,l=0,m=null,j={undefined:h,"null":h,"boolean":function(a){return a?"1\n":"0\n"},number:function(a){return"N\n"+a.toString()+"\n"},string:function(a){if(k!==null){var b="~"+a,c=k.hasOwnProperty(b)?k[b]:0;if(c>0&&c.toString().length<=a.length.toString().length+a.length)return"s\n"+c+"\n";++l;c===0&&(k[b]=l)}return"8\n"+a.length+"\n"+a+"\n"},object:function(a){var b=n(a);if(b!==null)return b;b=
+0;var c="",e;for(e in a)c+=d(e)+d(a[e]),++b;return"T\n0\n"+b+"\n"+c},array:function(a){var b=n(a);if(b!==null)return b;b="T\n"+a.length+"\n0\n";for(var c=0;c<a.length;++c)b+=d(a[c]);return b},"function":i};f.save=function(){for(var a=arguments.length.toString()+"\n",b=0;b<arguments.length;++b)a+=d(arguments[b]);return a};f.save_dedup=function(){k={};l=0;m=new Map;try{return f.save.apply(null,arguments)}finally{k=null;m=null}};return f}(LUATEXTS||{});
 
@@ -0,0 +1,1021 @@
+--------------------------------------------------------------------------------
+-- luatexts/ffi.lua: LuaJIT FFI implementation of luatexts
+--------------------------------------------------------------------------------
+-- Copyright (c) 2011-2013, luatexts authors
+-- See license in the file named COPYRIGHT
+--------------------------------------------------------------------------------
+-- Data is read through a byte pointer and tables are built in plain Lua,
+-- so that the JIT compiler may keep both load() and save() in traces
+-- (calls to the C module are trace boundaries).
+--
+-- Accepts and produces the same data as the C module load() and save() do,
+-- with the same error messages.
+--------------------------------------------------------------------------------
+
+local error, next, rawget, select, tonumber, tostring, type, unpack
+    = error, next, rawget, select, tonumber, tostring, type, unpack
+
+local math_floor, math_huge, math_min
+    = math.floor, math.huge, math.min
+
+local string_format
+    = string.format
+
+local ffi = require 'ffi'
+
+local ffi_cast, ffi_copy, ffi_new, ffi_string
+    = ffi.cast, ffi.copy, ffi.new, ffi.string
+
+-- May be already declared by someone else
+pcall(ffi.cdef, "double strtod(const char * str, char ** endptr);")
+
+-- Only the first field of struct lconv is needed. Declarations are private,
+-- so the real struct lconv and localeconv() are left for others to declare.
+-- (Already declared if this module is loaded again.)
+pcall(
+    ffi.cdef,
+    "struct luatexts_lconv { char * decimal_point; };"
+ .. "struct luatexts_lconv * luatexts_localeconv(void)"
+ .. " __asm__(\"localeconv\");"
+  )
+
+local C = ffi.C
+
+-- LuaJIT extension, used to preallocate tables
+local table_new = (function()
+  local ok, table_new = pcall(require, 'table.new')
+  return ok and table_new or function() return { } end
+end)()
+
+--------------------------------------------------------------------------------
+
+-- Same as in C module
+local DEFAULT_MAX_DEPTH = 1000
+local MAXASIZE = 2 ^ 26
+
+local E_BADSIZE = "load failed: corrupt data, bad size"
+local E_BADDATA = "load failed: corrupt data"
+local E_BADTYPE = "load failed: unknown data type"
+local E_GARBAGE = "load failed: garbage before newline"
+local E_TOOHUGE = "load failed: value too huge"
+local E_BADUTF8 = "load failed: invalid utf-8 data"
+local E_CLIPPED = "load failed: corrupt data, truncated"
+local E_TOODEEP = "load failed: nesting too deep"
+local E_LIMIT   = "load failed: limit exceeded"
+
+-- Not an error: tuple references tables, load it again recording them
+local RELOAD = { }
+
+local byte_array = function(init)
+  local t = { }
+  for i = 0, 255 do
+    t[i + 1] = init(i)
+  end
+  return ffi_new("const int8_t[256]", t)
+end
+
+local digit_value = function(c)
+  if c >= 48 and c <= 57 then -- 0-9
+    return c - 48
+  elseif c >= 65 and c <= 90 then -- A-Z
+    return c - 55
+  elseif c >= 97 and c <= 122 then -- a-z
+    return c - 87
+  end
+  return 99
+end
+
+-- Digit values, -1 for bytes that are not digits in given base
+local uint_lookup_table = function(base)
+  return byte_array(function(c)
+    local d = digit_value(c)
+    return d < base and d or -1
+  end)
+end
+
+-- 1-4 for a lead byte, -1 for a continuation byte, 0 for invalid byte
+local utf8_char_len = byte_array(function(c)
+  if c < 0x80 then
+    return 1
+  elseif c < 0xC0 then
+    return -1
+  elseif c < 0xC2 then
+    return 0
+  elseif c < 0xE0 then
+    return 2
+  elseif c < 0xF0 then
+    return 3
+  elseif c < 0xF5 then
+    return 4
+  end
+  return 0
+end)
+
+local u64 = function(hi, lo)
+  return ffi_new("uint64_t", hi) * 2 ^ 32 + lo
+end
+
+-- Powers of ten that are exact in double
+local POW10 = { [0] = 1 }
+for i = 1, 22 do
+  POW10[i] = POW10[i - 1] * 10
+end
+
+--------------------------------------------------------------------------------
+
+local load
+do
+  -- Load state: { p = data pointer, n = data length, err = message, ... }.
+  -- Readers take data offset and return value and new offset,
+  -- or nil offset on failure.
+
+  local fail = function(ls, err)
+    ls.err = err
+    return nil, nil
+  end
+
+  -- Eats '\n' or '\r\n'
+  local eat_newline = function(ls, pos)
+    local p, n = ls.p, ls.n
+    if pos >= n then
+      return fail(ls, E_CLIPPED)
+    end
+    if p[pos] == 13 then -- '\r'
+      pos = pos + 1
+      if pos >= n then
+        return fail(ls, E_CLIPPED)
+      end
+    end
+    if p[pos] ~= 10 then -- '\n'
+      return fail(ls, E_GARBAGE)
+    end
+    return pos + 1
+  end
+
+  -- No leading '-' and no leading whitespace, value must fit to uint64_t.
+  -- Huge values are loaded as (inexact) numbers, as C module does it.
+  local make_uint_reader = function(base, limit_hi, limit_lo, tail)
+    local digits = uint_lookup_table(base)
+    local limit = u64(limit_hi, limit_lo)
+    -- Any value below this, times base plus digit, is exact in double
+    local exact = 2 ^ 47
+
+    return function(ls, pos)
+      local p, n = ls.p, ls.n
+      if pos >= n then
+        return fail(ls, E_CLIPPED)
+      end
+
+      local d = digits[p[pos]]
+      if d < 0 then
+        return fail(ls, E_BADDATA)
+      end
+
+      -- Note: p[n] is the terminating zero of Lua string, not a digit
+      local k = 0
+      repeat
+        k = k * base + d
+        pos = pos + 1
+        d = digits[p[pos]]
+      until d < 0 or k >= exact
+
+      if d >= 0 then
+        local k64 = ffi_new("uint64_t", k)
+        repeat
+          if k64 >= limit and (k64 ~= limit or d > tail) then
+            return fail(ls, E_TOOHUGE)
+          end
+          k64 = k64 * base + d
+          pos = pos + 1
+          d = digits[p[pos]]
+        until d < 0
+        k = tonumber(k64)
+      end
+
+      return k, eat_newline(ls, pos)
+    end
+  end
+
+  -- LIMIT and TAIL are (2^64 - 1) / BASE and (2^64 - 1) % BASE
+  local read_uint10 = make_uint_reader(10, 0x19999999, 0x99999999, 5)
+  local read_uint16 = make_uint_reader(16, 0x0FFFFFFF, 0xFFFFFFFF, 0xF)
+  local read_uint36 = make_uint_reader(36, 0x071C71C7, 0x1C71C71C, 15)
+
+  -- Returns offset of the end of line (without '\r') and of the next line
+  local find_eol = function(ls, pos)
+    local p, n = ls.p, ls.n
+    local nl = pos
+    while nl < n and p[nl] ~= 10 do
+      nl = nl + 1
+    end
+    if nl >= n then
+      return nil
+    end
+    if nl > pos and p[nl - 1] == 13 then
+      return nl - 1, nl + 1
+    end
+    return nl, nl + 1
+  end
+
+  -- Longest number we would copy to convert in a non-"C" locale
+  local MAX_NUMBER_LEN = 200
+
+  local number_buf = ffi_new("char[?]", MAX_NUMBER_LEN + 1)
+  local endptr = ffi_new("char *[1]")
+
+  -- The rest (inf, nan, hex, too many digits) goes to strtod(),
+  -- as C module does it, so both accept the same numbers.
+  -- Like Lua does, we replace '.' with the decimal point of current locale.
+  local convert_number = function(ls, pos, eol)
+    local p = ls.p
+    local len = eol - pos
+
+    local point = C.luatexts_localeconv().decimal_point[0]
+    if point == 46 then -- '.'
+      -- Safe, line is followed by at least one non-numeric byte
+      local v = C.strtod(ffi_cast("const char *", p + pos), endptr)
+      if ffi_cast("const uint8_t *", endptr[0]) ~= p + eol then
+        return fail(ls, E_GARBAGE)
+      end
+      return v
+    end
+
+    if len > MAX_NUMBER_LEN then
+      return fail(ls, E_GARBAGE)
+    end
+
+    for i = 0, len - 1 do
+      local c = p[pos + i]
+      if c == point then
+        return fail(ls, E_GARBAGE)
+      end
+      number_buf[i] = (c == 46) and point or c
+    end
+    number_buf[len] = 0
+
+    local v = C.strtod(number_buf, endptr)
+    if endptr[0] ~= number_buf + len then
+      return fail(ls, E_GARBAGE)
+    end
+
+    return v
+  end
+
+  local read_number = function(ls, pos)
+    local p, n = ls.p, ls.n
+
+    -- Fast path: up to 15 digits with optional sign and decimal point
+    local i = pos
+    local negative = p[i] == 45 -- '-'
+    if negative then
+      i = i + 1
+    end
+
+    local start = i
+    local m = 0
+    local d = p[i] - 48
+    while d >= 0 and d <= 9 do
+      m = m * 10 + d
+      i = i + 1
+      d = p[i] - 48
+    end
+
+    local int_digits = i - start
+    local frac_digits = 0
+    if d == -2 and int_digits > 0 then -- '.'
+      i = i + 1
+      start = i
+      d = p[i] - 48
+      while d >= 0 and d <= 9 do
+        m = m * 10 + d
+        i = i + 1
+        d = p[i] - 48
+      end
+      frac_digits = i - start
+    end
+
+    if
+      int_digits > 0 and int_digits + frac_digits <= 15 and i < n and (
+          d == -38 or -- '\n'
+          (d == -35 and i + 1 < n and p[i + 1] == 10) -- '\r\n'
+        )
+    then
+      local v = m / POW10[frac_digits]
+      if negative then
+        v = -v
+      end
+      return v, (d == -38) and (i + 1) or (i + 2)
+    end
+
+    -- Slow path
+    local eol, next_pos = find_eol(ls, pos)
+    if not eol then
+      return fail(ls, E_CLIPPED)
+    end
+    if eol == pos then
+      return fail(ls, E_BADDATA)
+    end
+
+    local v = convert_number(ls, pos, eol)
+    if v == nil then
+      return nil, nil
+    end
+
+    return v, next_pos
+  end
+
+  -- Returns offset after num_chars valid UTF-8 characters
+  local eat_utf8 = function(ls, pos, num_chars)
+    local p, n = ls.p, ls.n
+
+    for _ = 1, num_chars do
+      if pos >= n then
+        return fail(ls, E_CLIPPED)
+      end
+
+      local b = p[pos]
+      local len = utf8_char_len[b]
+      if len == 1 then
+        pos = pos + 1
+      else
+        if len < 1 then
+          return fail(ls, E_BADUTF8)
+        end
+
+        if pos + len > n then
+          return fail(ls, E_CLIPPED)
+        end
+
+        for i = 1, len - 1 do
+          if utf8_char_len[p[pos + i]] ~= -1 then
+            return fail(ls, E_BADUTF8)
+          end
+        end
+
+        -- Overlong forms, surrogates, values above U+10FFFF,
+        -- and U+FFFE, U+FFFF non-characters
+        local b1 = p[pos + 1]
+        if
+          (b == 0xE0 and b1 < 0xA0) or
+          (b == 0xF0 and b1 < 0x90) or
+          (b == 0xF4 and b1 > 0x8F) or
+          (b == 0xED and b1 > 0x9F) or
+          (b == 0xEF and b1 == 0xBF and p[pos + 2] >= 0xBE)
+        then
+          return fail(ls, E_BADUTF8)
+        end
+
+        pos = pos + len
+      end
+    end
+
+    return pos
+  end
+
+  -- Fits lua_Integer; strings longer than that can't be in memory anyway
+  local MAX_LEN = 2 ^ 63
+
+  local read_value
+
+  local read_string = function(ls, pos)
+    local len
+    len, pos = read_uint10(ls, pos)
+    if not pos then
+      return nil, nil
+    end
+
+    if len >= MAX_LEN then
+      return fail(ls, E_TOOHUGE)
+    end
+    if len > ls.max_string_length then
+      return fail(ls, E_LIMIT)
+    end
+
+    if ls.n - pos < len then
+      return fail(ls, E_BADSIZE)
+    end
+
+    local str = ffi_string(ls.p + pos, len)
+    local num_strings = ls.num_strings + 1
+    ls.num_strings = num_strings
+    ls.strings[num_strings] = str
+
+    return str, eat_newline(ls, pos + len)
+  end
+
+  local read_utf8 = function(ls, pos)
+    local len_chars
+    len_chars, pos = read_uint10(ls, pos)
+    if not pos then
+      return nil, nil
+    end
+
+    if len_chars >= MAX_LEN then
+      return fail(ls, E_TOOHUGE)
+    end
+    -- Each character is at least one byte
+    if len_chars > ls.max_string_length then
+      return fail(ls, E_LIMIT)
+    end
+
+    local finish = eat_utf8(ls, pos, len_chars)
+    if not finish then
+      return nil, nil
+    end
+
+    if finish - pos > ls.max_string_length then
+      return fail(ls, E_LIMIT)
+    end
+
+    local str = ffi_string(ls.p + pos, finish - pos)
+    local num_strings = ls.num_strings + 1
+    ls.num_strings = num_strings
+    ls.strings[num_strings] = str
+
+    return str, eat_newline(ls, finish)
+  end
+
+  -- Strings are numbered from one in the order they appear in the tuple
+  local read_string_ref = function(ls, pos)
+    local index
+    index, pos = read_uint10(ls, pos)
+    if not pos then
+      return nil, nil
+    end
+
+    if index < 1 or index > ls.num_strings then
+      return fail(ls, E_BADDATA)
+    end
+
+    return ls.strings[index], pos
+  end
+
+  -- Tables are numbered from one in the order they appear in the tuple,
+  -- but are recorded only when tuple is loaded again after a reference
+  local add_table = function(ls, t)
+    local tables = ls.tables
+    if tables then
+      local num_tables = ls.num_tables + 1
+      ls.num_tables = num_tables
+      tables[num_tables] = t
+    end
+    return t
+  end
+
+  local read_table_ref = function(ls, pos)
+    if not ls.tables then
+      return fail(ls, RELOAD)
+    end
+
+    local index
+    index, pos = read_uint10(ls, pos)
+    if not pos then
+      return nil, nil
+    end
+
+    if index < 1 or index > ls.num_tables then
+      return fail(ls, E_BADDATA)
+    end
+
+    return ls.tables[index], pos
+  end
+
+  -- Table key can't be nil or NaN
+  local bad_key = function(k)
+    return k == nil or k ~= k
+  end
+
+  local read_fixed_table = function(ls, pos, depth)
+    local array_size, hash_size
+    array_size, pos = read_uint10(ls, pos)
+    if not pos then
+      return nil, nil
+    end
+    hash_size, pos = read_uint10(ls, pos)
+    if not pos then
+      return nil, nil
+    end
+
+    -- Limits go first, as in the C module
+    if
+      array_size > ls.max_array_size or
+      hash_size > ls.max_hash_size or
+      array_size + hash_size * 2 > ls.values_left
+    then
+      return fail(ls, E_LIMIT)
+    end
+
+    -- Simplification: Assuming minimum value size is one byte.
+    if
+      array_size > MAXASIZE or hash_size > MAXASIZE or
+      ls.n - pos < array_size + hash_size * 2
+    then
+      return fail(ls, E_TOOHUGE)
+    end
+
+    if depth >= ls.max_depth then
+      return fail(ls, E_TOODEEP)
+    end
+
+    local r = add_table(ls, table_new(array_size, hash_size))
+
+    local v
+    for i = 1, array_size do
+      v, pos = read_value(ls, pos, depth + 1)
+      if not pos then
+        return nil, nil
+      end
+      r[i] = v
+    end
+
+    local k
+    for _ = 1, hash_size do
+      k, pos = read_value(ls, pos, depth + 1)
+      if not pos then
+        return nil, nil
+      end
+      if bad_key(k) then
+        return fail(ls, E_BADDATA)
+      end
+      v, pos = read_value(ls, pos, depth + 1)
+      if not pos then
+        return nil, nil
+      end
+      r[k] = v
+    end
+
+    return r, pos
+  end
+
+  -- Reads key-value pairs up to the terminating nil key
+  local read_stream_table = function(ls, pos, depth, r)
+    if depth >= ls.max_depth then
+      return fail(ls, E_TOODEEP)
+    end
+
+    local k, v
+    while true do
+      k, pos = read_value(ls, pos, depth + 1)
+      if not pos then
+        return nil, nil
+      end
+      if k == nil then
+        return r, pos -- End of table
+      end
+      if k ~= k then
+        return fail(ls, E_BADDATA)
+      end
+      v, pos = read_value(ls, pos, depth + 1)
+      if not pos then
+        return nil, nil
+      end
+      r[k] = v
+    end
+  end
+
+  -- Size hints are not trusted, each pair takes at least four bytes
+  local size_hint = function(hint, limit, unread)
+    return math_min(hint, limit, math_floor(unread / 4), MAXASIZE)
+  end
+
+  local read_hinted_table = function(ls, pos, depth)
+    local array_hint, hash_hint
+    array_hint, pos = read_uint10(ls, pos)
+    if not pos then
+      return nil, nil
+    end
+    hash_hint, pos = read_uint10(ls, pos)
+    if not pos then
+      return nil, nil
+    end
+
+    local unread = ls.n - pos
+
+    return read_stream_table(
+        ls, pos, depth,
+        add_table(ls, table_new(
+            size_hint(array_hint, ls.max_array_size, unread),
+            size_hint(hash_hint, ls.max_hash_size, unread)
+          ))
+      )
+  end
+
+  -- Value type character is followed by a newline,
+  -- so readers for value data start at offset + 2 (or + 3 for '\r\n').
+  read_value = function(ls, pos, depth)
+    local p, n = ls.p, ls.n
+
+    if ls.values_left <= 0 then
+      return fail(ls, E_LIMIT)
+    end
+    ls.values_left = ls.values_left - 1
+
+    if pos >= n then
+      return fail(ls, E_CLIPPED)
+    end
+
+    local type = p[pos]
+
+    pos = eat_newline(ls, pos + 1)
+    if not pos then
+      return nil, nil
+    end
+
+    if type == 45 then -- '-'
+      return nil, pos
+    elseif type == 48 then -- '0'
+      return false, pos
+    elseif type == 49 then -- '1'
+      return true, pos
+    elseif type == 78 then -- 'N'
+      return read_number(ls, pos)
+    elseif type == 85 then -- 'U'
+      return read_uint10(ls, pos)
+    elseif type == 72 then -- 'H'
+      return read_uint16(ls, pos)
+    elseif type == 90 then -- 'Z'
+      return read_uint36(ls, pos)
+    elseif type == 83 then -- 'S'
+      return read_string(ls, pos)
+    elseif type == 56 then -- '8'
+      return read_utf8(ls, pos)
+    elseif type == 115 then -- 's'
+      return read_string_ref(ls, pos)
+    elseif type == 114 then -- 'r'
+      return read_table_ref(ls, pos)
+    elseif type == 84 then -- 'T'
+      return read_fixed_table(ls, pos, depth)
+    elseif type == 116 then -- 't'
+      return read_stream_table(ls, pos, depth, add_table(ls, { }))
+    elseif type == 112 then -- 'p'
+      return read_hinted_table(ls, pos, depth)
+    end
+
+    return fail(ls, E_BADTYPE)
+  end
+
+  local opt_size = function(options, name, def)
+    local value = options[name]
+    if value == nil then
+      return def
+    end
+
+    if type(value) ~= "number" then
+      value = tonumber(value)
+      if value == nil then
+        error(
+            "bad argument #2 to 'load' (" .. name .. " must be a number)",
+            4
+          )
+      end
+    end
+
+    if value < 0 then
+      error(
+          "bad argument #2 to 'load' (" .. name .. " must not be negative)",
+          4
+        )
+    end
+
+    return math_floor(value)
+  end
+
+  local load_state = function(data, options)
+    local ls =
+    {
+      data = data; -- Keeps data alive while we use the pointer to it
+      p = ffi_cast("const uint8_t *", data);
+      n = #data;
+      err = nil;
+      strings = { }; -- For string back-references
+      num_strings = 0;
+      tables = nil; -- For table back-references, see add_table()
+      num_tables = 0;
+      --
+      max_depth = DEFAULT_MAX_DEPTH;
+      values_left = math_huge;
+      max_tuple_size = math_huge;
+      max_string_length = math_huge;
+      max_array_size = math_huge;
+      max_hash_size = math_huge;
+    }
+
+    if options ~= nil then
+      if type(options) ~= "table" then
+        error(
+            "bad argument #2 to 'load' (table expected, got "
+         .. type(options) .. ")",
+            3
+          )
+      end
+
+      ls.max_depth = opt_size(options, "max_depth", ls.max_depth)
+      ls.values_left = opt_size(options, "max_values", ls.values_left)
+      ls.max_tuple_size = opt_size(
+          options, "max_tuple_size", ls.max_tuple_size
+        )
+      ls.max_string_length = opt_size(
+          options, "max_string_length", ls.max_string_length
+        )
+      ls.max_array_size = opt_size(
+          options, "max_array_size", ls.max_array_size
+        )
+      ls.max_hash_size = opt_size(options, "max_hash_size", ls.max_hash_size)
+    end
+
+    return ls
+  end
+
+  local load_tuple
+  load_tuple = function(ls, start, tuple_size)
+    -- Security note: ignoring unread bytes if any, as C module does.
+    local values_left = ls.values_left
+    local r = { }
+    local v, pos = nil, start
+    for i = 1, tuple_size do
+      v, pos = read_value(ls, pos, 0)
+      if not pos then
+        if ls.err == RELOAD then
+          ls.err = nil
+          ls.values_left = values_left
+          ls.strings, ls.num_strings = { }, 0
+          ls.tables, ls.num_tables = { }, 0
+          return load_tuple(ls, start, tuple_size)
+        end
+        return nil, ls.err
+      end
+      r[i] = v
+    end
+
+    return true, unpack(r, 1, tuple_size)
+  end
+
+  -- Data that does not fit to Lua stack (too deep, or too many values
+  -- in a tuple) fails the same way as in C module
+  local check_result = function(ok, ...)
+    if ok then
+      return ...
+    end
+
+    local err = ...
+    if
+      type(err) == "string" and (
+          err:find("stack overflow", 1, true) or
+          err:find("too many results to unpack", 1, true)
+        )
+    then
+      return nil, E_TOOHUGE
+    end
+
+    return error(err, 0)
+  end
+
+  load = function(data, options)
+    local data_type = type(data)
+    if data_type == "number" then
+      data = tostring(data) -- As luaL_checklstring() does
+    elseif data_type ~= "string" then
+      error(
+          "bad argument #1 to 'load' (string expected, got "
+       .. (data == nil and "no value" or data_type) .. ")",
+          2
+        )
+    end
+
+    local ls = load_state(data, options)
+
+    local tuple_size, pos = read_uint10(ls, 0)
+    if not pos then
+      return nil, ls.err
+    end
+
+    if tuple_size >= MAX_LEN then
+      return nil, E_TOOHUGE
+    end
+    if tuple_size > ls.max_tuple_size or tuple_size > ls.values_left then
+      return nil, E_LIMIT
+    end
+
+    return check_result(pcall(load_tuple, ls, pos, tuple_size))
+  end
+end
+
+--------------------------------------------------------------------------------
+
+local save
+do
+  -- Output buffer is shared between calls. Large buffers are not kept.
+  local KEEP_SIZE = 64 * 1024
+
+  local buf, capacity, len = nil, 0, 0
+  local busy = false
+
+  local reserve = function(size)
+    if len + size > capacity then
+      local new_capacity = (capacity > 0) and capacity or 256
+      while new_capacity < len + size do
+        new_capacity = new_capacity * 2
+      end
+
+      local new_buf = ffi_new("uint8_t[?]", new_capacity)
+      if len > 0 then
+        ffi_copy(new_buf, buf, len)
+      end
+
+      buf, capacity = new_buf, new_capacity
+    end
+  end
+
+  local write_type = function(type)
+    reserve(2)
+    buf[len] = type
+    buf[len + 1] = 10
+    len = len + 2
+  end
+
+  local write_string = function(str)
+    local size = #str
+    reserve(size)
+    ffi_copy(buf + len, str, size)
+    len = len + size
+  end
+
+  -- Writes digits of non-negative integral value, followed by a newline
+  local write_digits = function(value)
+    local num_digits = 1
+    local v = value
+    while v >= 10 do
+      v = math_floor(v / 10)
+      num_digits = num_digits + 1
+    end
+
+    reserve(num_digits + 1)
+
+    local cur = len + num_digits
+    buf[cur] = 10
+    v = value
+    repeat
+      cur = cur - 1
+      local q = math_floor(v / 10)
+      buf[cur] = 48 + (v - q * 10)
+      v = q
+    until v == 0
+
+    len = len + num_digits + 1
+  end
+
+  -- Same as C module does it: integral values are formatted by hand,
+  -- the rest with enough digits to survive a round trip.
+  local write_number = function(value)
+    if
+      value == value and value ~= 0 and
+      value >= -9007199254740992 and value <= 9007199254740992 and
+      value == math_floor(value)
+    then
+      if value < 0 then
+        reserve(1)
+        buf[len] = 45 -- '-'
+        len = len + 1
+        value = -value
+      end
+      write_digits(value)
+    else
+      write_string(string_format("%.17g\n", value))
+    end
+  end
+
+  local save_value
+
+  -- Array and hash part are split the same way C module does it
+  local is_array_key = function(k, array_size)
+    return
+      type(k) == "number" and
+      k >= 1 and k <= array_size and k == math_floor(k)
+  end
+
+  local save_table = function(t, visited)
+    if visited[t] then
+      return "save failed: circular table reference detected"
+    end
+    visited[t] = true
+
+    local array_size = #t
+
+    -- Count hash part size (we do not want to patch output afterwards)
+    local hash_size = 0
+    for k in next, t do
+      if not is_array_key(k, array_size) then
+        hash_size = hash_size + 1
+      end
+    end
+
+    write_type(84) -- 'T'
+    write_digits(array_size)
+    write_digits(hash_size)
+
+    local err
+    for i = 1, array_size do
+      err = save_value(rawget(t, i), visited)
+      if err then
+        return err
+      end
+    end
+
+    if hash_size > 0 then
+      for k, v in next, t do
+        if not is_array_key(k, array_size) then
+          err = save_value(k, visited) or save_value(v, visited)
+          if err then
+            return err
+          end
+        end
+      end
+    end
+
+    visited[t] = nil
+
+    return nil
+  end
+
+  -- Returns error message on failure
+  save_value = function(v, visited)
+    local value_type = type(v)
+
+    if value_type == "nil" then
+      write_type(45) -- '-'
+    elseif value_type == "boolean" then
+      write_type(v and 49 or 48) -- '1' or '0'
+    elseif value_type == "number" then
+      write_type(78) -- 'N'
+      write_number(v)
+    elseif value_type == "string" then
+      write_type(83) -- 'S'
+      write_digits(#v)
+      write_string(v)
+      reserve(1)
+      buf[len] = 10
+      len = len + 1
+    elseif value_type == "table" then
+      return save_table(v, visited)
+    else
+      return "save failed: unsupported value type"
+    end
+
+    return nil
+  end
+
+  save = function(...)
+    local nargs = select("#", ...)
+
+    -- If __gc metamethod calls save() while we're saving,
+    -- nested call gets a buffer of its own.
+    local nested = busy
+    local outer_buf, outer_capacity, outer_len = buf, capacity, len
+    if nested then
+      buf, capacity = nil, 0
+    end
+    busy = true
+
+    len = 0
+    write_digits(nargs)
+
+    local visited = { }
+    local err
+    for i = 1, nargs do
+      err = save_value((select(i, ...)), visited)
+      if err then
+        break
+      end
+    end
+
+    local result = not err and ffi_string(buf, len) or nil
+
+    if nested then
+      buf, capacity, len = outer_buf, outer_capacity, outer_len
+    else
+      if capacity > KEEP_SIZE then
+        buf, capacity = nil, 0
+      end
+      len = 0
+      busy = false
+    end
+
+    if err then
+      return nil, err
+    end
+
+    return result
+  end
+end
+
+--------------------------------------------------------------------------------
+
+return
+{
+  _VERSION = "luatexts-ffi 0.1.5";
+  _COPYRIGHT = "Copyright (C) 2011-2013, luatexts authors";
+  _DESCRIPTION = "Trivial Lua human-readable binary-safe serialization library";
+  --
+  save = save;
+  load = load;
+}
@@ -5,129 +5,431 @@
 -- See license in the file named COPYRIGHT
 --------------------------------------------------------------------------------
 
-local assert, error, pairs, select, type
-    = assert, error, pairs, select, type
+local assert, error, next, pairs, pcall, rawget, require, select, tonumber, type
+    = assert, error, next, pairs, pcall, rawget, require, select, tonumber, type
 
-local table_concat
-    = table.concat
+local string_byte, string_find, string_format, string_lower, string_sub
+    = string.byte, string.find, string.format, string.lower, string.sub
+
+local table_concat, unpack
+    = table.concat, unpack or table.unpack
+
+local math_floor, math_min, math_type
+    = math.floor, math.min, math.type
+
+-- LuaJIT extension, used to preallocate tables
+local table_new = (function()
+  local ok, table_new = pcall(require, 'table.new')
+  return ok and table_new or nil
+end)()
 
 --------------------------------------------------------------------------------
 
-local bit = require 'bit'
+-- LuaBitOp, Lua 5.2 bit32, or Lua 5.3+ operators (compiled at run time,
+-- so that older Lua versions can parse this file)
+local bit = (function()
+  local ok, bit = pcall(require, 'bit')
+  if ok then
+    return bit
+  end
+
+  -- Lua 5.1 can not compile the operators below, so LuaBitOp is required
+  if _VERSION == "Lua 5.1" then
+    error(bit, 0)
+  end
+
+  ok, bit = pcall(require, 'bit32')
+  if ok then
+    return bit
+  end
+
+  return assert(load([[
+    return
+    {
+      band = function(a, b) return a & b end;
+      bor = function(a, b) return a | b end;
+      lshift = function(a, n) return (a << n) & 0xFFFFFFFF end;
+      rshift = function(a, n) return (a & 0xFFFFFFFF) >> n end;
+    }
+  ]]))()
+end)()
 
 local bit_band, bit_bor, bit_lshift, bit_rshift
     = bit.band, bit.bor, bit.lshift, bit.rshift
 
 --------------------------------------------------------------------------------
 
-local save, save_cat
+local save_cat, save_cat_hinted
 do
   local handlers = { }
 
-  local handle_value = function(cat, v, visited, buf)
+  local handle_value = function(cat, v, visited, hinted)
     local handler = handlers[type(v)]
     if handler == nil then
       return nil, "can't save `" .. type(v) .. "'"
     end
-    return handler(cat, v, { }, buf)
+    return handler(cat, v, visited, hinted)
   end
 
-  handlers["nil"] = function(cat, v, visited, buf)
+  handlers["nil"] = function(cat, v, visited, hinted)
     return cat "-" "\n"
   end
 
-  handlers["boolean"] = function(cat, v, visited, buf)
+  handlers["boolean"] = function(cat, v, visited, hinted)
     return cat (v and "1" or "0") "\n"
   end
 
-  handlers["number"] = function(cat, v, visited, buf)
+  handlers["number"] = function(cat, v, visited, hinted)
     return cat "N" "\n" (("%.54g"):format(v)) "\n"
   end
 
-  handlers["string"] = function(cat, v, visited, buf)
+  handlers["string"] = function(cat, v, visited, hinted)
     return cat "S" "\n" (#v) "\n" (v) "\n"
   end
 
-  handlers["table"] = function(cat, t, visited, buf)
+  handlers["table"] = function(cat, t, visited, hinted)
     if visited[t] then
       -- TODO: This should be `return nil, err`, not `error()`!
       error("circular table reference detected")
     end
     visited[t] = true
 
-    if buf then
-      cat "T" "\n"
+    if hinted then
+      -- Size hints let loader preallocate the table
+      local array_size, num_pairs = #t, 0
+      for _ in pairs(t) do
+        num_pairs = num_pairs + 1
+      end
 
-      local array_size = #t
+      cat "p" "\n"
       cat (array_size) "\n"
+      cat (num_pairs > array_size and num_pairs - array_size or 0) "\n"
+    else
+      cat "t" "\n"
+    end
 
-      local hash_size_pos = #buf + 1
-      cat ("?") "\n"
+    for k, v in pairs(t) do
+      assert(handle_value(cat, k, visited, hinted))
+      assert(handle_value(cat, v, visited, hinted))
+    end
 
-      for i = 1, array_size do
-        handle_value(cat, t[i], visited, buf)
-      end
-
-      local hash_size = 0
-      for k, v in pairs(t) do
-        if
-          type(k) ~= "number" or
-          k > array_size or k < 1 or -- integer key in hash part of the table
-          k % 1 ~= 0 -- non-integer key
-        then
-          hash_size = hash_size + 1
-          -- TODO: return nil, err on failure instead of asserting
-          assert(handle_value(cat, k, visited, buf))
-          assert(handle_value(cat, v, visited, buf))
+    handle_value(cat, nil, visited, hinted)
+
+    visited[t] = nil
+
+    return cat
+  end
+
+  local save_tuple = function(hinted, cat, ...)
+    local nargs = select("#", ...)
+
+    cat (nargs) "\n"
+
+    for i = 1, nargs do
+      handle_value(cat, select(i, ...), { }, hinted)
+    end
+
+    return cat
+  end
+
+  save_cat = function(cat, ...)
+    return save_tuple(false, cat, ...)
+  end
+
+  save_cat_hinted = function(cat, ...)
+    return save_tuple(true, cat, ...)
+  end
+end
+
+--------------------------------------------------------------------------------
+
+-- Serializes to a single string.
+-- Pieces go to a preallocated buffer table, reused between calls,
+-- and are concatenated once at the end.
+local save, save_dedup
+do
+  local BUF_SIZE = 1024 -- Buffers that grow past this are not kept
+  local MAX_U = 4294967295 -- Largest integer every luatexts reader accepts
+
+  local new_buf = function()
+    return table_new and table_new(BUF_SIZE, 0) or { }
+  end
+
+  local buf, n, visited = new_buf(), 0, { }
+  local busy = false
+
+  -- Set by save_dedup() only: number of the first occurrence of each string
+  -- (strings written in full are numbered from one), and the last number.
+  -- Same for tables, which may be referenced from inside themselves.
+  local string_index, num_strings = nil, 0
+  local table_index, num_tables = nil, 0
+
+  -- Shortest of %.15g, %.16g and %.17g that reads back as the same double
+  local format_float = function(v)
+    if math_type and math_type(v) == "integer" then
+      return string_format("%d", v)
+    end
+    local s = string_format("%.15g", v)
+    if tonumber(s) ~= v then
+      s = string_format("%.16g", v)
+      if tonumber(s) ~= v then
+        s = string_format("%.17g", v)
+      end
+    end
+    return s
+  end
+
+  local put_number = function(v)
+    local tag, s = "N\n", nil
+    if math_type and math_type(v) == "float" then
+      s = format_float(v)
+      if not string_find(s, "[.ein]") then -- Keep float subtype on 5.3+
+        s = s .. ".0"
+      end
+    elseif v % 1 ~= 0 or v > MAX_U or v < 0 or 1/v < 0 then -- 1/v is for -0
+      s = format_float(v)
+    else
+      tag, s = "U\n", string_format("%.0f", v)
+      if v >= 65536 then -- Hex may be shorter, halves fit any C long
+        local hex = string_format("%X%04X", math_floor(v / 65536), v % 65536)
+        if #hex < #s then
+          tag, s = "H\n", hex
         end
       end
+    end
+    buf[n + 1], buf[n + 2], buf[n + 3] = tag, s, "\n"
+    n = n + 3
+  end
+
+  local put_value
+
+  local put_table = function(t)
+    if table_index then
+      local index = table_index[t]
+      if index ~= nil then
+        buf[n + 1], buf[n + 2], buf[n + 3] = "r\n", index, "\n"
+        n = n + 3
+        return
+      end
+      num_tables = num_tables + 1
+      table_index[t] = num_tables
+    else
+      if visited[t] then
+        return "circular table reference detected"
+      end
+      visited[t] = true
+    end
 
-      buf[hash_size_pos] = hash_size
-    else -- Streaming mode
-      cat "t" "\n"
+    local array_size = #t
+    buf[n + 1], buf[n + 2], buf[n + 3] = "T\n", array_size, "\n"
+    n = n + 5
+    local hash_size_pos = n - 1 -- Filled in when hash part is written
+    buf[n] = "\n"
 
-      for k, v in pairs(t) do
-        assert(handle_value(cat, k, visited, buf))
-        assert(handle_value(cat, v, visited, buf))
+    for i = 1, array_size do
+      local err = put_value(rawget(t, i))
+      if err then
+        return err
       end
+    end
 
-      handle_value(cat, nil, visited, buf)
+    local hash_size = 0
+    for k, v in next, t do
+      if
+        type(k) ~= "number" or
+        k > array_size or k < 1 or -- integer key in hash part of the table
+        k % 1 ~= 0 -- non-integer key
+      then
+        hash_size = hash_size + 1
+        local err = put_value(k) or put_value(v)
+        if err then
+          return err
+        end
+      end
     end
+    buf[hash_size_pos] = hash_size
 
     visited[t] = nil
+  end
 
-    return cat
+  -- Back-reference is written if it is shorter than the string
+  local put_string_ref = function(v, index)
+    local size = #v
+    if #string_format("%d", index) > size + #string_format("%d", size) then
+      return false
+    end
+
+    buf[n + 1], buf[n + 2], buf[n + 3] = "s\n", index, "\n"
+    n = n + 3
+    return true
+  end
+
+  -- Returns error message on failure, nothing on success
+  put_value = function(v)
+    local t = type(v)
+    if t == "string" then
+      if string_index then
+        local index = string_index[v]
+        if index ~= nil and put_string_ref(v, index) then
+          return
+        end
+        num_strings = num_strings + 1
+        if index == nil then
+          string_index[v] = num_strings
+        end
+      end
+      buf[n + 1], buf[n + 2], buf[n + 3], buf[n + 4] = "S\n", #v, "\n", v
+      n = n + 5
+      buf[n] = "\n"
+    elseif t == "number" then
+      put_number(v)
+    elseif t == "table" then
+      return put_table(v)
+    elseif t == "boolean" then
+      n = n + 1
+      buf[n] = v and "1\n" or "0\n"
+    elseif t == "nil" then
+      n = n + 1
+      buf[n] = "-\n"
+    else
+      return "can't save `" .. t .. "'"
+    end
   end
 
-  local impl = function(buf, cat, ...)
+  local impl = function(...)
     local nargs = select("#", ...)
 
-    cat (nargs) "\n"
+    buf[1], buf[2] = nargs, "\n"
+    n = 2
 
     for i = 1, nargs do
-      handle_value(cat, select(i, ...), { }, buf)
+      local err = put_value((select(i, ...)))
+      if err then
+        return nil, "save failed: " .. err
+      end
     end
 
-    return cat
+    return table_concat(buf, "", 1, n)
   end
 
-  save_cat = function(cat, ...)
-    return impl(nil, cat, ...)
+  -- Drops references to saved data, so that the buffer does not keep it alive.
+  -- If save was interrupted by an error, n and visited may be off.
+  local reset = function(interrupted)
+    if interrupted or n > BUF_SIZE then
+      buf = new_buf()
+    else
+      for i = 1, n do
+        buf[i] = nil
+      end
+    end
+    n = 0
+
+    if interrupted or next(visited) ~= nil then
+      visited = { }
+    end
+  end
+
+  -- Errors (like stack overflow on deeply nested tables) are rethrown
+  -- after the state is reset
+  local run = function(dedup, ...)
+    if not busy then
+      busy = true
+      string_index, num_strings = dedup and { } or nil, 0
+      table_index, num_tables = dedup and { } or nil, 0
+      local ok, result, err = pcall(impl, ...)
+      reset(not ok)
+      string_index, table_index = nil, nil
+      busy = false
+      if not ok then
+        error(result, 0)
+      end
+      return result, err
+    end
+
+    -- Called from a __gc metamethod in the middle of another save
+    local old_buf, old_n, old_visited = buf, n, visited
+    local old_string_index, old_num_strings = string_index, num_strings
+    local old_table_index, old_num_tables = table_index, num_tables
+    buf, visited = new_buf(), { }
+    string_index, num_strings = dedup and { } or nil, 0
+    table_index, num_tables = dedup and { } or nil, 0
+    local ok, result, err = pcall(impl, ...)
+    buf, n, visited = old_buf, old_n, old_visited
+    string_index, num_strings = old_string_index, old_num_strings
+    table_index, num_tables = old_table_index, old_num_tables
+    if not ok then
+      error(result, 0)
+    end
+    return result, err
   end
 
   save = function(...)
-    local buf = { }
-    local function cat(s) buf[#buf + 1] = s; return cat end
+    return run(false, ...)
+  end
 
-    impl(buf, cat, ...)
+  -- Repeated strings and tables are written as back-references
+  save_dedup = function(...)
+    return run(true, ...)
+  end
+end
+
+--------------------------------------------------------------------------------
+
+local UTF8_ACCEPT, UTF8_REJECT, utf8_decode
+do
+  -- Based on MIT-licensed Flexible and Economical UTF-8 Decoder
+  -- by Bjoern Hoehrmann <bjoern@hoehrmann.de>
+  -- http://bjoern.hoehrmann.de/utf-8/decoder/dfa/
+
+  UTF8_ACCEPT = 0
+  UTF8_REJECT = 1
+
+  local utf8d =
+  {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, -- 00..1f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, -- 20..3f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, -- 40..5f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, -- 60..7f
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, -- 80..9f
+    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, -- a0..bf
+    8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, -- c0..df
+    0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, -- e0..ef
+    0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, -- f0..ff
+    0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, -- s0..s0
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, -- s1..s2
+    1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, -- s3..s4
+    1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, -- s5..s6
+    1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, -- s7..s8
+  }
 
-    return table_concat(buf)
+  -- Note: Keeping code as close to the C original as possible.
+  --       Thus the magic numbers without constants.
+  utf8_decode = function(state, codep, byte)
+    local byte_type = utf8d[byte + 1]
+
+    codep = (state ~= UTF8_ACCEPT)
+      and
+      (
+        bit_bor(
+            bit_band(byte, 0x3f),
+            bit_lshift(codep, 6)
+          )
+      )
+      or
+      (
+        bit_band(
+            bit_rshift(0xff, byte_type),
+            byte
+          )
+      )
+
+    return utf8d[256 + state * 16 + byte_type + 1], codep
   end
 end
 
 --------------------------------------------------------------------------------
 
-local load, load_from_buffer
+local load_from_buffer
 do
   local make_read_buf
   do
@@ -168,6 +470,10 @@ do
       return result
     end
 
+    local unread = function(self)
+      return #self.str_ - self.next_ + 1
+    end
+
     local good = function(self)
       return not self.failed_
     end
@@ -190,6 +496,7 @@ do
       {
         read = read;
         readpattern = readpattern;
+        unread = unread;
         --
         good = good;
         fail = fail;
@@ -266,57 +573,52 @@ do
 
   local read_uint10 = uint(10)
 
-  local read_utf8
-  do
-    -- Based on MIT-licensed Flexible and Economical UTF-8 Decoder
-    -- by Bjoern Hoehrmann <bjoern@hoehrmann.de>
-    -- http://bjoern.hoehrmann.de/utf-8/decoder/dfa/
+  -- Strings and tables of the tuple being loaded, for back-references
+  local strings, num_strings = nil, 0
+  local tables, num_tables = nil, 0
+
+  local add_string = function(v)
+    num_strings = num_strings + 1
+    strings[num_strings] = v
+    return v
+  end
 
-    local UTF8_ACCEPT = 0
-    local UTF8_REJECT = 1
+  local add_table = function(t)
+    num_tables = num_tables + 1
+    tables[num_tables] = t
+    return t
+  end
 
-    local utf8d =
-    {
-      0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, -- 00..1f
-      0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, -- 20..3f
-      0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, -- 40..5f
-      0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, -- 60..7f
-      1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, -- 80..9f
-      7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, -- a0..bf
-      8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, -- c0..df
-      0xa,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x3,0x4,0x3,0x3, -- e0..ef
-      0xb,0x6,0x6,0x6,0x5,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8,0x8, -- f0..ff
-      0x0,0x1,0x2,0x3,0x5,0x8,0x7,0x1,0x1,0x1,0x4,0x6,0x1,0x1,0x1,0x1, -- s0..s0
-      1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,1,1,1,1,0,1,0,1,1,1,1,1,1, -- s1..s2
-      1,2,1,1,1,1,1,2,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1, -- s3..s4
-      1,2,1,1,1,1,1,1,1,2,1,1,1,1,1,1,1,1,1,1,1,1,1,3,1,3,1,1,1,1,1,1, -- s5..s6
-      1,3,1,1,1,1,1,3,1,3,1,1,1,1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1,1,1,1, -- s7..s8
-    }
+  local read_string_ref = function(buf)
+    local index = read_uint10(buf)
+    if not buf:good() then
+      return nil
+    end
 
-    -- Note: Keeping code as close to the C original as possible.
-    --       Thus the magic numbers without constants.
-    local decode = function(state, codep, byte)
-      local byte_type = utf8d[byte + 1]
-
-      codep = (state ~= UTF8_ACCEPT)
-        and
-        (
-          bit_bor(
-              bit_band(byte, 0x3f),
-              bit_lshift(codep, 6)
-            )
-        )
-        or
-        (
-          bit_band(
-              bit_rshift(0xff, byte_type),
-              byte
-            )
-        )
+    if index < 1 or index > num_strings then
+      buf:fail("load failed: bad string reference")
+      return nil
+    end
 
-      return utf8d[256 + state * 16 + byte_type + 1], codep
+    return strings[index]
+  end
+
+  local read_table_ref = function(buf)
+    local index = read_uint10(buf)
+    if not buf:good() then
+      return nil
+    end
+
+    if index < 1 or index > num_tables then
+      buf:fail("load failed: bad table reference")
+      return nil
     end
 
+    return tables[index]
+  end
+
+  local read_utf8
+  do
     read_utf8 = function(buf)
       local length = read_uint10(buf)
       if not buf:good() then
@@ -339,7 +641,7 @@ do
 
           result[#result + 1] = char
 
-          state, codepoint = decode(state, codepoint, char:byte())
+          state, codepoint = utf8_decode(state, codepoint, char:byte())
           if state == UTF8_ACCEPT then
             length = length - 1
           elseif state == UTF8_REJECT then
@@ -357,16 +659,31 @@ do
         return nil
       end
 
-      return result
+      return add_string(result)
     end
   end
 
+  local read_value
+
+  local read_stream_table = function(buf, r)
+    while buf:good() do
+      local k = read_value(buf)
+      if buf:good() then
+        if k == nil then
+          break -- end of table
+        else
+          r[k] = read_value(buf)
+        end
+      end
+    end
+
+    return r
+  end
+
   local unsupported = function(buf)
     buf:fail("load failed: unsupported value type")
   end
 
-  local read_value
-
   local value_readers =
   {
     ['-'] = invariant(nil);
@@ -394,10 +711,12 @@ do
         return nil
       end
 
-      return v
+      return add_string(v)
     end;
 
     ['8'] = read_utf8;
+    ['s'] = read_string_ref;
+    ['r'] = read_table_ref;
 
     ['T'] = function(buf)
       local array_size = read_uint10(buf)
@@ -410,7 +729,7 @@ do
         return
       end
 
-      local r = { }
+      local r = add_table({ })
 
       for i = 1, array_size do
         if not buf:good() then
@@ -439,20 +758,33 @@ do
     end;
 
     ['t'] = function(buf)
-      local r = { }
+      return read_stream_table(buf, add_table({ }))
+    end;
 
-      while buf:good() do
-        local k = read_value(buf)
-        if buf:good() then
-          if k == nil then
-            break -- end of table
-          else
-            r[k] = read_value(buf)
-          end
-        end
+    -- Size hints are not trusted, each pair takes at least four bytes
+    ['p'] = function(buf)
+      local array_hint = read_uint10(buf)
+      if not buf:good() then
+        return
       end
 
-      return r
+      local hash_hint = read_uint10(buf)
+      if not buf:good() then
+        return
+      end
+
+      local r
+      if table_new and buf.unread then
+        local max_pairs = math_floor(buf:unread() / 4)
+        r = table_new(
+            math_min(array_hint, max_pairs),
+            math_min(hash_hint, max_pairs)
+          )
+      else
+        r = { }
+      end
+
+      return read_stream_table(buf, add_table(r))
     end;
   }
 
@@ -474,7 +806,7 @@ do
   -- TODO: Cover this with separate tests.
   --       Most importantly, test that readpattern's pattern
   --       always ends with '\n'
-  load_from_buffer = function(buf)
+  local load_tuple = function(buf)
     local n = read_uint10(buf)
     if not buf:good() then
       return buf:result()
@@ -493,6 +825,374 @@ do
     return true, unpack(r, 1, n)
   end
 
+  local restore_refs = function(
+      old_strings, old_num_strings, old_tables, old_num_tables, ...
+    )
+    strings, num_strings = old_strings, old_num_strings
+    tables, num_tables = old_tables, old_num_tables
+    return ...
+  end
+
+  load_from_buffer = function(buf)
+    -- Buffer methods may call us recursively
+    local old_strings, old_num_strings = strings, num_strings
+    local old_tables, old_num_tables = tables, num_tables
+    strings, num_strings = { }, 0
+    tables, num_tables = { }, 0
+    return restore_refs(
+        old_strings, old_num_strings, old_tables, old_num_tables,
+        load_tuple(buf)
+      )
+  end
+
+end
+
+--------------------------------------------------------------------------------
+
+-- Loads data from a string.
+-- Works on positions in the string and does not create per-value closures
+-- or strings other than values themselves (unlike load_from_buffer()).
+local load
+do
+  local fail = function(msg)
+    error(msg, 0) -- Caught in load()
+  end
+
+  -- Eats '\n' or '\r\n' at pos, returns position after it
+  local eat_eol = function(str, pos)
+    local b = string_byte(str, pos)
+    if b == 10 then -- '\n'
+      return pos + 1
+    end
+    if b == 13 and string_byte(str, pos + 1) == 10 then -- '\r\n'
+      return pos + 2
+    end
+    if b == nil or pos + 1 > #str then
+      fail("load failed: not enough data in buffer")
+    end
+    fail("load failed: garbage before newline")
+  end
+
+  local uint_patterns =
+  {
+    [16] = "^([0-9a-fA-F]+)\r?\n";
+    [36] = "^([0-9a-zA-Z]+)\r?\n";
+  }
+
+  -- Returns value and position after it
+  local uint = function(base)
+    local pattern = assert(uint_patterns[base])
+
+    return function(str, pos)
+      local _, finish, digits = string_find(str, pattern, pos)
+      if not finish then
+        if pos > #str then
+          fail("load failed: not enough data in buffer")
+        end
+        fail("load failed: not an unsigned integer")
+      end
+
+      local v = tonumber(digits, base)
+      if v > 4294967295 then
+        fail("load failed: uint is too huge")
+      end
+
+      return v, finish + 1
+    end
+  end
+
+  -- Sizes are read all the time, and they are short, so reading
+  -- them byte by byte is faster than a pattern match
+  local read_uint10 = function(str, pos)
+    local v = 0
+    local start = pos
+    local b = string_byte(str, pos)
+    while b and b >= 48 and b <= 57 do -- '0'..'9'
+      v = v * 10 + (b - 48)
+      if v > 4294967295 then
+        fail("load failed: uint is too huge")
+      end
+      pos = pos + 1
+      b = string_byte(str, pos)
+    end
+
+    if pos == start then
+      if not b then
+        fail("load failed: not enough data in buffer")
+      end
+      fail("load failed: not an unsigned integer")
+    end
+
+    if b == 10 then -- '\n'
+      return v, pos + 1
+    end
+
+    return v, eat_eol(str, pos)
+  end
+
+  local read_uint16 = uint(16)
+  local read_uint36 = uint(36)
+
+  -- Lua 5.2+ tonumber() does not accept these, C strtod() does
+  local special_numbers =
+  {
+    ["nan"] = 0/0, ["-nan"] = 0/0, ["+nan"] = 0/0;
+    ["inf"] = 1/0, ["-inf"] = -1/0, ["+inf"] = 1/0;
+    ["infinity"] = 1/0, ["-infinity"] = -1/0, ["+infinity"] = 1/0;
+  }
+
+  local read_number = function(str, pos)
+    local nl = string_find(str, "\n", pos, true)
+    if not nl then
+      fail("load failed: not enough data in buffer")
+    end
+
+    local last = nl - 1
+    if last >= pos and string_byte(str, last) == 13 then -- '\r'
+      last = last - 1
+    end
+
+    local s = string_sub(str, pos, last)
+    local v = tonumber(s) or special_numbers[string_lower(s)]
+    if not v then
+      fail("load failed: not a number")
+    end
+
+    return v, nl + 1
+  end
+
+  -- Strings and tables of the tuple being loaded, for back-references
+  local strings, num_strings = nil, 0
+  local tables, num_tables = nil, 0
+
+  local read_string = function(str, pos)
+    local length
+    length, pos = read_uint10(str, pos)
+
+    local last = pos + length - 1
+    if last > #str then
+      fail("load failed: not enough data in buffer")
+    end
+
+    local v = string_sub(str, pos, last)
+    num_strings = num_strings + 1
+    strings[num_strings] = v
+
+    return v, eat_eol(str, last + 1)
+  end
+
+  -- Strings are numbered from one in the order they appear in the tuple
+  local read_string_ref = function(str, pos)
+    local index
+    index, pos = read_uint10(str, pos)
+
+    if index < 1 or index > num_strings then
+      fail("load failed: bad string reference")
+    end
+
+    return strings[index], pos
+  end
+
+  -- Tables are numbered from one in the order they appear in the tuple
+  local read_table_ref = function(str, pos)
+    local index
+    index, pos = read_uint10(str, pos)
+
+    if index < 1 or index > num_tables then
+      fail("load failed: bad table reference")
+    end
+
+    return tables[index], pos
+  end
+
+  local add_table = function(t)
+    num_tables = num_tables + 1
+    tables[num_tables] = t
+    return t
+  end
+
+  -- Length is given in codepoints
+  local read_utf8 = function(str, pos)
+    local length
+    length, pos = read_uint10(str, pos)
+
+    local start = pos
+    local size = #str
+    while length > 0 do
+      -- Skip ASCII characters all at once
+      local non_ascii = string_find(str, "[\128-\255]", pos) or (size + 1)
+      if non_ascii - pos >= length then
+        pos = pos + length
+        break
+      end
+      length = length - (non_ascii - pos)
+      pos = non_ascii
+
+      if pos > size then
+        fail("load failed: not enough data in buffer")
+      end
+
+      local state, codepoint = UTF8_ACCEPT, 0
+      repeat
+        local b = string_byte(str, pos)
+        if not b then
+          fail("load failed: not enough data in buffer")
+        end
+        pos = pos + 1
+
+        state, codepoint = utf8_decode(state, codepoint, b)
+        if state == UTF8_REJECT then
+          fail("load failed: invalid utf-8 data")
+        end
+      until state == UTF8_ACCEPT
+
+      length = length - 1
+    end
+
+    local v = string_sub(str, start, pos - 1)
+    num_strings = num_strings + 1
+    strings[num_strings] = v
+
+    return v, eat_eol(str, pos)
+  end
+
+  local read_value
+
+  local check_key = function(k)
+    if k == nil then
+      fail("load failed: table key is nil")
+    end
+    if k ~= k then
+      fail("load failed: table key is nan")
+    end
+  end
+
+  local read_fixed_table = function(str, pos)
+    local array_size, hash_size
+    array_size, pos = read_uint10(str, pos)
+    hash_size, pos = read_uint10(str, pos)
+
+    local r = add_table({ })
+
+    local v
+    for i = 1, array_size do
+      v, pos = read_value(str, pos)
+      r[i] = v
+    end
+
+    local k
+    for i = 1, hash_size do
+      k, pos = read_value(str, pos)
+      check_key(k)
+      v, pos = read_value(str, pos)
+      r[k] = v
+    end
+
+    return r, pos
+  end
+
+  local read_stream_table = function(str, pos, r)
+    local k, v
+    while true do
+      k, pos = read_value(str, pos)
+      if k == nil then
+        return r, pos -- End of table
+      end
+      check_key(k)
+      v, pos = read_value(str, pos)
+      r[k] = v
+    end
+  end
+
+  -- Size hints are not trusted, each pair takes at least four bytes
+  local read_hinted_table = function(str, pos)
+    local array_hint, hash_hint
+    array_hint, pos = read_uint10(str, pos)
+    hash_hint, pos = read_uint10(str, pos)
+
+    local r
+    if table_new then
+      local max_pairs = math_floor((#str - pos + 1) / 4)
+      r = table_new(
+          math_min(array_hint, max_pairs),
+          math_min(hash_hint, max_pairs)
+        )
+    else
+      r = { }
+    end
+
+    return read_stream_table(str, pos, add_table(r))
+  end
+
+  read_value = function(str, pos)
+    local value_type, b1, b2 = string_byte(str, pos, pos + 2)
+    if b1 == 10 then -- '\n'
+      pos = pos + 2
+    elseif b1 == 13 and b2 == 10 then -- '\r\n'
+      pos = pos + 3
+    elseif b2 == nil then
+      fail("load failed: not enough data in buffer")
+    else
+      fail("load failed: garbage before newline")
+    end
+
+    if value_type == 45 then -- '-'
+      return nil, pos
+    elseif value_type == 48 then -- '0'
+      return false, pos
+    elseif value_type == 49 then -- '1'
+      return true, pos
+    elseif value_type == 78 then -- 'N'
+      return read_number(str, pos)
+    elseif value_type == 85 then -- 'U'
+      return read_uint10(str, pos)
+    elseif value_type == 72 then -- 'H'
+      return read_uint16(str, pos)
+    elseif value_type == 90 then -- 'Z'
+      return read_uint36(str, pos)
+    elseif value_type == 83 then -- 'S'
+      return read_string(str, pos)
+    elseif value_type == 56 then -- '8'
+      return read_utf8(str, pos)
+    elseif value_type == 115 then -- 's'
+      return read_string_ref(str, pos)
+    elseif value_type == 114 then -- 'r'
+      return read_table_ref(str, pos)
+    elseif value_type == 84 then -- 'T'
+      return read_fixed_table(str, pos)
+    elseif value_type == 116 then -- 't'
+      return read_stream_table(str, pos, add_table({ }))
+    elseif value_type == 112 then -- 'p'
+      return read_hinted_table(str, pos)
+    end
+
+    fail("load failed: unknown value type")
+  end
+
+  local load_tuple = function(str)
+    local n, pos = read_uint10(str, 1)
+
+    local r = { }
+    for i = 1, n do
+      r[i], pos = read_value(str, pos)
+    end
+
+    return true, unpack(r, 1, n)
+  end
+
+  local check_result = function(
+      old_strings, old_num_strings, old_tables, old_num_tables, ok, ...
+    )
+    strings, num_strings = old_strings, old_num_strings
+    tables, num_tables = old_tables, old_num_tables
+
+    if ok then
+      return ...
+    end
+
+    return nil, (...)
+  end
+
   load = function(str)
     if type(str) ~= "string" then -- TODO: Support io.file?
       -- Imitating C API to simplify tests
@@ -501,8 +1201,17 @@ do
         )
     end
 
-    return load_from_buffer(
-        make_read_buf(str)
+    -- Could be called from __gc while loading
+    local old_strings, old_num_strings = strings, num_strings
+    local old_tables, old_num_tables = tables, num_tables
+    strings, num_strings = { }, 0
+    tables, num_tables = { }, 0
+
+    -- Errors, including stack overflow on too deeply nested data,
+    -- are returned as nil, err
+    return check_result(
+        old_strings, old_num_strings, old_tables, old_num_tables,
+        pcall(load_tuple, str)
       )
   end
 end
@@ -516,7 +1225,9 @@ return
   _DESCRIPTION = "Trivial Lua human-readable binary-safe serialization library";
   --
   save = save;
+  save_dedup = save_dedup;
   save_cat = save_cat;
+  save_cat_hinted = save_cat_hinted;
   load = load;
   load_from_buffer = load_from_buffer;
 }
@@ -6,6 +6,11 @@
 
 class Luatexts
 {
+  // Set by save_dedup() only: number of the first occurrence of each string
+  // (strings saved in full are numbered from one).
+  private static $string_index = null;
+  private static $num_strings = 0;
+
   private static function save_boolean($v)
   {
     return ($v) ? "1\n" : "0\n";
@@ -23,7 +28,29 @@ class Luatexts
 
   private static function save_string($v)
   {
-    return "8\n" . mb_strlen($v, 'UTF-8') . "\n" . $v . "\n";
+    $length = mb_strlen($v, 'UTF-8');
+
+    if (self::$string_index !== null)
+    {
+      $index = isset(self::$string_index[$v]) ? self::$string_index[$v] : 0;
+
+      // Back-reference is saved if it is shorter than the string
+      if (
+          $index > 0 &&
+          strlen(strval($index)) <= strlen(strval($length)) + strlen($v)
+        )
+      {
+        return "s\n" . $index . "\n";
+      }
+
+      ++self::$num_strings;
+      if ($index == 0)
+      {
+        self::$string_index[$v] = self::$num_strings;
+      }
+    }
+
+    return "8\n" . $length . "\n" . $v . "\n";
   }
 
   // This function auto-converts all integer keys be one-based
@@ -108,5 +135,27 @@ class Luatexts
 
     return $result;
   }
+
+  // Same as save(), but saves repeated strings as back-references.
+  public static function save_dedup()
+  {
+    self::$string_index = array();
+    self::$num_strings = 0;
+
+    try
+    {
+      $args = func_get_args();
+      $result = call_user_func_array(array('Luatexts', 'save'), $args);
+    }
+    catch (Exception $e)
+    {
+      self::$string_index = null;
+      throw $e;
+    }
+
+    self::$string_index = null;
+
+    return $result;
+  }
 }
 ?>
@@ -0,0 +1,87 @@
+-- Tests of the plain Lua module alone, for Lua versions that the
+-- rest of the suite (which needs the C module and lua-nucleo) is not run on.
+--
+-- Usage (from the project root):
+--
+--   LUA_PATH="src/lua/?.lua;;" lua test/test-lua.lua
+
+local luatexts_lua = require 'luatexts.lua'
+
+local unpack = unpack or table.unpack
+
+local deep_equals
+deep_equals = function(lhs, rhs)
+  if type(lhs) ~= "table" or type(rhs) ~= "table" then
+    return lhs == rhs
+  end
+  for k, v in pairs(lhs) do
+    if not deep_equals(v, rhs[k]) then
+      return false
+    end
+  end
+  for k in pairs(rhs) do
+    if lhs[k] == nil then
+      return false
+    end
+  end
+  return true
+end
+
+local check = function(name, ok)
+  if not ok then
+    error(name .. ": failed", 2)
+  end
+end
+
+local check_returns = function(name, expected, ...)
+  local n = select("#", ...)
+  check(name .. " count", n == #expected)
+  for i = 1, n do
+    check(name .. " value " .. i, deep_equals((select(i, ...)), expected[i]))
+  end
+end
+
+print("===== BEGIN plain Lua module tests", _VERSION, "=====")
+
+check_returns("empty tuple", { true }, luatexts_lua.load("0\n"))
+
+check_returns(
+    "scalars",
+    { true, 42, "Ёж", false },
+    luatexts_lua.load("3\nU\n42\n8\n2\nЁж\n0\n")
+  )
+
+do
+  local values =
+  {
+    1, -0.5, 1e300, "string", "", true, false,
+    { 1, 2, 3, x = { y = "z" } },
+    { [{ }] = 1 },
+  }
+  local n = #values
+
+  local data = assert(luatexts_lua.save(unpack(values, 1, n)))
+  local results = { luatexts_lua.load(data) }
+  check("round trip ok", results[1] == true)
+  for i = 1, 7 do
+    check("round trip " .. i, results[i + 1] == values[i])
+  end
+  check("round trip table", deep_equals(results[9], values[8]))
+  check("round trip table key", next(results[10]) ~= nil)
+
+  data = assert(luatexts_lua.save_dedup(values[8], values[8]))
+  local ok, a, b = luatexts_lua.load(data)
+  check("dedup round trip", ok == true and a == b)
+  check("dedup round trip value", deep_equals(a, values[8]))
+end
+
+do
+  local ok, err = luatexts_lua.load("1\nU\n")
+  check("truncated", ok == nil and type(err) == "string")
+
+  ok, err = luatexts_lua.load("1\n8\n1\n\255\n")
+  check("bad utf-8", ok == nil and err == "load failed: invalid utf-8 data")
+end
+
+print("===== END plain Lua module tests", _VERSION, "=====")
+print("OK")
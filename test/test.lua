@@ -7,9 +7,17 @@ require = import 'lua-nucleo/require_and_declare.lua' { 'require_and_declare' }
 
 math.randomseed(12345)
 
+local unpack = unpack or table.unpack
+
 local luatexts = require 'luatexts'
 local luatexts_lua = require 'luatexts.lua'
 
+-- LuaJIT only
+local luatexts_ffi = (function()
+  local ok, luatexts_ffi = pcall(require, 'luatexts.ffi')
+  return ok and luatexts_ffi or nil
+end)()
+
 local ensure,
       ensure_equals,
       ensure_tequals,
@@ -1183,7 +1191,66 @@ end)()
 
 --------------------------------------------------------------------------------
 
-for LOAD_NAME, LOAD in pairs { C = luatexts.load, LUA = luatexts_lua.load } do
+-- Feeds data to the push decoder in random chunks of up to max_chunk bytes.
+-- Returns whatever the feed() call that stopped decoding returned.
+local feed_in_chunks
+do
+  local pack = function(...)
+    return { n = select("#", ...), ... }
+  end
+
+  feed_in_chunks = function(decoder, data, max_chunk)
+    while true do
+      local len = math.random(1, max_chunk)
+      if len >= #data then
+        return decoder:feed(data)
+      end
+
+      local results = pack(decoder:feed(data:sub(1, len)))
+      if results[1] ~= "more" then
+        return unpack(results, 1, results.n)
+      end
+
+      data = data:sub(len + 1)
+    end
+  end
+end
+
+-- Calls load_lazy() and loads all proxies in results recursively.
+-- Throws if some proxy fails to load.
+local load_lazy_deep
+do
+  local pack = function(...)
+    return { n = select("#", ...), ... }
+  end
+
+  local materialize_deep
+  materialize_deep = function(value, visited)
+    if type(value) == "table" and not visited[value] then
+      visited[value] = true
+      luatexts.materialize(value)
+      for k, v in pairs(value) do
+        materialize_deep(k, visited)
+        materialize_deep(v, visited)
+      end
+    end
+  end
+
+  load_lazy_deep = function(...)
+    local results = pack(luatexts.load_lazy(...))
+    for i = 2, results.n do
+      materialize_deep(results[i], { })
+    end
+    return unpack(results, 1, results.n)
+  end
+end
+
+for LOAD_NAME, LOAD in pairs {
+    C = luatexts.load,
+    LUA = luatexts_lua.load,
+    FFI = luatexts_ffi and luatexts_ffi.load
+  }
+do
   for NAME, NL in pairs {
       [LOAD_NAME .. "-" .. "LF"] = "\n", [LOAD_NAME .. "-" .. "CRLF"] = "\r\n"
     }
@@ -1311,21 +1378,45 @@ for LOAD_NAME, LOAD in pairs { C = luatexts.load, LUA = luatexts_lua.load } do
     print("===== END core tests", NAME, "=====")
 
     for _, BASE in ipairs({ "U", "H", "Z" }) do
-      local PARAM =
-      ({
+      -- C and FFI implementations support full 64-bit range
+      local PARAM = (LOAD_NAME ~= "LUA")
+      and ({
+        U =
+        {
+          max = '18446744073709551615', trunc = '18446744073709551616';
+          max_value = 2^64;
+          noneg = true, notrunc = true;
+        };
+        H =
+        {
+          max = 'FFFFFFFFFFFFFFFF', trunc = '10000000000000000';
+          max_value = 2^64;
+          noneg = true, notrunc = true;
+        };
+        Z =
+        {
+          max = '3W5E11264SGSF', trunc = '3W5E11264SGSG';
+          max_value = 2^64;
+          noneg = true, notrunc = true;
+        };
+      })[BASE]
+      or ({
         U =
         {
           max = '4294967295', trunc = '4294967296';
+          max_value = 4294967295;
           noneg = true, notrunc = true;
         };
         H =
         {
           max = 'FFFFFFFF', trunc = '100000000';
+          max_value = 4294967295;
           noneg = true, notrunc = true;
         };
         Z =
         {
           max = '1Z141Z3', trunc = '1Z141Z4';
+          max_value = 4294967295;
           noneg = true, notrunc = true;
         };
       })[BASE]
@@ -1410,7 +1501,7 @@ for LOAD_NAME, LOAD in pairs { C = luatexts.load, LUA = luatexts_lua.load } do
 
       ensure_returns(
           "huge uint " .. NAME,
-          2, { true, 4294967295 },
+          2, { true, PARAM.max_value },
           LOAD(
               '1' .. NL
            .. BASE .. NL
@@ -1485,6 +1576,49 @@ for LOAD_NAME, LOAD in pairs { C = luatexts.load, LUA = luatexts_lua.load } do
           )
       )
 
+    -- Results must be the same as with correctly rounded strtod()
+    for i = 1, 1e3 do
+      local r = math.random(1, 4)
+      local str
+      if r == 1 then
+        str = ("%.17g"):format(math.random() * 10 ^ math.random(-320, 308))
+      elseif r == 2 then
+        str = ("%." .. math.random(1, 17) .. "g"):format(
+            (math.random() - 0.5) * 10 ^ math.random(-30, 30)
+          )
+      elseif r == 3 then
+        -- Bounds must fit to int on Lua 5.1
+        str = (math.random(0, 2 ^ 30) * 2 + math.random(0, 1))
+          .. math.random(0, 99999)
+          .. "e" .. math.random(-345, 315)
+      else
+        str = math.random(0, 99999) .. "." .. math.random(0, 99999)
+      end
+
+      ensure_returns(
+          "number " .. str .. " " .. NAME,
+          2, { true, tonumber(str) },
+          LOAD(
+              '1' .. NL
+           .. 'N' .. NL
+             .. str .. NL
+            )
+        )
+    end
+
+    -- Newline at each position in a vector-sized block
+    for i = 0, 70 do
+      ensure_returns(
+          "number with " .. i .. " leading zeroes " .. NAME,
+          2, { true, 4.2 },
+          LOAD(
+              '1' .. NL
+           .. 'N' .. NL
+             .. ('0'):rep(i) .. '4.2' .. NL
+            )
+        )
+    end
+
     ensure_returns(
         "inf " .. NAME,
         2, { true, 1/0 },
@@ -1842,14 +1976,14 @@ for LOAD_NAME, LOAD in pairs { C = luatexts.load, LUA = luatexts_lua.load } do
       85; -- 6-byte sequence is illegal
       93; -- Overlong form
       --
-      -- C-only
+      -- C and FFI only
       --
       -- BOM non-character sequence is legitimately rejected by C reader,
       -- Lua reader does not care (should it be fixed to?).
-      (LOAD_NAME == "C") and 82 or nil;
+      (LOAD_NAME ~= "LUA") and 82 or nil;
       -- TODO: Why do these two pass?
-      (LOAD_NAME == "C") and 268 or nil;
-      (LOAD_NAME == "C") and 269 or nil;
+      (LOAD_NAME ~= "LUA") and 268 or nil;
+      (LOAD_NAME ~= "LUA") and 269 or nil;
     }
 
     table.sort(expected_errors)
@@ -1881,6 +2015,223 @@ for LOAD_NAME, LOAD in pairs { C = luatexts.load, LUA = luatexts_lua.load } do
 
     print("===== END utf8 tests", NAME, "=====")
 
+    print("===== BEGIN string reference tests", NAME, "=====")
+
+    ensure_returns(
+        "string reference " .. NAME,
+        4, { true, "abc", "abc", "abc" },
+        LOAD(
+            '3' .. NL
+         .. 'S' .. NL
+           .. '3' .. NL
+           .. 'abc' .. NL
+         .. 's' .. NL
+           .. '1' .. NL
+         .. 's' .. NL
+           .. '1' .. NL
+          )
+      )
+
+    -- Strings are numbered in order, table keys and utf-8 strings included
+    ensure_returns(
+        "string references in table " .. NAME,
+        3, { true, { "Ёж", a = "x", x = "a" }, "Ёж" },
+        LOAD(
+            '2' .. NL
+         .. 'T' .. NL
+           .. '1' .. NL
+           .. '2' .. NL
+           .. '8' .. NL
+           .. '2' .. NL
+           .. 'Ёж' .. NL
+           .. 'S' .. NL
+           .. '1' .. NL
+           .. 'a' .. NL
+           .. 'S' .. NL
+           .. '1' .. NL
+           .. 'x' .. NL
+           .. 's' .. NL
+           .. '3' .. NL
+           .. 's' .. NL
+           .. '2' .. NL
+         .. 's' .. NL
+           .. '1' .. NL
+          )
+      )
+
+    ensure_error_with_substring(
+        "string reference without strings " .. NAME,
+        "load failed: ",
+        LOAD('1' .. NL .. 's' .. NL .. '1' .. NL)
+      )
+
+    ensure_error_with_substring(
+        "string reference zero " .. NAME,
+        "load failed: ",
+        LOAD(
+            '2' .. NL
+         .. 'S' .. NL .. '1' .. NL .. 'a' .. NL
+         .. 's' .. NL .. '0' .. NL
+          )
+      )
+
+    ensure_error_with_substring(
+        "string reference forward " .. NAME,
+        "load failed: ",
+        LOAD(
+            '3' .. NL
+         .. 'S' .. NL .. '1' .. NL .. 'a' .. NL
+         .. 's' .. NL .. '2' .. NL
+         .. 'S' .. NL .. '1' .. NL .. 'b' .. NL
+          )
+      )
+
+    ensure_error_with_substring(
+        "string reference garbage " .. NAME,
+        "load failed: ",
+        LOAD(
+            '2' .. NL
+         .. 'S' .. NL .. '1' .. NL .. 'a' .. NL
+         .. 's' .. NL .. '1x' .. NL
+          )
+      )
+
+    -- More strings than C module keeps on stack
+    do
+      local t = { }
+      for i = 1, 200 do
+        t[i] = "s" .. i
+      end
+      local data = assert(luatexts_lua.save_dedup(t, t))
+      ensure_returns(
+          "many string references " .. NAME,
+          3, { true, t, t },
+          LOAD(data)
+        )
+    end
+
+    print("===== END string reference tests", NAME, "=====")
+
+    print("===== BEGIN table reference tests", NAME, "=====")
+
+    do
+      local ok, a, b = LOAD(
+          '2' .. NL
+       .. 'T' .. NL
+         .. '1' .. NL
+         .. '0' .. NL
+         .. 'U' .. NL
+         .. '42' .. NL
+       .. 'r' .. NL
+         .. '1' .. NL
+        )
+      ensure_equals("shared table loads " .. NAME, ok, true)
+      ensure_tequals("shared table value " .. NAME, a, { 42 })
+      ensure_equals("shared table is the same " .. NAME, b, a)
+    end
+
+    do
+      local ok, t = LOAD(
+          '1' .. NL
+       .. 'T' .. NL
+         .. '0' .. NL
+         .. '1' .. NL
+         .. 'S' .. NL
+         .. '4' .. NL
+         .. 'self' .. NL
+         .. 'r' .. NL
+         .. '1' .. NL
+        )
+      ensure_equals("cycle loads " .. NAME, ok, true)
+      ensure_equals("cycle is the same table " .. NAME, t.self, t)
+    end
+
+    -- Tables of all kinds are numbered in order, nested ones included
+    do
+      local ok, t, ref, key = LOAD(
+          '3' .. NL
+       .. 'T' .. NL
+         .. '2' .. NL
+         .. '1' .. NL
+         .. 't' .. NL
+           .. '-' .. NL
+         .. 'p' .. NL
+           .. '0' .. NL
+           .. '0' .. NL
+           .. '-' .. NL
+         .. 'r' .. NL
+           .. '2' .. NL
+         .. 'r' .. NL
+           .. '1' .. NL
+       .. 'r' .. NL
+         .. '3' .. NL
+       .. 'T' .. NL
+         .. '0' .. NL
+         .. '0' .. NL
+        )
+      ensure_equals("table references in table " .. NAME, ok, true)
+      ensure_equals("table reference as key " .. NAME, t[t[1]], t)
+      ensure_equals("table reference order " .. NAME, ref, t[2])
+      ensure("different tables " .. NAME, t[1] ~= t[2] and key ~= t[1])
+      ensure_tequals("last table " .. NAME, key, { })
+    end
+
+    ensure_error_with_substring(
+        "table reference without tables " .. NAME,
+        "load failed: ",
+        LOAD('1' .. NL .. 'r' .. NL .. '1' .. NL)
+      )
+
+    ensure_error_with_substring(
+        "table reference zero " .. NAME,
+        "load failed: ",
+        LOAD(
+            '2' .. NL
+         .. 'T' .. NL .. '0' .. NL .. '0' .. NL
+         .. 'r' .. NL .. '0' .. NL
+          )
+      )
+
+    ensure_error_with_substring(
+        "table reference forward " .. NAME,
+        "load failed: ",
+        LOAD(
+            '3' .. NL
+         .. 'T' .. NL .. '0' .. NL .. '0' .. NL
+         .. 'r' .. NL .. '2' .. NL
+         .. 'T' .. NL .. '0' .. NL .. '0' .. NL
+          )
+      )
+
+    ensure_error_with_substring(
+        "table reference garbage " .. NAME,
+        "load failed: ",
+        LOAD(
+            '2' .. NL
+         .. 'T' .. NL .. '0' .. NL .. '0' .. NL
+         .. 'r' .. NL .. '1x' .. NL
+          )
+      )
+
+    -- Reference after many tables and strings, deep in the data
+    do
+      local shared = { "shared" }
+      local t = { }
+      for i = 1, 200 do
+        t[i] = { name = "item"; i = i; shared = (i == 200) and shared or { } }
+      end
+      t[201] = shared
+      local ok, r = LOAD(assert(luatexts_lua.save_dedup(t)))
+      ensure_equals("many tables load " .. NAME, ok, true)
+      ensure_equals("many tables count " .. NAME, #r, 201)
+      ensure_equals("many tables reference " .. NAME, r[201], r[200].shared)
+      ensure_equals("many tables string " .. NAME, r[150].name, "item")
+      ensure_equals("many tables number " .. NAME, r[150].i, 150)
+      ensure("many tables are different " .. NAME, r[1].shared ~= r[2].shared)
+    end
+
+    print("===== END table reference tests", NAME, "=====")
+
     print("===== BEGIN fixed table tests", NAME, "=====")
 
     ensure_returns(
@@ -2158,6 +2509,123 @@ for LOAD_NAME, LOAD in pairs { C = luatexts.load, LUA = luatexts_lua.load } do
 
     print("===== END stream table tests", NAME, "=====")
 
+    print("===== BEGIN hinted table tests", NAME, "=====")
+
+    ensure_returns(
+        "empty hinted table " .. NAME,
+        2, { true, { } },
+        LOAD(
+            '1' .. NL
+         .. 'p' .. NL
+           .. '0' .. NL
+           .. '0' .. NL
+           .. '-' .. NL
+          )
+      )
+
+    ensure_returns(
+        "hinted table " .. NAME,
+        2, { true, { 42, 24, a = { true } } },
+        LOAD(
+            '1' .. NL
+         .. 'p' .. NL
+           .. '2' .. NL
+           .. '1' .. NL
+           .. 'U' .. NL
+           .. '1' .. NL
+           .. 'U' .. NL
+           .. '42' .. NL
+           .. 'U' .. NL
+           .. '2' .. NL
+           .. 'U' .. NL
+           .. '24' .. NL
+           .. 'S' .. NL
+           .. '1' .. NL
+           .. 'a' .. NL
+           .. 'p' .. NL
+             .. '1' .. NL
+             .. '0' .. NL
+             .. 'U' .. NL
+             .. '1' .. NL
+             .. '1' .. NL
+             .. '-' .. NL
+           .. '-' .. NL
+          )
+      )
+
+    -- Hints are hints, they do not have to match the data
+    ensure_returns(
+        "huge hints " .. NAME,
+        2, { true, { 42 } },
+        LOAD(
+            '1' .. NL
+         .. 'p' .. NL
+           .. '4294967295' .. NL
+           .. '4294967295' .. NL
+           .. 'U' .. NL
+           .. '1' .. NL
+           .. 'U' .. NL
+           .. '42' .. NL
+           .. '-' .. NL
+          )
+      )
+
+    ensure_returns(
+        "zero hints " .. NAME,
+        2, { true, { 42, a = 24 } },
+        LOAD(
+            '1' .. NL
+         .. 'p' .. NL
+           .. '0' .. NL
+           .. '0' .. NL
+           .. 'U' .. NL
+           .. '1' .. NL
+           .. 'U' .. NL
+           .. '42' .. NL
+           .. 'S' .. NL
+           .. '1' .. NL
+           .. 'a' .. NL
+           .. 'U' .. NL
+           .. '24' .. NL
+           .. '-' .. NL
+          )
+      )
+
+    ensure_error_with_substring(
+        "hinted table, no hash hint " .. NAME,
+        "load failed: ",
+        LOAD(
+            '1' .. NL
+         .. 'p' .. NL
+         .. '0' .. NL
+          )
+      )
+
+    ensure_error_with_substring(
+        "hinted table, bad hint " .. NAME,
+        "load failed: ",
+        LOAD(
+            '1' .. NL
+         .. 'p' .. NL
+         .. '0' .. NL
+         .. '-1' .. NL
+         .. '-' .. NL
+          )
+      )
+
+    ensure_error_with_substring(
+        "hinted table, no nil " .. NAME,
+        "load failed: ",
+        LOAD(
+            '1' .. NL
+         .. 'p' .. NL
+         .. '0' .. NL
+         .. '0' .. NL
+          )
+      )
+
+    print("===== END hinted table tests", NAME, "=====")
+
     print("===== BEGIN generative tests", NAME, "=====")
 
     do
@@ -2371,12 +2839,57 @@ for LOAD_NAME, LOAD in pairs { C = luatexts.load, LUA = luatexts_lua.load } do
             LOAD(data)
           )
 
-        -- Now trying to mutate
-        -- (ignoring results, the point is not to crash)
-        local num_steps = 100
-        for j = 1, num_steps do
-          --[[
-          local dump = false
+        ensure_returns(
+            "load C save",
+            n + 1, { true, unpack(tuple, 1, n) },
+            LOAD(ensure("C save", luatexts.save(unpack(tuple, 1, n))))
+          )
+
+        if LOAD_NAME == "FFI" then
+          ensure_strequals(
+              "FFI save is the same as C save",
+              ensure("FFI save", luatexts_ffi.save(unpack(tuple, 1, n))),
+              ensure("C save", luatexts.save(unpack(tuple, 1, n)))
+            )
+        end
+
+        ensure_returns(
+            "decoder",
+            n + 1, { true, unpack(tuple, 1, n) },
+            feed_in_chunks(
+                luatexts.decoder(), data, math.random(1, #data + 1)
+              )
+          )
+
+        do
+          local _, stats = ensure("validate", luatexts.validate(data))
+          ensure_equals("validate tuple_size", stats.tuple_size, n)
+        end
+
+        ensure_returns(
+            "load_lazy",
+            n + 1, { true, unpack(tuple, 1, n) },
+            load_lazy_deep(data)
+          )
+
+        ensure_returns(
+            "load dedup",
+            n + 1, { true, unpack(tuple, 1, n) },
+            luatexts.load(data, { dedup = true })
+          )
+
+        ensure_returns(
+            "load_select all",
+            n + 1, { true, unpack(tuple, 1, n) },
+            luatexts.load_select(data, { ["*"] = true })
+          )
+
+        -- Now trying to mutate
+        -- (ignoring results, the point is not to crash)
+        local num_steps = 100
+        for j = 1, num_steps do
+          --[[
+          local dump = false
           if i >= 8732 and j >= 12 and NL == "\n" then
             print("mutation", i..":"..j, "of", num_steps)
             dump = true
@@ -2389,23 +2902,2234 @@ for LOAD_NAME, LOAD in pairs { C = luatexts.load, LUA = luatexts_lua.load } do
             print("GC size:", collectgarbage("count"))
           end
           --]]
-          local res = LOAD(data)
+          local res, err = LOAD(data)
           if res then
             mutated_ok = mutated_ok + 1
           else
             mutated_fail = mutated_fail + 1
           end
 
-          collectgarbage("step")
-        end
+          if LOAD_NAME == "C" then
+            local decoded = feed_in_chunks(luatexts.decoder(), data, 64)
+            ensure_equals(
+                "decoder agrees with load on mutated data",
+                decoded == true,
+                res == true
+              )
+
+            -- Not the other way around: values that are overwritten
+            -- by duplicate keys are never loaded by load_lazy()
+            ensure_equals(
+                "validate agrees with load on mutated data",
+                luatexts.validate(data) == true,
+                res == true
+              )
+
+            ensure_equals(
+                "dedup load agrees with load on mutated data",
+                luatexts.load(data, { dedup = true }) == true,
+                res == true
+              )
+
+            ensure_equals(
+                "load_select agrees with load on mutated data",
+                luatexts.load_select(data, { ["*"] = true }) == true,
+                res == true
+              )
+
+            local ok, lazy = pcall(load_lazy_deep, data)
+            if res == true then
+              ensure_equals(
+                  "load_lazy loads what load loads on mutated data",
+                  ok and lazy == true,
+                  true
+                )
+            end
+          elseif LOAD_NAME == "FFI" then
+            local c_res, c_err = luatexts.load(data)
+            ensure_equals(
+                "FFI load agrees with C load on mutated data",
+                res == true or err,
+                c_res == true or c_err
+              )
+          end
+
+          collectgarbage("step")
+        end
+      end
+
+      print("mutated ok:", mutated_ok)
+      print("mutated fail:", mutated_fail)
+    end
+
+    print("===== END generative tests", NAME, "=====")
+  end
+end
+
+for SAVE_NAME, SAVE in pairs {
+    C = luatexts.save,
+    LUA = luatexts_lua.save,
+    FFI = luatexts_ffi and luatexts_ffi.save
+  }
+do
+  local NAME = SAVE_NAME
+
+  print("===== BEGIN save tests", NAME, "=====")
+
+  ensure_strequals(
+      "empty tuple " .. NAME,
+      SAVE(),
+      "0\n"
+    )
+
+  ensure_returns(
+      "simple values " .. NAME,
+      8, { true, nil, false, true, 42, -0.5, "", "Hello,\0world!\n" },
+      luatexts.load(SAVE(nil, false, true, 42, -0.5, "", "Hello,\0world!\n"))
+    )
+
+  ensure_returns(
+      "numbers " .. NAME,
+      7, { true, 0.1, 1/3, 1e300, -2^53, 2^63, 1/0 },
+      luatexts.load(SAVE(0.1, 1/3, 1e300, -2^53, 2^63, 1/0))
+    )
+
+  ensure_returns(
+      "table " .. NAME,
+      2,
+      {
+        true,
+        {
+          1, 2, nil, 4;
+          a = { b = { } };
+          [1.5] = "x";
+          [-1] = true;
+          [{ 42 }] = { 24 };
+        }
+      },
+      luatexts.load(
+          SAVE(
+              {
+                1, 2, nil, 4;
+                a = { b = { } };
+                [1.5] = "x";
+                [-1] = true;
+                [{ 42 }] = { 24 };
+              }
+            )
+        )
+    )
+
+  do
+    local shared = { 42 }
+    ensure_returns(
+        "shared non-circular table " .. NAME,
+        2, { true, { shared, { shared } } },
+        luatexts.load(SAVE({ shared, { shared } }))
+      )
+  end
+
+  print("===== END save tests", NAME, "=====")
+end
+
+for NAME, SAVE in pairs {
+    C = luatexts.save,
+    FFI = luatexts_ffi and luatexts_ffi.save
+  }
+do
+  print("===== BEGIN save error tests", NAME, "=====")
+
+  ensure_strequals(
+      "fixed table layout " .. NAME,
+      SAVE({ 42, x = true }),
+      "1\nT\n1\n1\nN\n42\nS\n1\nx\n1\n"
+    )
+
+  do
+    local t = { }
+    t[1] = { t }
+    ensure_error(
+        "circular table " .. NAME,
+        "save failed: circular table reference detected",
+        SAVE(t)
+      )
+  end
+
+  ensure_error(
+      "unsupported value " .. NAME,
+      "save failed: unsupported value type",
+      SAVE({ print })
+    )
+
+  print("===== END save error tests", NAME, "=====")
+end
+
+do
+  local NAME = "LUA"
+
+  print("===== BEGIN save number tests", NAME, "=====")
+
+  ensure_strequals(
+      "fixed table layout " .. NAME,
+      luatexts_lua.save({ 42, x = true }),
+      "1\nT\n1\n1\nU\n42\nS\n1\nx\n1\n"
+    )
+
+  do
+    -- Built at run time: Lua 5.1 folds a -0.0 literal to 0.
+    local zero = 0
+    local nz = -(zero * 1.0)
+    ensure_equals("negative zero sign " .. NAME, 1 / nz, -math.huge)
+
+    local data = luatexts_lua.save(
+        0, 65535, 1000000, 4294967295, 4294967296, -1, nz
+      )
+    ensure_strequals(
+        "compact numbers " .. NAME,
+        data,
+        "7\nU\n0\nU\n65535\nH\nF4240\nH\nFFFFFFFF\nN\n4294967296\nN\n-1\nN\n"
+     .. (math.type and "-0.0\n" or "-0\n") -- Lua 5.3+ keeps float subtype
+      )
+
+    local loaded = { luatexts.load(data) }
+    ensure_equals("compact numbers load " .. NAME, loaded[1], true)
+    ensure_equals("negative zero load " .. NAME, loaded[8], 0)
+    ensure_equals("negative zero load sign " .. NAME, 1 / loaded[8], -math.huge)
+  end
+
+  ensure_strequals(
+      "shortest floats " .. NAME,
+      luatexts_lua.save(0.1, 1/3, 1e300, 2^63, 1/0),
+      "5\nN\n0.1\nN\n0.3333333333333333\nN\n1e+300\n"
+   .. "N\n9.223372036854776e+18\nN\ninf\n"
+    )
+
+  do
+    local t = { }
+    t[1] = { t }
+    ensure_error(
+        "circular table " .. NAME,
+        "save failed: circular table reference detected",
+        luatexts_lua.save(t)
+      )
+  end
+
+  ensure_error(
+      "unsupported value " .. NAME,
+      "save failed: can't save `function'",
+      luatexts_lua.save({ [print] = true })
+    )
+
+  ensure_strequals(
+      "save after error " .. NAME,
+      luatexts_lua.save({ 42 }),
+      "1\nT\n1\n0\nU\n42\n"
+    )
+
+  do
+    -- Buffer does not keep saved strings alive
+    collectgarbage("collect")
+    local before = collectgarbage("count")
+
+    local str = ("luatexts"):rep(2 ^ 20)
+    ensure("save big string " .. NAME, #luatexts_lua.save(str) > #str)
+    str = nil
+    luatexts_lua.save(1)
+
+    -- LuaJIT halves its string buffer on each cycle
+    for i = 1, 10 do
+      collectgarbage("collect")
+    end
+    ensure(
+        "save does not keep data " .. NAME,
+        collectgarbage("count") - before < 1024
+      )
+  end
+
+  do
+    -- Lua stack overflows, save state must be reset
+    local t = { }
+    for i = 1, 2e5 do
+      t = { t }
+    end
+    ensure("deep table throws " .. NAME, not pcall(luatexts_lua.save, t))
+    t = nil
+
+    ensure_strequals(
+        "save after throw " .. NAME,
+        luatexts_lua.save({ 42 }),
+        "1\nT\n1\n0\nU\n42\n"
+      )
+  end
+
+  print("===== END save number tests", NAME, "=====")
+end
+
+do
+  local NAME = "LUA"
+
+  print("===== BEGIN save dedup tests", NAME, "=====")
+
+  ensure_strequals(
+      "dedup strings " .. NAME,
+      luatexts_lua.save_dedup({ { name = "x" } }, "name", "x", "", ""),
+      "5\nT\n1\n0\nT\n0\n1\nS\n4\nname\nS\n1\nx\n"
+   .. "s\n1\ns\n2\nS\n0\n\ns\n3\n"
+    )
+
+  -- Reference to string number 10 is longer than the string itself
+  ensure_strequals(
+      "dedup keeps short strings " .. NAME,
+      luatexts_lua.save_dedup("1", "2", "3", "4", "5", "6", "7", "8", "9", "", ""),
+      "11\nS\n1\n1\nS\n1\n2\nS\n1\n3\nS\n1\n4\nS\n1\n5\n"
+   .. "S\n1\n6\nS\n1\n7\nS\n1\n8\nS\n1\n9\nS\n0\n\nS\n0\n\n"
+    )
+
+  ensure_strequals(
+      "save does not dedup " .. NAME,
+      luatexts_lua.save("x", "x"),
+      "2\nS\n1\nx\nS\n1\nx\n"
+    )
+
+  do
+    local records = { }
+    for i = 1, 100 do
+      records[i] =
+      {
+        id = i;
+        status = (i % 2 == 0) and "published" or "unpublished";
+      }
+    end
+
+    local data = assert(luatexts_lua.save_dedup(records))
+    ensure(
+        "dedup is smaller " .. NAME,
+        #data < #assert(luatexts_lua.save(records))
+      )
+
+    ensure_returns(
+        "dedup loads " .. NAME,
+        2, { true, records },
+        luatexts.load(data)
+      )
+    ensure_returns(
+        "dedup loads lua " .. NAME,
+        2, { true, records },
+        luatexts_lua.load(data)
+      )
+    if luatexts_ffi then
+      ensure_returns(
+          "dedup loads ffi " .. NAME,
+          2, { true, records },
+          luatexts_ffi.load(data)
+        )
+    end
+    ensure_returns(
+        "dedup loads lazy " .. NAME,
+        2, { true, records },
+        load_lazy_deep(data)
+      )
+    ensure_returns(
+        "dedup loads by decoder " .. NAME,
+        2, { true, records },
+        feed_in_chunks(luatexts.decoder(), data, 5)
+      )
+    local ok, stats = luatexts.validate(data)
+    ensure_equals("dedup validates " .. NAME, ok, true)
+    ensure_equals("dedup string refs " .. NAME, stats.string_refs, 296)
+  end
+
+  ensure_strequals(
+      "dedup tables " .. NAME,
+      luatexts_lua.save_dedup({ 1 }, { }),
+      "2\nT\n1\n0\nU\n1\nT\n0\n0\n"
+    )
+
+  do
+    local t = { }
+    ensure_strequals(
+        "dedup shared table " .. NAME,
+        luatexts_lua.save_dedup(t, { t }, t),
+        "3\nT\n0\n0\nT\n1\n0\nr\n1\nr\n1\n"
+      )
+  end
+
+  do
+    local t = { }
+    t.self = t
+    ensure_strequals(
+        "dedup cycle " .. NAME,
+        luatexts_lua.save_dedup(t),
+        "1\nT\n0\n1\nS\n4\nself\nr\n1\n"
+      )
+    ensure_error_with_substring(
+        "save still fails on cycle " .. NAME,
+        "circular",
+        luatexts_lua.save(t)
+      )
+  end
+
+  do
+    -- Graph with a shared subtable and a cycle
+    local config = { name = "shared config", values = { 1, 2, 3 } }
+    local nodes = { }
+    for i = 1, 50 do
+      nodes[i] = { id = i, config = config }
+    end
+    for i = 1, 50 do
+      nodes[i].next = nodes[i % 50 + 1]
+    end
+
+    local data = assert(luatexts_lua.save_dedup(nodes, config))
+
+    local check = function(name, ok, r, c)
+      ensure_equals(name .. " loads", ok, true)
+      ensure_equals(name .. " shared", r[1].config, c)
+      ensure_equals(name .. " shared deep", r[50].config, c)
+      ensure_tequals(name .. " shared value", c.values, { 1, 2, 3 })
+      ensure_equals(name .. " cycle", r[50].next, r[1])
+      ensure_equals(name .. " next", r[7].next.id, 8)
+    end
+
+    check("dedup graph " .. NAME, luatexts.load(data))
+    check("dedup graph lua " .. NAME, luatexts_lua.load(data))
+    if luatexts_ffi then
+      check("dedup graph ffi " .. NAME, luatexts_ffi.load(data))
+    end
+    check("dedup graph lazy " .. NAME, load_lazy_deep(data))
+    check(
+        "dedup graph decoder " .. NAME,
+        feed_in_chunks(luatexts.decoder(), data, 3)
+      )
+
+    -- Lazy proxies of the same table are the same, in any access order
+    do
+      local ok, r, c = luatexts.load_lazy(data)
+      ensure_equals("dedup graph lazy ok " .. NAME, ok, true)
+      ensure_equals("dedup graph lazy top " .. NAME, r[30].config, c)
+      ensure_equals("dedup graph lazy cycle " .. NAME, r[50].next, r[1])
+      ensure_equals("dedup graph lazy values " .. NAME, c.values[3], 3)
+    end
+
+    local ok, stats = luatexts.validate(data)
+    ensure_equals("dedup graph validates " .. NAME, ok, true)
+    ensure_equals("dedup graph tables " .. NAME, stats.tables, 53)
+    ensure_equals("dedup graph table refs " .. NAME, stats.table_refs, 100)
+  end
+
+  print("===== END save dedup tests", NAME, "=====")
+end
+
+do
+  local NAME = "C"
+
+  print("===== BEGIN number locale tests", NAME, "=====")
+
+  local old_locale = os.setlocale(nil, "numeric")
+  local locale = os.setlocale("de_DE.UTF-8", "numeric")
+    or os.setlocale("ru_RU.UTF-8", "numeric")
+    or os.setlocale("fr_FR.UTF-8", "numeric")
+
+  if not locale then
+    print("no decimal comma locale available, skipping")
+  else
+    ensure_returns(
+        "number in " .. locale,
+        2, { true, 3.14 },
+        luatexts.load('1\nN\n3.14\n')
+      )
+
+    ensure_returns(
+        "long number in " .. locale,
+        2, { true, 3.141592653589793115997963468544185161590576171875 },
+        luatexts.load('1\nN\n3.141592653589793115997963468544185161590576171875\n')
+      )
+
+    ensure_error(
+        "decimal comma in " .. locale,
+        "load failed: garbage before newline",
+        luatexts.load('1\nN\n3,14\n')
+      )
+
+    -- Saved numbers have '.' whatever the locale is
+    ensure_strequals(
+        "save in " .. locale,
+        luatexts.save(1.5, -0.25),
+        "2\nN\n1.5\nN\n-0.25\n"
+      )
+    ensure_returns(
+        "save round trip in " .. locale,
+        3, { true, 0.1, 1 / 3 },
+        luatexts.load(luatexts.save(0.1, 1 / 3))
+      )
+
+    do
+      local filename = "./tmp/locale.luatexts"
+      local read = function()
+        local f = assert(io.open(filename, "rb"))
+        local data = f:read("*a")
+        f:close()
+        return data
+      end
+
+      ensure("save_to_file in " .. locale, luatexts.save_to_file(filename, 1.5))
+      ensure_strequals("save_to_file data in " .. locale, read(), "1\nN\n1.5\n")
+
+      local f = assert(io.open(filename, "wb"))
+      ensure("save_to_handle in " .. locale, luatexts.save_to_handle(f, 1.5))
+      f:close()
+      ensure_strequals(
+          "save_to_handle data in " .. locale, read(), "1\nN\n1.5\n"
+        )
+
+      os.remove(filename)
+    end
+
+    if luatexts_ffi then
+      ensure_returns(
+          "FFI long number in " .. locale,
+          2, { true, 3.141592653589793115997963468544185161590576171875 },
+          luatexts_ffi.load(
+              '1\nN\n3.141592653589793115997963468544185161590576171875\n'
+            )
+        )
+
+      ensure_error(
+          "FFI decimal comma in " .. locale,
+          "load failed: garbage before newline",
+          luatexts_ffi.load('1\nN\n3,14e0\n')
+        )
+    end
+
+    os.setlocale(old_locale, "numeric")
+  end
+
+  if luatexts_ffi then
+    -- FFI module must not declare libc structs
+    ensure(
+        "FFI leaves struct lconv alone",
+        pcall(
+            require 'ffi'.cdef,
+            "struct lconv { char * decimal_point; char * thousands_sep; };"
+          )
+      )
+  end
+
+  print("===== END number locale tests", NAME, "=====")
+end
+
+do
+  local NAME = "C"
+
+  print("===== BEGIN integer tests", NAME, "=====")
+
+  -- Exact on Lua 5.3+, rounded the same way as literals are on 5.1
+
+  ensure_returns(
+      "uint above 2^53 " .. NAME,
+      2, { true, 9007199254740993 },
+      luatexts.load('1\nU\n9007199254740993\n')
+    )
+
+  ensure_returns(
+      "hex uint above 2^53 " .. NAME,
+      2, { true, 0x20000000000001 },
+      luatexts.load('1\nH\n20000000000001\n')
+    )
+
+  ensure_returns(
+      "uint36 above 2^53 " .. NAME,
+      2, { true, 9007199254740993 },
+      luatexts.load('1\nZ\n2gosa7pa2gx\n')
+    )
+
+  if math.type then
+    local check_type = function(msg, expected_type, expected, res, value, ...)
+      ensure_equals(msg .. " ok", res, true)
+      ensure_equals(msg .. " no extra values", select("#", ...), 0)
+      ensure_equals(msg .. " type", math.type(value), expected_type)
+      ensure_equals(msg .. " value", value, expected)
+    end
+
+    check_type(
+        "U is integer", "integer", 42,
+        luatexts.load('1\nU\n42\n')
+      )
+
+    check_type(
+        "H is integer", "integer", 0x7FFFFFFFFFFFFFFF,
+        luatexts.load('1\nH\n7FFFFFFFFFFFFFFF\n')
+      )
+
+    check_type(
+        "Z is integer", "integer", 1295,
+        luatexts.load('1\nZ\nzz\n')
+      )
+
+    check_type(
+        "U max integer", "integer", math.maxinteger,
+        luatexts.load('1\nU\n9223372036854775807\n')
+      )
+
+    check_type(
+        "U above max integer is float", "float", 2^63,
+        luatexts.load('1\nU\n9223372036854775808\n')
+      )
+
+    check_type(
+        "N integer", "integer", -42,
+        luatexts.load('1\nN\n-42\n')
+      )
+
+    check_type(
+        "N min integer", "integer", math.mininteger,
+        luatexts.load('1\nN\n-9223372036854775808\n')
+      )
+
+    check_type(
+        "N integer overflow is float", "float", 2^63,
+        luatexts.load('1\nN\n9223372036854775808\n')
+      )
+
+    check_type(
+        "N integral float", "float", 42,
+        luatexts.load('1\nN\n42.0\n')
+      )
+
+    check_type(
+        "N exponent is float", "float", 1000,
+        luatexts.load('1\nN\n1e3\n')
+      )
+
+    check_type(
+        "decoder U is integer", "integer", 42,
+        luatexts.decoder():feed('1\nU\n42\n')
+      )
+
+    check_type(
+        "decoder N integer", "integer", 42,
+        luatexts.decoder():feed('1\nN\n42\n')
+      )
+
+    do
+      local res, t = luatexts.load('1\nT\n0\n1\nN\n1\nU\n2\n')
+      ensure_equals("integer key ok", res, true)
+      ensure_equals("integer key", math.type((next(t))), "integer")
+      ensure_equals("integer key value", t[1], 2)
+    end
+
+    local values =
+    {
+      math.maxinteger, math.mininteger, 0, -1, 2^53 + 1,
+      1.0, 0.0, -0.0, 2^53, 2^63, 0.5, 1 / 0, -1 / 0
+    }
+    local res, loaded = luatexts.load(ensure("save", luatexts.save(values)))
+    ensure_equals("round trip ok", res, true)
+    for i = 1, #values do
+      local msg = "round trip value " .. i
+      ensure_equals(msg .. " type", math.type(loaded[i]), math.type(values[i]))
+      ensure_equals(msg, loaded[i], values[i])
+      ensure_equals(msg .. " sign", 1 / loaded[i], 1 / values[i])
+    end
+  end
+
+  print("===== END integer tests", NAME, "=====")
+end
+
+do
+  local NAME = "C"
+
+  print("===== BEGIN utf8 block tests", NAME, "=====")
+
+  -- Strings are long enough to hit vectorized validation.
+  -- Any bad piece must be rejected the same way as by per-character code.
+
+  local GOOD =
+  {
+    "A", "z", "\0", "Ё", "€", "𐍈",
+    "\194\128",         -- U+0080
+    "\223\191",         -- U+07FF
+    "\224\160\128",     -- U+0800
+    "\237\159\191",     -- U+D7FF
+    "\238\128\128",     -- U+E000
+    "\239\187\191",     -- U+FEFF (BOM is allowed inside a string)
+    "\239\191\189",     -- U+FFFD
+    "\240\144\128\128", -- U+10000
+    "\244\143\191\191"  -- U+10FFFF
+  }
+
+  local BAD =
+  {
+    "\192\128", "\193\191",                 -- Overlong 2-byte
+    "\224\128\128", "\224\159\191",         -- Overlong 3-byte
+    "\240\128\128\128", "\240\143\191\191", -- Overlong 4-byte
+    "\237\160\128", "\237\191\191",         -- Surrogates
+    "\239\191\190", "\239\191\191",         -- U+FFFE, U+FFFF
+    "\244\144\128\128", "\245\128\128\128", -- Too large
+    "\128", "\191", "\254", "\255",         -- Bad first byte
+    "\194", "\226\130", "\240\144\141"      -- Truncated
+  }
+
+  for i = 1, 2000 do
+    local pieces = { }
+    for j = 1, math.random(1, 300) do
+      pieces[j] = (math.random() < 0.5)
+        and string.char(math.random(32, 126))
+         or GOOD[math.random(1, #GOOD)]
+    end
+
+    local bad = math.random() < 0.5
+    if bad then
+      pieces[math.random(1, #pieces)] = BAD[math.random(1, #BAD)]
+    end
+
+    local str = table.concat(pieces)
+    local data = '1\n8\n' .. #pieces .. '\n' .. str .. '\n'
+
+    if bad then
+      ensure_error(
+          "bad utf8 block " .. i,
+          "load failed: invalid utf-8 data",
+          luatexts.load(data)
+        )
+      ensure_error(
+          "bad utf8 block decoder " .. i,
+          "load failed: invalid utf-8 data",
+          feed_in_chunks(luatexts.decoder(), data, 64)
+        )
+      if luatexts_ffi then
+        ensure_error(
+            "bad utf8 block FFI " .. i,
+            "load failed: invalid utf-8 data",
+            luatexts_ffi.load(data)
+          )
+      end
+    else
+      ensure_returns(
+          "utf8 block " .. i,
+          2, { true, str },
+          luatexts.load(data)
+        )
+      ensure_returns(
+          "utf8 block decoder " .. i,
+          2, { true, str },
+          feed_in_chunks(luatexts.decoder(), data, 64)
+        )
+      if luatexts_ffi then
+        ensure_returns(
+            "utf8 block FFI " .. i,
+            2, { true, str },
+            luatexts_ffi.load(data)
+          )
+      end
+      if #pieces > 1 then
+        ensure_error(
+            "utf8 block short size " .. i,
+            "load failed: garbage before newline",
+            luatexts.load('1\n8\n' .. (#pieces - 1) .. '\n' .. str .. '\n')
+          )
+      end
+    end
+  end
+
+  print("===== END utf8 block tests", NAME, "=====")
+end
+
+do
+  local NAME = "C"
+
+  print("===== BEGIN nesting depth tests", NAME, "=====")
+
+  -- Fixed tables, each holding the next one in the array part
+  local nested = function(depth)
+    return '1\n' .. ('T\n1\n0\n'):rep(depth - 1) .. 'T\n0\n0\n'
+  end
+
+  -- Stream tables, each holding the next one under key 1
+  local nested_stream = function(depth)
+    return '1\n' .. ('t\nU\n1\n'):rep(depth) .. ('-\n'):rep(depth + 1)
+  end
+
+  local check_depth = function(msg, depth, res, t, ...)
+    ensure_equals(msg .. " ok", res, true)
+    ensure_equals(msg .. " no extra values", select("#", ...), 0)
+    for i = 1, depth - 1 do
+      t = t[1]
+    end
+    ensure_tequals(msg .. " innermost", t, { })
+  end
+
+  check_depth(
+      "max default depth", 1000,
+      luatexts.load(nested(1000))
+    )
+  check_depth(
+      "max default depth stream", 999,
+      luatexts.load(nested_stream(999))
+    )
+
+  ensure_error(
+      "too deep",
+      "load failed: nesting too deep",
+      luatexts.load(nested(1001))
+    )
+
+  ensure_error(
+      "too deep stream",
+      "load failed: nesting too deep",
+      luatexts.load(nested_stream(1e5))
+    )
+
+  check_depth(
+      "custom depth", 3,
+      luatexts.load(nested(3), { max_depth = 3 })
+    )
+
+  ensure_error(
+      "custom depth exceeded",
+      "load failed: nesting too deep",
+      luatexts.load(nested(4), { max_depth = 3 })
+    )
+
+  ensure_returns(
+      "zero depth allows scalars",
+      2, { true, 42 },
+      luatexts.load('1\nU\n42\n', { max_depth = 0 })
+    )
+
+  ensure_error(
+      "zero depth",
+      "load failed: nesting too deep",
+      luatexts.load(nested(1), { max_depth = 0 })
+    )
+
+  ensure_error(
+      "deeper than lua stack",
+      "load failed: value too huge",
+      luatexts.load(nested_stream(1e6), { max_depth = 1e7 })
+    )
+
+  ensure_fails_with_substring(
+      "bad options",
+      function() return luatexts.load(nested(1), 42) end,
+      "bad argument #2 to '.-' %(table expected.-%)"
+    )
+
+  ensure_fails_with_substring(
+      "bad max_depth",
+      function() return luatexts.load(nested(1), { max_depth = -1 }) end,
+      "max_depth must not be negative"
+    )
+
+  check_depth(
+      "decoder max default depth", 1000,
+      feed_in_chunks(luatexts.decoder(), nested(1000), 64)
+    )
+
+  ensure_error(
+      "decoder too deep",
+      "load failed: nesting too deep",
+      feed_in_chunks(luatexts.decoder(), nested_stream(1001), 64)
+    )
+
+  ensure_error(
+      "decoder custom depth exceeded",
+      "load failed: nesting too deep",
+      luatexts.decoder({ max_depth = 3 }):feed(nested(4))
+    )
+
+  if luatexts_ffi then
+    check_depth(
+        "FFI max default depth", 1000,
+        luatexts_ffi.load(nested(1000))
+      )
+
+    ensure_error(
+        "FFI too deep",
+        "load failed: nesting too deep",
+        luatexts_ffi.load(nested_stream(1001))
+      )
+
+    ensure_error(
+        "FFI custom depth exceeded",
+        "load failed: nesting too deep",
+        luatexts_ffi.load(nested(4), { max_depth = 3 })
+      )
+
+    ensure_error(
+        "FFI deeper than lua stack",
+        "load failed: value too huge",
+        luatexts_ffi.load(nested_stream(1e5), { max_depth = 1e7 })
+      )
+
+    ensure_error(
+        "FFI tuple larger than lua stack",
+        "load failed: value too huge",
+        luatexts_ffi.load('100000\n' .. ('-\n'):rep(1e5))
+      )
+
+    ensure_fails_with_substring(
+        "FFI bad max_depth",
+        function() return luatexts_ffi.load(nested(1), { max_depth = -1 }) end,
+        "max_depth must not be negative"
+      )
+  end
+
+  print("===== END nesting depth tests", NAME, "=====")
+end
+
+for NAME, NL in pairs { ["LF"] = "\n", ["CRLF"] = "\r\n" } do
+  print("===== BEGIN decoder tests", NAME, "=====")
+
+  local data =
+      '4' .. NL
+   .. 'S' .. NL
+     .. '5' .. NL
+     .. 'Hello' .. NL
+   .. 'T' .. NL
+     .. '2' .. NL
+     .. '1' .. NL
+     .. 'N' .. NL
+     .. '3.14' .. NL
+     .. 't' .. NL
+       .. 'U' .. NL
+       .. '1' .. NL
+       .. '8' .. NL
+       .. '4' .. NL
+       .. 'Ёжик' .. NL
+       .. '-' .. NL
+     .. 'H' .. NL
+     .. 'FF' .. NL
+     .. 'Z' .. NL
+     .. 'ZZ' .. NL
+   .. '8' .. NL
+     .. '10' .. NL
+     .. 'Встроенный' .. NL
+   .. 'p' .. NL
+     .. '1' .. NL
+     .. '1' .. NL
+     .. 'U' .. NL
+     .. '1' .. NL
+     .. '1' .. NL
+     .. 'S' .. NL
+     .. '1' .. NL
+     .. 'x' .. NL
+     .. '0' .. NL
+     .. '-' .. NL
+
+  local expected =
+  {
+    true, "Hello", { 3.14, { "Ёжик" }, [255] = 1295 }, "Встроенный",
+    { true, x = false }
+  }
+
+  ensure_returns(
+      "decoder whole " .. NAME,
+      5, expected,
+      luatexts.decoder():feed(data)
+    )
+
+  do
+    local decoder = luatexts.decoder()
+    for i = 1, #data - 1 do
+      ensure_equals(
+          "decoder byte-by-byte " .. i .. " " .. NAME,
+          decoder:feed(data:sub(i, i)),
+          "more"
+        )
+    end
+    ensure_returns(
+        "decoder byte-by-byte last " .. NAME,
+        5, expected,
+        decoder:feed(data:sub(#data))
+      )
+  end
+
+  do
+    -- Empty chunks between (and inside) values change nothing
+    local decoder = luatexts.decoder()
+    ensure_equals("decoder empty chunk " .. NAME, decoder:feed(""), "more")
+    ensure_equals(
+        "decoder empty utf-8 head " .. NAME,
+        decoder:feed('1' .. NL .. '8' .. NL .. '2' .. NL),
+        "more"
+      )
+    ensure_equals("decoder empty chunk utf8 " .. NAME, decoder:feed(""), "more")
+    ensure_equals("decoder partial char " .. NAME, decoder:feed("\208"), "more")
+    ensure_equals("decoder empty chunk char " .. NAME, decoder:feed(""), "more")
+    ensure_returns(
+        "decoder empty chunks value " .. NAME,
+        2, { true, "Жx" },
+        decoder:feed("\150x" .. NL)
+      )
+  end
+
+  for i = 1, 100 do
+    ensure_returns(
+        "decoder random chunks " .. NAME,
+        5, expected,
+        feed_in_chunks(luatexts.decoder(), data, 8)
+      )
+  end
+
+  do
+    local lines = split_by_char(UTF8_TEST_DATA, "\n")
+    for i = 1, #lines do
+      local line =
+          '1' .. NL
+       .. '8' .. NL
+         .. (#lines[i] < 79 and #lines[i] or 79) .. NL
+         .. lines[i] .. NL
+
+      ensure_returns(
+          "decoder utf8 line " .. i .. " " .. NAME,
+          2, { luatexts.load(line) },
+          feed_in_chunks(luatexts.decoder(), line, 3)
+        )
+    end
+  end
+
+  do
+    local decoder = luatexts.decoder()
+    local tuples = data .. '0' .. NL .. '1' .. NL .. '-' .. NL
+
+    ensure_returns(
+        "decoder several tuples in one chunk " .. NAME,
+        5, expected,
+        decoder:feed(tuples)
+      )
+    ensure_returns(
+        "decoder drain empty tuple " .. NAME,
+        1, { true },
+        decoder:feed()
+      )
+    ensure_returns(
+        "decoder drain nil " .. NAME,
+        2, { true, nil },
+        decoder:feed()
+      )
+    ensure_equals(
+        "decoder drain nothing left " .. NAME,
+        decoder:feed(),
+        "more"
+      )
+    ensure_returns(
+        "decoder reuse " .. NAME,
+        5, expected,
+        feed_in_chunks(decoder, data, 3)
+      )
+  end
+
+  do
+    local decoder = luatexts.decoder()
+    ensure_equals(
+        "decoder truncated " .. NAME,
+        decoder:feed(data:sub(1, -2)),
+        "more"
+      )
+    ensure_error(
+        "decoder garbage " .. NAME,
+        "load failed: garbage before newline",
+        decoder:feed("X" .. NL)
+      )
+    ensure_error(
+        "decoder error is persistent " .. NAME,
+        "load failed: garbage before newline",
+        decoder:feed(data)
+      )
+  end
+
+  ensure_error(
+      "decoder bad utf-8 " .. NAME,
+      "load failed: invalid utf-8 data",
+      feed_in_chunks(
+          luatexts.decoder(),
+          '1' .. NL .. '8' .. NL .. '2' .. NL .. 'Ё\255' .. NL,
+          2
+        )
+    )
+
+  ensure_error(
+      "decoder nil key " .. NAME,
+      "load failed: corrupt data",
+      luatexts.decoder():feed(
+          '1' .. NL .. 'T' .. NL .. '0' .. NL .. '1' .. NL
+       .. '-' .. NL .. '0' .. NL
+        )
+    )
+
+  ensure_fails_with_substring(
+      "decoder bad chunk " .. NAME,
+      function() return luatexts.decoder():feed({ }) end,
+      -- Argument number depends on whether self is counted in the message
+      "bad argument #%d to '.-' %(string expected.-%)"
+    )
+
+  print("===== END decoder tests", NAME, "=====")
+end
+
+for NAME, NL in pairs { ["LF"] = "\n", ["CRLF"] = "\r\n" } do
+  print("===== BEGIN lazy load tests", NAME, "=====")
+
+  local data =
+      '3' .. NL
+   .. 'T' .. NL
+     .. '1' .. NL
+     .. '2' .. NL
+     .. 'S' .. NL
+     .. '5' .. NL
+     .. 'first' .. NL
+     .. 'S' .. NL
+     .. '1' .. NL
+     .. 'a' .. NL
+     .. 't' .. NL
+       .. 'S' .. NL
+       .. '1' .. NL
+       .. 'b' .. NL
+       .. 'N' .. NL
+       .. '42' .. NL
+       .. '-' .. NL
+     .. 'p' .. NL
+       .. '0' .. NL
+       .. '1' .. NL
+       .. 'S' .. NL
+       .. '1' .. NL
+       .. 'k' .. NL
+       .. '1' .. NL
+       .. '-' .. NL
+     .. 'T' .. NL
+       .. '0' .. NL
+       .. '0' .. NL
+   .. '8' .. NL
+     .. '2' .. NL
+     .. 'Ёж' .. NL
+   .. '0' .. NL
+
+  do
+    local ok, t, s, b = luatexts.load_lazy(data)
+    ensure_equals("lazy ok " .. NAME, ok, true)
+    ensure_equals("lazy scalar " .. NAME, s, "Ёж")
+    ensure_equals("lazy boolean " .. NAME, b, false)
+
+    ensure_equals("lazy proxy is empty " .. NAME, next(t), nil)
+    ensure("lazy proxy has metatable " .. NAME, getmetatable(t) ~= nil)
+
+    ensure_equals("lazy index " .. NAME, t[1], "first")
+    ensure_equals("lazy metatable is gone " .. NAME, getmetatable(t), nil)
+    ensure_equals("lazy rawget " .. NAME, rawget(t, 1), "first")
+
+    local a = rawget(t, "a")
+    ensure_equals("lazy nested proxy is empty " .. NAME, next(a), nil)
+    ensure_equals("lazy nested index " .. NAME, a.b, 42)
+
+    -- Table key is a proxy too
+    local table_key = nil
+    for k, v in pairs(t) do
+      if type(k) == "table" then
+        table_key = k
+        ensure_equals(
+            "lazy table value " .. NAME,
+            tpretty(luatexts.materialize(v)),
+            tpretty({ })
+          )
+      end
+    end
+    ensure("lazy table key found " .. NAME, table_key ~= nil)
+    ensure_equals(
+        "lazy table key " .. NAME,
+        luatexts.materialize(table_key).k,
+        true
+      )
+  end
+
+  do
+    local ok, t = luatexts.load_lazy(data)
+    t.new = "value"
+    ensure_equals("lazy newindex " .. NAME, rawget(t, "new"), "value")
+    ensure_equals("lazy newindex loads " .. NAME, rawget(t, 1), "first")
+  end
+
+  do
+    local ok, t = luatexts.load_lazy(data)
+    ensure_equals("lazy materialize " .. NAME, luatexts.materialize(t), t)
+    ensure_equals("lazy materialize loads " .. NAME, rawget(t, 1), "first")
+    ensure_equals("lazy materialize non-proxy " .. NAME,
+        luatexts.materialize(42), 42
+      )
+    local plain = setmetatable({ }, { __index = function() return 1 end })
+    ensure_equals(
+        "lazy materialize foreign table " .. NAME,
+        luatexts.materialize(plain),
+        plain
+      )
+    ensure_equals(
+        "lazy materialize foreign table keeps metatable " .. NAME,
+        plain.x,
+        1
+      )
+  end
+
+  -- Value errors are deferred until proxy is loaded
+  do
+    local bad =
+        '1' .. NL
+     .. 't' .. NL
+       .. 'S' .. NL
+       .. '1' .. NL
+       .. 'x' .. NL
+       .. 'N' .. NL
+       .. 'bad' .. NL
+       .. '-' .. NL
+
+    local ok, t = luatexts.load_lazy(bad)
+    ensure_equals("lazy deferred error load " .. NAME, ok, true)
+    ensure_fails_with_substring(
+        "lazy deferred error access " .. NAME,
+        function() return t.x end,
+        "load failed: garbage before newline"
+      )
+    ensure_equals("lazy failed proxy is empty " .. NAME, next(t), nil)
+    ensure_fails_with_substring(
+        "lazy deferred error materialize " .. NAME,
+        function() return luatexts.materialize(t) end,
+        "load failed: garbage before newline"
+      )
+  end
+
+  -- Framing errors are not deferred
+  ensure_error(
+      "lazy truncated " .. NAME,
+      "load failed: corrupt data, truncated",
+      luatexts.load_lazy(data:sub(1, #data - 10))
+    )
+
+  ensure_error(
+      "lazy bad tuple size " .. NAME,
+      "load failed: corrupt data",
+      luatexts.load_lazy('X' .. NL)
+    )
+
+  ensure_error(
+      "lazy too deep " .. NAME,
+      "load failed: nesting too deep",
+      luatexts.load_lazy(data, { max_depth = 1 })
+    )
+
+  ensure_equals(
+      "lazy deep enough " .. NAME,
+      (luatexts.load_lazy(data, { max_depth = 2 })),
+      true
+    )
+
+  print("===== END lazy load tests", NAME, "=====")
+end
+
+for NAME, NL in pairs { ["LF"] = "\n", ["CRLF"] = "\r\n" } do
+  print("===== BEGIN validate tests", NAME, "=====")
+
+  local data =
+      '4' .. NL
+   .. 'T' .. NL
+     .. '2' .. NL
+     .. '1' .. NL
+     .. 'S' .. NL
+     .. '5' .. NL
+     .. 'first' .. NL
+     .. '-' .. NL
+     .. 'U' .. NL
+     .. '42' .. NL
+     .. 't' .. NL
+       .. 'N' .. NL
+       .. '3.14' .. NL
+       .. 'p' .. NL
+         .. '1' .. NL
+         .. '0' .. NL
+         .. 'H' .. NL
+         .. '1' .. NL
+         .. '1' .. NL
+         .. '-' .. NL
+       .. '0' .. NL
+       .. '-' .. NL
+       .. '-' .. NL
+   .. '8' .. NL
+     .. '2' .. NL
+     .. 'Ёж' .. NL
+   .. 'T' .. NL
+     .. '0' .. NL
+     .. '0' .. NL
+   .. 'Z' .. NL
+     .. 'z' .. NL
+
+  ensure_returns(
+      "validate stats " .. NAME,
+      2,
+      {
+        true,
+        {
+          tuple_size = 4;
+          values = 14;
+          nils = 2;
+          booleans = 2;
+          numbers = 4;
+          strings = 2;
+          string_refs = 0;
+          tables = 4;
+          table_refs = 0;
+          string_bytes = 9;
+          max_depth = 3;
+          max_table_size = 3;
+        }
+      },
+      luatexts.validate(data)
+    )
+
+  ensure_returns(
+      "validate empty tuple " .. NAME,
+      2,
+      {
+        true,
+        {
+          tuple_size = 0;
+          values = 0;
+          nils = 0;
+          booleans = 0;
+          numbers = 0;
+          strings = 0;
+          string_refs = 0;
+          tables = 0;
+          table_refs = 0;
+          string_bytes = 0;
+          max_depth = 0;
+          max_table_size = 0;
+        }
+      },
+      luatexts.validate('0' .. NL)
+    )
+
+  if math.type then
+    local _, stats = assert(luatexts.validate(data))
+    for k, v in pairs(stats) do
+      ensure_equals(
+          "validate " .. k .. " integer " .. NAME, math.type(v), "integer"
+        )
+    end
+  end
+
+  ensure_error(
+      "validate too deep " .. NAME,
+      "load failed: nesting too deep",
+      luatexts.validate(data, { max_depth = 2 })
+    )
+
+  ensure_equals(
+      "validate deep enough " .. NAME,
+      luatexts.validate(data, { max_depth = 3 }),
+      true
+    )
+
+  ensure_error(
+      "validate truncated " .. NAME,
+      "load failed: corrupt data, truncated",
+      luatexts.validate(data:sub(1, #data - 3))
+    )
+
+  ensure_error(
+      "validate bad number " .. NAME,
+      "load failed: garbage before newline",
+      luatexts.validate('1' .. NL .. 'N' .. NL .. '3.14x' .. NL)
+    )
+
+  ensure_error(
+      "validate bad utf-8 " .. NAME,
+      "load failed: invalid utf-8 data",
+      luatexts.validate('1' .. NL .. '8' .. NL .. '1' .. NL .. '\255' .. NL)
+    )
+
+  ensure_error(
+      "validate nil key " .. NAME,
+      "load failed: corrupt data",
+      luatexts.validate(
+          '1' .. NL .. 'T' .. NL .. '0' .. NL .. '1' .. NL
+       .. '-' .. NL .. '0' .. NL
+        )
+    )
+
+  ensure_error(
+      "validate nan key " .. NAME,
+      "load failed: corrupt data",
+      luatexts.validate(
+          '1' .. NL .. 't' .. NL .. 'N' .. NL .. 'nan' .. NL
+       .. '0' .. NL .. '-' .. NL
+        )
+    )
+
+  ensure_error(
+      "load nan key " .. NAME,
+      "load failed: corrupt data",
+      luatexts.load(
+          '1' .. NL .. 't' .. NL .. 'N' .. NL .. 'nan' .. NL
+       .. '0' .. NL .. '-' .. NL
+        )
+    )
+
+  ensure_fails_with_substring(
+      "validate bad options " .. NAME,
+      function() return luatexts.validate(data, 42) end,
+      "bad argument #2 to '.-' %(table expected.-%)"
+    )
+
+  print("===== END validate tests", NAME, "=====")
+end
+
+for NAME, NL in pairs { ["LF"] = "\n", ["CRLF"] = "\r\n" } do
+  print("===== BEGIN limits tests", NAME, "=====")
+
+  local loaders =
+  {
+    load = luatexts.load;
+    load_at = function(data, options)
+      return luatexts.load_at(data, 1, options)
+    end;
+    load_lazy = load_lazy_deep;
+    validate = luatexts.validate;
+    decoder = function(data, options)
+      return feed_in_chunks(luatexts.decoder(options), data, 3)
+    end;
+    ffi_load = luatexts_ffi and luatexts_ffi.load;
+  }
+
+  local lines = function(...)
+    return table.concat({ ... }, NL) .. NL
+  end
+
+  local cases =
+  {
+    {
+      "tuple size",
+      lines('3', '1', '1', '1'),
+      { max_tuple_size = 2 }, { max_tuple_size = 3 }
+    };
+    {
+      "tuple size vs values",
+      lines('3', '1', '1', '1'),
+      { max_values = 2 }, { max_values = 3 }
+    };
+    {
+      "fixed table values",
+      lines('1', 'T', '3', '0', '1', '1', '1'),
+      { max_values = 3 }, { max_values = 4 }
+    };
+    {
+      "fixed table key-value pairs",
+      lines('1', 'T', '0', '1', '1', '0'),
+      { max_values = 2 }, { max_values = 3 }
+    };
+    {
+      "stream table values",
+      lines('1', 't', '1', '0', '-'),
+      { max_values = 3 }, { max_values = 4 }
+    };
+    {
+      "string length",
+      lines('1', 'S', '5', 'hello'),
+      { max_string_length = 4 }, { max_string_length = 5 }
+    };
+    {
+      "utf-8 string characters",
+      lines('1', '8', '2', 'Ёж'),
+      { max_string_length = 1 }, { max_string_length = 4 }
+    };
+    {
+      "utf-8 string bytes",
+      lines('1', '8', '2', 'Ёж'),
+      { max_string_length = 3 }, { max_string_length = 4 }
+    };
+    {
+      "nested string length",
+      lines('1', 't', 'S', '1', 'k', 'S', '5', 'hello', '-'),
+      { max_string_length = 4 }, { max_string_length = 5 }
+    };
+    {
+      "array size",
+      lines('1', 'T', '2', '1', '1', '1', '1', '1'),
+      { max_array_size = 1 }, { max_array_size = 2, max_hash_size = 1 }
+    };
+    {
+      "hash size",
+      lines('1', 'T', '2', '1', '1', '1', '1', '1'),
+      { max_hash_size = 0 }, { max_array_size = 2, max_hash_size = 1 }
+    };
+    {
+      "nested table size",
+      lines('1', 't', '1', 'T', '0', '1', '1', '1', '-'),
+      { max_hash_size = 0 }, { max_hash_size = 1 }
+    };
+  }
+
+  for name, loader in pairs(loaders) do
+    for i = 1, #cases do
+      local case_name, data, bad_options, good_options = unpack(cases[i])
+
+      ensure_error(
+          name .. " limits " .. case_name .. " " .. NAME,
+          "load failed: limit exceeded",
+          loader(data, bad_options)
+        )
+
+      ensure(
+          name .. " limits " .. case_name .. " ok " .. NAME,
+          (loader(data, good_options))
+        )
+    end
+
+    -- Table header is checked against limits before data size,
+    -- so short data gets the same error from all loaders
+    ensure_error(
+        name .. " limits short table " .. NAME,
+        "load failed: limit exceeded",
+        loader(lines('1', 'T', '1000', '0', '1'), { max_array_size = 10 })
+      )
+
+    -- Hints are not trusted, so they are not checked
+    ensure(
+        name .. " limits hints " .. NAME,
+        (
+          loader(
+              lines('1', 'p', '1000000', '1000000', '1', '1', '-'),
+              { max_array_size = 0, max_hash_size = 0 }
+            )
+        )
+      )
+  end
+
+  ensure_returns(
+      "limits zero values " .. NAME,
+      1, { true },
+      luatexts.load(lines('0'), { max_values = 0 })
+    )
+
+  ensure_error(
+      "load_from_file limits " .. NAME,
+      "load failed: limit exceeded",
+      luatexts.load_from_file(
+          "./test/data/good.luatexts", { max_values = 0 }
+        )
+    )
+
+  ensure_fails_with_substring(
+      "negative limit " .. NAME,
+      function()
+        return luatexts.load(lines('0'), { max_string_length = -1 })
+      end,
+      "max_string_length must not be negative"
+    )
+
+  print("===== END limits tests", NAME, "=====")
+end
+
+for NAME, NL in pairs { ["LF"] = "\n", ["CRLF"] = "\r\n" } do
+  print("===== BEGIN stats tests", NAME, "=====")
+
+  local lines = function(...)
+    return table.concat({ ... }, NL) .. NL
+  end
+
+  local data = lines(
+      '2',
+      'T', '1', '1',
+      'N', '1.5',
+      'S', '1', 'k',
+      'U', '42',
+      'S', '1', 'x'
+    )
+
+  luatexts.reset_stats(false)
+  ensure_equals("disabled " .. NAME, luatexts.stats().enabled, false)
+  assert(luatexts.load(data))
+  ensure_equals("disabled, no loads " .. NAME, luatexts.stats().loads, 0)
+
+  luatexts.reset_stats(true)
+  ensure_equals("enabled " .. NAME, luatexts.stats().enabled, true)
+  assert(luatexts.load(data))
+
+  do
+    local stats = luatexts.stats()
+    local nl = #NL
+
+    ensure_equals("loads " .. NAME, stats.loads, 1)
+    ensure_equals("values T " .. NAME, stats.values["T"], 1)
+    ensure_equals("values N " .. NAME, stats.values["N"], 1)
+    ensure_equals("values S " .. NAME, stats.values["S"], 2)
+    ensure_equals("values U " .. NAME, stats.values["U"], 1)
+    ensure_equals("values - " .. NAME, stats.values["-"], 0)
+    ensure_equals("bytes T " .. NAME, stats.bytes["T"], 3 + 3 * nl)
+    ensure_equals("bytes N " .. NAME, stats.bytes["N"], 4 + 2 * nl)
+    ensure_equals("bytes S " .. NAME, stats.bytes["S"], 2 * (3 + 3 * nl))
+    ensure_equals("bytes U " .. NAME, stats.bytes["U"], 3 + 2 * nl)
+    ensure_tequals(
+        "tables " .. NAME,
+        stats.tables,
+        { created = 1, presized = 2, filled = 2, grown = 0 }
+      )
+    ensure_equals("max_depth " .. NAME, stats.max_depth, 1)
+    ensure_equals("no errors " .. NAME, stats.errors.EBADTYPE, 0)
+    ensure("load time " .. NAME, stats.time.load >= 0)
+
+    if math.type then
+      ensure_equals("loads integer " .. NAME, math.type(stats.loads), "integer")
+      ensure_equals(
+          "values integer " .. NAME, math.type(stats.values["T"]), "integer"
+        )
+      ensure_equals(
+          "bytes integer " .. NAME, math.type(stats.bytes["T"]), "integer"
+        )
+      ensure_equals(
+          "tables integer " .. NAME,
+          math.type(stats.tables.created) .. math.type(stats.tables.grown),
+          "integerinteger"
+        )
+      ensure_equals(
+          "max_depth integer " .. NAME, math.type(stats.max_depth), "integer"
+        )
+      ensure_equals(
+          "errors integer " .. NAME,
+          math.type(stats.errors.EBADTYPE),
+          "integer"
+        )
+    end
+  end
+
+  luatexts.reset_stats()
+  ensure_equals("reset keeps enabled " .. NAME, luatexts.stats().enabled, true)
+  ensure_equals("reset " .. NAME, luatexts.stats().loads, 0)
+
+  -- Hint is exceeded, terminating nil counts as a nil value
+  assert(luatexts.load(lines('1', 'p', '0', '0', 'U', '1', 'T', '0', '0', '-')))
+  ensure_tequals(
+      "grown table " .. NAME,
+      luatexts.stats().tables,
+      { created = 2, presized = 0, filled = 1, grown = 1 }
+    )
+  ensure_equals("max_depth nested " .. NAME, luatexts.stats().max_depth, 2)
+  ensure_equals("terminator " .. NAME, luatexts.stats().values["-"], 1)
+
+  -- Values of the abandoned first pass are not counted
+  luatexts.reset_stats()
+  assert(luatexts.load(lines('1', 'T', '1', '0', 'r', '1')))
+  ensure_equals("reload T " .. NAME, luatexts.stats().values["T"], 1)
+  ensure_equals("reload r " .. NAME, luatexts.stats().values["r"], 1)
+  ensure_equals("reload loads " .. NAME, luatexts.stats().loads, 1)
+
+  -- Tables of all types are counted as created, references are not
+  luatexts.reset_stats()
+  assert(luatexts.load(lines('3', 't', '-', 'p', '0', '0', '-', 'r', '1')))
+  ensure_equals("created " .. NAME, luatexts.stats().tables.created, 2)
+
+  -- Values of failed loads are not counted, errors are
+  luatexts.reset_stats()
+  ensure_error(
+      "bad type " .. NAME,
+      "load failed: unknown data type",
+      luatexts.load(lines('2', 'U', '1', 'X'))
+    )
+  ensure_error(
+      "bad type, validate " .. NAME,
+      "load failed: unknown data type",
+      luatexts.validate(lines('1', 'X'))
+    )
+  ensure_error(
+      "limit " .. NAME,
+      "load failed: limit exceeded",
+      luatexts.load(lines('1', 'U', '1'), { max_values = 0 })
+    )
+  do
+    local stats = luatexts.stats()
+    ensure_equals("failed loads " .. NAME, stats.loads, 0)
+    ensure_equals("failed values " .. NAME, stats.values["U"], 0)
+    ensure_equals("EBADTYPE " .. NAME, stats.errors.EBADTYPE, 2)
+    ensure_equals("ELIMIT " .. NAME, stats.errors.ELIMIT, 1)
+  end
+
+  luatexts.reset_stats(false)
+  assert(luatexts.load(data))
+  ensure_equals(
+      "disabled after reset " .. NAME, luatexts.stats().values["U"], 0
+    )
+
+  print("===== END stats tests", NAME, "=====")
+end
+
+for NAME, NL in pairs { ["LF"] = "\n", ["CRLF"] = "\r\n" } do
+  print("===== BEGIN cache tests", NAME, "=====")
+
+  local lines = function(...)
+    return table.concat({ ... }, NL) .. NL
+  end
+
+  -- Tables: 1 (outer), 2 ({ 42 }), 3 (key)
+  local data = lines(
+      '2',
+      'T', '0', '3',
+        'S', '1', 'a', 'T', '1', '0', 'U', '42',
+        'S', '4', 'self', 'r', '1',
+        'T', '0', '0', 'S', '1', 'x',
+      'r', '2'
+    )
+
+  local stats = function()
+    local s = luatexts.cache_stats()
+    return { s.hits, s.misses, s.evictions, s.entries, s.size }
+  end
+
+  luatexts.reset_cache(2)
+  ensure_tequals("cache empty " .. NAME, stats(), { 0, 0, 0, 0, 2 })
+  if math.type then
+    for k, v in pairs(luatexts.cache_stats()) do
+      ensure_equals(
+          "cache " .. k .. " integer " .. NAME, math.type(v), "integer"
+        )
+    end
+  end
+
+  local ok, t, a = luatexts.cached_load(data)
+  ensure_equals("cached_load " .. NAME, ok, true)
+  ensure_equals("cached_load nested " .. NAME, t.a[1], 42)
+  ensure("cached_load ref " .. NAME, t.a == a)
+  ensure("cached_load cycle " .. NAME, t.self == t)
+  ensure_equals("cached_load missing " .. NAME, t.b, nil)
+  ensure_tequals("cache miss " .. NAME, stats(), { 0, 1, 0, 1, 2 })
+
+  ensure_fails_with_substring(
+      "cached_load read-only " .. NAME,
+      function() t.b = 1 end,
+      "luatexts.cached_load: attempt to modify read-only table"
+    )
+  ensure_fails_with_substring(
+      "cached_load nested read-only " .. NAME,
+      function() t.a[1] = 1 end,
+      "luatexts.cached_load: attempt to modify read-only table"
+    )
+  ensure_equals("cached_load unchanged " .. NAME, t.a[1], 42)
+  ensure_equals(
+      "cached_load metatable hidden " .. NAME, getmetatable(t), "read-only"
+    )
+
+  -- Helpers work on all Lua versions, # and pairs() on Lua 5.2+ only
+  local check_pairs = function(name, pairs, len)
+    local keys, key = 0, nil
+    for k, v in pairs(t) do
+      keys = keys + 1
+      if type(k) == "table" then
+        key = k
+        ensure_equals(name .. " table key value " .. NAME, v, "x")
       end
+    end
+    ensure_equals(name .. " keys " .. NAME, keys, 3)
+    ensure_equals(name .. " table key " .. NAME, type(key), "table")
+    ensure_fails_with_substring(
+        name .. " table key read-only " .. NAME,
+        function() key[1] = 1 end,
+        "luatexts.cached_load: attempt to modify read-only table"
+      )
+    ensure_equals(name .. " len " .. NAME, len(t.a), 1)
+  end
 
-      print("mutated ok:", mutated_ok)
-      print("mutated fail:", mutated_fail)
+  check_pairs("cached_load helpers", luatexts.pairs, luatexts.len)
+  if _VERSION ~= "Lua 5.1" then
+    check_pairs("cached_load", pairs, function(v) return #v end)
+  end
+
+  do
+    local values = { }
+    for i, v in luatexts.ipairs(t.a) do
+      values[i] = v
     end
+    ensure_tequals("cached_load ipairs " .. NAME, values, { 42 })
 
-    print("===== END generative tests", NAME, "=====")
+    -- Iteration state is the proxy, not the original table
+    local _, state = luatexts.pairs(t)
+    ensure("cached_load pairs state " .. NAME, state == t)
+    ensure_fails_with_substring(
+        "cached_load pairs state read-only " .. NAME,
+        function() state.b = 1 end,
+        "luatexts.cached_load: attempt to modify read-only table"
+      )
+  end
+
+  -- Other tables are taken as they are
+  do
+    local plain = { 1, 2, x = 3 }
+    local keys = 0
+    for k, v in luatexts.pairs(plain) do
+      keys = keys + 1
+      ensure_equals("helpers plain pairs " .. NAME, plain[k], v)
+    end
+    ensure_equals("helpers plain keys " .. NAME, keys, 3)
+    ensure_equals("helpers plain len " .. NAME, luatexts.len(plain), 2)
+    local values = { }
+    for i, v in luatexts.ipairs(plain) do
+      values[i] = v
+    end
+    ensure_tequals("helpers plain ipairs " .. NAME, values, { 1, 2 })
+    ensure_fails_with_substring(
+        "helpers not a table " .. NAME,
+        function() luatexts.len("x") end,
+        "table expected"
+      )
+  end
+
+  local ok2, t2, a2 = luatexts.cached_load(data)
+  ensure("cache hit same tuple " .. NAME, ok2 == true and t2 == t and a2 == a)
+  ensure_tequals("cache hit " .. NAME, stats(), { 1, 1, 0, 1, 2 })
+
+  -- Same bytes in a different string
+  local copy = table.concat({ data, "" })
+  ensure("cache hit copy " .. NAME, select(2, luatexts.cached_load(copy)) == t)
+
+  ensure_error(
+      "cached_load options " .. NAME,
+      "load failed: limit exceeded",
+      luatexts.cached_load(data, { max_values = 1 })
+    )
+  ensure_error(
+      "cached_load bad data " .. NAME,
+      "load failed: unknown data type",
+      luatexts.cached_load(lines('1', 'X'))
+    )
+  ensure_tequals("cache errors " .. NAME, stats(), { 2, 3, 0, 1, 2 })
+
+  -- LRU: data is used, then b, then data again, so c evicts b
+  local b, c = lines('1', 'U', '1'), lines('1', 'U', '2')
+  ensure_returns(
+      "cached_load b " .. NAME, 2, { true, 1 }, luatexts.cached_load(b)
+    )
+  assert(luatexts.cached_load(data))
+  ensure_returns(
+      "cached_load c " .. NAME, 2, { true, 2 }, luatexts.cached_load(c)
+    )
+  ensure_tequals("cache evicted " .. NAME, stats(), { 3, 5, 1, 2, 2 })
+  ensure("cache kept " .. NAME, select(2, luatexts.cached_load(data)) == t)
+  ensure_returns(
+      "cached_load b again " .. NAME, 2, { true, 1 }, luatexts.cached_load(b)
+    )
+  ensure_tequals("cache b evicted " .. NAME, stats(), { 4, 6, 2, 2, 2 })
+
+  luatexts.reset_cache()
+  ensure_tequals("cache reset " .. NAME, stats(), { 0, 0, 0, 0, 2 })
+  ensure(
+      "cache reset reloads " .. NAME,
+      select(2, luatexts.cached_load(data)) ~= t
+    )
+
+  luatexts.reset_cache(0)
+  local ok3, t3 = luatexts.cached_load(data)
+  ensure_fails_with_substring(
+      "cache disabled read-only " .. NAME,
+      function() t3.a = 1 end,
+      "luatexts.cached_load: attempt to modify read-only table"
+    )
+  ensure("cache disabled " .. NAME, select(2, luatexts.cached_load(data)) ~= t3)
+  ensure_tequals("cache disabled stats " .. NAME, stats(), { 0, 2, 0, 0, 0 })
+
+  ensure_fails_with_substring(
+      "reset_cache bad size " .. NAME,
+      function() luatexts.reset_cache(-1) end,
+      "invalid cache size"
+    )
+
+  luatexts.reset_cache(64)
+
+  print("===== END cache tests", NAME, "=====")
+end
+
+for NAME, NL in pairs { ["LF"] = "\n", ["CRLF"] = "\r\n" } do
+  print("===== BEGIN dedup tests", NAME, "=====")
+
+  local lines = function(...)
+    return table.concat({ ... }, NL) .. NL
+  end
+
+  local DEDUP = { dedup = true }
+
+  local data = lines(
+      '6',
+      'T', '2', '0', 'U', '1', 'U', '2',
+      'T', '2', '0', 'U', '1', 'U', '2',
+      'T', '2', '0', 'U', '1', 'U', '3',
+      't', 'S', '1', 'a', 'T', '0', '0', '-',
+      't', 'S', '1', 'a', 'T', '0', '0', '-',
+      'T', '0', '0'
+    )
+
+  local ok, a, b, c, d, e, f = luatexts.load(data, DEDUP)
+  ensure_equals("dedup load " .. NAME, ok, true)
+  ensure_tequals("dedup values " .. NAME, { a, c }, { { 1, 2 }, { 1, 3 } })
+  ensure("dedup shared " .. NAME, a == b)
+  ensure("dedup different " .. NAME, a ~= c)
+  ensure("dedup nested " .. NAME, d == e)
+  ensure_tequals("dedup nested value " .. NAME, d, { a = { } })
+  ensure("dedup empty " .. NAME, d.a == f)
+
+  local ok, a, b = luatexts.load(data)
+  ensure("no dedup by default " .. NAME, ok == true and a ~= b)
+
+  -- Table 1 is { 1 }, table 2 is the same, so table 3 holds table 1 twice
+  ok, a, b, c = luatexts.load(
+      lines(
+          '3',
+          'T', '1', '0', 'U', '1',
+          'T', '1', '0', 'U', '1',
+          'T', '2', '0', 'r', '2', 'r', '1'
+        ),
+      DEDUP
+    )
+  ensure("dedup refs " .. NAME, ok == true and a == b)
+  ensure("dedup ref shared " .. NAME, c[1] == a and c[2] == a)
+
+  -- Both tables hold table 1, so they are the same
+  ok, a, b = luatexts.load(
+      lines('2', 'T', '1', '0', 'r', '1', 'T', '1', '0', 'r', '1'),
+      DEDUP
+    )
+  ensure("dedup cycle " .. NAME, ok == true and a == b and a[1] == a)
+
+  -- Table keys are not shared
+  ok, a = luatexts.load(
+      lines('1', 'T', '0', '2', 'T', '0', '0', 'U', '1', 'T', '0', '0', 'U', '2'),
+      DEDUP
+    )
+  do
+    local sum = 0
+    for k, v in pairs(a) do
+      sum = sum + v
+    end
+    ensure_equals("dedup keys " .. NAME, sum, 3)
+  end
+
+  -- Fingerprints cover data around and inside nested tables
+  do
+    local nested = function(depth, leaf, tail)
+      local t = { leaf }
+      for i = 2, depth do
+        t = { t, tail }
+      end
+      return t
+    end
+
+    ok, a, b, c, d = luatexts.load(
+        assert(luatexts.save(
+            nested(100, 1, "x"), nested(100, 1, "x"),
+            nested(100, 2, "x"), nested(100, 1, "y")
+          )),
+        DEDUP
+      )
+    ensure("dedup deep " .. NAME, ok == true and a == b)
+    ensure("dedup deep leaf differs " .. NAME, a ~= c and a[1] ~= c[1])
+    ensure("dedup deep tail differs " .. NAME, a ~= d and a[1] ~= d[1])
+    ensure_tequals("dedup deep value " .. NAME, c, nested(100, 2, "x"))
+  end
+
+  -- Back-references to tables inside a shared table (keys too)
+  -- get tables that are in the loaded value
+  do
+    local data = lines(
+        '3',
+        'T', '0', '1', 'T', '0', '0', 'U', '1',
+        'T', '0', '1', 'T', '0', '0', 'U', '1',
+        'r', '4'
+      )
+
+    local ok, a, b, c = luatexts.load(data)
+    ensure("dedup inner ref plain " .. NAME, ok == true and c == next(b))
+
+    ok, a, b, c = luatexts.load(data, DEDUP)
+    ensure("dedup inner ref " .. NAME, ok == true and a == b)
+    ensure("dedup inner ref key " .. NAME, c == next(b))
+
+    ok, a, b, c = luatexts.load(
+        lines(
+            '3',
+            'T', '0', '1', 'S', '1', 'x',
+              'T', '0', '1', 'T', '0', '0', 'U', '1',
+            'T', '0', '1', 'S', '1', 'x',
+              'T', '0', '1', 'T', '0', '0', 'U', '1',
+            'r', '6'
+          ),
+        DEDUP
+      )
+    ensure("dedup inner ref nested " .. NAME, ok == true and a == b)
+    ensure("dedup inner ref nested key " .. NAME, c == next(b.x))
+  end
+
+  ensure_error(
+      "dedup limits " .. NAME,
+      "load failed: limit exceeded",
+      luatexts.load(data, { dedup = true, max_values = 10 })
+    )
+
+  do
+    local str = ("luatexts"):rep(128)
+    local values = { }
+    for i = 1, 1000 do
+      values[i] = str
+    end
+    local data = assert(luatexts.save(values))
+    str, values = nil, nil
+
+    collectgarbage("collect")
+    local before = collectgarbage("count")
+    local ok, loaded = luatexts.load(data, DEDUP)
+    collectgarbage("collect")
+    ensure(
+        "dedup long strings " .. NAME,
+        ok == true and #loaded == 1000 and
+        collectgarbage("count") - before < 200
+      )
+  end
+
+  ok, a, b = luatexts.cached_load(data, DEDUP)
+  ensure("dedup cached_load " .. NAME, ok == true and a == b and a[2] == 2)
+
+  print("===== END dedup tests", NAME, "=====")
+end
+
+for NAME, NL in pairs { ["LF"] = "\n", ["CRLF"] = "\r\n" } do
+  print("===== BEGIN select tests", NAME, "=====")
+
+  local lines = function(...)
+    return table.concat({ ... }, NL) .. NL
+  end
+
+  local record =
+  {
+    id = 42;
+    name = "item";
+    tags = { "a", "b", "c" };
+    address = { city = "X", zip = "123", geo = { 1, 2 } };
+    blob = ("luatexts"):rep(64);
+  }
+  local data = assert(luatexts.save(record, "tail")):gsub("\n", NL)
+
+  ensure_returns(
+      "select paths " .. NAME,
+      3, { true, { id = 42, address = { city = "X" } }, "tail" },
+      luatexts.load_select(data, { "id", "address.city" })
+    )
+
+  ensure_returns(
+      "select nested " .. NAME,
+      3,
+      { true, { tags = { [2] = "b" }, address = { geo = { 1, 2 } } }, "tail" },
+      luatexts.load_select(
+          data,
+          { tags = { [2] = true }, address = { geo = true } }
+        )
+    )
+
+  ensure_returns(
+      "select whole wins " .. NAME,
+      3, { true, { address = record.address }, "tail" },
+      luatexts.load_select(data, { "address", address = { city = true } })
+    )
+
+  ensure_returns(
+      "select missing " .. NAME,
+      3, { true, { }, "tail" },
+      luatexts.load_select(data, { "nope", nope = { x = true } })
+    )
+
+  -- Values that are not tables are not projected
+  ensure_returns(
+      "select not a table " .. NAME,
+      3, { true, { id = 42, tags = { } }, "tail" },
+      luatexts.load_select(data, { "id.x", tags = { x = true } })
+    )
+
+  ensure_returns(
+      "select wildcard " .. NAME,
+      3, { true, record, "tail" },
+      luatexts.load_select(data, { ["*"] = true })
+    )
+
+  ensure_returns(
+      "select empty spec " .. NAME,
+      3, { true, { }, "tail" },
+      luatexts.load_select(data, { })
+    )
+
+  do
+    local records = { }
+    for i = 1, 50 do
+      records[i] = { id = i, name = "name" .. i, payload = { i, i * 2 } }
+    end
+    local spec = { ["*"] = { "id", payload = { [2] = true } } }
+
+    local expected = { }
+    for i = 1, 50 do
+      expected[i] = { id = i, payload = { [2] = i * 2 } }
+    end
+
+    ensure_returns(
+        "select wildcard records " .. NAME,
+        2, { true, expected },
+        luatexts.load_select(
+            assert(luatexts.save(records)):gsub("\n", NL),
+            spec
+          )
+      )
+
+    -- Spec applies to each tuple value
+    ensure_returns(
+        "select wildcard records refs " .. NAME,
+        3, { true, expected, { id = 1, name = "name1", payload = { } } },
+        luatexts.load_select(
+            assert(luatexts.save(records, records[1])):gsub("\n", NL),
+            spec
+          )
+      )
+  end
+
+  -- Referenced strings are either skipped or loaded
+  ensure_returns(
+      "select string refs " .. NAME,
+      2, { true, { b = "x", c = { "x", "y" } } },
+      luatexts.load_select(
+          lines(
+              '1',
+              't',
+              'S', '1', 'a', 'S', '1', 'x',
+              'S', '1', 'b', 's', '2',
+              'S', '1', 'c', 'T', '2', '0', 's', '2', 'S', '1', 'y',
+              'S', '1', 'd', 's', '5',
+              '-'
+            ),
+          { "b", "c" }
+        )
+    )
+
+  -- Tables with back-references are loaded, and then projected
+  do
+    local data = lines(
+        '1',
+        'T', '0', '4',
+        'S', '1', 'c', 'U', '3',
+        'S', '1', 'a', 'T', '0', '2',
+        'S', '1', 'x', 'U', '1', 'S', '1', 'y', 'U', '2',
+        'S', '1', 'b', 'r', '2',
+        'S', '4', 'self', 'r', '1'
+      )
+
+    local ok, t = luatexts.load_select(
+        data,
+        { "c", a = { x = true }, self = { "c" } }
+      )
+    ensure_equals("select refs ok " .. NAME, ok, true)
+    ensure_tequals(
+        "select refs " .. NAME,
+        t,
+        { c = 3, a = { x = 1 }, self = { c = 3 } }
+      )
+  end
+
+  -- Skipped table references are not loaded
+  ensure_returns(
+      "select skipped refs " .. NAME,
+      2, { true, { 1 } },
+      luatexts.load_select(
+          lines('1', 'T', '2', '0', 'U', '1', 'r', '1'),
+          { [1] = true }
+        )
+    )
+
+  ensure_error(
+      "select corrupt " .. NAME,
+      "load failed: corrupt data",
+      luatexts.load_select(
+          lines('1', 'T', '2', '0', 'U', '1', 'r', '2'),
+          { [1] = true }
+        )
+    )
+
+  ensure_error(
+      "select truncated " .. NAME,
+      "load failed: corrupt data, truncated",
+      luatexts.load_select(data:sub(1, -10), { "id" })
+    )
+
+  ensure_error(
+      "select limits " .. NAME,
+      "load failed: limit exceeded",
+      luatexts.load_select(data, { "id" }, { max_values = 5 })
+    )
+
+  ensure_fails_with_substring(
+      "select bad spec " .. NAME,
+      function() return luatexts.load_select(data, { id = 1 }) end,
+      "bad spec value %(number%)"
+    )
+
+  do
+    local spec = { }
+    spec.x = spec
+    ensure_fails_with_substring(
+        "select cyclic spec " .. NAME,
+        function() return luatexts.load_select(data, spec) end,
+        "spec nested too deep"
+      )
+  end
+
+  ensure_fails_with_substring(
+      "select no spec " .. NAME,
+      function() return luatexts.load_select(data) end,
+      "bad argument #2"
+    )
+
+  print("===== END select tests", NAME, "=====")
+end
+
+for NAME, NL in pairs { ["LF"] = "\n", ["CRLF"] = "\r\n" } do
+  print("===== BEGIN lua load tests", NAME, "=====")
+
+  local lines = function(...)
+    return table.concat({ ... }, NL) .. NL
+  end
+
+  ensure_returns(
+      "utf-8 string " .. NAME,
+      3, { true, "Ёж\nx", "" },
+      luatexts_lua.load(lines('2', '8', '4', 'Ёж\nx', '8', '0', ''))
+    )
+
+  ensure_error(
+      "utf-8 string truncated " .. NAME,
+      "load failed: not enough data in buffer",
+      luatexts_lua.load('1' .. NL .. '8' .. NL .. '3' .. NL .. 'Ёж')
+    )
+
+  ensure_error(
+      "nan key " .. NAME,
+      "load failed: table key is nan",
+      luatexts_lua.load(lines('1', 't', 'N', 'nan', '1', '-'))
+    )
+
+  ensure_error(
+      "nil key " .. NAME,
+      "load failed: table key is nil",
+      luatexts_lua.load(lines('1', 'T', '0', '1', '-', '1'))
+    )
+
+  do
+    local res, err = luatexts_lua.load(
+        '1' .. NL .. ('t' .. NL .. 'U' .. NL .. '1' .. NL):rep(1e6)
+      )
+    ensure_equals("deep nesting fails " .. NAME, res, nil)
+    ensure(
+        "deep nesting error " .. NAME,
+        err:find("stack overflow", 1, true)
+      )
   end
+
+  print("===== END lua load tests", NAME, "=====")
 end
 
 local NAME = ""
@@ -2468,6 +5192,532 @@ ensure_returns(
     luatexts.load_from_file("./test/data/good.luatexts")
   )
 
+ensure_returns(
+    "good with options " .. NAME,
+    2, { true, 42 },
+    luatexts.load_from_file("./test/data/good.luatexts", { max_depth = 0 })
+  )
+
 print("===== END file tests", NAME, "=====")
 
+print("===== BEGIN save to file tests", NAME, "=====")
+
+do
+  local filename = "./tmp/save_to_file.luatexts"
+  local data =
+  {
+    1, 2, nil, 4;
+    a = { b = { } };
+    [1.5] = "x";
+    [{ 42 }] = { 24 };
+    huge = ("luatexts"):rep(16384); -- Larger than internal buffer
+  }
+
+  ensure_equals(
+      "save_to_file " .. NAME,
+      ensure("save_to_file", luatexts.save_to_file(filename, data, nil, "x")),
+      true
+    )
+
+  ensure_returns(
+      "save_to_file load " .. NAME,
+      4, { true, data, nil, "x" },
+      luatexts.load_from_file(filename)
+    )
+
+  local f = assert(io.open(filename, "w"))
+  ensure_equals(
+      "save_to_handle " .. NAME,
+      ensure("save_to_handle", luatexts.save_to_handle(f, data, true)),
+      true
+    )
+  f:close()
+
+  ensure_returns(
+      "save_to_handle load " .. NAME,
+      3, { true, data, true },
+      luatexts.load_from_file(filename)
+    )
+
+  f = assert(io.open(filename, "w"))
+  local function cat(v) f:write(v) return cat end
+  luatexts_lua.save_cat(cat, { 1, a = { 2 } })
+  f:close()
+  f = assert(io.open(filename, "r"))
+  local expected = f:read("*a")
+  f:close()
+
+  ensure(
+      "save_to_file " .. NAME,
+      luatexts.save_to_file(filename, { 1, a = { 2 } })
+    )
+  f = assert(io.open(filename, "r"))
+  ensure_strequals(
+      "save_to_file output matches save_cat " .. NAME,
+      f:read("*a"),
+      expected
+    )
+  f:close()
+
+  -- Size hints are opt-in, default output uses `t`
+  ensure(
+      "save_to_file empty table " .. NAME,
+      luatexts.save_to_file(filename, { })
+    )
+  f = assert(io.open(filename, "r"))
+  ensure_strequals(
+      "save_to_file writes t " .. NAME,
+      f:read("*a"),
+      "1\nt\n-\n"
+    )
+  f:close()
+
+  f = assert(io.open(filename, "w"))
+  luatexts_lua.save_cat_hinted(cat, { 1, a = { 2 } })
+  f:close()
+  f = assert(io.open(filename, "r"))
+  expected = f:read("*a")
+  f:close()
+  ensure_strequals(
+      "save_cat_hinted writes p " .. NAME,
+      expected:sub(1, 4),
+      "1\np\n"
+    )
+
+  ensure(
+      "save_to_file_hinted " .. NAME,
+      luatexts.save_to_file_hinted(filename, { 1, a = { 2 } })
+    )
+  f = assert(io.open(filename, "r"))
+  ensure_strequals(
+      "save_to_file_hinted output matches save_cat_hinted " .. NAME,
+      f:read("*a"),
+      expected
+    )
+  f:close()
+
+  f = assert(io.open(filename, "w"))
+  ensure(
+      "save_to_handle_hinted " .. NAME,
+      luatexts.save_to_handle_hinted(f, { 1, a = { 2 } })
+    )
+  f:close()
+  f = assert(io.open(filename, "r"))
+  ensure_strequals(
+      "save_to_handle_hinted output matches save_cat_hinted " .. NAME,
+      f:read("*a"),
+      expected
+    )
+  f:close()
+
+  assert(luatexts.save_to_file_hinted(filename, { 1, a = { 2 } }, "x"))
+  ensure_returns(
+      "save_to_file_hinted load " .. NAME,
+      3, { true, { 1, a = { 2 } }, "x" },
+      luatexts.load_from_file(filename)
+    )
+
+  do
+    local t = { }
+    t[1] = t
+    ensure_error(
+        "save_to_file circular table " .. NAME,
+        "save failed: circular table reference detected",
+        luatexts.save_to_file(filename, t)
+      )
+  end
+
+  do
+    local nested = function(depth)
+      local t = { }
+      for i = 2, depth do
+        t = { t }
+      end
+      return t
+    end
+
+    -- Whatever is saved loads with default options
+    local data = ensure("save max depth " .. NAME, luatexts.save(nested(1000)))
+    ensure("save max depth load " .. NAME, luatexts.load(data))
+
+    local t = nested(1e5)
+    ensure_error(
+        "save too deep " .. NAME,
+        "save failed: nesting too deep",
+        luatexts.save(t)
+      )
+    ensure_error(
+        "save too deep inside " .. NAME,
+        "save failed: nesting too deep",
+        luatexts.save(42, { x = nested(1001) })
+      )
+    ensure_error(
+        "save_to_file too deep " .. NAME,
+        "save failed: nesting too deep",
+        luatexts.save_to_file(filename, t)
+      )
+    local f = assert(io.open(filename, "w"))
+    ensure_error(
+        "save_to_handle too deep " .. NAME,
+        "save failed: nesting too deep",
+        luatexts.save_to_handle(f, t)
+      )
+    f:close()
+    t = nil
+
+    local ok, v = luatexts.load(luatexts.save({ { 42 } }))
+    ensure("save after too deep " .. NAME, ok == true and v[1][1] == 42)
+  end
+
+  ensure_error_with_substring(
+      "save_to_file bad path " .. NAME,
+      "save_to_file failed: can't open './tmp/no-such-dir/x.luatexts'"
+   .. " for writing: ",
+      luatexts.save_to_file("./tmp/no-such-dir/x.luatexts", 42)
+    )
+
+  ensure_error_with_substring(
+      "save_to_file_hinted bad path " .. NAME,
+      "save_to_file_hinted failed: can't open './tmp/no-such-dir/x.luatexts'"
+   .. " for writing: ",
+      luatexts.save_to_file_hinted("./tmp/no-such-dir/x.luatexts", 42)
+    )
+
+  os.remove(filename)
+end
+
+print("===== END save to file tests", NAME, "=====")
+
+print("===== BEGIN open tests", NAME, "=====")
+
+do
+  local filename = "./tmp/open.luatexts"
+  local write = function(name, data)
+    local f = assert(io.open(name, "wb"))
+    f:write(data)
+    f:close()
+  end
+
+  os.remove(filename)
+
+  local handle = luatexts.open(filename, { populate = true, sequential = true })
+
+  ensure_error_with_substring(
+      "open missing file " .. NAME,
+      "load failed: can't stat '" .. filename .. "': No such file or directory",
+      handle:load()
+    )
+
+  write(filename, "")
+  ensure_error_with_substring(
+      "open empty file " .. NAME,
+      "load failed: '" .. filename .. "' is empty",
+      handle:load()
+    )
+
+  assert(luatexts.save_to_file(filename, { a = 1 }, "x"))
+
+  local ok, t, x = handle:load()
+  ensure_tequals("open load " .. NAME, { ok, t, x }, { true, { a = 1 }, "x" })
+
+  ensure_returns(
+      "open load unchanged returns cached " .. NAME,
+      3, { true, t, "x" },
+      handle:load()
+    )
+  ensure("open cached table " .. NAME, select(2, handle:load()) == t)
+
+  -- Size changes
+  assert(luatexts.save_to_file(filename, { a = 2, b = 3 }))
+  local ok, t2 = handle:load()
+  ensure_tequals("open reload " .. NAME, { ok, t2 }, { true, { a = 2, b = 3 } })
+  ensure("open reload new table " .. NAME, t2 ~= t)
+
+  -- File is replaced
+  assert(luatexts.save_to_file(filename .. ".new", 42))
+  assert(os.rename(filename .. ".new", filename))
+  ensure_returns("open replaced " .. NAME, 2, { true, 42 }, handle:load())
+
+  -- Bad data is loaded again on each call
+  write(filename, "1\nX\n")
+  ensure_error(
+      "open bad data " .. NAME,
+      "load failed: unknown data type",
+      handle:load()
+    )
+  ensure_error(
+      "open bad data again " .. NAME,
+      "load failed: unknown data type",
+      handle:load()
+    )
+
+  write(filename, "2\n1\n0\n")
+  ensure_returns("open fixed " .. NAME, 3, { true, true, false }, handle:load())
+
+  ensure_error(
+      "open options " .. NAME,
+      "load failed: limit exceeded",
+      luatexts.open(filename, { max_values = 1 }):load()
+    )
+
+  ensure_equals("open close " .. NAME, handle:close(), true)
+  ensure_fails_with_substring(
+      "open closed " .. NAME,
+      function() return handle:load() end,
+      "luatexts.open: attempt to use a closed handle"
+    )
+
+  os.remove(filename)
+end
+
+print("===== END open tests", NAME, "=====")
+
+print("===== BEGIN load from handle tests", NAME, "=====")
+
+do
+  local filename = "./tmp/load_from_handle.luatexts"
+  local data =
+  {
+    1, 2, nil, 4;
+    a = { b = { } };
+    huge = ("luatexts"):rep(16384); -- Larger than internal buffer
+  }
+
+  assert(luatexts.save_to_file(filename, data, "x"))
+
+  local f = assert(io.open(filename, "rb"))
+  ensure_returns(
+      "load_from_handle file " .. NAME,
+      3, { true, data, "x" },
+      luatexts.load_from_handle(f)
+    )
+  ensure_equals("load_from_handle file consumed " .. NAME, f:read(1), nil)
+  ensure_error_with_substring(
+      "load_from_handle file at end " .. NAME,
+      "load failed: ",
+      luatexts.load_from_handle(f)
+    )
+  f:close()
+
+  ensure_fails_with_substring(
+      "load_from_handle closed file " .. NAME,
+      function() return luatexts.load_from_handle(f) end,
+      "attempt to use a closed file"
+    )
+
+  -- Loading starts at current position
+  f = assert(io.open(filename, "rb"))
+  local encoded = f:read("*a")
+  f:close()
+
+  f = assert(io.open(filename, "wb"))
+  f:write("header\n", encoded)
+  f:close()
+
+  f = assert(io.open(filename, "rb"))
+  ensure_equals("load_from_handle skip header " .. NAME, f:read("*l"), "header")
+  ensure_returns(
+      "load_from_handle after header " .. NAME,
+      3, { true, data, "x" },
+      luatexts.load_from_handle(f, { max_values = 32 })
+    )
+  f:close()
+
+  f = assert(io.open(filename, "rb"))
+  f:read("*l")
+  ensure_error(
+      "load_from_handle options " .. NAME,
+      "load failed: limit exceeded",
+      luatexts.load_from_handle(f, { max_values = 1 })
+    )
+  f:close()
+
+  -- Pipes are read until the end of data
+  local popen_ok, f = pcall(io.popen, "tail -c +8 " .. filename, "r")
+  if not popen_ok then
+    print("WARNING: io.popen() is not supported, skipping pipe tests")
+  else
+    ensure_returns(
+        "load_from_handle pipe " .. NAME,
+        3, { true, data, "x" },
+        luatexts.load_from_handle(f)
+      )
+    f:close()
+
+    f = assert(io.popen("true", "r"))
+    ensure_error_with_substring(
+        "load_from_handle empty pipe " .. NAME,
+        "load failed: ",
+        luatexts.load_from_handle(f)
+      )
+    f:close()
+  end
+
+  ensure_error_with_substring(
+      "load_from_fd bad fd " .. NAME,
+      "load_from_fd failed: can't stat: ",
+      luatexts.load_from_fd(1024 * 1024)
+    )
+
+  ensure_fails_with_substring(
+      "load_from_fd negative fd " .. NAME,
+      function() return luatexts.load_from_fd(-1) end,
+      "invalid file descriptor"
+    )
+
+  os.remove(filename)
+end
+
+print("===== END load from handle tests", NAME, "=====")
+
+print("===== BEGIN record tests", NAME, "=====")
+
+do
+  local records = { }
+  local expected = { }
+  local offset = 1
+  for i = 1, 5 do
+    local tuple = { i, ("x"):rep(i), { i, a = { i } } }
+    if i == 3 then
+      tuple = { } -- Empty tuple
+    end
+    local data = ensure("save", luatexts.save(unpack(tuple, 1, #tuple)))
+    records[#records + 1] = data
+    offset = offset + #data
+    expected[#expected + 1] = { offset, tuple }
+  end
+  local data = table.concat(records)
+
+  offset = 1
+  for i = 1, #expected do
+    local tuple = expected[i][2]
+    ensure_returns(
+        "load_at " .. i .. " " .. NAME,
+        #tuple + 1, { expected[i][1], unpack(tuple, 1, #tuple) },
+        luatexts.load_at(data, offset)
+      )
+    offset = expected[i][1]
+  end
+  ensure_equals("load_at last offset " .. NAME, offset, #data + 1)
+
+  ensure_returns(
+      "load_at default offset " .. NAME,
+      #expected[1][2] + 1, { expected[1][1], unpack(expected[1][2]) },
+      luatexts.load_at(data)
+    )
+
+  ensure_error(
+      "load_at end of data " .. NAME,
+      "load failed: corrupt data, truncated",
+      luatexts.load_at(data, #data + 1)
+    )
+
+  ensure_error(
+      "load_at in the middle of record " .. NAME,
+      "load failed: corrupt data",
+      luatexts.load_at(data, 3)
+    )
+
+  ensure_error(
+      "load_at truncated " .. NAME,
+      "load failed: corrupt data, truncated",
+      luatexts.load_at(data:sub(1, #data - 1), expected[4][1])
+    )
+
+  ensure_fails_with_substring(
+      "load_at zero offset " .. NAME,
+      function() return luatexts.load_at(data, 0) end,
+      "offset out of range"
+    )
+
+  ensure_fails_with_substring(
+      "load_at offset past the end " .. NAME,
+      function() return luatexts.load_at(data, #data + 2) end,
+      "offset out of range"
+    )
+
+  ensure_error(
+      "load_at options " .. NAME,
+      "load failed: nesting too deep",
+      luatexts.load_at(data, 1, { max_depth = 0 })
+    )
+
+  local filename = "./tmp/records.luatexts"
+  local f = assert(io.open(filename, "wb"))
+  f:write(data)
+  f:close()
+
+  local i = 0
+  for offset, a, b, c in luatexts.records(filename) do
+    i = i + 1
+    ensure_equals("records offset " .. i .. " " .. NAME, offset, expected[i][1])
+    ensure_tdeepequals(
+        "records tuple " .. i .. " " .. NAME,
+        { a, b, c },
+        expected[i][2]
+      )
+  end
+  ensure_equals("records count " .. NAME, i, #expected)
+
+  local next_record = ensure("records", luatexts.records(filename))
+  ensure_equals("records first " .. NAME, next_record(), expected[1][1])
+  for i = 2, #expected do
+    next_record()
+  end
+  ensure_equals("records done " .. NAME, next_record(), nil)
+  ensure_equals("records still done " .. NAME, next_record(), nil)
+
+  f = assert(io.open(filename, "wb"))
+  f:write(data:sub(1, #data - 1))
+  f:close()
+
+  i = 0
+  ensure_fails_with_substring(
+      "records truncated " .. NAME,
+      function()
+        for offset in luatexts.records(filename) do
+          i = i + 1
+        end
+      end,
+      "load failed: corrupt data, truncated"
+    )
+  ensure_equals("records before truncated " .. NAME, i, #expected - 1)
+
+  ensure_fails_with_substring(
+      "records options " .. NAME,
+      function()
+        for offset in luatexts.records(filename, { max_depth = 0 }) do
+        end
+      end,
+      "load failed: nesting too deep"
+    )
+
+  os.remove(filename)
+end
+
+do
+  local i = 0
+  local filename = "./test/data/empty.luatexts"
+  for offset in ensure("records", luatexts.records(filename)) do
+    i = i + 1
+  end
+  ensure_equals("records empty file " .. NAME, i, 0)
+end
+
+ensure_error_with_substring(
+    "records missing file " .. NAME,
+    "records failed:"
+ .. " can't open './test/data/no-such-file.luatexts' for reading:"
+ .. " No such file or directory",
+    luatexts.records("./test/data/no-such-file.luatexts")
+  )
+
+ensure_error_with_substring(
+    "records directory " .. NAME,
+    "records failed: './test/data/' is not a file",
+    luatexts.records("./test/data/")
+  )
+
+print("===== END record tests", NAME, "=====")
+
 print("OK")
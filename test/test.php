@@ -108,6 +108,57 @@ try{
     }
   }
 
+  print("\n\n");
+  print("Serialize with back-references: array('name', 'name', array('name' => 'x')), 'x'\n");
+  $lt_result = Luatexts::save_dedup(
+      array('name', 'name', array('name' => 'x')), 'x'
+    );
+  // Numbering starts anew on each call, save() has no references.
+  $lt_result .= Luatexts::save_dedup('name');
+  $lt_result .= Luatexts::save('name', 'name');
+  $required = array("2",
+  "T",
+  "3",
+  "0",
+  "8",
+  "4",
+  "name",
+  "s",
+  "1",
+  "T",
+  "0",
+  "1",
+  "s",
+  "1",
+  "8",
+  "1",
+  "x",
+  "s",
+  "2",
+  "1",
+  "8",
+  "4",
+  "name",
+  "2",
+  "8",
+  "4",
+  "name",
+  "8",
+  "4",
+  "name");
+  $required = implode("\n", $required)."\n";
+  echo "RESULT: " . ($required == $lt_result ? "OK\n" : "ERROR\n");
+
+  if ($required != $lt_result){
+    $required = explode("\n", $required);
+    $lt_result = explode("\n", $lt_result);
+
+    $count = max(count($required), count($lt_result));
+    for($i=0;$i<$count;$i++){
+      echo @$required[$i]."\t".@$lt_result[$i].(@$required[$i] != @$lt_result[$i] ? "\t<< ERROR\n" : "\n");
+    }
+  }
+
   print("\n\n");
   $a = new Test;
   print_r($a);